@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmark of fleet controller ticks planned on the calling thread versus
+ * across worker threads.
+ *
+ * For every fleet size up to ANKI_FLEET_MAX_VEHICLES, two controllers tick
+ * the same moving fleet: one plans serially, the other always hands the
+ * plan to its workers (parallel_min = 1). The mean cost of a tick is
+ * printed for both, followed by the crossover: the smallest fleet from
+ * which the parallel plan is faster for every larger fleet measured. This
+ * is the value to use for anki_fleet_config_t.parallel_min on the machine
+ * the benchmark ran on.
+ *
+ * With fewer CPUs than threads the workers cannot run alongside the calling
+ * thread and the measured plan is never faster. The benchmark then also
+ * prints the cost of handing a tick to the workers, taken from the single
+ * vehicle fleet, and the crossover expected with one CPU per thread: the
+ * smallest fleet from which the share of the serial cost moved to the
+ * workers exceeds that handoff.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <ankidrive/fleet_controller.h>
+#include <ankidrive/timeline.h>
+
+#define TRACK_LENGTH_MM             3000.0f
+#define DEFAULT_TICKS               2000
+#define WARMUP_TICKS                50
+
+static const uint8_t fleet_sizes[] = { 1, 2, 4, 8, 12, 16, 24, 32, 40, 48, 56, 64 };
+
+/* Smallest entry from which a[i] < b[i] for every later entry too. */
+static size_t crossover(const double *a, const double *b)
+{
+        size_t i = sizeof(fleet_sizes);
+
+        while (i > 0 && a[i - 1] < b[i - 1])
+                i--;
+        return i;
+}
+
+static void print_crossover(const char *label, size_t i)
+{
+        if (i < sizeof(fleet_sizes))
+                printf("%s: %u vehicles\n", label, fleet_sizes[i]);
+        else
+                printf("%s: none up to %d vehicles\n", label, ANKI_FLEET_MAX_VEHICLES);
+}
+
+static float distance[ANKI_FLEET_MAX_VEHICLES];
+static float offset[ANKI_FLEET_MAX_VEHICLES];
+static float speed[ANKI_FLEET_MAX_VEHICLES];
+
+static void discard(uint8_t vehicle, const anki_vehicle_msg_t *msg, uint8_t len, void *user_data)
+{
+        (void)vehicle;
+        (void)msg;
+        (void)len;
+        (*(uint64_t *)user_data)++;
+}
+
+static void reset_fleet(uint8_t count)
+{
+        uint8_t i;
+
+        for (i = 0; i < count; i++) {
+                distance[i] = (float)((i * 137) % (int)TRACK_LENGTH_MM);
+                offset[i] = (i % 4) * 45.0f - 68.0f;
+                speed[i] = 300.0f + (i % 5) * 100.0f;
+        }
+}
+
+/* Mean cost of one tick in nanoseconds. */
+static double run(anki_fleet_controller_t *ctrl, uint8_t count, uint32_t ticks)
+{
+        uint64_t start = 0;
+        uint32_t t;
+        uint8_t i;
+
+        reset_fleet(count);
+        for (i = 0; i < count; i++)
+                anki_fleet_controller_set_cruise(ctrl, i, 400 + (i % 3) * 150);
+
+        for (t = 0; t < WARMUP_TICKS + ticks; t++) {
+                if (t == WARMUP_TICKS)
+                        start = anki_timeline_now_us();
+                anki_fleet_controller_tick(ctrl, (uint64_t)t * 20000, count, distance, offset, speed,
+                                           NULL, TRACK_LENGTH_MM);
+                for (i = 0; i < count; i++)
+                        distance[i] += speed[i] * 0.02f;
+        }
+        return (anki_timeline_now_us() - start) * 1000.0 / ticks;
+}
+
+static struct option bench_options[] = {
+        { "help",       0, 0, 'h' },
+        { "workers",    1, 0, 'w' },
+        { "ticks",      1, 0, 't' },
+        { 0, 0, 0, 0 }
+};
+
+static const char *bench_help =
+        "Usage:\n"
+        "\tfleet-bench [options]\n"
+        "\t  -w, --workers=N     worker threads (default: online CPUs - 1, at least 1)\n"
+        "\t  -t, --ticks=N       ticks timed per fleet size (default: 2000)\n";
+
+int main(int argc, char *argv[])
+{
+        anki_fleet_config_t config;
+        anki_fleet_controller_t serial, parallel;
+        double serial_ns[sizeof(fleet_sizes)], parallel_ns[sizeof(fleet_sizes)];
+        double handoff_ns[sizeof(fleet_sizes)], moved_ns[sizeof(fleet_sizes)];
+        unsigned long workers = 0;
+        unsigned long ticks = DEFAULT_TICKS;
+        uint64_t commands = 0;
+        long online;
+        size_t i;
+        int opt;
+
+        while ((opt = getopt_long(argc, argv, "hw:t:", bench_options, NULL)) != -1) {
+                switch (opt) {
+                case 'w':
+                        workers = strtoul(optarg, NULL, 10);
+                        if (workers == 0 || workers > ANKI_FLEET_MAX_WORKERS) {
+                                fprintf(stderr, "Workers must be between 1 and %d\n", ANKI_FLEET_MAX_WORKERS);
+                                return 1;
+                        }
+                        break;
+                case 't':
+                        ticks = strtoul(optarg, NULL, 10);
+                        if (ticks == 0 || ticks > 1000000) {
+                                fprintf(stderr, "Ticks must be between 1 and 1000000\n");
+                                return 1;
+                        }
+                        break;
+                default:
+                        printf("%s", bench_help);
+                        return opt == 'h' ? 0 : 1;
+                }
+        }
+
+        online = sysconf(_SC_NPROCESSORS_ONLN);
+        if (workers == 0) {
+                workers = online > 1 ? online - 1 : 1;
+                if (workers > ANKI_FLEET_MAX_WORKERS)
+                        workers = ANKI_FLEET_MAX_WORKERS;
+        }
+
+        anki_fleet_config_default(&config);
+        if (anki_fleet_controller_init(&serial, &config, discard, &commands) != 0) {
+                fprintf(stderr, "Failed to initialize the serial controller\n");
+                return 1;
+        }
+        config.workers = workers;
+        config.parallel_min = 1;
+        if (anki_fleet_controller_init(&parallel, &config, discard, &commands) != 0) {
+                fprintf(stderr, "Failed to start %lu workers\n", workers);
+                anki_fleet_controller_destroy(&serial);
+                return 1;
+        }
+
+        printf("cpus=%ld workers=%lu ticks=%lu\n", online, workers, ticks);
+        printf("%8s %12s %12s %8s\n", "vehicles", "serial_ns", "parallel_ns", "speedup");
+        for (i = 0; i < sizeof(fleet_sizes); i++) {
+                serial_ns[i] = run(&serial, fleet_sizes[i], ticks);
+                parallel_ns[i] = run(&parallel, fleet_sizes[i], ticks);
+                printf("%8u %12.0f %12.0f %8.2f\n", fleet_sizes[i], serial_ns[i], parallel_ns[i],
+                       serial_ns[i] / parallel_ns[i]);
+        }
+
+        print_crossover("crossover", crossover(parallel_ns, serial_ns));
+
+        if (online <= (long)workers) {
+                for (i = 0; i < sizeof(fleet_sizes); i++) {
+                        handoff_ns[i] = parallel_ns[0] - serial_ns[0];
+                        moved_ns[i] = serial_ns[i] * workers / (workers + 1);
+                }
+                printf("handoff_ns: %.0f\n", handoff_ns[0]);
+                print_crossover("expected crossover with one CPU per thread", crossover(handoff_ns, moved_ns));
+        }
+
+        anki_fleet_controller_destroy(&serial);
+        anki_fleet_controller_destroy(&parallel);
+        return 0;
+}
@@ -0,0 +1,885 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Offline analyzer for advertising captures.
+ *
+ * A capture is a text file with one advertising report per line:
+ *
+ *     <seconds.micros> <AA:BB:CC:DD:EE:FF> <rssi> <hex bytes ...>
+ *
+ * The file is mapped into memory and split into chunks on line boundaries.
+ * Worker threads pull chunks from a shared counter and parse them into a
+ * per-thread registry, so the hot path takes no locks. Once all chunks are
+ * done the registries are merged; state samples are ordered by their file
+ * position, which makes the output independent of the thread count.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "uthash.h"
+
+#include <ankidrive/advertisement.h>
+#include <ankidrive/vehicle_gatt_profile.h>
+
+#define ADV_TYPE_UUID_128           0x07
+#define ADV_TYPE_LOCAL_NAME         0x09
+#define ADV_TYPE_MANUFACTURER_DATA  0xff
+
+#define ADV_DATA_MAX_LEN            31
+#define VEHICLE_STATE_MASK          0x70
+
+#define DEFAULT_BUCKET_SEC          60
+#define MAX_RATE_BUCKETS            (1 << 20)
+#define DEFAULT_CHUNK_SIZE          (8 << 20)
+#define CHUNKS_PER_THREAD           4
+
+struct capture_file {
+        const char *path;
+        const char *data;
+        size_t size;
+};
+
+struct chunk {
+        uint32_t file;
+        const char *begin;
+        const char *end;
+};
+
+/* A change in the advertised state bits or firmware version. */
+struct state_sample {
+        uint64_t position;      /* file index << 48 | byte offset */
+        double timestamp;
+        uint16_t version;
+        uint8_t state;
+};
+
+struct rate_bucket {
+        uint32_t count;
+        int32_t rssi_sum;
+        int8_t rssi_min;
+        int8_t rssi_max;
+};
+
+struct vehicle_entry {
+        uint8_t address[6];
+        uint8_t is_anki;
+        uint8_t has_mfg;
+        anki_vehicle_adv_mfg_t mfg;
+        double mfg_timestamp;
+        uint64_t mfg_position;
+
+        /* per-thread bookkeeping for change detection */
+        int64_t last_chunk;
+        uint16_t last_version;
+        uint8_t last_state;
+
+        struct state_sample *samples;
+        size_t sample_count;
+        size_t sample_alloc;
+
+        struct rate_bucket *buckets;
+        size_t bucket_count;
+
+        UT_hash_handle hh;
+};
+
+struct worker {
+        pthread_t thread;
+        struct vehicle_entry *vehicles;
+        uint64_t lines;
+        uint64_t bad_lines;
+};
+
+static struct capture_file *files;
+static size_t file_count;
+static struct chunk *chunks;
+static size_t chunk_count;
+static volatile size_t next_chunk;
+
+static double capture_start;
+static double bucket_sec = DEFAULT_BUCKET_SEC;
+
+static const char *vehicle_model_name(uint8_t model_id)
+{
+        switch (model_id) {
+        case 1:
+                return "Kourai";
+        case 2:
+                return "Boson";
+        case 3:
+                return "Rho";
+        case 4:
+                return "Katal";
+        default:
+                return "Unknown";
+        }
+}
+
+static int hex_value(char c)
+{
+        if (c >= '0' && c <= '9')
+                return c - '0';
+        if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+        return -1;
+}
+
+static const char *skip_spaces(const char *p, const char *end)
+{
+        while (p < end && (*p == ' ' || *p == '\t'))
+                p++;
+        return p;
+}
+
+static const char *parse_double(const char *p, const char *end, double *out)
+{
+        double value = 0, scale = 1;
+        int digits = 0;
+
+        while (p < end && *p >= '0' && *p <= '9') {
+                value = value * 10 + (*p++ - '0');
+                digits++;
+        }
+
+        if (p < end && *p == '.') {
+                p++;
+                while (p < end && *p >= '0' && *p <= '9') {
+                        scale /= 10;
+                        value += (*p++ - '0') * scale;
+                        digits++;
+                }
+        }
+
+        if (digits == 0)
+                return NULL;
+
+        *out = value;
+        return p;
+}
+
+static const char *parse_address(const char *p, const char *end, uint8_t address[6])
+{
+        int i;
+
+        for (i = 0; i < 6; i++) {
+                int hi, lo;
+
+                if (end - p < 2)
+                        return NULL;
+
+                hi = hex_value(p[0]);
+                lo = hex_value(p[1]);
+                if (hi < 0 || lo < 0)
+                        return NULL;
+
+                address[i] = (hi << 4) | lo;
+                p += 2;
+
+                if (i < 5) {
+                        if (p >= end || *p != ':')
+                                return NULL;
+                        p++;
+                }
+        }
+
+        return p;
+}
+
+static const char *parse_rssi(const char *p, const char *end, int8_t *rssi)
+{
+        int value = 0, sign = 1, digits = 0;
+
+        if (p < end && *p == '-') {
+                sign = -1;
+                p++;
+        }
+
+        while (p < end && *p >= '0' && *p <= '9') {
+                value = value * 10 + (*p++ - '0');
+                if (value > 128)
+                        return NULL;
+                digits++;
+        }
+
+        /* int8_t goes down to -128 but only up to 127 */
+        if (digits == 0 || value > (sign < 0 ? 128 : 127))
+                return NULL;
+
+        *rssi = (int8_t)(sign * value);
+        return p;
+}
+
+static int parse_hex_bytes(const char *p, const char *end, uint8_t *data, size_t max_len)
+{
+        size_t len = 0;
+
+        while (1) {
+                int hi, lo;
+
+                p = skip_spaces(p, end);
+                if (p >= end || *p == '\r')
+                        break;
+
+                if (end - p < 2 || len == max_len)
+                        return -1;
+
+                hi = hex_value(p[0]);
+                lo = hex_value(p[1]);
+                if (hi < 0 || lo < 0)
+                        return -1;
+
+                data[len++] = (hi << 4) | lo;
+                p += 2;
+        }
+
+        return len;
+}
+
+static struct vehicle_entry *vehicle_lookup(struct vehicle_entry **head, const uint8_t address[6])
+{
+        struct vehicle_entry *v = NULL;
+
+        HASH_FIND(hh, *head, address, 6, v);
+        if (v != NULL)
+                return v;
+
+        v = calloc(1, sizeof(*v));
+        if (v == NULL) {
+                perror("calloc");
+                exit(1);
+        }
+
+        memcpy(v->address, address, 6);
+        v->last_chunk = -1;
+        HASH_ADD(hh, *head, address, 6, v);
+
+        return v;
+}
+
+static void vehicle_add_sample(struct vehicle_entry *v, const struct state_sample *sample)
+{
+        if (v->sample_count == v->sample_alloc) {
+                size_t alloc = v->sample_alloc ? v->sample_alloc * 2 : 16;
+                struct state_sample *samples = realloc(v->samples, alloc * sizeof(*samples));
+                if (samples == NULL) {
+                        perror("realloc");
+                        exit(1);
+                }
+                v->samples = samples;
+                v->sample_alloc = alloc;
+        }
+
+        v->samples[v->sample_count++] = *sample;
+}
+
+static struct rate_bucket *vehicle_bucket(struct vehicle_entry *v, size_t index)
+{
+        if (index >= v->bucket_count) {
+                size_t count = index + 1;
+                struct rate_bucket *buckets;
+
+                /* grow geometrically, captures are mostly appended in time order */
+                if (count < v->bucket_count * 2)
+                        count = v->bucket_count * 2;
+
+                buckets = realloc(v->buckets, count * sizeof(*buckets));
+                if (buckets == NULL) {
+                        perror("realloc");
+                        exit(1);
+                }
+                memset(&buckets[v->bucket_count], 0, (count - v->bucket_count) * sizeof(*buckets));
+                v->buckets = buckets;
+                v->bucket_count = count;
+        }
+
+        return &v->buckets[index];
+}
+
+/* A list of 128-bit service UUIDs, in advertising byte order, naming the Anki service */
+static int has_anki_uuid(const uint8_t *uuids, size_t len)
+{
+        static const uint8_t anki_uuid[16] = ANKI_SERVICE_UUID_LE;
+        size_t k;
+
+        if (len == 0 || len % sizeof(anki_uuid) != 0)
+                return 0;
+
+        for (k = 0; k < len; k += sizeof(anki_uuid)) {
+                if (memcmp(&uuids[k], anki_uuid, sizeof(anki_uuid)) == 0)
+                        return 1;
+        }
+        return 0;
+}
+
+/* The latest manufacturer data wins, whichever thread saw it */
+static int mfg_is_newer(const struct vehicle_entry *v, double timestamp, uint64_t position)
+{
+        if (!v->has_mfg || timestamp > v->mfg_timestamp)
+                return 1;
+        return timestamp == v->mfg_timestamp && position > v->mfg_position;
+}
+
+static void process_report(struct vehicle_entry *v, size_t chunk_index, uint64_t position,
+                                double timestamp, int8_t rssi, const uint8_t *data, size_t len)
+{
+        struct rate_bucket *bucket;
+        size_t i = 0;
+        double rel;
+
+        while (i < len) {
+                uint8_t field_len = data[i];
+                const uint8_t *field;
+
+                if (field_len == 0 || i + 1 + field_len > len)
+                        break;
+
+                field = &data[i + 2];
+
+                switch (data[i + 1]) {
+                case ADV_TYPE_UUID_128:
+                        if (has_anki_uuid(field, field_len - 1))
+                                v->is_anki = 1;
+                        break;
+                case ADV_TYPE_MANUFACTURER_DATA:
+                {
+                        anki_vehicle_adv_mfg_t mfg;
+
+                        if (mfg_is_newer(v, timestamp, position) &&
+                            anki_vehicle_parse_mfg_data(field, field_len - 1, &mfg) == 0) {
+                                v->mfg = mfg;
+                                v->mfg_timestamp = timestamp;
+                                v->mfg_position = position;
+                                v->has_mfg = 1;
+                        }
+                        break;
+                }
+                case ADV_TYPE_LOCAL_NAME:
+                {
+                        anki_vehicle_adv_info_t info;
+                        struct state_sample sample;
+                        /* state, version, reserved bytes, then at most sizeof(info.name) - 1 */
+                        uint8_t max_len = 8 + sizeof(info.name) - 1;
+
+                        if (field_len < 3)
+                                break;
+
+                        memset(&info, 0, sizeof(info));
+                        anki_vehicle_parse_local_name(field, field_len - 1 < max_len ? field_len - 1 : max_len,
+                                                      &info);
+
+                        sample.position = position;
+                        sample.timestamp = timestamp;
+                        sample.version = info.version;
+                        sample.state = field[0] & VEHICLE_STATE_MASK;
+
+                        /*
+                         * Always keep the first sample of a chunk; the merge
+                         * step drops it again if the previous chunk ended in
+                         * the same state.
+                         */
+                        if (v->last_chunk != (int64_t)chunk_index ||
+                            v->last_state != sample.state ||
+                            v->last_version != sample.version) {
+                                vehicle_add_sample(v, &sample);
+                                v->last_chunk = chunk_index;
+                                v->last_state = sample.state;
+                                v->last_version = sample.version;
+                        }
+                        break;
+                }
+                }
+
+                i += field_len + 1;
+        }
+
+        /* A corrupt timestamp far outside the capture must not size the rate table */
+        rel = timestamp - capture_start;
+        if (rel / bucket_sec >= MAX_RATE_BUCKETS)
+                return;
+        bucket = vehicle_bucket(v, rel > 0 ? (size_t)(rel / bucket_sec) : 0);
+        if (bucket->count == 0) {
+                bucket->rssi_min = rssi;
+                bucket->rssi_max = rssi;
+        } else {
+                if (rssi < bucket->rssi_min)
+                        bucket->rssi_min = rssi;
+                if (rssi > bucket->rssi_max)
+                        bucket->rssi_max = rssi;
+        }
+        bucket->count++;
+        bucket->rssi_sum += rssi;
+}
+
+static void process_chunk(struct worker *w, size_t chunk_index)
+{
+        const struct chunk *c = &chunks[chunk_index];
+        const char *base = files[c->file].data;
+        const char *p = c->begin;
+
+        while (p < c->end) {
+                const char *eol = memchr(p, '\n', c->end - p);
+                const char *q;
+                uint8_t address[6];
+                uint8_t data[ADV_DATA_MAX_LEN];
+                double timestamp;
+                int8_t rssi;
+                int len;
+
+                if (eol == NULL)
+                        eol = c->end;
+
+                q = skip_spaces(p, eol);
+                if (q == eol || *q == '#')
+                        goto next;
+
+                w->lines++;
+
+                q = parse_double(q, eol, &timestamp);
+                if (q == NULL)
+                        goto bad;
+
+                q = parse_address(skip_spaces(q, eol), eol, address);
+                if (q == NULL)
+                        goto bad;
+
+                q = parse_rssi(skip_spaces(q, eol), eol, &rssi);
+                if (q == NULL)
+                        goto bad;
+
+                len = parse_hex_bytes(q, eol, data, sizeof(data));
+                if (len < 0)
+                        goto bad;
+
+                process_report(vehicle_lookup(&w->vehicles, address), chunk_index,
+                                ((uint64_t)c->file << 48) | (uint64_t)(p - base),
+                                timestamp, rssi, data, len);
+                goto next;
+bad:
+                w->bad_lines++;
+next:
+                p = eol + 1;
+        }
+}
+
+static void *worker_main(void *data)
+{
+        struct worker *w = data;
+        size_t index;
+
+        while ((index = __sync_fetch_and_add(&next_chunk, 1)) < chunk_count)
+                process_chunk(w, index);
+
+        return NULL;
+}
+
+static int map_capture(struct capture_file *f)
+{
+        struct stat st;
+        int fd;
+
+        fd = open(f->path, O_RDONLY);
+        if (fd < 0) {
+                fprintf(stderr, "%s: %s\n", f->path, strerror(errno));
+                return -1;
+        }
+
+        if (fstat(fd, &st) < 0) {
+                fprintf(stderr, "%s: %s\n", f->path, strerror(errno));
+                close(fd);
+                return -1;
+        }
+
+        f->size = st.st_size;
+        f->data = NULL;
+        if (f->size > 0) {
+                f->data = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (f->data == MAP_FAILED) {
+                        fprintf(stderr, "%s: %s\n", f->path, strerror(errno));
+                        close(fd);
+                        return -1;
+                }
+                madvise((void *)f->data, f->size, MADV_SEQUENTIAL);
+        }
+
+        close(fd);
+        return 0;
+}
+
+static void split_capture(uint32_t file_index, size_t chunk_size)
+{
+        const struct capture_file *f = &files[file_index];
+        const char *p = f->data;
+        const char *end = f->data + f->size;
+
+        while (p < end) {
+                const char *split = p + chunk_size;
+                struct chunk *c;
+
+                if (split >= end) {
+                        split = end;
+                } else {
+                        split = memchr(split, '\n', end - split);
+                        split = split ? split + 1 : end;
+                }
+
+                chunks = realloc(chunks, (chunk_count + 1) * sizeof(*chunks));
+                if (chunks == NULL) {
+                        perror("realloc");
+                        exit(1);
+                }
+
+                c = &chunks[chunk_count++];
+                c->file = file_index;
+                c->begin = p;
+                c->end = split;
+                p = split;
+        }
+}
+
+static int find_capture_start(void)
+{
+        size_t i;
+
+        for (i = 0; i < file_count; i++) {
+                const char *p = files[i].data;
+                const char *end = p + files[i].size;
+
+                while (p < end) {
+                        const char *eol = memchr(p, '\n', end - p);
+                        const char *q;
+
+                        if (eol == NULL)
+                                eol = end;
+
+                        q = skip_spaces(p, eol);
+                        if (q < eol && *q != '#' && parse_double(q, eol, &capture_start) != NULL)
+                                return 0;
+
+                        p = eol + 1;
+                }
+        }
+
+        return -1;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+        const struct state_sample *sa = a;
+        const struct state_sample *sb = b;
+
+        if (sa->position < sb->position)
+                return -1;
+        return sa->position > sb->position;
+}
+
+static int compare_vehicles(struct vehicle_entry *a, struct vehicle_entry *b)
+{
+        return memcmp(a->address, b->address, 6);
+}
+
+static struct vehicle_entry *merge_workers(struct worker *workers, size_t count)
+{
+        struct vehicle_entry *merged = NULL;
+        struct vehicle_entry *v, *tmp;
+        size_t i, j;
+
+        for (i = 0; i < count; i++) {
+                HASH_ITER(hh, workers[i].vehicles, v, tmp) {
+                        struct vehicle_entry *m = vehicle_lookup(&merged, v->address);
+
+                        m->is_anki |= v->is_anki;
+                        if (v->has_mfg && mfg_is_newer(m, v->mfg_timestamp, v->mfg_position)) {
+                                m->has_mfg = 1;
+                                m->mfg = v->mfg;
+                                m->mfg_timestamp = v->mfg_timestamp;
+                                m->mfg_position = v->mfg_position;
+                        }
+
+                        for (j = 0; j < v->sample_count; j++)
+                                vehicle_add_sample(m, &v->samples[j]);
+
+                        if (v->bucket_count > 0)
+                                vehicle_bucket(m, v->bucket_count - 1);
+
+                        for (j = 0; j < v->bucket_count; j++) {
+                                struct rate_bucket *src = &v->buckets[j];
+                                struct rate_bucket *dst = &m->buckets[j];
+
+                                if (src->count == 0)
+                                        continue;
+
+                                if (dst->count == 0) {
+                                        dst->rssi_min = src->rssi_min;
+                                        dst->rssi_max = src->rssi_max;
+                                } else {
+                                        if (src->rssi_min < dst->rssi_min)
+                                                dst->rssi_min = src->rssi_min;
+                                        if (src->rssi_max > dst->rssi_max)
+                                                dst->rssi_max = src->rssi_max;
+                                }
+                                dst->count += src->count;
+                                dst->rssi_sum += src->rssi_sum;
+                        }
+
+                        HASH_DEL(workers[i].vehicles, v);
+                        free(v->samples);
+                        free(v->buckets);
+                        free(v);
+                }
+        }
+
+        HASH_ITER(hh, merged, v, tmp) {
+                size_t out = 0;
+
+                if (!v->is_anki) {
+                        HASH_DEL(merged, v);
+                        free(v->samples);
+                        free(v->buckets);
+                        free(v);
+                        continue;
+                }
+
+                /* order by file position and collapse repeated states */
+                qsort(v->samples, v->sample_count, sizeof(*v->samples), compare_samples);
+                for (j = 0; j < v->sample_count; j++) {
+                        if (out > 0 &&
+                            v->samples[out - 1].state == v->samples[j].state &&
+                            v->samples[out - 1].version == v->samples[j].version)
+                                continue;
+                        v->samples[out++] = v->samples[j];
+                }
+                v->sample_count = out;
+        }
+
+        HASH_SORT(merged, compare_vehicles);
+
+        return merged;
+}
+
+static void print_vehicle(const struct vehicle_entry *v)
+{
+        uint64_t sightings = 0;
+        int64_t rssi_sum = 0;
+        int rssi_min = 127, rssi_max = -128;
+        size_t first = v->bucket_count, last = 0;
+        size_t i;
+
+        for (i = 0; i < v->bucket_count; i++) {
+                const struct rate_bucket *b = &v->buckets[i];
+
+                if (b->count == 0)
+                        continue;
+
+                if (first == v->bucket_count)
+                        first = i;
+                last = i;
+
+                sightings += b->count;
+                rssi_sum += b->rssi_sum;
+                if (b->rssi_min < rssi_min)
+                        rssi_min = b->rssi_min;
+                if (b->rssi_max > rssi_max)
+                        rssi_max = b->rssi_max;
+        }
+
+        printf("%02X:%02X:%02X:%02X:%02X:%02X",
+                v->address[0], v->address[1], v->address[2],
+                v->address[3], v->address[4], v->address[5]);
+
+        if (v->has_mfg)
+                printf(" %s (%04x)", vehicle_model_name(v->mfg.model_id), v->mfg.identifier & 0xffff);
+
+        if (sightings > 0) {
+                double span = (last - first + 1) * bucket_sec;
+
+                printf(" sightings=%llu rate=%.2f/s rssi=%.1f [%d, %d]",
+                        (unsigned long long)sightings, sightings / span,
+                        (double)rssi_sum / sightings, rssi_min, rssi_max);
+        }
+        printf("\n");
+
+        for (i = 0; i < v->sample_count; i++) {
+                const struct state_sample *s = &v->samples[i];
+
+                printf("  state %10.3f v%04x%s%s%s\n",
+                        s->timestamp - capture_start, s->version,
+                        (s->state & 0x10) ? " full_battery" : "",
+                        (s->state & 0x20) ? " low_battery" : "",
+                        (s->state & 0x40) ? " on_charger" : "");
+        }
+
+        for (i = first; i <= last && i < v->bucket_count; i++) {
+                const struct rate_bucket *b = &v->buckets[i];
+
+                if (b->count == 0) {
+                        printf("  rate  %10.3f 0.00/s\n", i * bucket_sec);
+                        continue;
+                }
+
+                printf("  rate  %10.3f %.2f/s rssi=%.1f [%d, %d]\n",
+                        i * bucket_sec, b->count / bucket_sec,
+                        (double)b->rssi_sum / b->count, b->rssi_min, b->rssi_max);
+        }
+}
+
+static struct option analyze_options[] = {
+        { "help",       0, 0, 'h' },
+        { "threads",    1, 0, 'j' },
+        { "bucket",     1, 0, 'b' },
+        { "chunk-size", 1, 0, 'c' },
+        { 0, 0, 0, 0 }
+};
+
+static const char *analyze_help =
+        "Usage:\n"
+        "\tvehicle-analyze [options] <capture> [capture ...]\n"
+        "\t  -j, --threads=N     worker threads (default: online CPUs)\n"
+        "\t  -b, --bucket=SEC    sighting rate / RSSI bucket size (default: 60)\n"
+        "\t  -c, --chunk-size=MB capture chunk size (default: 8)\n";
+
+int main(int argc, char *argv[])
+{
+        struct worker *workers;
+        struct vehicle_entry *merged, *v, *tmp;
+        size_t thread_count = 0;
+        size_t chunk_size = DEFAULT_CHUNK_SIZE;
+        uint64_t lines = 0, bad_lines = 0;
+        size_t i;
+        int opt;
+
+        while ((opt = getopt_long(argc, argv, "hj:b:c:", analyze_options, NULL)) != -1) {
+                switch (opt) {
+                case 'j':
+                        thread_count = strtoul(optarg, NULL, 10);
+                        break;
+                case 'b':
+                        bucket_sec = strtod(optarg, NULL);
+                        if (bucket_sec <= 0) {
+                                fprintf(stderr, "Invalid bucket size: %s\n", optarg);
+                                return 1;
+                        }
+                        break;
+                case 'c':
+                        chunk_size = strtoul(optarg, NULL, 10) << 20;
+                        if (chunk_size == 0) {
+                                fprintf(stderr, "Invalid chunk size: %s\n", optarg);
+                                return 1;
+                        }
+                        break;
+                default:
+                        printf("%s", analyze_help);
+                        return opt == 'h' ? 0 : 1;
+                }
+        }
+
+        if (optind >= argc) {
+                printf("%s", analyze_help);
+                return 1;
+        }
+
+        if (thread_count == 0) {
+                long n = sysconf(_SC_NPROCESSORS_ONLN);
+                thread_count = n > 0 ? n : 1;
+        }
+
+        file_count = argc - optind;
+        files = calloc(file_count, sizeof(*files));
+        if (files == NULL) {
+                perror("calloc");
+                return 1;
+        }
+
+        for (i = 0; i < file_count; i++) {
+                files[i].path = argv[optind + i];
+                if (map_capture(&files[i]) < 0)
+                        return 1;
+        }
+
+        if (find_capture_start() < 0) {
+                fprintf(stderr, "No advertising reports found\n");
+                return 1;
+        }
+
+        /* Keep enough chunks around for the workers to balance load */
+        for (i = 0; i < file_count; i++) {
+                size_t size = chunk_size;
+                size_t min_chunks = thread_count * CHUNKS_PER_THREAD;
+
+                if (files[i].size / size < min_chunks)
+                        size = files[i].size / min_chunks + 1;
+                split_capture(i, size);
+        }
+
+        workers = calloc(thread_count, sizeof(*workers));
+        if (workers == NULL) {
+                perror("calloc");
+                return 1;
+        }
+
+        for (i = 0; i < thread_count; i++) {
+                int err = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+                if (err != 0) {
+                        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+                        return 1;
+                }
+        }
+
+        for (i = 0; i < thread_count; i++) {
+                pthread_join(workers[i].thread, NULL);
+                lines += workers[i].lines;
+                bad_lines += workers[i].bad_lines;
+        }
+
+        merged = merge_workers(workers, thread_count);
+
+        HASH_ITER(hh, merged, v, tmp) {
+                print_vehicle(v);
+                HASH_DEL(merged, v);
+                free(v->samples);
+                free(v->buckets);
+                free(v);
+        }
+
+        fprintf(stderr, "%llu reports, %llu malformed, %zu chunks, %zu threads\n",
+                (unsigned long long)lines, (unsigned long long)bad_lines,
+                chunk_count, thread_count);
+
+        for (i = 0; i < file_count; i++) {
+                if (files[i].data != NULL)
+                        munmap((void *)files[i].data, files[i].size);
+        }
+
+        free(workers);
+        free(chunks);
+        free(files);
+
+        return 0;
+}
@@ -0,0 +1,1123 @@
+/*
+ *
+ *  Copyright (C) 2014  Anki, Inc.
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Long-running owner of all vehicle connections.
+ *
+ * Clients talk to the daemon over a SOCK_SEQPACKET Unix socket using the
+ * binary protocol in vehicle_daemon.h. A single request can carry commands
+ * for many vehicles; each pre-encoded message is copied straight into a
+ * reserved ATT Write Command on the vehicle's connection, so a command
+ * costs one memcpy and a queue insertion. Notifications from the vehicles
+ * are fanned out to subscribed clients, coalesced into one packet per
+ * client per main loop iteration.
+ *
+ * Everything runs on one thread. The ATT transport and the client sockets
+ * share the event loop of vehicle-tool, so --epoll moves both onto epoll.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <glib.h>
+
+#include "lib/uuid.h"
+#include <btio/btio.h>
+#include "att.h"
+#include "gattrib.h"
+#include "gatt.h"
+#include "timer_wheel.h"
+#include "event_loop.h"
+#include "utils.h"
+
+#include <ankidrive.h>
+
+#include "vehicle_daemon.h"
+
+#define MAX_CLIENTS		16
+
+/* Requests handled per client wakeup before yielding to other sources */
+#define CLIENT_RX_BUDGET	64
+
+#define dlog(fmt, arg...) \
+	fprintf(stderr, "vehicle-daemon: " fmt, ## arg)
+
+enum {
+	ANKI_CHAR_READ,
+	ANKI_CHAR_WRITE,
+	ANKI_CHAR_COUNT
+};
+
+struct vehicle {
+	bool used;
+	uint8_t id;
+	uint8_t state;
+	uint8_t addr[6];
+	uint8_t addr_type;
+	GIOChannel *io;
+	guint hup_watch;
+	GAttrib *attrib;
+	struct gatt_char_match chars[ANKI_CHAR_COUNT];
+	uint16_t read_handle;
+	uint16_t write_handle;
+	uint32_t expired;
+};
+
+struct client {
+	bool used;
+	int fd;
+	struct event_io *io;
+	uint32_t vehicle_mask;
+	uint8_t msg_mask[32];
+	uint32_t event_seq;
+	uint64_t dropped;
+	size_t out_len;
+	uint8_t out[VD_MAX_PACKET];
+};
+
+static struct vehicle vehicles[VD_MAX_VEHICLES];
+static struct client clients[MAX_CLIENTS];
+static guint flush_source;
+
+static char *opt_src = NULL;
+static char *opt_socket = NULL;
+static char *opt_sec_level = NULL;
+static char *opt_state_table = NULL;
+static char *opt_record = NULL;
+static gboolean opt_epoll = FALSE;
+static GMainLoop *main_loop;
+static anki_vehicle_state_table_t *state_table;
+static anki_session_recorder_t recorder;
+static gboolean recording = FALSE;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void vehicle_info(const struct vehicle *v, vd_vehicle_info_t *info)
+{
+	info->vehicle = v->id;
+	info->state = v->state;
+	memcpy(info->addr, v->addr, sizeof(info->addr));
+	info->addr_type = v->addr_type;
+	info->expired = v->expired;
+}
+
+/* Client output */
+
+static void client_close(struct client *c);
+
+static void client_flush(struct client *c)
+{
+	vd_hdr_t *hdr = (vd_hdr_t *) c->out;
+
+	if (c->out_len == 0)
+		return;
+
+	if (send(c->fd, c->out, c->out_len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+		/* Events are lossy: a slow client sees a gap in event seq */
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			c->dropped += hdr->count;
+		} else {
+			client_close(c);
+			return;
+		}
+	}
+
+	c->out_len = 0;
+}
+
+static gboolean flush_idle(gpointer user_data)
+{
+	unsigned int i;
+
+	flush_source = 0;
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i].used)
+			client_flush(&clients[i]);
+	}
+
+	return FALSE;
+}
+
+/*
+ * Append an event entry followed by an optional payload to the client's
+ * pending packet, starting a new packet when the type changes or the
+ * entry does not fit. Pending packets go out once the loop is idle.
+ */
+static void client_queue_event(struct client *c, uint8_t type,
+				const void *entry, size_t len,
+				const void *payload, size_t plen)
+{
+	vd_hdr_t *hdr = (vd_hdr_t *) c->out;
+
+	if (c->out_len > 0 && (hdr->type != type ||
+			c->out_len + len + plen > VD_MAX_PACKET))
+		client_flush(c);
+
+	if (!c->used)
+		return;
+
+	if (c->out_len == 0) {
+		hdr->type = type;
+		hdr->status = 0;
+		hdr->count = 0;
+		hdr->seq = c->event_seq++;
+		c->out_len = sizeof(vd_hdr_t);
+	}
+
+	memcpy(c->out + c->out_len, entry, len);
+	c->out_len += len;
+	if (plen > 0) {
+		memcpy(c->out + c->out_len, payload, plen);
+		c->out_len += plen;
+	}
+	hdr->count++;
+
+	if (flush_source == 0)
+		flush_source = g_idle_add(flush_idle, NULL);
+}
+
+static void client_reply(struct client *c, const vd_hdr_t *req,
+				uint8_t status, uint16_t count,
+				const void *body, size_t len)
+{
+	uint8_t buf[VD_MAX_PACKET];
+	vd_hdr_t *hdr = (vd_hdr_t *) buf;
+
+	hdr->type = req->type | VD_RESPONSE;
+	hdr->status = status;
+	hdr->count = count;
+	hdr->seq = req->seq;
+	if (len > 0)
+		memcpy(buf + sizeof(vd_hdr_t), body, len);
+
+	/* Clients wait for their responses; one that does not read is gone */
+	if (send(c->fd, buf, sizeof(vd_hdr_t) + len,
+					MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+		dlog("Dropping client %d: %s\n", c->fd, strerror(errno));
+		client_close(c);
+	}
+}
+
+static void broadcast_state(const struct vehicle *v)
+{
+	vd_vehicle_info_t info;
+	unsigned int i;
+
+	vehicle_info(v, &info);
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		struct client *c = &clients[i];
+
+		if (c->used && (c->vehicle_mask & (1u << v->id)))
+			client_queue_event(c, VD_EVT_STATE, &info, sizeof(info),
+								NULL, 0);
+	}
+}
+
+/* Vehicle connections */
+
+static void publish_connection(const struct vehicle *v)
+{
+	anki_vehicle_connection_t connection;
+
+	if (state_table == NULL)
+		return;
+
+	switch (v->state) {
+	case VD_STATE_READY:
+		connection = ANKI_VEHICLE_CONNECTED;
+		break;
+	case VD_STATE_DISCONNECTED:
+		connection = ANKI_VEHICLE_DISCONNECTED;
+		break;
+	default:
+		connection = ANKI_VEHICLE_CONNECTING;
+		break;
+	}
+
+	anki_vehicle_state_table_set_connection(state_table, v->id, now_us(),
+							v->addr, connection);
+}
+
+static void record_msg(const struct vehicle *v, uint8_t kind,
+					const uint8_t *msg, uint8_t len)
+{
+	if (!recording)
+		return;
+
+	if (anki_session_recorder_record(&recorder, now_us(), v->id, kind,
+							msg, len) != 0) {
+		g_printerr("Unable to record to %s, recording stopped\n",
+								opt_record);
+		anki_session_recorder_close(&recorder);
+		recording = FALSE;
+	}
+}
+
+/* Bounds what a crash loses to about a second of the session */
+static gboolean record_flush_cb(gpointer user_data)
+{
+	if (recording)
+		anki_session_recorder_flush(&recorder);
+
+	return TRUE;
+}
+
+static void vehicle_set_state(struct vehicle *v, uint8_t state)
+{
+	if (v->state == state)
+		return;
+
+	v->state = state;
+	broadcast_state(v);
+	publish_connection(v);
+}
+
+/* Free the slot and its id for the next address that connects */
+static void vehicle_release(struct vehicle *v)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		clients[i].vehicle_mask &= ~(1u << v->id);
+
+	v->used = false;
+}
+
+static void vehicle_disconnect(struct vehicle *v)
+{
+	if (v->state == VD_STATE_DISCONNECTED)
+		return;
+
+	if (v->hup_watch) {
+		g_source_remove(v->hup_watch);
+		v->hup_watch = 0;
+	}
+
+	if (v->attrib) {
+		/*
+		 * Requests in flight keep the GAttrib alive after the unref;
+		 * none of their callbacks may reach v, which can be reused.
+		 */
+		g_attrib_cancel_all(v->attrib);
+		g_attrib_unregister_all(v->attrib);
+		g_attrib_set_expire_function(v->attrib, NULL, NULL);
+		g_attrib_unref(v->attrib);
+		v->attrib = NULL;
+	}
+
+	if (v->io) {
+		g_io_channel_shutdown(v->io, FALSE, NULL);
+		g_io_channel_unref(v->io);
+		v->io = NULL;
+	}
+
+	v->read_handle = 0;
+	v->write_handle = 0;
+	vehicle_set_state(v, VD_STATE_DISCONNECTED);
+	vehicle_release(v);
+}
+
+static void notify_handler(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+	struct vehicle *v = user_data;
+	vd_telemetry_t tel;
+	const uint8_t *data = &pdu[3];
+	uint16_t dlen;
+	uint8_t msg_id;
+	unsigned int i;
+
+	if (len < 3 || att_get_u16(&pdu[1]) != v->read_handle)
+		return;
+
+	dlen = len - 3;
+	if (dlen < ANKI_VEHICLE_MSG_BASE_SIZE + 1 ||
+					dlen > ANKI_VEHICLE_MSG_MAX_SIZE)
+		return;
+
+	msg_id = data[1];
+	tel.timestamp_us = now_us();
+	tel.vehicle = v->id;
+	tel.len = dlen;
+
+	record_msg(v, ANKI_SESSION_RECORD_RX, data, dlen);
+
+	if (state_table)
+		anki_vehicle_state_table_handle_msg(state_table, v->id,
+				tel.timestamp_us, (const anki_vehicle_msg_t *) data,
+				dlen);
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		struct client *c = &clients[i];
+
+		if (!c->used || !(c->vehicle_mask & (1u << v->id)))
+			continue;
+		if (!(c->msg_mask[msg_id / 8] & (1 << (msg_id % 8))))
+			continue;
+
+		client_queue_event(c, VD_EVT_TELEMETRY, &tel, sizeof(tel),
+								data, dlen);
+	}
+}
+
+static void expired_cb(guint id, const guint8 *pdu, guint16 len,
+				guint64 overrun_ms, gpointer user_data)
+{
+	struct vehicle *v = user_data;
+
+	v->expired++;
+}
+
+static void enable_notify_cb(guint8 status, const guint8 *pdu, guint16 plen,
+							gpointer user_data)
+{
+	struct vehicle *v = user_data;
+
+	if (status != 0) {
+		dlog("Vehicle %u: enabling notifications failed: %s\n",
+					v->id, att_ecode2str(status));
+		vehicle_disconnect(v);
+	}
+}
+
+static void discover_char_cb(guint8 status, unsigned int index,
+							gpointer user_data)
+{
+	struct vehicle *v = user_data;
+	uint8_t notify_cmd[] = { 0x01, 0x00 };
+
+	/* Left over from a connection that is gone */
+	if (v->state != VD_STATE_DISCOVERING)
+		return;
+
+	switch (index) {
+	case ANKI_CHAR_READ:
+		v->read_handle = v->chars[index].chr.value_handle;
+		/* CCC descriptor follows the read value, see vehicle-tool */
+		gatt_write_char(v->attrib, v->read_handle + 1, notify_cmd,
+				sizeof(notify_cmd), enable_notify_cb, v);
+		break;
+	case ANKI_CHAR_WRITE:
+		v->write_handle = v->chars[index].chr.value_handle;
+		break;
+	default:
+		if (status != 0 || v->read_handle == 0 || v->write_handle == 0) {
+			dlog("Vehicle %u: characteristic discovery failed\n",
+									v->id);
+			vehicle_disconnect(v);
+			return;
+		}
+
+		vehicle_set_state(v, VD_STATE_READY);
+		break;
+	}
+}
+
+static void discover_services_cb(GSList *ranges, guint8 status,
+							gpointer user_data)
+{
+	struct vehicle *v = user_data;
+	struct att_range *range;
+
+	if (v->state != VD_STATE_DISCOVERING)
+		return;
+
+	if (status != 0 || ranges == NULL) {
+		dlog("Vehicle %u: Anki service not found\n", v->id);
+		vehicle_disconnect(v);
+		return;
+	}
+
+	range = ranges->data;
+	memset(v->chars, 0, sizeof(v->chars));
+	bt_string_to_uuid(&v->chars[ANKI_CHAR_READ].uuid,
+						ANKI_STR_CHR_READ_UUID);
+	bt_string_to_uuid(&v->chars[ANKI_CHAR_WRITE].uuid,
+						ANKI_STR_CHR_WRITE_UUID);
+
+	gatt_discover_char_match(v->attrib, range->start, range->end,
+				v->chars, ANKI_CHAR_COUNT, discover_char_cb, v);
+}
+
+static struct vehicle *vehicle_by_io(GIOChannel *io)
+{
+	unsigned int i;
+
+	for (i = 0; i < VD_MAX_VEHICLES; i++) {
+		if (vehicles[i].used && vehicles[i].io == io)
+			return &vehicles[i];
+	}
+
+	return NULL;
+}
+
+static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
+{
+	struct vehicle *v = vehicle_by_io(io);
+	bt_uuid_t uuid;
+
+	/* Disconnected while the connection was being set up */
+	if (v == NULL)
+		return;
+
+	if (err) {
+		dlog("Vehicle %u: %s\n", v->id, err->message);
+		vehicle_disconnect(v);
+		return;
+	}
+
+	v->attrib = g_attrib_new(io);
+	g_attrib_register(v->attrib, ATT_OP_HANDLE_NOTIFY, GATTRIB_ALL_HANDLES,
+						notify_handler, v, NULL);
+	g_attrib_set_expire_function(v->attrib, expired_cb, v);
+	vehicle_set_state(v, VD_STATE_DISCOVERING);
+
+	bt_string_to_uuid(&uuid, ANKI_STR_SERVICE_UUID);
+	gatt_discover_primary(v->attrib, &uuid, discover_services_cb, v);
+}
+
+static gboolean vehicle_hup(GIOChannel *chan, GIOCondition cond,
+							gpointer user_data)
+{
+	struct vehicle *v = user_data;
+
+	/* Returning FALSE removes the watch */
+	v->hup_watch = 0;
+	vehicle_disconnect(v);
+
+	return FALSE;
+}
+
+static int vehicle_connect(struct vehicle *v)
+{
+	GError *gerr = NULL;
+	char addr[18];
+
+	snprintf(addr, sizeof(addr), "%02X:%02X:%02X:%02X:%02X:%02X",
+				v->addr[0], v->addr[1], v->addr[2],
+				v->addr[3], v->addr[4], v->addr[5]);
+
+	v->io = gatt_connect(opt_src, addr,
+			v->addr_type == VD_ADDR_RANDOM ? "random" : "public",
+			opt_sec_level, 0, 0, connect_cb, &gerr);
+	if (v->io == NULL) {
+		dlog("Vehicle %u: %s\n", v->id, gerr->message);
+		g_error_free(gerr);
+		return -EIO;
+	}
+
+	v->hup_watch = g_io_add_watch(v->io, G_IO_HUP, vehicle_hup, v);
+	vehicle_set_state(v, VD_STATE_CONNECTING);
+
+	return 0;
+}
+
+static uint8_t vehicle_send(struct vehicle *v, const uint8_t *msg,
+					uint8_t len, uint16_t deadline_ms)
+{
+	struct gattrib_pdu *pdu;
+	uint8_t *value;
+	size_t vlen;
+	guint id;
+
+	if (v->state != VD_STATE_READY)
+		return VD_STATUS_NOT_READY;
+
+	value = gatt_write_reserve(v->attrib, v->write_handle, FALSE,
+								&vlen, &pdu);
+	if (value == NULL)
+		return VD_STATUS_QUEUE_FULL;
+
+	if (vlen < len) {
+		g_attrib_abort(v->attrib, pdu);
+		return VD_STATUS_INVALID;
+	}
+
+	memcpy(value, msg, len);
+	id = gatt_write_commit(v->attrib, pdu, len, NULL, NULL);
+	if (id == 0)
+		return VD_STATUS_TRANSPORT;
+
+	if (deadline_ms > 0)
+		g_attrib_set_deadline(v->attrib, id,
+					timer_wheel_now() + deadline_ms);
+
+	record_msg(v, ANKI_SESSION_RECORD_TX, msg, len);
+
+	return VD_STATUS_OK;
+}
+
+/* One payload, referenced by the Write Command of every ready vehicle */
+static uint8_t vehicle_broadcast(const uint8_t *msg, uint8_t len,
+							uint16_t deadline_ms)
+{
+	struct gattrib_buf *buf;
+	uint8_t status = VD_STATUS_NOT_READY;
+	unsigned int i;
+
+	buf = g_attrib_buf_new(len);
+	if (buf == NULL)
+		return VD_STATUS_QUEUE_FULL;
+
+	memcpy(buf->data, msg, len);
+
+	for (i = 0; i < VD_MAX_VEHICLES; i++) {
+		struct vehicle *v = &vehicles[i];
+		guint id;
+
+		if (!v->used || v->state != VD_STATE_READY)
+			continue;
+
+		id = gatt_write_cmd_buf(v->attrib, v->write_handle, buf,
+								NULL, NULL);
+		if (id == 0) {
+			status = VD_STATUS_TRANSPORT;
+			continue;
+		}
+
+		if (deadline_ms > 0)
+			g_attrib_set_deadline(v->attrib, id,
+					timer_wheel_now() + deadline_ms);
+		record_msg(v, ANKI_SESSION_RECORD_TX, msg, len);
+		if (status == VD_STATUS_NOT_READY)
+			status = VD_STATUS_OK;
+	}
+
+	g_attrib_buf_unref(buf);
+
+	return status;
+}
+
+/* Requests */
+
+static struct vehicle *vehicle_lookup(uint8_t id)
+{
+	if (id >= VD_MAX_VEHICLES || !vehicles[id].used)
+		return NULL;
+
+	return &vehicles[id];
+}
+
+static void handle_connect(struct client *c, const vd_hdr_t *hdr,
+					const uint8_t *body, size_t len)
+{
+	const vd_connect_req_t *req = (const vd_connect_req_t *) body;
+	struct vehicle *v = NULL;
+	vd_vehicle_info_t info;
+	unsigned int i;
+
+	if (len < sizeof(*req) || req->addr_type > VD_ADDR_RANDOM) {
+		client_reply(c, hdr, VD_STATUS_INVALID, 0, NULL, 0);
+		return;
+	}
+
+	for (i = 0; i < VD_MAX_VEHICLES && v == NULL; i++) {
+		if (vehicles[i].used &&
+			memcmp(vehicles[i].addr, req->addr, 6) == 0)
+			v = &vehicles[i];
+	}
+
+	for (i = 0; i < VD_MAX_VEHICLES && v == NULL; i++) {
+		if (!vehicles[i].used) {
+			v = &vehicles[i];
+			memset(v, 0, sizeof(*v));
+			v->used = true;
+			v->id = i;
+			memcpy(v->addr, req->addr, 6);
+			/* Drop what the slot's previous vehicle left */
+			if (state_table)
+				anki_vehicle_state_table_clear(state_table,
+									v->id);
+		}
+	}
+
+	if (v == NULL) {
+		client_reply(c, hdr, VD_STATUS_NO_SLOT, 0, NULL, 0);
+		return;
+	}
+
+	if (v->state == VD_STATE_DISCONNECTED) {
+		v->addr_type = req->addr_type;
+		if (vehicle_connect(v) < 0) {
+			vehicle_release(v);
+			client_reply(c, hdr, VD_STATUS_TRANSPORT, 0, NULL, 0);
+			return;
+		}
+	}
+
+	vehicle_info(v, &info);
+	client_reply(c, hdr, VD_STATUS_OK, 1, &info, sizeof(info));
+}
+
+static void handle_disconnect(struct client *c, const vd_hdr_t *hdr,
+					const uint8_t *body, size_t len)
+{
+	const vd_vehicle_req_t *req = (const vd_vehicle_req_t *) body;
+	struct vehicle *v;
+
+	if (len < sizeof(*req)) {
+		client_reply(c, hdr, VD_STATUS_INVALID, 0, NULL, 0);
+		return;
+	}
+
+	v = vehicle_lookup(req->vehicle);
+	if (v == NULL) {
+		client_reply(c, hdr, VD_STATUS_UNKNOWN_VEHICLE, 0, NULL, 0);
+		return;
+	}
+
+	vehicle_disconnect(v);
+	client_reply(c, hdr, VD_STATUS_OK, 0, NULL, 0);
+}
+
+static void handle_list(struct client *c, const vd_hdr_t *hdr)
+{
+	vd_vehicle_info_t info[VD_MAX_VEHICLES];
+	uint16_t count = 0;
+	unsigned int i;
+
+	for (i = 0; i < VD_MAX_VEHICLES; i++) {
+		if (vehicles[i].used)
+			vehicle_info(&vehicles[i], &info[count++]);
+	}
+
+	client_reply(c, hdr, VD_STATUS_OK, count, info, count * sizeof(info[0]));
+}
+
+static void handle_commands(struct client *c, const vd_hdr_t *hdr,
+					const uint8_t *body, size_t len)
+{
+	const vd_batch_t *batch = (const vd_batch_t *) body;
+	uint8_t status[VD_MAX_PACKET];
+	size_t off = sizeof(*batch);
+	uint16_t i;
+
+	/* Every entry takes at least a vd_cmd, which bounds the reply too */
+	if (len < sizeof(*batch) ||
+			hdr->count > (len - sizeof(*batch)) / sizeof(vd_cmd_t)) {
+		client_reply(c, hdr, VD_STATUS_INVALID, 0, NULL, 0);
+		return;
+	}
+
+	for (i = 0; i < hdr->count; i++) {
+		const vd_cmd_t *cmd = (const vd_cmd_t *) (body + off);
+		const uint8_t *msg = body + off + sizeof(*cmd);
+		struct vehicle *v;
+
+		if (off + sizeof(*cmd) > len ||
+				off + sizeof(*cmd) + cmd->len > len) {
+			/* Truncated batch: report what was parsed before it */
+			if (!(batch->flags & VD_BATCH_NO_REPLY))
+				client_reply(c, hdr, VD_STATUS_INVALID, i,
+								status, i);
+			return;
+		}
+		off += sizeof(*cmd) + cmd->len;
+
+		if (cmd->len < ANKI_VEHICLE_MSG_BASE_SIZE + 1 ||
+				cmd->len > ANKI_VEHICLE_MSG_MAX_SIZE ||
+				msg[0] != cmd->len - ANKI_VEHICLE_MSG_BASE_SIZE) {
+			status[i] = VD_STATUS_INVALID;
+			continue;
+		}
+
+		if (cmd->vehicle == VD_VEHICLE_ALL) {
+			status[i] = vehicle_broadcast(msg, cmd->len,
+							batch->deadline_ms);
+			continue;
+		}
+
+		v = vehicle_lookup(cmd->vehicle);
+		if (v == NULL)
+			status[i] = VD_STATUS_UNKNOWN_VEHICLE;
+		else
+			status[i] = vehicle_send(v, msg, cmd->len,
+							batch->deadline_ms);
+	}
+
+	if (batch->flags & VD_BATCH_NO_REPLY)
+		return;
+
+	client_reply(c, hdr, VD_STATUS_OK, hdr->count, status, hdr->count);
+}
+
+static void handle_subscribe(struct client *c, const vd_hdr_t *hdr,
+					const uint8_t *body, size_t len)
+{
+	const vd_subscribe_req_t *req = (const vd_subscribe_req_t *) body;
+	unsigned int i;
+
+	if (len < sizeof(*req)) {
+		client_reply(c, hdr, VD_STATUS_INVALID, 0, NULL, 0);
+		return;
+	}
+
+	c->vehicle_mask = req->vehicle_mask;
+	memcpy(c->msg_mask, req->msg_mask, sizeof(c->msg_mask));
+	client_reply(c, hdr, VD_STATUS_OK, 0, NULL, 0);
+
+	if (!c->used)
+		return;
+
+	/* Start with the current state of every subscribed vehicle */
+	for (i = 0; i < VD_MAX_VEHICLES; i++) {
+		vd_vehicle_info_t info;
+
+		if (!vehicles[i].used || !(c->vehicle_mask & (1u << i)))
+			continue;
+
+		vehicle_info(&vehicles[i], &info);
+		client_queue_event(c, VD_EVT_STATE, &info, sizeof(info),
+								NULL, 0);
+	}
+}
+
+static void handle_request(struct client *c, const uint8_t *buf, size_t len)
+{
+	const vd_hdr_t *hdr = (const vd_hdr_t *) buf;
+	const uint8_t *body = buf + sizeof(vd_hdr_t);
+	size_t blen;
+
+	if (len < sizeof(vd_hdr_t))
+		return;
+
+	blen = len - sizeof(vd_hdr_t);
+
+	switch (hdr->type) {
+	case VD_REQ_CONNECT:
+		handle_connect(c, hdr, body, blen);
+		break;
+	case VD_REQ_DISCONNECT:
+		handle_disconnect(c, hdr, body, blen);
+		break;
+	case VD_REQ_LIST:
+		handle_list(c, hdr);
+		break;
+	case VD_REQ_COMMANDS:
+		handle_commands(c, hdr, body, blen);
+		break;
+	case VD_REQ_SUBSCRIBE:
+		handle_subscribe(c, hdr, body, blen);
+		break;
+	default:
+		client_reply(c, hdr, VD_STATUS_UNSUPPORTED, 0, NULL, 0);
+		break;
+	}
+}
+
+/* Client sockets */
+
+static void client_close(struct client *c)
+{
+	if (!c->used)
+		return;
+
+	if (c->dropped > 0)
+		dlog("Client %d dropped %llu events\n", c->fd,
+					(unsigned long long) c->dropped);
+
+	event_io_remove(c->io);
+	close(c->fd);
+	c->used = false;
+}
+
+static bool client_io(struct event_io *io, int fd, uint32_t events,
+							void *user_data)
+{
+	struct client *c = user_data;
+	uint8_t buf[VD_MAX_PACKET];
+	unsigned int n;
+
+	for (n = 0; n < CLIENT_RX_BUDGET; n++) {
+		ssize_t len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+		if (len == 0) {
+			client_close(c);
+			return false;
+		}
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				client_close(c);
+			return false;
+		}
+
+		handle_request(c, buf, len);
+		if (!c->used)
+			return false;
+	}
+
+	/* More requests may be waiting; come back after other sources */
+	return true;
+}
+
+static bool listen_io(struct event_io *io, int fd, uint32_t events,
+							void *user_data)
+{
+	for (;;) {
+		struct client *c = NULL;
+		unsigned int i;
+		int cfd;
+
+		cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (cfd < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		for (i = 0; i < MAX_CLIENTS && c == NULL; i++) {
+			if (!clients[i].used)
+				c = &clients[i];
+		}
+
+		if (c == NULL) {
+			dlog("Too many clients\n");
+			close(cfd);
+			continue;
+		}
+
+		memset(c, 0, offsetof(struct client, out));
+		c->fd = cfd;
+		c->io = event_io_add(cfd, EVENT_IN, client_io, c);
+		if (c->io == NULL) {
+			close(cfd);
+			continue;
+		}
+		c->used = true;
+	}
+}
+
+static int listen_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+						listen(fd, MAX_CLIENTS) < 0) {
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
+static bool signal_io(struct event_io *io, int fd, uint32_t events,
+							void *user_data)
+{
+	struct signalfd_siginfo si;
+
+	while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+		if (si.ssi_signo == SIGINT || si.ssi_signo == SIGTERM)
+			g_main_loop_quit(main_loop);
+	}
+
+	return false;
+}
+
+static int setup_signalfd(void)
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+		return -errno;
+
+	return signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+static GOptionEntry options[] = {
+	{ "adapter", 'i', 0, G_OPTION_ARG_STRING, &opt_src,
+		"Specify local adapter interface", "hciX" },
+	{ "socket", 's', 0, G_OPTION_ARG_STRING, &opt_socket,
+		"Unix socket to listen on. Default: " VD_DEFAULT_SOCKET_PATH,
+		"PATH" },
+	{ "sec-level", 'l', 0, G_OPTION_ARG_STRING, &opt_sec_level,
+		"Set security level. Default: low", "[low | medium | high]"},
+	{ "state-table", 't', 0, G_OPTION_ARG_STRING, &opt_state_table,
+		"Publish vehicle state to a shared memory table", "PATH" },
+	{ "record", 'r', 0, G_OPTION_ARG_STRING, &opt_record,
+		"Record all vehicle traffic to a session log", "PATH" },
+	{ "epoll", 'e', 0, G_OPTION_ARG_NONE, &opt_epoll,
+		"Run the ATT transport and clients on epoll instead of GLib",
+		NULL },
+	{ NULL },
+};
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *gerr = NULL;
+	struct event_io *listen_watch = NULL, *signal_watch = NULL;
+	int listen_fd = -1, signal_fd = -1;
+	guint transport = 0, record_flush = 0;
+	int status = EXIT_FAILURE;
+	unsigned int i;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &gerr)) {
+		g_printerr("%s\n", gerr->message);
+		g_clear_error(&gerr);
+		goto done;
+	}
+
+	if (opt_socket == NULL)
+		opt_socket = g_strdup(VD_DEFAULT_SOCKET_PATH);
+	if (opt_sec_level == NULL)
+		opt_sec_level = g_strdup("low");
+
+	if (opt_epoll && event_loop_init(EVENT_LOOP_EPOLL) < 0) {
+		g_printerr("Unable to set up the epoll event loop\n");
+		goto done;
+	}
+
+	listen_fd = listen_socket(opt_socket);
+	if (listen_fd < 0) {
+		g_printerr("Unable to listen on %s: %s\n", opt_socket,
+							strerror(-listen_fd));
+		goto done;
+	}
+
+	if (opt_state_table) {
+		state_table = anki_vehicle_state_table_create(opt_state_table,
+							VD_MAX_VEHICLES);
+		if (state_table == NULL) {
+			g_printerr("Unable to create state table %s\n",
+							opt_state_table);
+			goto done;
+		}
+	}
+
+	if (opt_record) {
+		if (anki_session_recorder_create(&recorder, opt_record) != 0) {
+			g_printerr("Unable to create session log %s\n",
+								opt_record);
+			goto done;
+		}
+		recording = TRUE;
+		record_flush = g_timeout_add_seconds(1, record_flush_cb, NULL);
+	}
+
+	signal_fd = setup_signalfd();
+	if (signal_fd < 0) {
+		g_printerr("Unable to set up signal handling\n");
+		goto done;
+	}
+
+	main_loop = g_main_loop_new(NULL, FALSE);
+
+	listen_watch = event_io_add(listen_fd, EVENT_IN, listen_io, NULL);
+	signal_watch = event_io_add(signal_fd, EVENT_IN, signal_io, NULL);
+	if (listen_watch == NULL || signal_watch == NULL) {
+		g_printerr("Unable to watch the daemon sockets\n");
+		goto done;
+	}
+
+	/* No-op unless everything runs on its own epoll loop */
+	transport = event_loop_glib_attach();
+
+	dlog("Listening on %s\n", opt_socket);
+	g_main_loop_run(main_loop);
+	status = EXIT_SUCCESS;
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (!clients[i].used)
+			continue;
+		client_flush(&clients[i]);
+		client_close(&clients[i]);
+	}
+
+	for (i = 0; i < VD_MAX_VEHICLES; i++) {
+		if (vehicles[i].used)
+			vehicle_disconnect(&vehicles[i]);
+	}
+
+done:
+	if (transport)
+		g_source_remove(transport);
+	if (flush_source)
+		g_source_remove(flush_source);
+	if (record_flush)
+		g_source_remove(record_flush);
+	if (recording)
+		anki_session_recorder_close(&recorder);
+	event_io_remove(listen_watch);
+	event_io_remove(signal_watch);
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		unlink(opt_socket);
+	}
+	if (signal_fd >= 0)
+		close(signal_fd);
+	if (main_loop)
+		g_main_loop_unref(main_loop);
+	if (state_table) {
+		anki_vehicle_state_table_unmap(state_table);
+		unlink(opt_state_table);
+	}
+
+	g_option_context_free(context);
+	g_free(opt_src);
+	g_free(opt_socket);
+	g_free(opt_sec_level);
+	g_free(opt_state_table);
+	g_free(opt_record);
+
+	return status;
+}
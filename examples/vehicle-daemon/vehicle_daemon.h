@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef VEHICLE_DAEMON_H
+#define VEHICLE_DAEMON_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <ankidrive/common.h>
+#include <ankidrive/protocol.h>
+
+/*
+ * Wire protocol of vehicle-daemon.
+ *
+ * Clients connect to a SOCK_SEQPACKET Unix domain socket, so every request,
+ * response and event is exactly one packet of at most VD_MAX_PACKET bytes
+ * and needs no framing. Every packet starts with a vd_hdr. Multi-byte
+ * fields are in host byte order: both ends run on the same machine.
+ *
+ * Vehicle messages travel in the encoding of <ankidrive/protocol.h>, so a
+ * client builds a batch with the SDK encoders and the daemon copies each
+ * message straight into an ATT Write Command without parsing it.
+ *
+ * Responses carry the type of the request with VD_RESPONSE set and the seq
+ * of the request. Events are only sent to subscribed clients; their seq
+ * counts events per client, so a gap means events were dropped because the
+ * client did not read fast enough.
+ */
+
+#define VD_DEFAULT_SOCKET_PATH          "/tmp/vehicle-daemon.sock"
+
+#define VD_MAX_PACKET                   4096
+#define VD_MAX_VEHICLES                 32
+
+/* Vehicle id addressing every ready vehicle in a command batch */
+#define VD_VEHICLE_ALL                  0xff
+
+/* vd_hdr.type */
+#define VD_REQ_CONNECT                  0x01
+#define VD_REQ_DISCONNECT               0x02
+#define VD_REQ_LIST                     0x03
+#define VD_REQ_COMMANDS                 0x04
+#define VD_REQ_SUBSCRIBE                0x05
+#define VD_EVT_TELEMETRY                0x40
+#define VD_EVT_STATE                    0x41
+#define VD_RESPONSE                     0x80
+
+/* vd_hdr.status and per-command status in VD_REQ_COMMANDS responses */
+#define VD_STATUS_OK                    0
+#define VD_STATUS_INVALID               1
+#define VD_STATUS_UNKNOWN_VEHICLE       2
+#define VD_STATUS_NOT_READY             3
+#define VD_STATUS_QUEUE_FULL            4
+#define VD_STATUS_NO_SLOT               5
+#define VD_STATUS_UNSUPPORTED           6
+#define VD_STATUS_TRANSPORT             7
+
+/* vd_vehicle_info.state */
+#define VD_STATE_DISCONNECTED           0
+#define VD_STATE_CONNECTING             1
+#define VD_STATE_DISCOVERING            2
+#define VD_STATE_READY                  3
+
+/* vd_connect_req.addr_type */
+#define VD_ADDR_PUBLIC                  0
+#define VD_ADDR_RANDOM                  1
+
+/* vd_batch.flags */
+#define VD_BATCH_NO_REPLY               (1 << 0)
+
+/*
+ * - type: VD_REQ_*, VD_EVT_* or a request type | VD_RESPONSE
+ * - status: VD_STATUS_* in responses, 0 otherwise
+ * - count: Number of entries following the fixed part of the body
+ * - seq: Chosen by the client for requests, echoed in the response
+ */
+typedef struct vd_hdr {
+        uint8_t type;
+        uint8_t status;
+        uint16_t count;
+        uint32_t seq;
+} ATTRIBUTE_PACKED vd_hdr_t;
+
+/*
+ * VD_REQ_CONNECT body. The response holds one vd_vehicle_info; readiness
+ * is reported later with VD_EVT_STATE. Connecting to an address that
+ * already has a slot reuses it. A slot, and with it the vehicle id, is
+ * released when its vehicle disconnects, after the VD_STATE_DISCONNECTED
+ * event; subscriptions to the id end there too.
+ */
+typedef struct vd_connect_req {
+        uint8_t addr[6];                /* Most significant byte first */
+        uint8_t addr_type;
+} ATTRIBUTE_PACKED vd_connect_req_t;
+
+/* VD_REQ_DISCONNECT body */
+typedef struct vd_vehicle_req {
+        uint8_t vehicle;
+} ATTRIBUTE_PACKED vd_vehicle_req_t;
+
+/*
+ * VD_REQ_CONNECT and VD_REQ_LIST response entries, VD_EVT_STATE entries.
+ * expired counts the commands to this vehicle that were dropped at their
+ * deadline since it took its slot.
+ */
+typedef struct vd_vehicle_info {
+        uint8_t vehicle;
+        uint8_t state;
+        uint8_t addr[6];
+        uint8_t addr_type;
+        uint32_t expired;
+} ATTRIBUTE_PACKED vd_vehicle_info_t;
+
+/*
+ * VD_REQ_COMMANDS body: a vd_batch followed by count vd_cmd entries.
+ * Commands still queued deadline_ms after they were received are dropped
+ * instead of sent late; 0 sends them whenever the link allows.
+ * The response holds one VD_STATUS_* byte per command, unless
+ * VD_BATCH_NO_REPLY is set, in which case nothing is sent back.
+ */
+typedef struct vd_batch {
+        uint16_t deadline_ms;
+        uint16_t flags;
+} ATTRIBUTE_PACKED vd_batch_t;
+
+/* A vehicle message of len bytes follows each entry */
+typedef struct vd_cmd {
+        uint8_t vehicle;
+        uint8_t len;
+} ATTRIBUTE_PACKED vd_cmd_t;
+
+/*
+ * VD_REQ_SUBSCRIBE body. Receive VD_EVT_TELEMETRY for the vehicles in
+ * vehicle_mask (bit n = vehicle n) and message ids set in msg_mask
+ * (bit n of byte n / 8). VD_EVT_STATE is sent for the vehicles in
+ * vehicle_mask. An all-zero vehicle_mask unsubscribes.
+ */
+typedef struct vd_subscribe_req {
+        uint32_t vehicle_mask;
+        uint8_t msg_mask[32];
+} ATTRIBUTE_PACKED vd_subscribe_req_t;
+
+/* VD_EVT_TELEMETRY entries: a vehicle message of len bytes follows */
+typedef struct vd_telemetry {
+        uint64_t timestamp_us;          /* CLOCK_MONOTONIC, on receipt */
+        uint8_t vehicle;
+        uint8_t len;
+} ATTRIBUTE_PACKED vd_telemetry_t;
+
+/*
+ * Helpers for building a VD_REQ_COMMANDS packet in a caller buffer of
+ * VD_MAX_PACKET bytes. vd_batch_add returns 0 on success and 1 when the
+ * command does not fit, in which case the batch should be sent first.
+ */
+static inline size_t vd_batch_init(uint8_t *buf, uint32_t seq,
+                                   uint16_t deadline_ms, uint16_t flags)
+{
+        vd_hdr_t *hdr = (vd_hdr_t *)buf;
+        vd_batch_t *batch = (vd_batch_t *)(buf + sizeof(vd_hdr_t));
+
+        hdr->type = VD_REQ_COMMANDS;
+        hdr->status = 0;
+        hdr->count = 0;
+        hdr->seq = seq;
+        batch->deadline_ms = deadline_ms;
+        batch->flags = flags;
+
+        return sizeof(vd_hdr_t) + sizeof(vd_batch_t);
+}
+
+static inline uint8_t vd_batch_add(uint8_t *buf, size_t *len, uint8_t vehicle,
+                                   const anki_vehicle_msg_t *msg, uint8_t msg_len)
+{
+        vd_hdr_t *hdr = (vd_hdr_t *)buf;
+        vd_cmd_t *cmd;
+
+        if (*len + sizeof(vd_cmd_t) + msg_len > VD_MAX_PACKET)
+                return 1;
+
+        cmd = (vd_cmd_t *)(buf + *len);
+        cmd->vehicle = vehicle;
+        cmd->len = msg_len;
+        memcpy(buf + *len + sizeof(vd_cmd_t), msg, msg_len);
+
+        *len += sizeof(vd_cmd_t) + msg_len;
+        hdr->count++;
+
+        return 0;
+}
+
+#endif
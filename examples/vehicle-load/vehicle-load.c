@@ -0,0 +1,1466 @@
+/*
+ *
+ *  Copyright (C) 2014  Anki, Inc.
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Load generator for the ATT connection stack.
+ *
+ * Every simulated vehicle is one end of a SOCK_SEQPACKET socket pair. The
+ * other end is a GAttrib connection set up exactly like vehicle-daemon
+ * sets up a real one: service and characteristic discovery, notifications
+ * enabled through the CCC descriptor. Behind each socket a minimal GATT
+ * server answers discovery, passes writes to anki_vehicle_sim and sends
+ * whatever the simulated vehicle reports back as notifications.
+ *
+ * Once every vehicle is ready, each one is sent commands from a weighted
+ * mix at a fixed rate. Commands are tracked from the moment they are
+ * queued until the vehicle receives them, acknowledges them or answers
+ * them, and the run ends with a JSON report of throughput, latency
+ * percentiles, queue depths, CPU use and dropped or expired commands.
+ *
+ * Everything, including the simulated vehicles, runs on one thread, so
+ * the time spent in the vehicles is measured separately and subtracted
+ * to get the cost of the connection stack alone.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include "lib/uuid.h"
+#include "att.h"
+#include "gattrib.h"
+#include "gatt.h"
+#include "timer_wheel.h"
+#include "event_loop.h"
+
+#include <ankidrive.h>
+
+#define MAX_VEHICLES		1024
+#define MAX_QUEUE_LIMIT		4096
+
+/* Command generation and queue sampling period */
+#define TICK_MS			5
+#define SIM_STEP_MS		10
+#define CONNECT_TIMEOUT_MS	10000
+#define DRAIN_MS		1000
+
+/* Responses a vehicle may owe before further ones are not timed */
+#define MAX_AWAITING		64
+
+/* GATT database of a simulated vehicle */
+#define SERVICE_HANDLE		0x000c
+#define READ_DECL_HANDLE	0x000d
+#define READ_VALUE_HANDLE	0x000e
+#define READ_CCC_HANDLE		0x000f
+#define WRITE_DECL_HANDLE	0x0010
+#define WRITE_VALUE_HANDLE	0x0011
+
+/* Opcodes with this bit set are commands and never get a response */
+#define ATT_COMMAND_FLAG	0x40
+
+#define REPORT_FORMAT		1
+
+#define dlog(fmt, arg...) \
+	fprintf(stderr, "vehicle-load: " fmt, ## arg)
+
+enum {
+	ANKI_CHAR_READ,
+	ANKI_CHAR_WRITE,
+	ANKI_CHAR_COUNT
+};
+
+enum cmd_kind {
+	CMD_SPEED,
+	CMD_LANE,
+	CMD_LIGHTS,
+	CMD_PING,
+	CMD_BATTERY,
+	CMD_KINDS
+};
+
+static const char *const cmd_names[CMD_KINDS] = {
+	"speed", "lane", "lights", "ping", "battery",
+};
+
+enum phase {
+	PHASE_CONNECT,
+	PHASE_WARMUP,
+	PHASE_MEASURE,
+	PHASE_DRAIN,
+};
+
+/*
+ * Log-linear latency histogram in microseconds: values below HIST_SUB are
+ * exact, larger ones fall into HIST_SUB buckets per power of two, so any
+ * percentile is within 1/HIST_SUB of the true value.
+ */
+#define HIST_SUB_BITS		5
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		((32 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint32_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+struct kind_stats {
+	unsigned int weight;
+	uint64_t issued;
+	uint64_t delivered;
+	uint64_t acked;
+	uint64_t answered;
+	uint64_t dropped;
+	uint64_t expired;
+	uint64_t failed;
+	uint64_t pending;
+	struct histogram delivery;
+	struct histogram ack;
+	struct histogram response;
+};
+
+/* A command queued on a connection and not yet received by the vehicle */
+struct pending {
+	guint id;
+	uint8_t kind;
+	bool acked;
+	bool measured;
+	bool dead;
+	uint64_t issued_us;
+};
+
+/* A ping or battery request received by the vehicle, awaiting its answer */
+struct awaiting {
+	uint8_t kind;
+	bool measured;
+	uint64_t issued_us;
+};
+
+struct vehicle {
+	unsigned int index;
+	GIOChannel *io;
+	GAttrib *attrib;
+	struct gatt_char_match chars[ANKI_CHAR_COUNT];
+	uint16_t read_handle;
+	uint16_t write_handle;
+	bool discovered;
+	bool notifying;
+	bool ready;
+	bool failed;
+	uint64_t connect_start_us;
+
+	/* Commands in flight, oldest first */
+	struct pending *ring;
+	unsigned int head;
+	unsigned int count;
+	unsigned int live;
+	double credit;
+
+	/* Write Request being acknowledged */
+	uint8_t ack_kind;
+	bool ack_measured;
+	bool expiring;
+	uint64_t ack_issued_us;
+
+	struct awaiting awaiting[MAX_AWAITING];
+	unsigned int awaiting_head;
+	unsigned int awaiting_count;
+
+	/* Simulated side */
+	int peer_fd;
+	struct event_io *peer_watch;
+	bool peer_notify;
+
+	/* Measured */
+	uint64_t issued;
+	uint64_t delivered;
+	uint64_t dropped;
+	uint64_t expired;
+	uint64_t notifications;
+	uint64_t depth_sum;
+	uint64_t depth_samples;
+	unsigned int depth_max;
+	unsigned int in_flight_max;
+};
+
+static struct vehicle *vehicles;
+static anki_vehicle_sim_t sim;
+static void *sim_storage;
+static struct kind_stats kinds[CMD_KINDS];
+static struct histogram connect_hist;
+static enum phase phase = PHASE_CONNECT;
+static unsigned int ready_count;
+static unsigned int failed_count;
+static uint64_t phase_start_us;
+static uint64_t measure_start_us;
+static uint64_t measure_end_us;
+static uint64_t last_tick_us;
+static unsigned int tick_source;
+static uint64_t peer_cpu_ns;
+static uint64_t notifications;
+static uint64_t peer_notify_dropped;
+static uint64_t unmatched;
+static struct rusage usage_start, usage_end;
+static uint32_t rng_state;
+
+static gint opt_vehicles = 50;
+static gdouble opt_rate = 20;
+static gdouble opt_duration = 10;
+static gdouble opt_warmup = 1;
+static gchar *opt_mix = NULL;
+static gint opt_acked = 0;
+static gint opt_deadline = 0;
+static gint opt_queue_limit = 256;
+static gchar *opt_output = NULL;
+static gint opt_seed = 1;
+static gboolean opt_epoll = FALSE;
+static gboolean opt_per_vehicle = FALSE;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t rusage_us(const struct rusage *ru)
+{
+	return (uint64_t) ru->ru_utime.tv_sec * 1000000 + ru->ru_utime.tv_usec +
+		(uint64_t) ru->ru_stime.tv_sec * 1000000 + ru->ru_stime.tv_usec;
+}
+
+static uint32_t rng_next(void)
+{
+	/* xorshift32; reproducible for a given --seed */
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+/* Histograms */
+
+static unsigned int hist_index(uint32_t value)
+{
+	unsigned int shift;
+
+	if (value < HIST_SUB)
+		return value;
+
+	shift = 31 - __builtin_clz(value) - HIST_SUB_BITS;
+
+	return (shift + 1) * HIST_SUB + (value >> shift) - HIST_SUB;
+}
+
+static uint32_t hist_upper(unsigned int index)
+{
+	unsigned int shift;
+
+	if (index < HIST_SUB)
+		return index;
+
+	shift = index / HIST_SUB - 1;
+
+	return ((uint32_t) (index % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+}
+
+static void hist_add(struct histogram *h, uint64_t value)
+{
+	uint32_t v = value > UINT32_MAX ? UINT32_MAX : (uint32_t) value;
+
+	h->buckets[hist_index(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+static void hist_merge(struct histogram *dst, const struct histogram *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+static uint32_t hist_percentile(const struct histogram *h, double p)
+{
+	uint64_t rank, seen = 0;
+	unsigned int i;
+
+	if (h->count == 0)
+		return 0;
+
+	rank = (uint64_t) (p * (h->count - 1)) + 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			return MIN(hist_upper(i), h->max);
+	}
+
+	return h->max;
+}
+
+/* Simulated vehicles: a GATT server per socket in front of the simulation */
+
+static void peer_send(struct vehicle *v, const uint8_t *pdu, size_t len)
+{
+	while (send(v->peer_fd, pdu, len, MSG_DONTWAIT) < 0) {
+		if (errno == EINTR)
+			continue;
+		peer_notify_dropped++;
+		return;
+	}
+}
+
+static void peer_error(struct vehicle *v, uint8_t opcode, uint16_t handle,
+							uint8_t status)
+{
+	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+	uint16_t len;
+
+	len = enc_error_resp(opcode, handle, status, pdu, sizeof(pdu));
+	peer_send(v, pdu, len);
+}
+
+static void sim_emit(uint32_t vehicle, const anki_vehicle_msg_t *msg,
+				uint8_t len, uint64_t timestamp_us, void *user_data)
+{
+	struct vehicle *v = &vehicles[vehicle];
+	uint8_t pdu[3 + ANKI_VEHICLE_MSG_MAX_SIZE];
+
+	if (!v->peer_notify)
+		return;
+
+	pdu[0] = ATT_OP_HANDLE_NOTIFY;
+	att_put_u16(READ_VALUE_HANDLE, &pdu[1]);
+	memcpy(&pdu[3], msg, len);
+
+	if (send(v->peer_fd, pdu, 3 + len, MSG_DONTWAIT) == 3 + len)
+		return;
+
+	peer_notify_dropped++;
+
+	/* Keep answers paired with the requests they answer */
+	if ((msg->msg_id == ANKI_VEHICLE_MSG_V2C_PING_RESPONSE ||
+		msg->msg_id == ANKI_VEHICLE_MSG_V2C_BATTERY_LEVEL_RESPONSE) &&
+						v->awaiting_count > 0) {
+		v->awaiting_head = (v->awaiting_head + 1) % MAX_AWAITING;
+		v->awaiting_count--;
+	}
+}
+
+static void pending_pop_dead(struct vehicle *v)
+{
+	while (v->count > 0 && v->ring[v->head].dead) {
+		v->head = (v->head + 1) % opt_queue_limit;
+		v->count--;
+	}
+}
+
+/* A write to the vehicle's write characteristic arrived */
+static void peer_deliver(struct vehicle *v, const uint8_t *value, size_t vlen)
+{
+	uint64_t now = now_us();
+	struct pending *p;
+	struct kind_stats *k;
+
+	pending_pop_dead(v);
+
+	if (v->count == 0) {
+		unmatched++;
+		goto deliver;
+	}
+
+	p = &v->ring[v->head];
+	k = &kinds[p->kind];
+
+	if (p->measured) {
+		k->delivered++;
+		hist_add(&k->delivery, now - p->issued_us);
+		v->delivered++;
+	}
+
+	if (p->acked) {
+		v->ack_kind = p->kind;
+		v->ack_measured = p->measured;
+		v->ack_issued_us = p->issued_us;
+	}
+
+	if ((p->kind == CMD_PING || p->kind == CMD_BATTERY) &&
+					v->awaiting_count < MAX_AWAITING) {
+		struct awaiting *a = &v->awaiting[(v->awaiting_head +
+				v->awaiting_count) % MAX_AWAITING];
+
+		a->kind = p->kind;
+		a->measured = p->measured;
+		a->issued_us = p->issued_us;
+		v->awaiting_count++;
+	}
+
+	v->head = (v->head + 1) % opt_queue_limit;
+	v->count--;
+	v->live--;
+
+deliver:
+	if (vlen > ANKI_VEHICLE_MSG_MAX_SIZE)
+		return;
+
+	anki_vehicle_sim_handle_msg(&sim, v->index,
+			(const anki_vehicle_msg_t *) value, vlen, sim_emit, NULL);
+}
+
+static void peer_find_by_type(struct vehicle *v, const uint8_t *pdu,
+								size_t len)
+{
+	uint8_t rsp[5];
+	uint16_t start;
+
+	if (len < 7) {
+		peer_error(v, pdu[0], 0, ATT_ECODE_INVALID_PDU);
+		return;
+	}
+
+	start = att_get_u16(&pdu[1]);
+	if (start > SERVICE_HANDLE) {
+		peer_error(v, pdu[0], start, ATT_ECODE_ATTR_NOT_FOUND);
+		return;
+	}
+
+	/* The Anki service is the last one, so discovery stops here */
+	rsp[0] = ATT_OP_FIND_BY_TYPE_RESP;
+	att_put_u16(SERVICE_HANDLE, &rsp[1]);
+	att_put_u16(0xffff, &rsp[3]);
+	peer_send(v, rsp, sizeof(rsp));
+}
+
+static void peer_read_by_type(struct vehicle *v, const uint8_t *pdu,
+								size_t len)
+{
+	uint8_t rsp[2 + 21];
+	uint16_t start, end, decl, value;
+	uint8_t properties;
+	bt_uuid_t uuid;
+	const char *chr;
+
+	if (dec_read_by_type_req(pdu, len, &start, &end, &uuid) == 0) {
+		peer_error(v, pdu[0], 0, ATT_ECODE_INVALID_PDU);
+		return;
+	}
+
+	/* One 128-bit declaration fits the default MTU per response */
+	if (start <= READ_DECL_HANDLE && end >= READ_DECL_HANDLE) {
+		decl = READ_DECL_HANDLE;
+		value = READ_VALUE_HANDLE;
+		properties = ATT_CHAR_PROPER_READ | ATT_CHAR_PROPER_NOTIFY;
+		chr = ANKI_STR_CHR_READ_UUID;
+	} else if (start <= WRITE_DECL_HANDLE && end >= WRITE_DECL_HANDLE) {
+		decl = WRITE_DECL_HANDLE;
+		value = WRITE_VALUE_HANDLE;
+		properties = ATT_CHAR_PROPER_WRITE |
+					ATT_CHAR_PROPER_WRITE_WITHOUT_RESP;
+		chr = ANKI_STR_CHR_WRITE_UUID;
+	} else {
+		peer_error(v, pdu[0], start, ATT_ECODE_ATTR_NOT_FOUND);
+		return;
+	}
+
+	bt_string_to_uuid(&uuid, chr);
+
+	rsp[0] = ATT_OP_READ_BY_TYPE_RESP;
+	rsp[1] = 21;
+	att_put_u16(decl, &rsp[2]);
+	rsp[4] = properties;
+	att_put_u16(value, &rsp[5]);
+	att_put_uuid128(uuid, &rsp[7]);
+	peer_send(v, rsp, sizeof(rsp));
+}
+
+static void peer_write(struct vehicle *v, const uint8_t *pdu, size_t len)
+{
+	bool request = pdu[0] == ATT_OP_WRITE_REQ;
+	uint8_t rsp[1];
+	uint16_t handle;
+
+	if (len < 3) {
+		if (request)
+			peer_error(v, pdu[0], 0, ATT_ECODE_INVALID_PDU);
+		return;
+	}
+
+	handle = att_get_u16(&pdu[1]);
+
+	switch (handle) {
+	case WRITE_VALUE_HANDLE:
+		peer_deliver(v, &pdu[3], len - 3);
+		break;
+	case READ_CCC_HANDLE:
+		v->peer_notify = len > 3 && (pdu[3] & 0x01);
+		break;
+	default:
+		if (request)
+			peer_error(v, pdu[0], handle,
+						ATT_ECODE_WRITE_NOT_PERM);
+		return;
+	}
+
+	if (request) {
+		enc_write_resp(rsp);
+		peer_send(v, rsp, sizeof(rsp));
+	}
+}
+
+static bool peer_io(struct event_io *io, int fd, uint32_t events,
+							void *user_data)
+{
+	struct vehicle *v = user_data;
+	uint64_t cpu = thread_cpu_ns();
+	uint8_t pdu[ATT_MAX_VALUE_LEN];
+	ssize_t len;
+
+	while ((len = recv(fd, pdu, sizeof(pdu), MSG_DONTWAIT)) != 0) {
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		switch (pdu[0]) {
+		case ATT_OP_FIND_BY_TYPE_REQ:
+			peer_find_by_type(v, pdu, len);
+			break;
+		case ATT_OP_READ_BY_TYPE_REQ:
+			peer_read_by_type(v, pdu, len);
+			break;
+		case ATT_OP_WRITE_REQ:
+		case ATT_OP_WRITE_CMD:
+			peer_write(v, pdu, len);
+			break;
+		default:
+			if (!(pdu[0] & ATT_COMMAND_FLAG))
+				peer_error(v, pdu[0], 0,
+						ATT_ECODE_REQ_NOT_SUPP);
+			break;
+		}
+	}
+
+	if (phase == PHASE_MEASURE)
+		peer_cpu_ns += thread_cpu_ns() - cpu;
+
+	return false;
+}
+
+static bool sim_step_cb(void *user_data)
+{
+	uint64_t cpu = thread_cpu_ns();
+
+	anki_vehicle_sim_step(&sim, now_us(), sim_emit, NULL);
+
+	if (phase == PHASE_MEASURE)
+		peer_cpu_ns += thread_cpu_ns() - cpu;
+
+	return true;
+}
+
+static void make_map(anki_track_map_t *map)
+{
+	/* An oval: start, straight, two curves, two straights, two curves */
+	static const uint8_t ids[] = { 33, 36, 17, 17, 39, 40, 18, 18 };
+	static const uint16_t lengths[] = { 340, 560, 350, 350, 560, 560,
+								350, 350 };
+	unsigned int i;
+
+	anki_track_map_init(map);
+	for (i = 0; i < G_N_ELEMENTS(ids); i++) {
+		map->pieces[i].road_piece_id = ids[i];
+		map->pieces[i].length_mm = lengths[i];
+		map->pieces[i].link = ANKI_TRACK_PIECE_NONE;
+	}
+	map->count = G_N_ELEMENTS(ids);
+	map->state = ANKI_TRACK_MAP_COMPLETE;
+}
+
+/* Connection stack side, as in vehicle-daemon */
+
+static void vehicle_fail(struct vehicle *v, const char *what)
+{
+	if (v->failed)
+		return;
+
+	dlog("Vehicle %u: %s\n", v->index, what);
+	v->failed = true;
+	failed_count++;
+}
+
+static void vehicle_check_ready(struct vehicle *v)
+{
+	if (v->ready || !v->discovered || !v->notifying)
+		return;
+
+	v->ready = true;
+	ready_count++;
+	hist_add(&connect_hist, now_us() - v->connect_start_us);
+}
+
+static void notify_handler(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+	struct vehicle *v = user_data;
+	const uint8_t *data = &pdu[3];
+	struct awaiting *a;
+	uint8_t msg_id;
+
+	if (len < 3 || att_get_u16(&pdu[1]) != v->read_handle)
+		return;
+
+	if (len - 3 < ANKI_VEHICLE_MSG_BASE_SIZE + 1)
+		return;
+
+	if (phase == PHASE_MEASURE) {
+		notifications++;
+		v->notifications++;
+	}
+
+	msg_id = data[1];
+	if (msg_id != ANKI_VEHICLE_MSG_V2C_PING_RESPONSE &&
+			msg_id != ANKI_VEHICLE_MSG_V2C_BATTERY_LEVEL_RESPONSE)
+		return;
+
+	if (v->awaiting_count == 0)
+		return;
+
+	a = &v->awaiting[v->awaiting_head];
+	v->awaiting_head = (v->awaiting_head + 1) % MAX_AWAITING;
+	v->awaiting_count--;
+
+	if (a->measured) {
+		kinds[a->kind].answered++;
+		hist_add(&kinds[a->kind].response, now_us() - a->issued_us);
+	}
+}
+
+static void expired_cb(guint id, const guint8 *pdu, guint16 len,
+				guint64 overrun_ms, gpointer user_data)
+{
+	struct vehicle *v = user_data;
+	unsigned int i;
+
+	/* The result callback of an expired Write Request follows */
+	v->expiring = pdu[0] == ATT_OP_WRITE_REQ;
+
+	for (i = 0; i < v->count; i++) {
+		struct pending *p = &v->ring[(v->head + i) % opt_queue_limit];
+
+		if (p->dead || p->id != id)
+			continue;
+
+		p->dead = true;
+		v->live--;
+		if (p->measured) {
+			kinds[p->kind].expired++;
+			v->expired++;
+		}
+		break;
+	}
+}
+
+static void ack_cb(guint8 status, const guint8 *pdu, guint16 plen,
+							gpointer user_data)
+{
+	struct vehicle *v = user_data;
+
+	if (v->expiring) {
+		v->expiring = false;
+		return;
+	}
+
+	if (status != 0) {
+		if (phase == PHASE_MEASURE)
+			kinds[v->ack_kind].failed++;
+		return;
+	}
+
+	if (v->ack_measured) {
+		kinds[v->ack_kind].acked++;
+		hist_add(&kinds[v->ack_kind].ack, now_us() - v->ack_issued_us);
+	}
+}
+
+static void enable_notify_cb(guint8 status, const guint8 *pdu, guint16 plen,
+							gpointer user_data)
+{
+	struct vehicle *v = user_data;
+
+	if (status != 0) {
+		vehicle_fail(v, "enabling notifications failed");
+		return;
+	}
+
+	v->notifying = true;
+	vehicle_check_ready(v);
+}
+
+static void discover_char_cb(guint8 status, unsigned int index,
+							gpointer user_data)
+{
+	struct vehicle *v = user_data;
+	uint8_t notify_cmd[] = { 0x01, 0x00 };
+
+	switch (index) {
+	case ANKI_CHAR_READ:
+		v->read_handle = v->chars[index].chr.value_handle;
+		gatt_write_char(v->attrib, v->read_handle + 1, notify_cmd,
+				sizeof(notify_cmd), enable_notify_cb, v);
+		break;
+	case ANKI_CHAR_WRITE:
+		v->write_handle = v->chars[index].chr.value_handle;
+		break;
+	default:
+		if (status != 0 || v->read_handle == 0 || v->write_handle == 0) {
+			vehicle_fail(v, "characteristic discovery failed");
+			return;
+		}
+
+		v->discovered = true;
+		vehicle_check_ready(v);
+		break;
+	}
+}
+
+static void discover_services_cb(GSList *ranges, guint8 status,
+							gpointer user_data)
+{
+	struct vehicle *v = user_data;
+	struct att_range *range;
+
+	if (status != 0 || ranges == NULL) {
+		vehicle_fail(v, "Anki service not found");
+		return;
+	}
+
+	range = ranges->data;
+	memset(v->chars, 0, sizeof(v->chars));
+	bt_string_to_uuid(&v->chars[ANKI_CHAR_READ].uuid,
+						ANKI_STR_CHR_READ_UUID);
+	bt_string_to_uuid(&v->chars[ANKI_CHAR_WRITE].uuid,
+						ANKI_STR_CHR_WRITE_UUID);
+
+	gatt_discover_char_match(v->attrib, range->start, range->end,
+				v->chars, ANKI_CHAR_COUNT, discover_char_cb, v);
+}
+
+static int vehicle_connect(struct vehicle *v)
+{
+	bt_uuid_t uuid;
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+							0, fds) < 0)
+		return -errno;
+
+	v->peer_fd = fds[1];
+	v->peer_watch = event_io_add(fds[1], EVENT_IN, peer_io, v);
+
+	v->io = g_io_channel_unix_new(fds[0]);
+	g_io_channel_set_close_on_unref(v->io, TRUE);
+
+	v->attrib = g_attrib_new(v->io);
+	if (v->attrib == NULL || v->peer_watch == NULL)
+		return -ENOMEM;
+
+	g_attrib_register(v->attrib, ATT_OP_HANDLE_NOTIFY, GATTRIB_ALL_HANDLES,
+						notify_handler, v, NULL);
+	g_attrib_set_expire_function(v->attrib, expired_cb, v);
+
+	v->connect_start_us = now_us();
+	bt_string_to_uuid(&uuid, ANKI_STR_SERVICE_UUID);
+	gatt_discover_primary(v->attrib, &uuid, discover_services_cb, v);
+
+	return 0;
+}
+
+static void vehicle_close(struct vehicle *v)
+{
+	if (v->attrib)
+		g_attrib_unref(v->attrib);
+	if (v->io) {
+		g_io_channel_shutdown(v->io, FALSE, NULL);
+		g_io_channel_unref(v->io);
+	}
+	event_io_remove(v->peer_watch);
+	if (v->peer_fd >= 0)
+		close(v->peer_fd);
+	g_free(v->ring);
+}
+
+/* Load generation */
+
+static uint8_t encode_cmd(enum cmd_kind kind, anki_vehicle_msg_t *msg)
+{
+	static const float lanes[] = { -68.0f, -23.0f, 23.0f, 68.0f };
+
+	switch (kind) {
+	case CMD_SPEED:
+		return anki_vehicle_msg_set_speed(msg, 300 + rng_next() % 900,
+									25000);
+	case CMD_LANE:
+		return anki_vehicle_msg_change_lane(msg, 600,
+						lanes[rng_next() % 4]);
+	case CMD_LIGHTS:
+		/* Valid bit, plus the value bit to switch them on */
+		return anki_vehicle_msg_set_lights(msg,
+				(1 << LIGHT_HEADLIGHTS) | ((rng_next() & 1) <<
+						(4 + LIGHT_HEADLIGHTS)));
+	case CMD_PING:
+		return anki_vehicle_msg_ping(msg);
+	case CMD_BATTERY:
+	default:
+		return anki_vehicle_msg_get_battery_level(msg);
+	}
+}
+
+static enum cmd_kind pick_kind(unsigned int total_weight)
+{
+	unsigned int r = rng_next() % total_weight;
+	int i;
+
+	for (i = 0; i < CMD_KINDS - 1; i++) {
+		if (r < kinds[i].weight)
+			return i;
+		r -= kinds[i].weight;
+	}
+
+	return CMD_KINDS - 1;
+}
+
+static void vehicle_issue(struct vehicle *v, enum cmd_kind kind)
+{
+	bool measured = phase == PHASE_MEASURE;
+	bool acked = (int) (rng_next() % 100) < opt_acked;
+	struct kind_stats *k = &kinds[kind];
+	anki_vehicle_msg_t msg;
+	struct gattrib_pdu *pdu;
+	struct pending *p;
+	uint8_t *value;
+	size_t vlen;
+	uint8_t len;
+	guint id;
+
+	if (measured) {
+		k->issued++;
+		v->issued++;
+	}
+
+	pending_pop_dead(v);
+
+	/* Back off like a controller would once a vehicle falls behind */
+	if (v->count >= (unsigned int) opt_queue_limit)
+		goto dropped;
+
+	value = gatt_write_reserve(v->attrib, v->write_handle, acked, &vlen,
+									&pdu);
+	if (value == NULL)
+		goto dropped;
+
+	len = encode_cmd(kind, &msg);
+	if (vlen < len) {
+		g_attrib_abort(v->attrib, pdu);
+		goto dropped;
+	}
+
+	memcpy(value, &msg, len);
+	id = gatt_write_commit(v->attrib, pdu, len, acked ? ack_cb : NULL,
+								acked ? v : NULL);
+	if (id == 0)
+		goto dropped;
+
+	if (opt_deadline > 0)
+		g_attrib_set_deadline(v->attrib, id,
+					timer_wheel_now() + opt_deadline);
+
+	p = &v->ring[(v->head + v->count) % opt_queue_limit];
+	p->id = id;
+	p->kind = kind;
+	p->acked = acked;
+	p->measured = measured;
+	p->dead = false;
+	p->issued_us = now_us();
+	v->count++;
+	v->live++;
+
+	return;
+
+dropped:
+	if (measured) {
+		k->dropped++;
+		v->dropped++;
+	}
+}
+
+static void sample_queues(struct vehicle *v)
+{
+	struct gattrib_queue_stats qs;
+
+	g_attrib_get_queue_stats(v->attrib, &qs);
+
+	v->depth_sum += qs.requests;
+	v->depth_samples++;
+	if (qs.requests > v->depth_max)
+		v->depth_max = qs.requests;
+	if (v->live > v->in_flight_max)
+		v->in_flight_max = v->live;
+}
+
+static void generate_load(uint64_t now, unsigned int total_weight)
+{
+	double due = opt_rate * (now - last_tick_us) / 1e6;
+	int i;
+
+	for (i = 0; i < opt_vehicles; i++) {
+		struct vehicle *v = &vehicles[i];
+
+		if (!v->ready)
+			continue;
+
+		for (v->credit += due; v->credit >= 1; v->credit -= 1)
+			vehicle_issue(v, pick_kind(total_weight));
+
+		if (phase == PHASE_MEASURE)
+			sample_queues(v);
+	}
+}
+
+static bool drained(void)
+{
+	int i;
+
+	for (i = 0; i < opt_vehicles; i++) {
+		if (vehicles[i].ready && vehicles[i].live > 0)
+			return false;
+	}
+
+	return true;
+}
+
+static void start_phase(enum phase next, uint64_t now)
+{
+	phase = next;
+	phase_start_us = now;
+
+	switch (next) {
+	case PHASE_WARMUP:
+		dlog("%u of %d vehicles ready, warming up\n", ready_count,
+								opt_vehicles);
+		break;
+	case PHASE_MEASURE:
+		measure_start_us = now;
+		peer_cpu_ns = 0;
+		getrusage(RUSAGE_SELF, &usage_start);
+		break;
+	case PHASE_DRAIN:
+		measure_end_us = now;
+		getrusage(RUSAGE_SELF, &usage_end);
+		break;
+	default:
+		break;
+	}
+}
+
+static bool tick_cb(void *user_data)
+{
+	unsigned int total_weight = GPOINTER_TO_UINT(user_data);
+	uint64_t now = now_us();
+	uint64_t elapsed = now - phase_start_us;
+
+	switch (phase) {
+	case PHASE_CONNECT:
+		if (ready_count + failed_count < (unsigned int) opt_vehicles &&
+				elapsed < CONNECT_TIMEOUT_MS * 1000ULL)
+			break;
+
+		if (ready_count == 0) {
+			dlog("No vehicle became ready\n");
+			tick_source = 0;
+			event_loop_quit();
+			return false;
+		}
+
+		start_phase(PHASE_WARMUP, now);
+		break;
+	case PHASE_WARMUP:
+		generate_load(now, total_weight);
+		if (elapsed >= opt_warmup * 1e6)
+			start_phase(PHASE_MEASURE, now);
+		break;
+	case PHASE_MEASURE:
+		generate_load(now, total_weight);
+		if (elapsed >= opt_duration * 1e6)
+			start_phase(PHASE_DRAIN, now);
+		break;
+	case PHASE_DRAIN:
+		if (drained() || elapsed >= DRAIN_MS * 1000ULL) {
+			tick_source = 0;
+			event_loop_quit();
+			return false;
+		}
+		break;
+	}
+
+	last_tick_us = now;
+
+	return true;
+}
+
+static int parse_mix(const char *mix, unsigned int *total_weight)
+{
+	gchar **items = g_strsplit(mix, ",", -1);
+	int i, err = 0;
+
+	*total_weight = 0;
+
+	for (i = 0; items[i] != NULL; i++) {
+		gchar **kv = g_strsplit(items[i], "=", 2);
+		int k;
+
+		for (k = 0; k < CMD_KINDS; k++) {
+			if (g_strcmp0(g_strstrip(kv[0]), cmd_names[k]) == 0)
+				break;
+		}
+
+		if (k == CMD_KINDS || kv[1] == NULL || atoi(kv[1]) < 0) {
+			g_printerr("Invalid mix entry: %s\n", items[i]);
+			err = -EINVAL;
+		} else {
+			kinds[k].weight = atoi(kv[1]);
+			*total_weight += kinds[k].weight;
+		}
+
+		g_strfreev(kv);
+	}
+
+	g_strfreev(items);
+
+	if (err == 0 && *total_weight == 0) {
+		g_printerr("Command mix has no weight\n");
+		err = -EINVAL;
+	}
+
+	return err;
+}
+
+/* Report */
+
+static void report_hist(FILE *f, const char *name, const struct histogram *h)
+{
+	fprintf(f, "\"%s\": { \"count\": %llu, \"mean\": %.1f, "
+		"\"p50\": %u, \"p90\": %u, \"p99\": %u, \"p999\": %u, "
+		"\"max\": %u }", name, (unsigned long long) h->count,
+		h->count ? (double) h->sum / h->count : 0.0,
+		hist_percentile(h, 0.5), hist_percentile(h, 0.9),
+		hist_percentile(h, 0.99), hist_percentile(h, 0.999), h->max);
+}
+
+static void report_kind(FILE *f, const char *name, const struct kind_stats *k)
+{
+	fprintf(f, "    \"%s\": {\n", name);
+	fprintf(f, "      \"issued\": %llu, \"delivered\": %llu, "
+		"\"acked\": %llu, \"answered\": %llu,\n",
+		(unsigned long long) k->issued,
+		(unsigned long long) k->delivered,
+		(unsigned long long) k->acked,
+		(unsigned long long) k->answered);
+	fprintf(f, "      \"dropped\": %llu, \"expired\": %llu, "
+		"\"failed\": %llu, \"pending\": %llu,\n",
+		(unsigned long long) k->dropped,
+		(unsigned long long) k->expired,
+		(unsigned long long) k->failed,
+		(unsigned long long) k->pending);
+	fprintf(f, "      ");
+	report_hist(f, "delivery_us", &k->delivery);
+	fprintf(f, ",\n      ");
+	report_hist(f, "ack_us", &k->ack);
+	fprintf(f, ",\n      ");
+	report_hist(f, "response_us", &k->response);
+	fprintf(f, "\n    }");
+}
+
+static void write_report(FILE *f)
+{
+	static struct kind_stats all;
+	struct gattrib_tx_stats tx, tx_sum;
+	struct gattrib_rx_stats rx, rx_sum;
+	struct gattrib_queue_stats qs;
+	uint64_t depth_sum = 0, depth_samples = 0;
+	unsigned int depth_max = 0, in_flight_max = 0, high_water = 0;
+	double seconds = (measure_end_us - measure_start_us) / 1e6;
+	uint64_t cpu_us = rusage_us(&usage_end) - rusage_us(&usage_start);
+	uint64_t peer_us = peer_cpu_ns / 1000;
+	uint64_t stack_us = cpu_us > peer_us ? cpu_us - peer_us : 0;
+	unsigned int n = ready_count;
+	int i;
+
+	memset(&tx_sum, 0, sizeof(tx_sum));
+	memset(&rx_sum, 0, sizeof(rx_sum));
+
+	for (i = 0; i < opt_vehicles; i++) {
+		struct vehicle *v = &vehicles[i];
+		unsigned int j;
+
+		if (!v->ready)
+			continue;
+
+		/* Measured commands the vehicle never received */
+		for (j = 0; j < v->count; j++) {
+			struct pending *p = &v->ring[(v->head + j) %
+							opt_queue_limit];
+
+			if (p->measured && !p->dead)
+				kinds[p->kind].pending++;
+		}
+
+		depth_sum += v->depth_sum;
+		depth_samples += v->depth_samples;
+		depth_max = MAX(depth_max, v->depth_max);
+		in_flight_max = MAX(in_flight_max, v->in_flight_max);
+
+		g_attrib_get_queue_stats(v->attrib, &qs);
+		high_water = MAX(high_water, qs.max_requests);
+
+		g_attrib_get_tx_stats(v->attrib, &tx);
+		tx_sum.wakeups += tx.wakeups;
+		tx_sum.pdus += tx.pdus;
+		tx_sum.eagain += tx.eagain;
+		tx_sum.max_batch = MAX(tx_sum.max_batch, tx.max_batch);
+
+		g_attrib_get_rx_stats(v->attrib, &rx);
+		rx_sum.wakeups += rx.wakeups;
+		rx_sum.pdus += rx.pdus;
+		rx_sum.max_batch = MAX(rx_sum.max_batch, rx.max_batch);
+	}
+
+	memset(&all, 0, sizeof(all));
+	for (i = 0; i < CMD_KINDS; i++) {
+		all.issued += kinds[i].issued;
+		all.delivered += kinds[i].delivered;
+		all.acked += kinds[i].acked;
+		all.answered += kinds[i].answered;
+		all.dropped += kinds[i].dropped;
+		all.expired += kinds[i].expired;
+		all.failed += kinds[i].failed;
+		all.pending += kinds[i].pending;
+		hist_merge(&all.delivery, &kinds[i].delivery);
+		hist_merge(&all.ack, &kinds[i].ack);
+		hist_merge(&all.response, &kinds[i].response);
+	}
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"tool\": \"vehicle-load\",\n");
+	fprintf(f, "  \"format\": %d,\n", REPORT_FORMAT);
+
+	fprintf(f, "  \"config\": {\n");
+	fprintf(f, "    \"vehicles\": %d, \"rate_per_vehicle\": %.3f, "
+		"\"duration_s\": %.3f, \"warmup_s\": %.3f,\n",
+		opt_vehicles, opt_rate, opt_duration, opt_warmup);
+	fprintf(f, "    \"acked_pct\": %d, \"deadline_ms\": %d, "
+		"\"queue_limit\": %d, \"seed\": %d, \"backend\": \"%s\",\n",
+		opt_acked, opt_deadline, opt_queue_limit, opt_seed,
+		opt_epoll ? "epoll" : "glib");
+	fprintf(f, "    \"mix\": {");
+	for (i = 0; i < CMD_KINDS; i++)
+		fprintf(f, "%s \"%s\": %u", i ? "," : "", cmd_names[i],
+							kinds[i].weight);
+	fprintf(f, " }\n  },\n");
+
+	fprintf(f, "  \"connect\": { \"ready\": %u, \"failed\": %u, ",
+					ready_count, opt_vehicles - ready_count);
+	report_hist(f, "setup_us", &connect_hist);
+	fprintf(f, " },\n");
+
+	fprintf(f, "  \"elapsed_s\": %.3f,\n", seconds);
+	fprintf(f, "  \"throughput\": { \"issued_per_s\": %.1f, "
+		"\"delivered_per_s\": %.1f, \"acked_per_s\": %.1f, "
+		"\"notifications_per_s\": %.1f },\n",
+		all.issued / seconds, all.delivered / seconds,
+		all.acked / seconds, notifications / seconds);
+
+	fprintf(f, "  \"commands\": {\n");
+	for (i = 0; i < CMD_KINDS; i++) {
+		if (kinds[i].weight == 0)
+			continue;
+		report_kind(f, cmd_names[i], &kinds[i]);
+		fprintf(f, ",\n");
+	}
+	report_kind(f, "all", &all);
+	fprintf(f, "\n  },\n");
+
+	fprintf(f, "  \"queues\": { \"mean_depth\": %.2f, \"max_depth\": %u, "
+		"\"high_water\": %u, \"max_in_flight\": %u },\n",
+		depth_samples ? (double) depth_sum / depth_samples : 0.0,
+		depth_max, high_water, in_flight_max);
+
+	fprintf(f, "  \"cpu\": { \"total_pct\": %.2f, \"vehicles_pct\": %.2f, "
+		"\"stack_pct\": %.2f, \"stack_pct_per_vehicle\": %.4f, "
+		"\"stack_us_per_command\": %.3f },\n",
+		cpu_us / seconds / 1e4, peer_us / seconds / 1e4,
+		stack_us / seconds / 1e4, n ? stack_us / seconds / 1e4 / n : 0.0,
+		all.issued ? (double) stack_us / all.issued : 0.0);
+
+	fprintf(f, "  \"transport\": { \"tx_pdus\": %llu, \"tx_wakeups\": %llu, "
+		"\"tx_eagain\": %llu, \"tx_max_batch\": %u, "
+		"\"rx_pdus\": %llu, \"rx_wakeups\": %llu, \"rx_max_batch\": %u, "
+		"\"vehicle_notify_dropped\": %llu, \"unmatched\": %llu }",
+		(unsigned long long) tx_sum.pdus,
+		(unsigned long long) tx_sum.wakeups,
+		(unsigned long long) tx_sum.eagain, tx_sum.max_batch,
+		(unsigned long long) rx_sum.pdus,
+		(unsigned long long) rx_sum.wakeups, rx_sum.max_batch,
+		(unsigned long long) peer_notify_dropped,
+		(unsigned long long) unmatched);
+
+	if (opt_per_vehicle) {
+		bool first = true;
+
+		fprintf(f, ",\n  \"vehicles\": [\n");
+		for (i = 0; i < opt_vehicles; i++) {
+			struct vehicle *v = &vehicles[i];
+
+			if (!v->ready)
+				continue;
+
+			fprintf(f, "%s    { \"vehicle\": %d, \"issued\": %llu, "
+				"\"delivered\": %llu, \"dropped\": %llu, "
+				"\"expired\": %llu, \"notifications\": %llu, "
+				"\"mean_depth\": %.2f, \"max_depth\": %u }",
+				first ? "" : ",\n", i,
+				(unsigned long long) v->issued,
+				(unsigned long long) v->delivered,
+				(unsigned long long) v->dropped,
+				(unsigned long long) v->expired,
+				(unsigned long long) v->notifications,
+				v->depth_samples ?
+				(double) v->depth_sum / v->depth_samples : 0.0,
+				v->depth_max);
+			first = false;
+		}
+		fprintf(f, "\n  ]");
+	}
+
+	fprintf(f, "\n}\n");
+
+	dlog("%u vehicles, %.1f s: %.0f cmd/s delivered, p99 %u us, "
+		"%llu dropped, %llu expired, stack %.3f%% CPU per vehicle\n",
+		n, seconds, all.delivered / seconds,
+		hist_percentile(&all.delivery, 0.99),
+		(unsigned long long) all.dropped,
+		(unsigned long long) all.expired,
+		n ? stack_us / seconds / 1e4 / n : 0.0);
+}
+
+/* Two sockets per vehicle plus the loop's own */
+static void raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+static GOptionEntry options[] = {
+	{ "vehicles", 'n', 0, G_OPTION_ARG_INT, &opt_vehicles,
+		"Number of simulated vehicles. Default: 50", "N" },
+	{ "rate", 'r', 0, G_OPTION_ARG_DOUBLE, &opt_rate,
+		"Commands per second per vehicle. Default: 20", "N" },
+	{ "duration", 'd', 0, G_OPTION_ARG_DOUBLE, &opt_duration,
+		"Seconds to measure. Default: 10", "SEC" },
+	{ "warmup", 'w', 0, G_OPTION_ARG_DOUBLE, &opt_warmup,
+		"Seconds of load before measuring. Default: 1", "SEC" },
+	{ "mix", 'm', 0, G_OPTION_ARG_STRING, &opt_mix,
+		"Command weights. Default: "
+		"speed=50,lane=20,lights=10,ping=15,battery=5", "MIX" },
+	{ "acked", 'a', 0, G_OPTION_ARG_INT, &opt_acked,
+		"Percent of commands sent as Write Requests. Default: 0",
+		"PCT" },
+	{ "deadline", 'D', 0, G_OPTION_ARG_INT, &opt_deadline,
+		"Drop commands still queued after MS. Default: never", "MS" },
+	{ "queue-limit", 'q', 0, G_OPTION_ARG_INT, &opt_queue_limit,
+		"Commands in flight per vehicle before new ones are dropped. "
+		"Default: 256", "N" },
+	{ "output", 'o', 0, G_OPTION_ARG_STRING, &opt_output,
+		"Write the JSON report to PATH. Default: stdout", "PATH" },
+	{ "seed", 's', 0, G_OPTION_ARG_INT, &opt_seed,
+		"Seed of the command generator. Default: 1", "N" },
+	{ "epoll", 'e', 0, G_OPTION_ARG_NONE, &opt_epoll,
+		"Run the ATT transport on epoll instead of GLib", NULL },
+	{ "per-vehicle", 'V', 0, G_OPTION_ARG_NONE, &opt_per_vehicle,
+		"Include per-vehicle counters in the report", NULL },
+	{ NULL },
+};
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *gerr = NULL;
+	anki_track_map_t map;
+	unsigned int total_weight = 0, step = 0;
+	size_t storage_size;
+	uint64_t start;
+	FILE *out = NULL;
+	int status = EXIT_FAILURE;
+	int i;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &gerr)) {
+		g_printerr("%s\n", gerr->message);
+		g_clear_error(&gerr);
+		goto done;
+	}
+
+	if (opt_vehicles < 1 || opt_vehicles > MAX_VEHICLES) {
+		g_printerr("Vehicles must be between 1 and %d\n", MAX_VEHICLES);
+		goto done;
+	}
+
+	/* The in-flight rings are indexed modulo the limit */
+	if (opt_queue_limit < 1 || opt_queue_limit > MAX_QUEUE_LIMIT) {
+		g_printerr("Queue limit must be between 1 and %d\n",
+							MAX_QUEUE_LIMIT);
+		goto done;
+	}
+
+	if (opt_rate <= 0 || opt_duration <= 0 || opt_warmup < 0 ||
+			opt_acked < 0 || opt_acked > 100 || opt_deadline < 0) {
+		g_printerr("Invalid option value\n");
+		goto done;
+	}
+
+	if (parse_mix(opt_mix ? opt_mix :
+			"speed=50,lane=20,lights=10,ping=15,battery=5",
+			&total_weight) < 0)
+		goto done;
+
+	rng_state = opt_seed ? (uint32_t) opt_seed : 1;
+	raise_fd_limit();
+
+	if (opt_epoll && event_loop_init(EVENT_LOOP_EPOLL) < 0) {
+		g_printerr("Unable to set up the epoll event loop\n");
+		goto done;
+	}
+
+	out = opt_output ? fopen(opt_output, "w") : stdout;
+	if (out == NULL) {
+		g_printerr("Unable to open %s: %s\n", opt_output,
+							strerror(errno));
+		goto done;
+	}
+
+	make_map(&map);
+	storage_size = anki_vehicle_sim_storage_size(opt_vehicles);
+	if (posix_memalign(&sim_storage, ANKI_VEHICLE_SIM_ALIGN,
+							storage_size) != 0 ||
+			anki_vehicle_sim_init(&sim, &map, sim_storage,
+				storage_size, opt_vehicles, now_us()) != 0) {
+		g_printerr("Unable to set up the vehicle simulation\n");
+		goto done;
+	}
+
+	vehicles = g_new0(struct vehicle, opt_vehicles);
+	for (i = 0; i < opt_vehicles; i++) {
+		struct vehicle *v = &vehicles[i];
+
+		v->index = i;
+		v->peer_fd = -1;
+		v->ring = g_new0(struct pending, opt_queue_limit);
+		/* Spread the commands of different vehicles over a tick */
+		v->credit = (rng_next() % 1000) / 1000.0;
+	}
+
+	for (i = 0; i < opt_vehicles; i++) {
+		int err = vehicle_connect(&vehicles[i]);
+
+		if (err < 0) {
+			g_printerr("Unable to set up vehicle %d: %s\n", i,
+							strerror(-err));
+			goto done;
+		}
+	}
+
+	start = now_us();
+	phase_start_us = start;
+	last_tick_us = start;
+	tick_source = event_timeout_add(TICK_MS, tick_cb,
+					GUINT_TO_POINTER(total_weight));
+	step = event_timeout_add(SIM_STEP_MS, sim_step_cb, NULL);
+
+	event_loop_run();
+
+	if (phase == PHASE_DRAIN) {
+		write_report(out);
+		status = EXIT_SUCCESS;
+	}
+
+done:
+	if (step)
+		event_timeout_remove(step);
+	if (tick_source)
+		event_timeout_remove(tick_source);
+	if (vehicles) {
+		for (i = 0; i < opt_vehicles; i++)
+			vehicle_close(&vehicles[i]);
+		g_free(vehicles);
+	}
+	free(sim_storage);
+	if (out && out != stdout)
+		fclose(out);
+
+	g_option_context_free(context);
+	g_free(opt_mix);
+	g_free(opt_output);
+
+	return status;
+}
@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Replays a session log recorded by vehicle-daemon --record.
+ *
+ * Notifications are fed through the message decoders, the vehicle state
+ * table and the lap timer exactly as they arrived. Commands go to a
+ * stand-in vehicle that remembers what it was told, so the replay shows
+ * how long each vehicle took to reach a commanded speed. Every record
+ * keeps its recorded timestamp, so the result does not depend on the
+ * replay speed.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <ankidrive.h>
+
+#define MAX_VEHICLES            32
+#define SPEED_TOLERANCE_PCT     5
+
+/* Stand-in for a vehicle: the commands it was sent */
+struct standin {
+        uint32_t commands;
+        int16_t speed_mm_per_sec;
+        float offset_mm;
+        uint64_t speed_cmd_us;          /* 0 once the vehicle reached the speed */
+        uint32_t responses;
+        uint64_t response_total_us;
+        uint32_t response_max_us;
+};
+
+struct replay {
+        anki_vehicle_state_table_t *table;
+        anki_lap_timer_t lap_timer;
+        struct standin standins[MAX_VEHICLES];
+        uint32_t rx[MAX_VEHICLES];
+        uint32_t msg_counts[256];
+        uint64_t first_us;
+        int verbose;
+};
+
+static void standin_command(struct standin *s, uint64_t timestamp_us,
+                            const anki_vehicle_msg_t *msg, uint8_t len)
+{
+        s->commands++;
+
+        if (msg->msg_id == ANKI_VEHICLE_MSG_C2V_SET_SPEED &&
+            len >= ANKI_VEHICLE_MSG_C2V_SET_SPEED_SIZE + ANKI_VEHICLE_MSG_BASE_SIZE) {
+                const anki_vehicle_msg_set_speed_t *m = (const anki_vehicle_msg_set_speed_t *)msg;
+
+                if (m->speed_mm_per_sec != s->speed_mm_per_sec)
+                        s->speed_cmd_us = timestamp_us;
+                s->speed_mm_per_sec = m->speed_mm_per_sec;
+        } else if (msg->msg_id == ANKI_VEHICLE_MSG_C2V_SET_OFFSET_FROM_ROAD_CENTER &&
+                   len >= sizeof(anki_vehicle_msg_set_offset_from_road_center_t)) {
+                const anki_vehicle_msg_set_offset_from_road_center_t *m =
+                        (const anki_vehicle_msg_set_offset_from_road_center_t *)msg;
+
+                s->offset_mm = m->offset_mm;
+        } else if (msg->msg_id == ANKI_VEHICLE_MSG_C2V_CHANGE_LANE &&
+                   len >= ANKI_VEHICLE_MSG_C2V_CHANGE_LANE_SIZE + ANKI_VEHICLE_MSG_BASE_SIZE) {
+                const anki_vehicle_msg_change_lane_t *m = (const anki_vehicle_msg_change_lane_t *)msg;
+
+                s->offset_mm = m->offset_from_road_center_mm;
+        }
+}
+
+/* Time from a speed command until the vehicle reports that speed */
+static void standin_report(struct standin *s, uint64_t timestamp_us, uint16_t speed_mm_per_sec)
+{
+        int32_t diff = (int32_t)speed_mm_per_sec - s->speed_mm_per_sec;
+        uint32_t elapsed;
+
+        if (s->speed_cmd_us == 0)
+                return;
+        if (abs(diff) * 100 > abs(s->speed_mm_per_sec) * SPEED_TOLERANCE_PCT)
+                return;
+
+        elapsed = (uint32_t)(timestamp_us - s->speed_cmd_us);
+        s->responses++;
+        s->response_total_us += elapsed;
+        if (elapsed > s->response_max_us)
+                s->response_max_us = elapsed;
+        s->speed_cmd_us = 0;
+}
+
+static void replay_record(const anki_session_record_t *record, void *user_data)
+{
+        struct replay *r = user_data;
+        const anki_vehicle_msg_t *msg = (const anki_vehicle_msg_t *)record->data;
+
+        if (record->vehicle >= MAX_VEHICLES || record->len < ANKI_VEHICLE_MSG_BASE_SIZE + 1)
+                return;
+
+        if (r->verbose) {
+                uint8_t i;
+
+                printf("%10.6f %2u %s", (record->timestamp_us - r->first_us) / 1e6, record->vehicle,
+                        record->kind == ANKI_SESSION_RECORD_TX ? "tx" : "rx");
+                for (i = 0; i < record->len; i++)
+                        printf(" %02x", record->data[i]);
+                printf("\n");
+        }
+
+        if (record->kind == ANKI_SESSION_RECORD_TX) {
+                standin_command(&r->standins[record->vehicle], record->timestamp_us, msg, record->len);
+                return;
+        }
+
+        r->rx[record->vehicle]++;
+        r->msg_counts[msg->msg_id]++;
+
+        anki_vehicle_state_table_handle_msg(r->table, record->vehicle, record->timestamp_us,
+                                            msg, record->len);
+        if (record->vehicle < ANKI_LAP_TIMER_MAX_VEHICLES)
+                anki_lap_timer_handle_msg(&r->lap_timer, record->vehicle, record->timestamp_us,
+                                          msg, record->len);
+
+        if (msg->msg_id == ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE &&
+            record->len >= ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE_SIZE + ANKI_VEHICLE_MSG_BASE_SIZE) {
+                const anki_vehicle_msg_localization_position_update_t *m =
+                        (const anki_vehicle_msg_localization_position_update_t *)msg;
+
+                standin_report(&r->standins[record->vehicle], record->timestamp_us,
+                               m->speed_mm_per_sec);
+        }
+}
+
+static void print_summary(const struct replay *r)
+{
+        anki_lap_board_t board;
+        unsigned int i;
+
+        anki_lap_timer_read_board(&r->lap_timer, &board);
+
+        for (i = 0; i < MAX_VEHICLES; i++) {
+                const struct standin *s = &r->standins[i];
+                anki_vehicle_state_t state;
+
+                if (s->commands == 0 && r->rx[i] == 0)
+                        continue;
+
+                if (anki_vehicle_state_table_read(r->table, i, &state) != 0)
+                        continue;
+
+                printf("vehicle %2u tx=%u rx=%u piece=%u speed=%u/%d mm/s offset=%.1f/%.1f mm",
+                        i, s->commands, r->rx[i], state.road_piece_id,
+                        state.speed_mm_per_sec, s->speed_mm_per_sec,
+                        state.offset_mm, s->offset_mm);
+
+                if (s->responses > 0)
+                        printf(" speed_response=%.1f/%.1f ms",
+                                s->response_total_us / 1e3 / s->responses,
+                                s->response_max_us / 1e3);
+
+                if (i < ANKI_LAP_TIMER_MAX_VEHICLES && board.results[i].laps > 0)
+                        printf(" laps=%u best=%.3f s", board.results[i].laps,
+                                board.results[i].best_lap_us / 1e6);
+                printf("\n");
+        }
+
+        for (i = 0; i < 256; i++) {
+                if (r->msg_counts[i] > 0)
+                        printf("msg 0x%02x %u\n", i, r->msg_counts[i]);
+        }
+}
+
+static struct option replay_options[] = {
+        { "help",        0, 0, 'h' },
+        { "speed",       1, 0, 's' },
+        { "from",        1, 0, 'f' },
+        { "to",          1, 0, 't' },
+        { "state-table", 1, 0, 'T' },
+        { "verbose",     0, 0, 'v' },
+        { 0, 0, 0, 0 }
+};
+
+static const char *replay_help =
+        "Usage:\n"
+        "\tvehicle-replay [options] <session log>\n"
+        "\t  -s, --speed=X        1 for the original pace, 0 as fast as possible (default: 0)\n"
+        "\t  -f, --from=SEC       start SEC seconds into the log\n"
+        "\t  -t, --to=SEC         stop SEC seconds into the log\n"
+        "\t  -T, --state-table=P  publish vehicle state to a shared table at P\n"
+        "\t  -v, --verbose        print every record\n";
+
+int main(int argc, char *argv[])
+{
+        static struct replay r;
+        anki_session_log_t log;
+        anki_session_log_cursor_t cursor;
+        anki_lap_timer_config_t config;
+        const char *table_path = NULL;
+        double speed = 0, from_sec = 0, to_sec = -1;
+        uint64_t start_us, delivered, end_us = UINT64_MAX;
+        void *table_mem = NULL;
+        size_t table_size = anki_vehicle_state_table_size(MAX_VEHICLES);
+        int opt;
+
+        while ((opt = getopt_long(argc, argv, "hs:f:t:T:v", replay_options, NULL)) != -1) {
+                switch (opt) {
+                case 's':
+                        speed = strtod(optarg, NULL);
+                        if (speed < 0) {
+                                fprintf(stderr, "Invalid speed: %s\n", optarg);
+                                return 1;
+                        }
+                        break;
+                case 'f':
+                        from_sec = strtod(optarg, NULL);
+                        break;
+                case 't':
+                        to_sec = strtod(optarg, NULL);
+                        break;
+                case 'T':
+                        table_path = optarg;
+                        break;
+                case 'v':
+                        r.verbose = 1;
+                        break;
+                default:
+                        printf("%s", replay_help);
+                        return opt == 'h' ? 0 : 1;
+                }
+        }
+
+        if (optind != argc - 1) {
+                printf("%s", replay_help);
+                return 1;
+        }
+
+        if (anki_session_log_open(&log, argv[optind]) != 0) {
+                fprintf(stderr, "Unable to open session log %s\n", argv[optind]);
+                return 1;
+        }
+
+        if (table_path) {
+                r.table = anki_vehicle_state_table_create(table_path, MAX_VEHICLES);
+        } else if (posix_memalign(&table_mem, ANKI_VEHICLE_STATE_TABLE_CACHE_LINE, table_size) == 0) {
+                r.table = anki_vehicle_state_table_init(table_mem, table_size, MAX_VEHICLES);
+        }
+        if (r.table == NULL) {
+                fprintf(stderr, "Unable to set up the vehicle state table\n");
+                return 1;
+        }
+
+        anki_lap_timer_config_default(&config);
+        anki_lap_timer_init(&r.lap_timer, &config, ANKI_LAP_TIMER_MAX_VEHICLES);
+        anki_lap_timer_start_race(&r.lap_timer, log.first_us);
+        r.first_us = log.first_us;
+
+        anki_session_log_seek(&log, &cursor, log.first_us + (uint64_t)(from_sec * 1e6));
+        if (to_sec >= 0)
+                end_us = log.first_us + (uint64_t)(to_sec * 1e6);
+
+        start_us = anki_timeline_now_us();
+        delivered = anki_session_replay(&log, &cursor, end_us, speed, replay_record, &r);
+
+        printf("log %.3f s, %llu records in %u blocks; replayed %llu in %.3f s\n",
+                (log.last_us - log.first_us) / 1e6, (unsigned long long)log.records,
+                log.block_count, (unsigned long long)delivered,
+                (anki_timeline_now_us() - start_us) / 1e6);
+        print_summary(&r);
+
+        if (table_path)
+                anki_vehicle_state_table_unmap(r.table);
+        free(table_mem);
+        anki_session_log_close(&log);
+
+        return 0;
+}
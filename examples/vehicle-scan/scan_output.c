@@ -0,0 +1,423 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scan_output.h"
+
+/* Upper bound for a single formatted report in any format */
+#define SCAN_REPORT_MAX_LEN     512
+
+static const char hex_upper[] = "0123456789ABCDEF";
+static const char hex_lower[] = "0123456789abcdef";
+
+static uint64_t monotonic_ms(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+const char *scan_model_name(uint8_t model_id)
+{
+        switch (model_id) {
+        case 1:
+                return "Kourai";
+        case 2:
+                return "Boson";
+        case 3:
+                return "Rho";
+        case 4:
+                return "Katal";
+        default:
+                return "Unknown";
+        }
+}
+
+int scan_output_init(struct scan_output *out, int fd,
+                        enum scan_output_format format, size_t size,
+                        unsigned int flush_interval_ms)
+{
+        memset(out, 0, sizeof(*out));
+
+        if (size < SCAN_REPORT_MAX_LEN * 2)
+                size = SCAN_REPORT_MAX_LEN * 2;
+
+        out->buf = malloc(size);
+        if (out->buf == NULL)
+                return -ENOMEM;
+
+        out->fd = fd;
+        out->format = format;
+        out->size = size;
+        out->flush_interval_ms = flush_interval_ms;
+        out->last_flush_ms = monotonic_ms();
+
+        /* Never let a slow reader on the other end stall the scan loop */
+        out->fd_flags = fcntl(fd, F_GETFL);
+        if (out->fd_flags >= 0)
+                fcntl(fd, F_SETFL, out->fd_flags | O_NONBLOCK);
+
+        return 0;
+}
+
+void scan_output_finish(struct scan_output *out)
+{
+        if (out->buf == NULL)
+                return;
+
+        /* Drain whatever is left with blocking writes */
+        if (out->fd_flags >= 0)
+                fcntl(out->fd, F_SETFL, out->fd_flags);
+
+        scan_output_flush(out, 1);
+
+        free(out->buf);
+        out->buf = NULL;
+}
+
+int scan_output_pending(const struct scan_output *out)
+{
+        return out->tail > out->head;
+}
+
+static int flush_due(const struct scan_output *out, uint64_t now)
+{
+        if (out->flush_interval_ms == 0)
+                return 1;
+
+        if (out->tail - out->head >= out->size / 2)
+                return 1;
+
+        return now - out->last_flush_ms >= out->flush_interval_ms;
+}
+
+int scan_output_timeout(const struct scan_output *out)
+{
+        uint64_t now, elapsed;
+
+        if (!scan_output_pending(out) || out->blocked)
+                return -1;
+
+        now = monotonic_ms();
+        if (flush_due(out, now))
+                return 0;
+
+        elapsed = now - out->last_flush_ms;
+        return out->flush_interval_ms - elapsed;
+}
+
+int scan_output_flush(struct scan_output *out, int force)
+{
+        uint64_t now = monotonic_ms();
+
+        if (!scan_output_pending(out))
+                return 0;
+
+        if (!force && !flush_due(out, now))
+                return 0;
+
+        out->blocked = 0;
+        while (out->head < out->tail) {
+                ssize_t n = write(out->fd, out->buf + out->head,
+                                        out->tail - out->head);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                out->blocked = 1;
+                                out->stalls++;
+                                break;
+                        }
+
+                        return -errno;
+                }
+
+                out->head += n;
+        }
+
+        if (out->head == out->tail)
+                out->head = out->tail = 0;
+
+        out->last_flush_ms = now;
+
+        return 0;
+}
+
+/* Make room for len contiguous bytes at the tail, or return NULL. */
+static uint8_t *reserve(struct scan_output *out, size_t len)
+{
+        if (out->size - out->tail >= len)
+                return out->buf + out->tail;
+
+        if (out->size - (out->tail - out->head) < len)
+                return NULL;
+
+        memmove(out->buf, out->buf + out->head, out->tail - out->head);
+        out->tail -= out->head;
+        out->head = 0;
+
+        return out->buf + out->tail;
+}
+
+int scan_output_write(struct scan_output *out, const void *data, size_t len)
+{
+        uint8_t *p = reserve(out, len);
+
+        if (p == NULL) {
+                out->dropped++;
+                return -ENOSPC;
+        }
+
+        memcpy(p, data, len);
+        out->tail += len;
+
+        return scan_output_flush(out, 0);
+}
+
+static char *put_str(char *p, const char *s)
+{
+        while (*s)
+                *p++ = *s++;
+        return p;
+}
+
+static char *put_u64(char *p, uint64_t v)
+{
+        char tmp[20];
+        int n = 0;
+
+        do {
+                tmp[n++] = '0' + v % 10;
+                v /= 10;
+        } while (v);
+
+        while (n)
+                *p++ = tmp[--n];
+        return p;
+}
+
+static char *put_i32(char *p, int32_t v)
+{
+        if (v < 0) {
+                *p++ = '-';
+                return put_u64(p, -(int64_t)v);
+        }
+        return put_u64(p, v);
+}
+
+/* Fixed point with one decimal, which is all the precision RSSI needs */
+static char *put_float1(char *p, float v)
+{
+        int32_t tenths = (int32_t)(v * 10.0f + (v < 0 ? -0.5f : 0.5f));
+
+        if (tenths < 0) {
+                *p++ = '-';
+                tenths = -tenths;
+        }
+        p = put_u64(p, tenths / 10);
+        *p++ = '.';
+        *p++ = '0' + tenths % 10;
+        return p;
+}
+
+static char *put_hex(char *p, const char *digits_table, uint32_t v, int digits)
+{
+        while (digits--)
+                *p++ = digits_table[(v >> (digits * 4)) & 0xf];
+        return p;
+}
+
+static char *put_address(char *p, const uint8_t address[6])
+{
+        int i;
+
+        for (i = 5; i >= 0; i--) {
+                p = put_hex(p, hex_upper, address[i], 2);
+                if (i)
+                        *p++ = ':';
+        }
+        return p;
+}
+
+static char *put_json_string(char *p, const char *s)
+{
+        *p++ = '"';
+        for (; s && *s; s++) {
+                unsigned char c = *s;
+
+                if (c == '"' || c == '\\') {
+                        *p++ = '\\';
+                        *p++ = c;
+                } else if (c < 0x20) {
+                        p = put_str(p, "\\u00");
+                        p = put_hex(p, hex_lower, c, 2);
+                } else {
+                        *p++ = c;
+                }
+        }
+        *p++ = '"';
+        return p;
+}
+
+static char *format_text(char *p, const struct scan_report *r)
+{
+        p = put_address(p, r->address);
+        *p++ = ' ';
+        p = put_str(p, r->name ? r->name : "");
+        p = put_str(p, " [v");
+        p = put_hex(p, hex_lower, r->version, 4);
+        p = put_str(p, "] (");
+        p = put_str(p, scan_model_name(r->model_id));
+        *p++ = ' ';
+        p = put_hex(p, hex_lower, r->identifier & 0xffff, 4);
+        p = put_str(p, ")\n");
+        return p;
+}
+
+static char *format_json_stats(char *p, const anki_vehicle_stats_t *s)
+{
+        p = put_str(p, ",\"rssi_min\":");
+        p = put_i32(p, s->rssi_min);
+        p = put_str(p, ",\"rssi_max\":");
+        p = put_i32(p, s->rssi_max);
+        p = put_str(p, ",\"rssi_ewma\":");
+        p = put_float1(p, s->rssi_ewma);
+        p = put_str(p, ",\"rssi_kalman\":");
+        p = put_float1(p, s->rssi_kalman);
+        p = put_str(p, ",\"rssi_trend\":");
+        p = put_float1(p, anki_vehicle_stats_rssi_trend(s));
+        p = put_str(p, ",\"interval_us\":");
+        p = put_u64(p, anki_vehicle_stats_interval_mean_us(s));
+        p = put_str(p, ",\"reports\":");
+        p = put_u64(p, s->count);
+        p = put_str(p, ",\"missed\":");
+        p = put_u64(p, s->missed);
+        return p;
+}
+
+static char *format_json(char *p, const struct scan_report *r)
+{
+        p = put_str(p, "{\"ts\":");
+        p = put_u64(p, r->timestamp_us);
+        p = put_str(p, ",\"addr\":\"");
+        p = put_address(p, r->address);
+        p = put_str(p, "\",\"rssi\":");
+        p = put_i32(p, r->rssi);
+        p = put_str(p, ",\"id\":");
+        p = put_u64(p, r->identifier);
+        p = put_str(p, ",\"product\":");
+        p = put_u64(p, r->product_id);
+        p = put_str(p, ",\"model\":");
+        p = put_u64(p, r->model_id);
+        p = put_str(p, ",\"model_name\":\"");
+        p = put_str(p, scan_model_name(r->model_id));
+        p = put_str(p, "\",\"version\":");
+        p = put_u64(p, r->version);
+        p = put_str(p, ",\"state\":");
+        p = put_u64(p, r->state);
+        p = put_str(p, ",\"full_battery\":");
+        p = put_str(p, (r->state & SCAN_STATE_FULL_BATTERY) ? "true" : "false");
+        p = put_str(p, ",\"low_battery\":");
+        p = put_str(p, (r->state & SCAN_STATE_LOW_BATTERY) ? "true" : "false");
+        p = put_str(p, ",\"on_charger\":");
+        p = put_str(p, (r->state & SCAN_STATE_ON_CHARGER) ? "true" : "false");
+        p = put_str(p, ",\"name\":");
+        p = put_json_string(p, r->name);
+        if (r->stats != NULL)
+                p = format_json_stats(p, r->stats);
+        p = put_str(p, "}\n");
+        return p;
+}
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+        p[0] = v & 0xff;
+        p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+        put_le16(p, v & 0xffff);
+        put_le16(p + 2, v >> 16);
+}
+
+static uint8_t *format_binary(uint8_t *p, const struct scan_report *r)
+{
+        struct scan_record *rec = (struct scan_record *)p;
+
+        memset(rec, 0, sizeof(*rec));
+        put_le32((uint8_t *)&rec->timestamp_us, r->timestamp_us & 0xffffffff);
+        put_le32((uint8_t *)&rec->timestamp_us + 4, r->timestamp_us >> 32);
+        memcpy(rec->address, r->address, sizeof(rec->address));
+        rec->rssi = r->rssi;
+        rec->state = r->state;
+        put_le32((uint8_t *)&rec->identifier, r->identifier);
+        put_le16((uint8_t *)&rec->product_id, r->product_id);
+        put_le16((uint8_t *)&rec->version, r->version);
+        rec->model_id = r->model_id;
+        rec->flags = r->flags;
+        if (r->stats != NULL) {
+                uint32_t interval_ms = anki_vehicle_stats_interval_mean_us(r->stats) / 1000;
+
+                rec->rssi_filtered = (int8_t)(r->stats->rssi_kalman +
+                                        (r->stats->rssi_kalman < 0 ? -0.5f : 0.5f));
+                rec->loss_percent = (uint8_t)(anki_vehicle_stats_loss_ratio(r->stats) * 100.0f + 0.5f);
+                put_le16((uint8_t *)&rec->interval_ms,
+                                interval_ms > UINT16_MAX ? UINT16_MAX : interval_ms);
+        }
+
+        return p + SCAN_RECORD_SIZE;
+}
+
+void scan_output_report(struct scan_output *out, const struct scan_report *report)
+{
+        uint8_t *start = reserve(out, SCAN_REPORT_MAX_LEN);
+        uint8_t *end;
+
+        if (start == NULL) {
+                out->dropped++;
+                return;
+        }
+
+        switch (out->format) {
+        case SCAN_OUTPUT_JSON:
+                end = (uint8_t *)format_json((char *)start, report);
+                break;
+        case SCAN_OUTPUT_BINARY:
+                end = format_binary(start, report);
+                break;
+        case SCAN_OUTPUT_TEXT:
+        default:
+                end = (uint8_t *)format_text((char *)start, report);
+                break;
+        }
+
+        out->tail += end - start;
+        out->records++;
+
+        scan_output_flush(out, 0);
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SCAN_OUTPUT_H
+#define SCAN_OUTPUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <ankidrive/vehicle_stats.h>
+
+/*
+ * Buffered output for vehicle-scan.
+ *
+ * Reports are formatted straight into a large userspace buffer which is
+ * written to a non-blocking descriptor according to the flush policy. If the
+ * consumer stalls, the buffer absorbs the backlog; once it is full, new
+ * records are dropped and counted instead of blocking the scan loop.
+ */
+
+enum scan_output_format {
+        SCAN_OUTPUT_TEXT,
+        SCAN_OUTPUT_JSON,
+        SCAN_OUTPUT_BINARY,
+};
+
+#define SCAN_OUTPUT_DEFAULT_SIZE        (1 << 20)
+
+/* State bits from the LOCAL_NAME record */
+#define SCAN_STATE_FULL_BATTERY         (1 << 4)
+#define SCAN_STATE_LOW_BATTERY          (1 << 5)
+#define SCAN_STATE_ON_CHARGER           (1 << 6)
+
+/* scan_report.flags */
+#define SCAN_REPORT_HAS_MFG             (1 << 0)
+#define SCAN_REPORT_HAS_NAME            (1 << 1)
+
+struct scan_report {
+        uint64_t timestamp_us;          /* CLOCK_REALTIME */
+        uint8_t address[6];             /* bdaddr_t byte order */
+        int8_t rssi;
+        uint8_t state;
+        uint32_t identifier;
+        uint16_t product_id;
+        uint16_t version;
+        uint8_t model_id;
+        uint8_t flags;
+        const char *name;               /* NUL terminated, may be NULL */
+        const anki_vehicle_stats_t *stats;      /* may be NULL */
+};
+
+/*
+ * Record written by SCAN_OUTPUT_BINARY. Records are fixed-size and stored
+ * back to back without a stream header. Multi-byte fields are little-endian.
+ */
+struct scan_record {
+        uint64_t timestamp_us;
+        uint8_t address[6];
+        int8_t rssi;
+        uint8_t state;
+        uint32_t identifier;
+        uint16_t product_id;
+        uint16_t version;
+        uint8_t model_id;
+        uint8_t flags;
+        int8_t rssi_filtered;           /* Kalman smoothed RSSI */
+        uint8_t loss_percent;
+        uint16_t interval_ms;           /* mean advertising interval */
+        uint8_t _reserved[2];
+} __attribute__((packed));
+
+#define SCAN_RECORD_SIZE        32
+
+typedef char scan_record_size_check[sizeof(struct scan_record) == SCAN_RECORD_SIZE ? 1 : -1];
+
+struct scan_output {
+        int fd;
+        int fd_flags;
+        enum scan_output_format format;
+
+        uint8_t *buf;
+        size_t size;
+        size_t head;                    /* first byte not yet written */
+        size_t tail;                    /* end of buffered data */
+
+        unsigned int flush_interval_ms;
+        uint64_t last_flush_ms;
+        int blocked;                    /* last write returned EAGAIN */
+
+        uint64_t records;
+        uint64_t dropped;
+        uint64_t stalls;
+};
+
+const char *scan_model_name(uint8_t model_id);
+
+int scan_output_init(struct scan_output *out, int fd,
+                        enum scan_output_format format, size_t size,
+                        unsigned int flush_interval_ms);
+void scan_output_finish(struct scan_output *out);
+
+void scan_output_report(struct scan_output *out, const struct scan_report *report);
+int scan_output_write(struct scan_output *out, const void *data, size_t len);
+
+/* Returns the poll() timeout in ms until the next flush is due, -1 if idle. */
+int scan_output_timeout(const struct scan_output *out);
+int scan_output_pending(const struct scan_output *out);
+
+/* Flush if the policy says so, or unconditionally when force is set. */
+int scan_output_flush(struct scan_output *out, int force);
+
+#endif
@@ -10,6 +10,8 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
 
 #define for_each_opt(opt, long, short) while ((opt=getopt_long(argc, argv, short ? short:"+", long, NULL)) != -1)
 
@@ -20,6 +22,14 @@
 #include "uthash.h"
 
 #include <ankidrive/advertisement.h>
+#include <ankidrive/adv_prefilter.h>
+#include <ankidrive/vehicle_stats.h>
+#include <ankidrive/timeline.h>
+
+#include "scan_output.h"
+
+/* Upper bound on advertising reports in a single LE meta event */
+#define MAX_REPORTS     ((HCI_MAX_EVENT_SIZE - 2) / (LE_ADVERTISING_INFO_SIZE + 1))
 
 /* Unofficial value, might still change */
 #define LE_LINK         0x03
@@ -43,7 +53,9 @@
 struct _vehicle {
     bdaddr_t   address; 
     anki_vehicle_adv_t adv;
+    uint8_t state;
     uint8_t scan_complete;
+    anki_vehicle_stats_t stats;
     UT_hash_handle hh;
 };
 typedef struct _vehicle vehicle_t;
@@ -52,19 +64,35 @@ static volatile int signal_received = 0;
 
 static void hex_dump(char *pref, int width, unsigned char *buf, int len)
 {
-        register int i,n;
+        static const char hex[] = "0123456789ABCDEF";
+        char line[256];
+        size_t pref_len = strlen(pref);
+        size_t pos = 0;
+        int i, n;
 
+        if (pref_len > sizeof(line) / 2)
+                pref_len = sizeof(line) / 2;
+
+        /* Format whole lines and write each one at once */
         for (i = 0, n = 1; i < len; i++, n++) {
-                if (n == 1)
-                        printf("%s", pref);
-                printf("%2.2X ", buf[i]);
-                if (n == width) {
-                        printf("\n");
+                if (n == 1) {
+                        memcpy(line, pref, pref_len);
+                        pos = pref_len;
+                }
+                line[pos++] = hex[buf[i] >> 4];
+                line[pos++] = hex[buf[i] & 0xf];
+                line[pos++] = ' ';
+                if (n == width || pos + 4 > sizeof(line)) {
+                        line[pos++] = '\n';
+                        fwrite(line, 1, pos, stdout);
+                        pos = 0;
                         n = 0;
                 }
         }
-        if (i && n!=1)
-                printf("\n");
+        if (pos > 0) {
+                line[pos++] = '\n';
+                fwrite(line, 1, pos, stdout);
+        }
 }
 
 static struct option lescan_options[] = {
@@ -74,6 +102,9 @@ static struct option lescan_options[] = {
         { "whitelist",  0, 0, 'w' },
         { "discovery",  1, 0, 'd' },
         { "duplicates", 0, 0, 'D' },
+        { "format",     1, 0, 'f' },
+        { "flush",      1, 0, 'F' },
+        { "buffer",     1, 0, 'B' },
         { 0, 0, 0, 0 }
 };
 
@@ -84,7 +115,11 @@ static const char *lescan_help =
         "\tlescan [--whitelist] scan for address in the whitelist only\n"
         "\tlescan [--discovery=g|l] enable general or limited discovery"
                 "procedure\n"
-        "\tlescan [--duplicates] don't filter duplicates\n";
+        "\tlescan [--duplicates] don't filter duplicates\n"
+        "\tlescan [--format=text|json|binary] output format (default text)\n"
+        "\tlescan [--flush=ms] flush interval, 0 flushes every report\n"
+        "\t\t(default 0 for text, 100 otherwise)\n"
+        "\tlescan [--buffer=kb] output buffer size (default 1024)\n";
 
 static void helper_arg(int min_num_arg, int max_num_arg, int *argc,
                         char ***argv, const char *usage)
@@ -218,7 +253,123 @@ failed:
 
 vehicle_t *vehicles = NULL;
 
-static int print_advertising_devices(int dd, uint8_t filter_type)
+/* Wall-clock time for reports; intervals use the monotonic clock instead */
+static uint64_t realtime_us(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void report_vehicle(struct scan_output *out, const vehicle_t *v,
+                                int8_t rssi, uint64_t timestamp_us)
+{
+        struct scan_report report;
+        char name[sizeof(v->adv.local_name.name) + 1];
+
+        memset(&report, 0, sizeof(report));
+        report.timestamp_us = timestamp_us;
+        memcpy(report.address, &v->address, sizeof(report.address));
+        report.rssi = rssi;
+        report.state = v->state;
+        report.identifier = v->adv.mfg_data.identifier;
+        report.product_id = v->adv.mfg_data.product_id;
+        report.version = v->adv.local_name.version;
+        report.model_id = v->adv.mfg_data.model_id;
+        memcpy(name, v->adv.local_name.name, sizeof(v->adv.local_name.name));
+        name[sizeof(name) - 1] = '\0';
+        report.name = name;
+        report.stats = &v->stats;
+
+        if (v->adv.mfg_data.identifier > 0)
+                report.flags |= SCAN_REPORT_HAS_MFG;
+        if (v->adv.local_name.version > 0)
+                report.flags |= SCAN_REPORT_HAS_NAME;
+
+        scan_output_report(out, &report);
+}
+
+static void process_report(struct scan_output *out, uint8_t filter_type,
+                                le_advertising_info *info, int candidate,
+                                uint64_t now_us, uint64_t timestamp_us)
+{
+        vehicle_t *v = NULL;
+        int8_t rssi;
+        int err;
+
+        if (!check_report_filter(filter_type, info))
+                return;
+
+        /* RSSI follows the advertising data */
+        rssi = (int8_t)info->data[info->length];
+
+        HASH_FIND(hh, vehicles, &info->bdaddr, sizeof(bdaddr_t), v);
+
+        /*
+         * Reports without the service UUID can only matter for a vehicle we
+         * already know about, e.g. its scan response.
+         */
+        if (v == NULL && !candidate)
+                return;
+
+        if (v == NULL) {
+                v = (vehicle_t *)calloc(1, sizeof(vehicle_t));
+                if (v == NULL)
+                        return;
+                memcpy(&v->address, &info->bdaddr, sizeof(bdaddr_t));
+                anki_vehicle_stats_init(&v->stats);
+                HASH_ADD(hh, vehicles, address, sizeof(bdaddr_t), v);
+        }
+
+        err = anki_vehicle_parse_adv_record(info->data, info->length, &v->adv);
+        if (err != 0)
+                return;
+
+        anki_vehicle_stats_update(&v->stats, now_us, rssi);
+
+        v->state = v->adv.local_name.state.full_battery ? SCAN_STATE_FULL_BATTERY : 0;
+        v->state |= v->adv.local_name.state.low_battery ? SCAN_STATE_LOW_BATTERY : 0;
+        v->state |= v->adv.local_name.state.on_charger ? SCAN_STATE_ON_CHARGER : 0;
+
+        /* Structured output streams every report from a vehicle */
+        if (out->format != SCAN_OUTPUT_TEXT) {
+                report_vehicle(out, v, rssi, timestamp_us);
+                return;
+        }
+
+        if (v->adv.mfg_data.identifier > 0 && v->adv.local_name.version > 0 && !v->scan_complete) {
+                v->scan_complete = 1;
+                report_vehicle(out, v, rssi, timestamp_us);
+        }
+}
+
+static int wait_for_events(int dd, struct scan_output *out)
+{
+        struct pollfd pfd[2];
+        int n;
+
+        if (!scan_output_pending(out))
+                return 0;
+
+        memset(pfd, 0, sizeof(pfd));
+        pfd[0].fd = dd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = out->fd;
+        pfd[1].events = POLLOUT;
+
+        n = poll(pfd, out->blocked ? 2 : 1, scan_output_timeout(out));
+        if (n < 0)
+                return -errno;
+
+        /* The reader caught up again, or the flush interval expired */
+        scan_output_flush(out, pfd[1].revents & POLLOUT);
+
+        return (pfd[0].revents & POLLIN) ? 0 : -EAGAIN;
+}
+
+static int print_advertising_devices(int dd, uint8_t filter_type,
+                                                struct scan_output *out)
 {
         unsigned char buf[HCI_MAX_EVENT_SIZE], *ptr;
         struct hci_filter nf, of;
@@ -228,7 +379,7 @@ static int print_advertising_devices(int dd, uint8_t filter_type)
 
         olen = sizeof(of);
         if (getsockopt(dd, SOL_HCI, HCI_FILTER, &of, &olen) < 0) {
-                printf("Could not get socket options\n");
+                fprintf(stderr, "Could not get socket options\n");
                 return -1;
         }
 
@@ -237,7 +388,7 @@ static int print_advertising_devices(int dd, uint8_t filter_type)
         hci_filter_set_event(EVT_LE_META_EVENT, &nf);
 
         if (setsockopt(dd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0) {
-                printf("Could not set socket options\n");
+                fprintf(stderr, "Could not set socket options\n");
                 return -1;
         }
 
@@ -248,8 +399,22 @@ static int print_advertising_devices(int dd, uint8_t filter_type)
 
         while (1) {
                 evt_le_meta_event *meta;
-                le_advertising_info *info;
-                char addr[18];
+                le_advertising_info *infos[MAX_REPORTS];
+                const uint8_t *reports[MAX_REPORTS];
+                size_t lens[MAX_REPORTS];
+                uint64_t mask[ANKI_ADV_PREFILTER_MASK_WORDS(MAX_REPORTS)];
+                uint64_t now_us, timestamp_us;
+                uint8_t num_reports;
+                int count, i;
+                int err;
+
+                err = wait_for_events(dd, out);
+                if (err == -EINTR && signal_received == SIGINT) {
+                        len = 0;
+                        goto done;
+                }
+                if (err < 0)
+                        continue;
 
                 while ((len = read(dd, buf, sizeof(buf))) < 0) {
                         if (errno == EINTR && signal_received == SIGINT) {
@@ -262,6 +427,9 @@ static int print_advertising_devices(int dd, uint8_t filter_type)
                         goto done;
                 }
 
+                now_us = anki_timeline_now_us();
+                timestamp_us = realtime_us();
+
                 ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
                 len -= (1 + HCI_EVENT_HDR_SIZE);
 
@@ -270,53 +438,34 @@ static int print_advertising_devices(int dd, uint8_t filter_type)
                 if (meta->subevent != 0x02)
                         goto done;
 
-                /* Ignoring multiple reports */
-                info = (le_advertising_info *) (meta->data + 1);
-                if (check_report_filter(filter_type, info)) {
-                        char name[30];
+                /* An event may carry several reports back to back */
+                num_reports = meta->data[0];
+                ptr = meta->data + 1;
+                len -= 2;
 
-                        memset(name, 0, sizeof(name));
+                for (count = 0; count < num_reports && len >= LE_ADVERTISING_INFO_SIZE; count++) {
+                        le_advertising_info *info = (le_advertising_info *) ptr;
+                        int info_len = LE_ADVERTISING_INFO_SIZE + info->length + 1;
 
-                        ba2str(&info->bdaddr, addr);
+                        if (info_len > len)
+                                break;
 
-                        vehicle_t vehicle;
-                        vehicle_t *v = &vehicle;
+                        infos[count] = info;
+                        reports[count] = info->data;
+                        lens[count] = info->length;
 
-                        HASH_FIND(hh, vehicles, &info->bdaddr, sizeof(bdaddr_t), v);
-                        if (v == NULL) {
-                            v = (vehicle_t *)malloc(sizeof(vehicle_t));
-                            memset(&v->adv, 0, sizeof(anki_vehicle_adv_t));
-                            memcpy(&v->address, &info->bdaddr, sizeof(bdaddr_t));
-                            HASH_ADD(hh, vehicles, address, sizeof(bdaddr_t), v);
-                        }
-                       
-                        int err = anki_vehicle_parse_adv_record(info->data, info->length, &v->adv);
-                        
-                        if (err == 0 && v->adv.mfg_data.identifier > 0 && v->adv.local_name.version > 0 && !v->scan_complete) {
-                            v->scan_complete = 1;
-                            printf("%s ", addr);
-
-                            const char *model = NULL;
-                            switch(v->adv.mfg_data.model_id) {
-                                case 1:
-                                    model = "Kourai";
-                                    break;
-                                case 2:
-                                    model = "Boson";
-                                    break;
-                                case 3:
-                                    model = "Rho";
-                                    break;
-                                case 4:
-                                    model = "Katal";
-                                    break;
-                                default:
-                                    model = "Unknown";
-                                    break;
-                            }
-
-                            printf("%s [v%04x] (%s %04x)\n", v->adv.local_name.name, v->adv.local_name.version & 0xffff, model, v->adv.mfg_data.identifier & 0xffff);
-                        }
+                        ptr += info_len;
+                        len -= info_len;
+                }
+
+                /* Look for the Anki service UUID in all reports at once */
+                anki_vehicle_adv_prefilter(reports, lens, count, mask);
+
+                for (i = 0; i < count; i++) {
+                        int candidate = (mask[i / 64] >> (i % 64)) & 1;
+
+                        process_report(out, filter_type, infos[i], candidate,
+                                        now_us, timestamp_us);
                 }
         }
 
@@ -339,6 +488,10 @@ static void cmd_lescan(int dev_id, int argc, char **argv)
         uint16_t interval = htobs(0x0010);
         uint16_t window = htobs(0x0010);
         uint8_t filter_dup = 1;
+        enum scan_output_format format = SCAN_OUTPUT_TEXT;
+        int flush_ms = -1;
+        size_t buffer_size = SCAN_OUTPUT_DEFAULT_SIZE;
+        struct scan_output out;
 
         for_each_opt(opt, lescan_options, NULL) {
                 switch (opt) {
@@ -364,6 +517,24 @@ static void cmd_lescan(int dev_id, int argc, char **argv)
                 case 'D':
                         filter_dup = 0x00;
                         break;
+                case 'f':
+                        if (strcmp(optarg, "text") == 0)
+                                format = SCAN_OUTPUT_TEXT;
+                        else if (strcmp(optarg, "json") == 0)
+                                format = SCAN_OUTPUT_JSON;
+                        else if (strcmp(optarg, "binary") == 0)
+                                format = SCAN_OUTPUT_BINARY;
+                        else {
+                                fprintf(stderr, "Unknown output format\n");
+                                exit(1);
+                        }
+                        break;
+                case 'F':
+                        flush_ms = atoi(optarg);
+                        break;
+                case 'B':
+                        buffer_size = (size_t)atoi(optarg) << 10;
+                        break;
                 default:
                         printf("%s", lescan_help);
                         return;
@@ -394,14 +565,31 @@ static void cmd_lescan(int dev_id, int argc, char **argv)
                 exit(1);
         }
 
-        printf("LE Scan ...\n");
+        if (flush_ms < 0)
+                flush_ms = (format == SCAN_OUTPUT_TEXT) ? 0 : 100;
 
-        err = print_advertising_devices(dd, filter_type);
+        if (scan_output_init(&out, STDOUT_FILENO, format, buffer_size, flush_ms) < 0) {
+                fprintf(stderr, "Could not allocate output buffer\n");
+                exit(1);
+        }
+
+        /* Keep stdout clean for machine-readable formats */
+        fprintf(format == SCAN_OUTPUT_TEXT ? stdout : stderr, "LE Scan ...\n");
+        fflush(NULL);
+
+        err = print_advertising_devices(dd, filter_type, &out);
+        scan_output_finish(&out);
         if (err < 0) {
                 perror("Could not receive advertising events");
                 exit(1);
         }
 
+        if (out.dropped > 0 || out.stalls > 0)
+                fprintf(stderr, "%llu records, %llu dropped, %llu output stalls\n",
+                        (unsigned long long)out.records,
+                        (unsigned long long)out.dropped,
+                        (unsigned long long)out.stalls);
+
         err = hci_le_set_scan_enable(dd, 0x00, filter_dup, 2000);
         if (err < 0) {
                 fprintf(stderr, "Disable scan failed with error code: %d", err);
@@ -718,6 +718,98 @@ ssize_t dec_read_resp(const uint8_t *pdu, size_t len, uint8_t *value,
 	return len - 1;
 }
 
+uint16_t enc_read_multi_req(const uint16_t *handles, size_t count,
+						uint8_t *pdu, size_t len)
+{
+	const uint16_t hdr_len = sizeof(pdu[0]);
+	size_t i;
+
+	if (pdu == NULL || handles == NULL)
+		return 0;
+
+	/* The Set Of Handles holds two or more handles */
+	if (count < 2)
+		return 0;
+
+	if (len < hdr_len + count * sizeof(handles[0]))
+		return 0;
+
+	pdu[0] = ATT_OP_READ_MULTI_REQ;
+
+	for (i = 0; i < count; i++)
+		att_put_u16(handles[i], &pdu[hdr_len + i * sizeof(handles[0])]);
+
+	return hdr_len + count * sizeof(handles[0]);
+}
+
+uint16_t dec_read_multi_req(const uint8_t *pdu, size_t len, uint16_t *handles,
+								size_t *count)
+{
+	const uint16_t hdr_len = sizeof(pdu[0]);
+	size_t i, num;
+
+	if (pdu == NULL || handles == NULL || count == NULL)
+		return 0;
+
+	if (pdu[0] != ATT_OP_READ_MULTI_REQ)
+		return 0;
+
+	if (len < hdr_len + 2 * sizeof(handles[0]))
+		return 0;
+
+	if ((len - hdr_len) % sizeof(handles[0]))
+		return 0;
+
+	num = (len - hdr_len) / sizeof(handles[0]);
+	if (num > *count)
+		return 0;
+
+	for (i = 0; i < num; i++)
+		handles[i] = att_get_u16(&pdu[hdr_len + i * sizeof(handles[0])]);
+
+	*count = num;
+
+	return len;
+}
+
+uint16_t enc_read_multi_resp(const uint8_t *values, size_t vlen, uint8_t *pdu,
+								size_t len)
+{
+	/* Room for at least the opcode */
+	if (pdu == NULL || len < 1)
+		return 0;
+
+	/* Values that do not fit are truncated, as in Read Response */
+	if (vlen > len - 1)
+		vlen = len - 1;
+
+	pdu[0] = ATT_OP_READ_MULTI_RESP;
+
+	memcpy(pdu + 1, values, vlen);
+
+	return vlen + 1;
+}
+
+ssize_t dec_read_multi_resp(const uint8_t *pdu, size_t len, uint8_t *values,
+								size_t vlen)
+{
+	if (pdu == NULL || len < 1)
+		return -EINVAL;
+
+	if (pdu[0] != ATT_OP_READ_MULTI_RESP)
+		return -EINVAL;
+
+	if (values == NULL)
+		return len - 1;
+
+	if (vlen < (len - 1))
+		return -ENOBUFS;
+
+	memcpy(values, pdu + 1, len - 1);
+
+	return len - 1;
+}
+
 uint16_t enc_error_resp(uint8_t opcode, uint16_t handle, uint8_t status,
 						uint8_t *pdu, size_t len)
 {
@@ -1095,7 +1187,7 @@ uint16_t dec_prep_write_resp(const uint8_t *pdu, size_t len, uint16_t *handle,
 	if (len < min_len)
 		return 0;
 
-	if (pdu[0] != ATT_OP_PREP_WRITE_REQ)
+	if (pdu[0] != ATT_OP_PREP_WRITE_RESP)
 		return 0;
 
 	*handle = att_get_u16(&pdu[1]);
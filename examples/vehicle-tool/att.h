@@ -246,6 +246,14 @@ uint16_t enc_read_blob_resp(uint8_t *value, size_t vlen, uint16_t offset,
 						uint8_t *pdu, size_t len);
 ssize_t dec_read_resp(const uint8_t *pdu, size_t len, uint8_t *value,
 								size_t vlen);
+uint16_t enc_read_multi_req(const uint16_t *handles, size_t count,
+						uint8_t *pdu, size_t len);
+uint16_t dec_read_multi_req(const uint8_t *pdu, size_t len, uint16_t *handles,
+								size_t *count);
+uint16_t enc_read_multi_resp(const uint8_t *values, size_t vlen, uint8_t *pdu,
+								size_t len);
+ssize_t dec_read_multi_resp(const uint8_t *pdu, size_t len, uint8_t *values,
+								size_t vlen);
 uint16_t enc_error_resp(uint8_t opcode, uint16_t handle, uint8_t status,
 						uint8_t *pdu, size_t len);
 uint16_t enc_find_info_req(uint16_t start, uint16_t end, uint8_t *pdu,
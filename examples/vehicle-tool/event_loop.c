@@ -0,0 +1,702 @@
+/*
+ *
+ *  Copyright (C) 2014  Anki, Inc.
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <glib.h>
+
+#include "event_loop.h"
+
+#define EPOLL_MAX_EVENTS	64
+
+struct event_io {
+	int refs;
+	int fd;
+	uint32_t events;
+	event_io_func_t func;
+	void *user_data;
+	bool removed;
+
+	/* GLib backend */
+	GIOChannel *chan;
+	guint in_source;
+	guint out_source;
+
+	/* epoll backend: handler asked to be called again */
+	struct event_io *ready_next;
+	uint32_t ready_events;
+	bool ready;
+};
+
+struct event_timeout {
+	unsigned int id;
+	unsigned int interval;
+	uint64_t expires;
+	event_timeout_func_t func;
+	void *user_data;
+	struct event_timeout *next;
+};
+
+static struct {
+	bool initialized;
+	enum event_loop_backend backend;
+
+	/* GLib backend */
+	GMainLoop *main_loop;
+
+	/* epoll backend */
+	int epfd;
+	int wakefd;
+	int timerfd;
+	bool quit;
+	struct event_io *ready;
+	struct event_timeout *timeouts;	/* sorted by expiry */
+	struct event_timeout *running;
+	bool running_removed;
+	unsigned int next_timeout_id;
+} loop = {
+	.epfd = -1,
+	.wakefd = -1,
+	.timerfd = -1,
+};
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void io_ref(struct event_io *io)
+{
+	io->refs++;
+}
+
+static void io_unref(struct event_io *io)
+{
+	if (--io->refs > 0)
+		return;
+
+	if (io->chan)
+		g_io_channel_unref(io->chan);
+
+	free(io);
+}
+
+static int epoll_setup(void)
+{
+	struct epoll_event ev;
+
+	loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop.epfd < 0)
+		return -errno;
+
+	loop.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop.wakefd < 0)
+		goto fail;
+
+	loop.timerfd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC);
+	if (loop.timerfd < 0)
+		goto fail;
+
+	/* Both are drained on every wakeup, level-triggered is fine */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &loop.wakefd;
+	if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.wakefd, &ev) < 0)
+		goto fail;
+
+	ev.data.ptr = &loop.timerfd;
+	if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.timerfd, &ev) < 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	if (loop.timerfd >= 0)
+		close(loop.timerfd);
+	if (loop.wakefd >= 0)
+		close(loop.wakefd);
+	close(loop.epfd);
+	loop.epfd = loop.wakefd = loop.timerfd = -1;
+
+	return -errno;
+}
+
+int event_loop_init(enum event_loop_backend backend)
+{
+	int err;
+
+	if (loop.initialized)
+		return loop.backend == backend ? 0 : -EALREADY;
+
+	if (backend == EVENT_LOOP_EPOLL) {
+		err = epoll_setup();
+		if (err < 0)
+			return err;
+	}
+
+	loop.backend = backend;
+	loop.initialized = true;
+
+	return 0;
+}
+
+enum event_loop_backend event_loop_get_backend(void)
+{
+	return loop.backend;
+}
+
+static void ensure_init(void)
+{
+	if (!loop.initialized)
+		event_loop_init(EVENT_LOOP_GLIB);
+}
+
+/* GLib backend */
+
+static uint32_t cond_to_events(GIOCondition cond)
+{
+	uint32_t events = 0;
+
+	if (cond & (G_IO_IN | G_IO_PRI))
+		events |= EVENT_IN;
+	if (cond & G_IO_OUT)
+		events |= EVENT_OUT;
+	if (cond & G_IO_HUP)
+		events |= EVENT_HUP;
+	if (cond & (G_IO_ERR | G_IO_NVAL))
+		events |= EVENT_ERR;
+
+	return events;
+}
+
+static gboolean glib_io_cb(GIOChannel *chan, GIOCondition cond, gpointer data)
+{
+	struct event_io *io = data;
+
+	if (io->removed)
+		return FALSE;
+
+	/* Level-triggered, an unfinished handler is simply called again */
+	io->func(io, io->fd, cond_to_events(cond), io->user_data);
+
+	return TRUE;
+}
+
+static void glib_io_destroy(gpointer data)
+{
+	io_unref(data);
+}
+
+static guint glib_watch(struct event_io *io, GIOCondition cond)
+{
+	io_ref(io);
+
+	return g_io_add_watch_full(io->chan, G_PRIORITY_DEFAULT, cond,
+					glib_io_cb, io, glib_io_destroy);
+}
+
+/* Readable and error conditions share one source, writable has its own */
+static void glib_io_update(struct event_io *io, uint32_t events)
+{
+	GIOCondition cond = G_IO_HUP | G_IO_ERR | G_IO_NVAL;
+
+	if ((events & EVENT_IN) != (io->events & EVENT_IN) ||
+							!io->in_source) {
+		if (io->in_source)
+			g_source_remove(io->in_source);
+
+		if (events & EVENT_IN)
+			cond |= G_IO_IN;
+
+		io->in_source = glib_watch(io, cond);
+	}
+
+	if ((events & EVENT_OUT) && !io->out_source)
+		io->out_source = glib_watch(io, G_IO_OUT);
+	else if (!(events & EVENT_OUT) && io->out_source) {
+		g_source_remove(io->out_source);
+		io->out_source = 0;
+	}
+
+	io->events = events;
+}
+
+/* epoll backend */
+
+static uint32_t events_to_epoll(uint32_t events)
+{
+	uint32_t ev = EPOLLET | EPOLLRDHUP;
+
+	if (events & EVENT_IN)
+		ev |= EPOLLIN;
+	if (events & EVENT_OUT)
+		ev |= EPOLLOUT;
+
+	return ev;
+}
+
+static uint32_t epoll_to_events(uint32_t ev)
+{
+	uint32_t events = 0;
+
+	if (ev & (EPOLLIN | EPOLLPRI))
+		events |= EVENT_IN;
+	if (ev & EPOLLOUT)
+		events |= EVENT_OUT;
+	if (ev & (EPOLLHUP | EPOLLRDHUP))
+		events |= EVENT_HUP;
+	if (ev & EPOLLERR)
+		events |= EVENT_ERR;
+
+	return events;
+}
+
+struct event_io *event_io_add(int fd, uint32_t events, event_io_func_t func,
+							void *user_data)
+{
+	struct event_io *io;
+	struct epoll_event ev;
+
+	ensure_init();
+
+	io = calloc(1, sizeof(*io));
+	if (io == NULL)
+		return NULL;
+
+	io->refs = 1;
+	io->fd = fd;
+	io->func = func;
+	io->user_data = user_data;
+
+	if (loop.backend == EVENT_LOOP_GLIB) {
+		io->chan = g_io_channel_unix_new(fd);
+		glib_io_update(io, events);
+		return io;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events_to_epoll(events);
+	ev.data.ptr = io;
+
+	if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		free(io);
+		return NULL;
+	}
+
+	io->events = events;
+
+	return io;
+}
+
+int event_io_modify(struct event_io *io, uint32_t events)
+{
+	struct epoll_event ev;
+
+	if (io == NULL || io->removed)
+		return -EINVAL;
+
+	if (loop.backend == EVENT_LOOP_GLIB) {
+		glib_io_update(io, events);
+		return 0;
+	}
+
+	/* Re-arming also reports readiness that is already there */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events_to_epoll(events);
+	ev.data.ptr = io;
+
+	if (epoll_ctl(loop.epfd, EPOLL_CTL_MOD, io->fd, &ev) < 0)
+		return -errno;
+
+	io->events = events;
+
+	return 0;
+}
+
+void event_io_remove(struct event_io *io)
+{
+	if (io == NULL || io->removed)
+		return;
+
+	io->removed = true;
+
+	if (loop.backend == EVENT_LOOP_GLIB) {
+		if (io->in_source)
+			g_source_remove(io->in_source);
+		if (io->out_source)
+			g_source_remove(io->out_source);
+		io->in_source = io->out_source = 0;
+	} else
+		epoll_ctl(loop.epfd, EPOLL_CTL_DEL, io->fd, NULL);
+
+	/*
+	 * A pending ready list entry, running handler or event still in the
+	 * current epoll batch keeps its own ref
+	 */
+	io_unref(io);
+}
+
+static void ready_push(struct event_io *io, uint32_t events)
+{
+	io->ready_events |= events;
+
+	if (io->ready)
+		return;
+
+	io_ref(io);
+	io->ready = true;
+	io->ready_next = loop.ready;
+	loop.ready = io;
+}
+
+static void io_dispatch(struct event_io *io, uint32_t events)
+{
+	if (io->removed)
+		return;
+
+	io_ref(io);
+
+	if (io->func(io, io->fd, events, io->user_data) && !io->removed)
+		ready_push(io, events & (EVENT_IN | EVENT_OUT));
+
+	io_unref(io);
+}
+
+static void ready_dispatch(void)
+{
+	struct event_io *io = loop.ready;
+
+	loop.ready = NULL;
+
+	while (io) {
+		struct event_io *next = io->ready_next;
+		uint32_t events = io->ready_events;
+
+		io->ready = false;
+		io->ready_events = 0;
+		io->ready_next = NULL;
+
+		io_dispatch(io, events);
+		io_unref(io);
+
+		io = next;
+	}
+}
+
+/* Timeouts */
+
+struct glib_timeout {
+	event_timeout_func_t func;
+	void *user_data;
+};
+
+static gboolean glib_timeout_cb(gpointer data)
+{
+	struct glib_timeout *t = data;
+
+	return t->func(t->user_data) ? TRUE : FALSE;
+}
+
+static void timerfd_rearm(void)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+
+	if (loop.timeouts) {
+		uint64_t expires = loop.timeouts->expires;
+
+		/* A zero value would disarm the timer */
+		if (expires == 0)
+			expires = 1;
+
+		its.it_value.tv_sec = expires / 1000;
+		its.it_value.tv_nsec = (expires % 1000) * 1000000;
+	}
+
+	timerfd_settime(loop.timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void timeout_insert(struct event_timeout *t)
+{
+	struct event_timeout **p = &loop.timeouts;
+
+	while (*p && (*p)->expires <= t->expires)
+		p = &(*p)->next;
+
+	t->next = *p;
+	*p = t;
+}
+
+unsigned int event_timeout_add(unsigned int timeout_ms,
+				event_timeout_func_t func, void *user_data)
+{
+	struct event_timeout *t;
+
+	ensure_init();
+
+	if (loop.backend == EVENT_LOOP_GLIB) {
+		struct glib_timeout *gt = g_new0(struct glib_timeout, 1);
+
+		gt->func = func;
+		gt->user_data = user_data;
+
+		return g_timeout_add_full(G_PRIORITY_DEFAULT, timeout_ms,
+					glib_timeout_cb, gt, g_free);
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return 0;
+
+	if (++loop.next_timeout_id == 0)
+		loop.next_timeout_id = 1;
+
+	t->id = loop.next_timeout_id;
+	t->interval = timeout_ms;
+	t->expires = now_ms() + timeout_ms;
+	t->func = func;
+	t->user_data = user_data;
+
+	timeout_insert(t);
+
+	if (loop.timeouts == t)
+		timerfd_rearm();
+
+	return t->id;
+}
+
+void event_timeout_remove(unsigned int id)
+{
+	struct event_timeout **p;
+
+	if (id == 0)
+		return;
+
+	if (loop.backend == EVENT_LOOP_GLIB) {
+		g_source_remove(id);
+		return;
+	}
+
+	if (loop.running && loop.running->id == id) {
+		loop.running_removed = true;
+		return;
+	}
+
+	for (p = &loop.timeouts; *p; p = &(*p)->next) {
+		struct event_timeout *t = *p;
+
+		if (t->id != id)
+			continue;
+
+		*p = t->next;
+		free(t);
+
+		if (p == &loop.timeouts)
+			timerfd_rearm();
+
+		return;
+	}
+}
+
+static void timeouts_dispatch(void)
+{
+	uint64_t expirations, now = now_ms();
+
+	if (read(loop.timerfd, &expirations, sizeof(expirations)) < 0 &&
+							errno != EAGAIN)
+		return;
+
+	while (loop.timeouts && loop.timeouts->expires <= now) {
+		struct event_timeout *t = loop.timeouts;
+		bool keep;
+
+		loop.timeouts = t->next;
+		t->next = NULL;
+
+		loop.running = t;
+		loop.running_removed = false;
+
+		keep = t->func(t->user_data);
+
+		loop.running = NULL;
+
+		if (keep && !loop.running_removed) {
+			t->expires = now + (t->interval ? t->interval : 1);
+			timeout_insert(t);
+		} else
+			free(t);
+	}
+
+	timerfd_rearm();
+}
+
+/* Main loop */
+
+static bool is_loop_fd(const void *ptr)
+{
+	return ptr == &loop.wakefd || ptr == &loop.timerfd;
+}
+
+int event_loop_dispatch(int timeout_ms)
+{
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	int n, i;
+
+	ensure_init();
+
+	if (loop.backend == EVENT_LOOP_GLIB) {
+		g_main_context_iteration(NULL, timeout_ms != 0);
+		return 0;
+	}
+
+	if (loop.ready)
+		timeout_ms = 0;
+
+	n = epoll_wait(loop.epfd, events, EPOLL_MAX_EVENTS, timeout_ms);
+	if (n < 0)
+		return errno == EINTR ? 0 : -errno;
+
+	/* Any handler may remove an io that is still further down the batch */
+	for (i = 0; i < n; i++) {
+		if (!is_loop_fd(events[i].data.ptr))
+			io_ref(events[i].data.ptr);
+	}
+
+	/* Handlers that ran out of budget last time go first */
+	ready_dispatch();
+
+	for (i = 0; i < n; i++) {
+		void *ptr = events[i].data.ptr;
+
+		if (ptr == &loop.wakefd) {
+			eventfd_t value;
+
+			eventfd_read(loop.wakefd, &value);
+			continue;
+		}
+
+		if (ptr == &loop.timerfd) {
+			timeouts_dispatch();
+			continue;
+		}
+
+		io_dispatch(ptr, epoll_to_events(events[i].events));
+		io_unref(ptr);
+	}
+
+	/* Keep the epoll fd readable for an outer GLib loop */
+	if (loop.ready)
+		eventfd_write(loop.wakefd, 1);
+
+	return n;
+}
+
+int event_loop_run(void)
+{
+	int err;
+
+	ensure_init();
+
+	if (loop.backend == EVENT_LOOP_GLIB) {
+		loop.main_loop = g_main_loop_new(NULL, FALSE);
+		g_main_loop_run(loop.main_loop);
+		g_main_loop_unref(loop.main_loop);
+		loop.main_loop = NULL;
+		return 0;
+	}
+
+	loop.quit = false;
+
+	while (!loop.quit) {
+		err = event_loop_dispatch(-1);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+void event_loop_quit(void)
+{
+	if (loop.backend == EVENT_LOOP_GLIB) {
+		if (loop.main_loop)
+			g_main_loop_quit(loop.main_loop);
+		return;
+	}
+
+	loop.quit = true;
+	event_loop_wakeup();
+}
+
+void event_loop_wakeup(void)
+{
+	if (loop.backend == EVENT_LOOP_GLIB) {
+		g_main_context_wakeup(NULL);
+		return;
+	}
+
+	eventfd_write(loop.wakefd, 1);
+}
+
+static gboolean glib_nested_cb(GIOChannel *chan, GIOCondition cond,
+							gpointer data)
+{
+	event_loop_dispatch(0);
+
+	return TRUE;
+}
+
+unsigned int event_loop_glib_attach(void)
+{
+	GIOChannel *chan;
+	guint source;
+
+	ensure_init();
+
+	if (loop.backend == EVENT_LOOP_GLIB)
+		return 0;
+
+	chan = g_io_channel_unix_new(loop.epfd);
+	source = g_io_add_watch(chan, G_IO_IN, glib_nested_cb, NULL);
+	g_io_channel_unref(chan);
+
+	return source;
+}
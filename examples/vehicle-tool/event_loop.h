@@ -0,0 +1,97 @@
+/*
+ *
+ *  Copyright (C) 2014  Anki, Inc.
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __EVENT_LOOP_H
+#define __EVENT_LOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Minimal process-wide event loop used by the ATT transport.
+ *
+ * The GLib backend maps everything onto the default GMainContext. The
+ * epoll backend keeps one registration per fd (edge-triggered), drives all
+ * timeouts from a single timerfd and uses an eventfd for wakeups from
+ * other threads. Its epoll fd can itself be watched by a GLib main loop,
+ * so both can run in the same thread.
+ *
+ * Apart from event_loop_wakeup() and event_loop_quit(), none of these
+ * functions are thread-safe.
+ */
+
+enum event_loop_backend {
+	EVENT_LOOP_GLIB,
+	EVENT_LOOP_EPOLL,
+};
+
+#define EVENT_IN	0x01
+#define EVENT_OUT	0x02
+#define EVENT_HUP	0x04
+#define EVENT_ERR	0x08
+
+struct event_io;
+
+/*
+ * Called with the events that are ready. Edge-triggered handlers must
+ * consume until EAGAIN; a handler that stops early because of a budget
+ * returns true and is called again on the next iteration.
+ */
+typedef bool (*event_io_func_t)(struct event_io *io, int fd, uint32_t events,
+							void *user_data);
+
+/* Return true to keep the timeout armed with the same interval */
+typedef bool (*event_timeout_func_t)(void *user_data);
+
+/* Select the backend; must be called before anything is registered */
+int event_loop_init(enum event_loop_backend backend);
+enum event_loop_backend event_loop_get_backend(void);
+
+struct event_io *event_io_add(int fd, uint32_t events, event_io_func_t func,
+							void *user_data);
+int event_io_modify(struct event_io *io, uint32_t events);
+void event_io_remove(struct event_io *io);
+
+unsigned int event_timeout_add(unsigned int timeout_ms,
+				event_timeout_func_t func, void *user_data);
+void event_timeout_remove(unsigned int id);
+
+/* Run one iteration, waiting at most timeout_ms (-1 = forever) */
+int event_loop_dispatch(int timeout_ms);
+int event_loop_run(void);
+void event_loop_quit(void);
+void event_loop_wakeup(void);
+
+/*
+ * With the epoll backend, dispatch it from the GLib main loop whenever
+ * its epoll fd becomes readable. Returns the GLib source id, 0 when the
+ * GLib backend is in use and nothing needs attaching.
+ */
+unsigned int event_loop_glib_attach(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
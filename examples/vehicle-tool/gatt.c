@@ -551,6 +551,158 @@ guint gatt_discover_char(GAttrib *attrib, uint16_t start, uint16_t end,
 								dc, NULL);
 }
 
+struct match_char {
+	GAttrib *attrib;
+	uint16_t end;
+	struct gatt_char_match *match;
+	unsigned int count;
+	unsigned int found;
+	gatt_match_cb_t cb;
+	void *user_data;
+};
+
+static void match_char_free(struct match_char *mc)
+{
+	g_attrib_unref(mc->attrib);
+	g_free(mc);
+}
+
+static void char_matched_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
+							gpointer user_data)
+{
+	struct match_char *mc = user_data;
+	struct att_data_list *list;
+	unsigned int i, j;
+	uint8_t err = ATT_ECODE_ATTR_NOT_FOUND;
+	uint16_t last = 0;
+
+	if (status) {
+		err = status;
+		goto done;
+	}
+
+	list = dec_read_by_type_resp(ipdu, iplen);
+	if (list == NULL) {
+		err = ATT_ECODE_IO;
+		goto done;
+	}
+
+	for (i = 0; i < list->num; i++) {
+		uint8_t *value = list->data[i];
+		struct gatt_char *chr;
+		bt_uuid_t uuid;
+
+		last = att_get_u16(value);
+
+		/* Compare binary UUIDs, no string round trip */
+		if (list->len == 7) {
+			bt_uuid_t uuid16 = att_get_uuid16(&value[5]);
+			bt_uuid_to_uuid128(&uuid16, &uuid);
+		} else
+			uuid = att_get_uuid128(&value[5]);
+
+		for (j = 0; j < mc->count; j++) {
+			chr = &mc->match[j].chr;
+
+			if (chr->handle != 0 ||
+					bt_uuid_cmp(&mc->match[j].uuid, &uuid))
+				continue;
+
+			chr->handle = last;
+			chr->properties = value[2];
+			chr->value_handle = att_get_u16(&value[3]);
+			bt_uuid_to_string(&uuid, chr->uuid, sizeof(chr->uuid));
+
+			mc->found++;
+			mc->cb(0, j, mc->user_data);
+			break;
+		}
+	}
+
+	att_data_list_free(list);
+
+	/* Stop as soon as every wanted characteristic has been seen */
+	if (mc->found < mc->count && last != 0 && (last + 1 < mc->end)) {
+		bt_uuid_t uuid;
+		guint16 oplen;
+		size_t buflen;
+		uint8_t *buf;
+
+		buf = g_attrib_get_buffer(mc->attrib, &buflen);
+
+		bt_uuid16_create(&uuid, GATT_CHARAC_UUID);
+
+		oplen = enc_read_by_type_req(last + 1, mc->end, &uuid, buf,
+									buflen);
+		if (oplen == 0) {
+			err = ATT_ECODE_IO;
+			goto done;
+		}
+
+		if (g_attrib_send(mc->attrib, 0, buf, oplen, char_matched_cb,
+							mc, NULL) == 0) {
+			err = ATT_ECODE_INSUFF_RESOURCES;
+			goto done;
+		}
+
+		return;
+	}
+
+done:
+	err = (mc->found == mc->count ? 0 : err);
+
+	mc->cb(err, mc->count, mc->user_data);
+	match_char_free(mc);
+}
+
+guint gatt_discover_char_match(GAttrib *attrib, uint16_t start, uint16_t end,
+				struct gatt_char_match *match,
+				unsigned int count, gatt_match_cb_t func,
+				gpointer user_data)
+{
+	size_t buflen;
+	uint8_t *buf = g_attrib_get_buffer(attrib, &buflen);
+	struct match_char *mc;
+	bt_uuid_t type_uuid;
+	unsigned int i;
+	guint16 plen;
+	guint id;
+
+	if (count == 0)
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		bt_uuid_t uuid = match[i].uuid;
+
+		/* Matching is done on 128-bit values */
+		bt_uuid_to_uuid128(&uuid, &match[i].uuid);
+		memset(&match[i].chr, 0, sizeof(match[i].chr));
+	}
+
+	bt_uuid16_create(&type_uuid, GATT_CHARAC_UUID);
+
+	plen = enc_read_by_type_req(start, end, &type_uuid, buf, buflen);
+	if (plen == 0)
+		return 0;
+
+	mc = g_try_new0(struct match_char, 1);
+	if (mc == NULL)
+		return 0;
+
+	mc->attrib = g_attrib_ref(attrib);
+	mc->end = end;
+	mc->match = match;
+	mc->count = count;
+	mc->cb = func;
+	mc->user_data = user_data;
+
+	id = g_attrib_send(attrib, 0, buf, plen, char_matched_cb, mc, NULL);
+	if (id == 0)
+		match_char_free(mc);
+
+	return id;
+}
+
 guint gatt_read_char_by_uuid(GAttrib *attrib, uint16_t start, uint16_t end,
 					bt_uuid_t *uuid, GAttribResultFunc func,
 					gpointer user_data)
@@ -706,16 +858,233 @@ guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
 	return id;
 }
 
+guint gatt_read_multi(GAttrib *attrib, const uint16_t *handles, size_t count,
+				GAttribResultFunc func, gpointer user_data)
+{
+	uint8_t *buf;
+	size_t buflen;
+	guint16 plen;
+
+	buf = g_attrib_get_buffer(attrib, &buflen);
+	plen = enc_read_multi_req(handles, count, buf, buflen);
+	if (plen == 0)
+		return 0;
+
+	return g_attrib_send(attrib, 0, buf, plen, func, user_data, NULL);
+}
+
+/* Handles that fit a Read Multiple Request at the largest ATT MTU */
+#define READ_MULTI_MAX_HANDLES	((ATT_MAX_VALUE_LEN + 4) / 2)
+
+struct read_batch {
+	GAttrib *attrib;
+	struct gatt_read_item *items;
+	size_t count;
+	unsigned int pending;
+	uint8_t status;
+	gatt_read_batch_cb_t cb;
+	void *user_data;
+};
+
+struct read_group {
+	struct read_batch *batch;
+	size_t first;
+	size_t num;
+	gboolean done;
+};
+
+static void read_batch_set_status(struct read_batch *batch, size_t first,
+						size_t num, uint8_t status)
+{
+	size_t i;
+
+	for (i = first; i < first + num; i++)
+		batch->items[i].status = status;
+
+	if (batch->status == 0)
+		batch->status = status;
+}
+
+static void read_group_cb(guint8 status, const guint8 *pdu, guint16 plen,
+							gpointer user_data)
+{
+	struct read_group *group = user_data;
+	struct read_batch *batch = group->batch;
+	const uint8_t *value;
+	size_t left, i;
+
+	group->done = TRUE;
+
+	if (status) {
+		read_batch_set_status(batch, group->first, group->num, status);
+		return;
+	}
+
+	/* Read Response and Read Multiple Response share the same layout */
+	value = pdu + 1;
+	left = plen - 1;
+	for (i = group->first; i < group->first + group->num; i++) {
+		struct gatt_read_item *item = &batch->items[i];
+		size_t vlen = MIN(item->len, left);
+
+		memcpy(item->value, value, vlen);
+		item->received = vlen;
+		item->status = 0;
+
+		value += vlen;
+		left -= vlen;
+	}
+}
+
+static void read_group_destroy(gpointer user_data)
+{
+	struct read_group *group = user_data;
+	struct read_batch *batch = group->batch;
+
+	if (!group->done)
+		read_batch_set_status(batch, group->first, group->num,
+							ATT_ECODE_ABORTED);
+
+	g_free(group);
+
+	if (--batch->pending > 0)
+		return;
+
+	batch->cb(batch->status, batch->items, batch->count, batch->user_data);
+	g_attrib_unref(batch->attrib);
+	g_free(batch);
+}
+
+/* Number of items from first on that fit one request and its response */
+static size_t read_group_size(const struct gatt_read_item *items,
+					size_t first, size_t count, size_t mtu)
+{
+	size_t req = 1 + sizeof(uint16_t);
+	size_t resp = 1 + items[first].len;
+	size_t i;
+
+	for (i = first + 1; i < count; i++) {
+		if (req + sizeof(uint16_t) > mtu || resp + items[i].len > mtu)
+			break;
+
+		req += sizeof(uint16_t);
+		resp += items[i].len;
+	}
+
+	return i - first;
+}
+
+guint gatt_read_batch(GAttrib *attrib, struct gatt_read_item *items,
+				size_t count, gatt_read_batch_cb_t func,
+				gpointer user_data)
+{
+	struct read_batch *batch;
+	uint16_t handles[READ_MULTI_MAX_HANDLES];
+	size_t buflen, first, num, i;
+	unsigned int sent = 0;
+	uint8_t *buf;
+
+	if (count == 0)
+		return 0;
+
+	batch = g_try_new0(struct read_batch, 1);
+	if (batch == NULL)
+		return 0;
+
+	batch->attrib = g_attrib_ref(attrib);
+	batch->items = items;
+	batch->count = count;
+	batch->cb = func;
+	batch->user_data = user_data;
+
+	/* Hold the batch open until every request has been queued */
+	batch->pending = 1;
+
+	for (first = 0; first < count; first += num) {
+		struct read_group *group;
+		guint16 plen;
+
+		buf = g_attrib_get_buffer(attrib, &buflen);
+
+		num = read_group_size(items, first, count, buflen);
+		num = MIN(num, G_N_ELEMENTS(handles));
+
+		for (i = 0; i < num; i++) {
+			handles[i] = items[first + i].handle;
+			items[first + i].received = 0;
+		}
+
+		if (num == 1)
+			plen = enc_read_req(handles[0], buf, buflen);
+		else
+			plen = enc_read_multi_req(handles, num, buf, buflen);
+
+		group = g_try_new0(struct read_group, 1);
+		if (plen == 0 || group == NULL) {
+			g_free(group);
+			read_batch_set_status(batch, first, num,
+						ATT_ECODE_INSUFF_RESOURCES);
+			continue;
+		}
+
+		group->batch = batch;
+		group->first = first;
+		group->num = num;
+
+		batch->pending++;
+		if (g_attrib_send(attrib, 0, buf, plen, read_group_cb, group,
+						read_group_destroy) == 0) {
+			batch->pending--;
+			g_free(group);
+			read_batch_set_status(batch, first, num,
+						ATT_ECODE_INSUFF_RESOURCES);
+			continue;
+		}
+
+		sent++;
+	}
+
+	if (sent == 0) {
+		g_attrib_unref(batch->attrib);
+		g_free(batch);
+		return 0;
+	}
+
+	/* Drop the setup reference; completion runs from the main loop */
+	batch->pending--;
+
+	return sent;
+}
+
+/*
+ * Prepare Write Requests kept queued ahead of the responses. ATT allows a
+ * single outstanding request, so the window lives in the GAttrib queue:
+ * the next chunk goes out as soon as the previous response is processed
+ * instead of after a callback round trip.
+ */
+#define LONG_WRITE_WINDOW	8
+
 struct write_long_data {
 	GAttrib *attrib;
 	GAttribResultFunc func;
 	gpointer user_data;
 	guint16 handle;
-	uint16_t offset;
+	uint16_t offset;		/* next offset to be confirmed */
+	uint16_t next;			/* next offset to queue */
 	uint8_t *value;
 	size_t vlen;
+	guint ids[LONG_WRITE_WINDOW];
+	unsigned int head;
+	unsigned int queued;
+	uint8_t status;
 };
 
+static void write_long_free(struct write_long_data *long_write)
+{
+	g_free(long_write->value);
+	g_free(long_write);
+}
+
 static guint execute_write(GAttrib *attrib, uint8_t flags,
 				GAttribResultFunc func, gpointer user_data)
 {
@@ -731,50 +1100,121 @@ static guint execute_write(GAttrib *attrib, uint8_t flags,
 	return g_attrib_send(attrib, 0, buf, plen, func, user_data, NULL);
 }
 
+static void cancel_write_cb(guint8 status, const guint8 *rpdu, guint16 rlen,
+							gpointer user_data)
+{
+	struct write_long_data *long_write = user_data;
+
+	if (long_write->func)
+		long_write->func(long_write->status, NULL, 0,
+						long_write->user_data);
+
+	write_long_free(long_write);
+}
+
+/* Drop queued chunks and have the server discard what it has prepared */
+static void abort_write(struct write_long_data *long_write, uint8_t status)
+{
+	unsigned int i;
+
+	for (i = 0; i < long_write->queued; i++)
+		g_attrib_cancel(long_write->attrib, long_write->ids[
+			(long_write->head + i) % LONG_WRITE_WINDOW]);
+
+	long_write->queued = 0;
+	long_write->status = status;
+
+	if (execute_write(long_write->attrib, ATT_CANCEL_ALL_PREP_WRITES,
+					cancel_write_cb, long_write) == 0)
+		cancel_write_cb(0, NULL, 0, long_write);
+}
+
 static guint prepare_write(struct write_long_data *long_write);
 
 static void prepare_write_cb(guint8 status, const guint8 *rpdu, guint16 rlen,
 							gpointer user_data)
 {
 	struct write_long_data *long_write = user_data;
+	uint16_t handle, offset;
+	size_t elen;
+
+	long_write->head = (long_write->head + 1) % LONG_WRITE_WINDOW;
+	long_write->queued--;
 
 	if (status != 0) {
-		long_write->func(status, rpdu, rlen, long_write->user_data);
+		abort_write(long_write, status);
+		return;
+	}
+
+	uint8_t echo[rlen];
+
+	/* The response echoes the chunk, check it landed where it should */
+	if (dec_prep_write_resp(rpdu, rlen, &handle, &offset, echo,
+								&elen) == 0 ||
+			handle != long_write->handle ||
+			offset != long_write->offset || elen == 0 ||
+			offset + elen > long_write->vlen ||
+			memcmp(echo, long_write->value + offset, elen) != 0) {
+		abort_write(long_write, ATT_ECODE_IO);
 		return;
 	}
 
-	/* Skip Prepare Write Response PDU header (5 bytes) */
-	long_write->offset += rlen - 5;
+	long_write->offset += elen;
 
 	if (long_write->offset == long_write->vlen) {
-		execute_write(long_write->attrib, ATT_WRITE_ALL_PREP_WRITES,
-				long_write->func, long_write->user_data);
-		g_free(long_write->value);
-		g_free(long_write);
+		/* Unable to commit: try to discard the prepared value */
+		if (execute_write(long_write->attrib, ATT_WRITE_ALL_PREP_WRITES,
+				long_write->func, long_write->user_data) == 0) {
+			abort_write(long_write, ATT_ECODE_INSUFF_RESOURCES);
+			return;
+		}
+
+		write_long_free(long_write);
 
 		return;
 	}
 
-	prepare_write(long_write);
+	if (prepare_write(long_write) == 0 && long_write->queued == 0)
+		abort_write(long_write, ATT_ECODE_INSUFF_RESOURCES);
 }
 
+/* Top up the window. Returns the id of the first chunk queued, if any. */
 static guint prepare_write(struct write_long_data *long_write)
 {
 	GAttrib *attrib = long_write->attrib;
 	uint16_t handle = long_write->handle;
-	uint16_t offset = long_write->offset;
-	uint8_t *buf, *value = long_write->value + offset;
-	size_t buflen, vlen = long_write->vlen - offset;
-	guint16 plen;
+	guint first = 0;
 
-	buf = g_attrib_get_buffer(attrib, &buflen);
+	while (long_write->queued < LONG_WRITE_WINDOW &&
+					long_write->next < long_write->vlen) {
+		uint16_t offset = long_write->next;
+		uint8_t *buf, *value = long_write->value + offset;
+		size_t buflen, vlen = long_write->vlen - offset;
+		guint16 plen;
+		guint id;
 
-	plen = enc_prep_write_req(handle, offset, value, vlen, buf, buflen);
-	if (plen == 0)
-		return 0;
+		buf = g_attrib_get_buffer(attrib, &buflen);
 
-	return g_attrib_send(attrib, 0, buf, plen, prepare_write_cb, long_write,
-									NULL);
+		plen = enc_prep_write_req(handle, offset, value, vlen, buf,
+									buflen);
+		if (plen <= 5)
+			break;
+
+		id = g_attrib_send(attrib, 0, buf, plen, prepare_write_cb,
+							long_write, NULL);
+		if (id == 0)
+			break;
+
+		long_write->ids[(long_write->head + long_write->queued) %
+						LONG_WRITE_WINDOW] = id;
+		long_write->queued++;
+		long_write->next += plen - 5;
+
+		if (first == 0)
+			first = id;
+	}
+
+	return first;
 }
 
 guint gatt_write_char(GAttrib *attrib, uint16_t handle, uint8_t *value,
@@ -783,6 +1223,7 @@ guint gatt_write_char(GAttrib *attrib, uint16_t handle, uint8_t *value,
 	uint8_t *buf;
 	size_t buflen;
 	struct write_long_data *long_write;
+	guint id;
 
 	buf = g_attrib_get_buffer(attrib, &buflen);
 
@@ -811,7 +1252,11 @@ guint gatt_write_char(GAttrib *attrib, uint16_t handle, uint8_t *value,
 	long_write->value = g_memdup(value, vlen);
 	long_write->vlen = vlen;
 
-	return prepare_write(long_write);
+	id = prepare_write(long_write);
+	if (id == 0)
+		write_long_free(long_write);
+
+	return id;
 }
 
 guint gatt_exchange_mtu(GAttrib *attrib, uint16_t mtu, GAttribResultFunc func,
@@ -853,6 +1298,50 @@ guint gatt_write_cmd(GAttrib *attrib, uint16_t handle, uint8_t *value, int vlen,
 	return g_attrib_send(attrib, 0, buf, plen, NULL, user_data, notify);
 }
 
+uint8_t *gatt_write_reserve(GAttrib *attrib, uint16_t handle,
+				gboolean response, size_t *vlen,
+				struct gattrib_pdu **pdu)
+{
+	uint8_t *buf;
+	size_t buflen;
+
+	g_attrib_get_buffer(attrib, &buflen);
+	if (buflen < 3)
+		return NULL;
+
+	buf = g_attrib_reserve(attrib, buflen, pdu);
+	if (buf == NULL)
+		return NULL;
+
+	/* Header of a Write Request / Write Command, value follows */
+	buf[0] = response ? ATT_OP_WRITE_REQ : ATT_OP_WRITE_CMD;
+	att_put_u16(handle, &buf[1]);
+
+	*vlen = buflen - 3;
+
+	return &buf[3];
+}
+
+guint gatt_write_commit(GAttrib *attrib, struct gattrib_pdu *pdu,
+				size_t vlen, GAttribResultFunc func,
+				gpointer user_data)
+{
+	return g_attrib_commit(attrib, pdu, 3 + vlen, func, user_data, NULL);
+}
+
+guint gatt_write_cmd_buf(GAttrib *attrib, uint16_t handle,
+				struct gattrib_buf *value,
+				GDestroyNotify notify, gpointer user_data)
+{
+	uint8_t hdr[3];
+
+	hdr[0] = ATT_OP_WRITE_CMD;
+	att_put_u16(handle, &hdr[1]);
+
+	return g_attrib_send_buf(attrib, hdr, sizeof(hdr), value, NULL,
+							user_data, notify);
+}
+
 static sdp_data_t *proto_seq_find(sdp_list_t *proto_list)
 {
 	sdp_list_t *list;
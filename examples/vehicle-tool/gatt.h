@@ -84,9 +84,56 @@ guint gatt_discover_char(GAttrib *attrib, uint16_t start, uint16_t end,
 					bt_uuid_t *uuid, gatt_cb_t func,
 					gpointer user_data);
 
+/*
+ * Range-scoped discovery of a known set of characteristics. Each entry's
+ * chr is filled in as its UUID is seen and func is called with that index
+ * right away; discovery stops once all are found. A final call with
+ * index == count reports the overall status. match must stay valid until
+ * then.
+ */
+struct gatt_char_match {
+	bt_uuid_t uuid;
+	struct gatt_char chr;
+};
+
+typedef void (*gatt_match_cb_t) (guint8 status, unsigned int index,
+							gpointer user_data);
+
+guint gatt_discover_char_match(GAttrib *attrib, uint16_t start, uint16_t end,
+				struct gatt_char_match *match,
+				unsigned int count, gatt_match_cb_t func,
+				gpointer user_data);
+
 guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
 							gpointer user_data);
 
+/* Read Multiple: values come back concatenated in handle order */
+guint gatt_read_multi(GAttrib *attrib, const uint16_t *handles, size_t count,
+				GAttribResultFunc func, gpointer user_data);
+
+/*
+ * Batched read of fixed-size values. Items are packed into as few Read
+ * Multiple requests as the MTU allows, all queued at once, and func runs
+ * when the last one completes. len is the size of the value (and of the
+ * value buffer); received and status are filled in per item. Returns the
+ * number of requests queued, 0 on failure.
+ */
+struct gatt_read_item {
+	uint16_t handle;
+	uint16_t len;
+	uint8_t *value;
+	uint16_t received;
+	uint8_t status;
+};
+
+typedef void (*gatt_read_batch_cb_t) (guint8 status,
+					struct gatt_read_item *items,
+					size_t count, gpointer user_data);
+
+guint gatt_read_batch(GAttrib *attrib, struct gatt_read_item *items,
+				size_t count, gatt_read_batch_cb_t func,
+				gpointer user_data);
+
 guint gatt_write_char(GAttrib *attrib, uint16_t handle, uint8_t *value,
 					size_t vlen, GAttribResultFunc func,
 					gpointer user_data);
@@ -97,6 +144,22 @@ guint gatt_discover_char_desc(GAttrib *attrib, uint16_t start, uint16_t end,
 guint gatt_write_cmd(GAttrib *attrib, uint16_t handle, uint8_t *value, int vlen,
 				GDestroyNotify notify, gpointer user_data);
 
+/*
+ * Zero-copy write: returns a pointer to *vlen bytes of value space inside
+ * a reserved PDU. Encode the value there, then commit its length.
+ */
+uint8_t *gatt_write_reserve(GAttrib *attrib, uint16_t handle,
+				gboolean response, size_t *vlen,
+				struct gattrib_pdu **pdu);
+guint gatt_write_commit(GAttrib *attrib, struct gattrib_pdu *pdu,
+				size_t vlen, GAttribResultFunc func,
+				gpointer user_data);
+
+/* Write Command with a payload shared between several connections */
+guint gatt_write_cmd_buf(GAttrib *attrib, uint16_t handle,
+				struct gattrib_buf *value,
+				GDestroyNotify notify, gpointer user_data);
+
 guint gatt_read_char_by_uuid(GAttrib *attrib, uint16_t start, uint16_t end,
 				bt_uuid_t *uuid, GAttribResultFunc func,
 				gpointer user_data);
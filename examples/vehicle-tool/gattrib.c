@@ -26,9 +26,13 @@
 #include "config.h"
 #endif
 
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <glib.h>
 
 #include <stdio.h>
@@ -40,17 +44,34 @@
 #include "log.h"
 #include "att.h"
 #include "gattrib.h"
+#include "timer_wheel.h"
+#include "event_loop.h"
 
 #define GATT_TIMEOUT 30
 
+/* Default per-request timeout; the rest of the policy is in gattrib.h */
+#define GATTRIB_DEFAULT_TIMEOUT_MS	(GATT_TIMEOUT * 1000)
+
+/* PDUs fetched per recvmmsg() call and per readable wakeup */
+#define GATTRIB_RX_VECTOR	16
+#define GATTRIB_RX_MAX_BATCH	64
+#define GATTRIB_RX_PDU_LEN	ATT_MAX_VALUE_LEN
+
+/* PDUs handed to sendmmsg() at once and per writable wakeup */
+#define GATTRIB_TX_VECTOR	16
+#define GATTRIB_TX_MAX_BATCH	64
+
+/* Recycled MTU-sized commands kept per connection */
+#define GATTRIB_POOL_MAX	32
+
 struct _GAttrib {
 	GIOChannel *io;
 	int refs;
 	uint8_t *buf;
 	size_t buflen;
-	guint read_watch;
-	guint write_watch;
-	guint timeout_watch;
+	struct event_io *watch;
+	bool reading;
+	bool writing;
 	GQueue *requests;
 	GQueue *responses;
 	GSList *events;
@@ -58,6 +79,27 @@ struct _GAttrib {
 	GDestroyNotify destroy;
 	gpointer destroy_user_data;
 	bool stale;
+	uint8_t (*rx_bufs)[GATTRIB_RX_PDU_LEN];
+	struct iovec rx_iov[GATTRIB_RX_VECTOR];
+	struct mmsghdr rx_msgs[GATTRIB_RX_VECTOR];
+	struct gattrib_rx_stats rx_stats;
+	struct iovec tx_iov[GATTRIB_TX_VECTOR][2];
+	struct mmsghdr tx_msgs[GATTRIB_TX_VECTOR];
+	struct command *pool;
+	guint pool_count;
+	guint16 pool_size;
+	struct gattrib_tx_stats tx_stats;
+	guint default_timeout_ms;
+	guint max_timeouts;
+	guint late_grace_ms;
+	guint consecutive_timeouts;
+	struct gattrib_timeout_stats timeout_stats;
+	guint deadlines;		/* live commands with a deadline */
+	GAttribExpireFunc expire_func;
+	gpointer expire_user_data;
+	struct gattrib_deadline_stats deadline_stats;
+	guint max_requests;
+	guint max_responses;
 };
 
 struct command {
@@ -65,8 +107,16 @@ struct command {
 	guint8 opcode;
 	guint8 *pdu;
 	guint16 len;
+	guint16 size;			/* capacity of pdu */
+	struct gattrib_buf *payload;	/* sent after pdu, may be NULL */
+	struct command *pool_next;
 	guint8 expected;
 	bool sent;
+	bool timed_out;
+	guint timeout_ms;
+	guint64 deadline_ms;		/* monotonic, 0 = none */
+	struct wheel_timer timer;
+	struct _GAttrib *attrib;
 	GAttribResultFunc func;
 	gpointer user_data;
 	GDestroyNotify notify;
@@ -160,13 +210,114 @@ GAttrib *g_attrib_ref(GAttrib *attrib)
 	return attrib;
 }
 
+struct gattrib_buf *g_attrib_buf_new(guint16 len)
+{
+	struct gattrib_buf *buf;
+
+	buf = g_try_malloc0(sizeof(*buf) + len);
+	if (buf == NULL)
+		return NULL;
+
+	buf->refs = 1;
+	buf->len = len;
+
+	return buf;
+}
+
+struct gattrib_buf *g_attrib_buf_ref(struct gattrib_buf *buf)
+{
+	if (buf)
+		__sync_add_and_fetch(&buf->refs, 1);
+
+	return buf;
+}
+
+void g_attrib_buf_unref(struct gattrib_buf *buf)
+{
+	if (buf && __sync_sub_and_fetch(&buf->refs, 1) == 0)
+		g_free(buf);
+}
+
+static void command_free(struct command *cmd)
+{
+	g_free(cmd->pdu);
+	g_free(cmd);
+}
+
 static void command_destroy(struct command *cmd)
 {
+	struct _GAttrib *attrib = cmd->attrib;
+
+	wheel_timer_del(&cmd->timer);
+
+	if (cmd->deadline_ms && attrib)
+		attrib->deadlines--;
+
 	if (cmd->notify)
 		cmd->notify(cmd->user_data);
 
-	g_free(cmd->pdu);
-	g_free(cmd);
+	g_attrib_buf_unref(cmd->payload);
+
+	if (attrib == NULL || cmd->size != attrib->pool_size ||
+				attrib->pool_count >= GATTRIB_POOL_MAX) {
+		command_free(cmd);
+		return;
+	}
+
+	cmd->pool_next = attrib->pool;
+	attrib->pool = cmd;
+	attrib->pool_count++;
+}
+
+static void pool_flush(struct _GAttrib *attrib)
+{
+	struct command *cmd;
+
+	while ((cmd = attrib->pool)) {
+		attrib->pool = cmd->pool_next;
+		command_free(cmd);
+	}
+
+	attrib->pool_count = 0;
+}
+
+static void command_timeout(struct wheel_timer *timer, void *user_data);
+
+/* Take a command with room for at least len PDU bytes, reusing pooled ones */
+static struct command *command_alloc(struct _GAttrib *attrib, guint16 len)
+{
+	struct command *c;
+	guint8 *pdu;
+	guint16 size;
+
+	if (len <= attrib->pool_size && attrib->pool) {
+		c = attrib->pool;
+		attrib->pool = c->pool_next;
+		attrib->pool_count--;
+
+		pdu = c->pdu;
+		size = c->size;
+	} else {
+		c = g_try_new(struct command, 1);
+		if (c == NULL)
+			return NULL;
+
+		size = MAX(len, attrib->pool_size);
+		pdu = g_try_malloc(size);
+		if (pdu == NULL) {
+			g_free(c);
+			return NULL;
+		}
+	}
+
+	memset(c, 0, sizeof(*c));
+	c->pdu = pdu;
+	c->size = size;
+	c->attrib = attrib;
+	c->timeout_ms = attrib->default_timeout_ms;
+	wheel_timer_init(&c->timer, command_timeout, c);
+
+	return c;
 }
 
 static void event_destroy(struct event *evt)
@@ -200,19 +351,16 @@ static void attrib_destroy(GAttrib *attrib)
 	g_slist_free(attrib->events);
 	attrib->events = NULL;
 
-	if (attrib->timeout_watch > 0)
-		g_source_remove(attrib->timeout_watch);
-
-	if (attrib->write_watch > 0)
-		g_source_remove(attrib->write_watch);
-
-	if (attrib->read_watch > 0)
-		g_source_remove(attrib->read_watch);
+	if (attrib->watch)
+		event_io_remove(attrib->watch);
 
 	if (attrib->io)
 		g_io_channel_unref(attrib->io);
 
+	pool_flush(attrib);
+
 	g_free(attrib->buf);
+	g_free(attrib->rx_bufs);
 
 	if (attrib->destroy)
 		attrib->destroy(attrib->destroy_user_data);
@@ -257,12 +405,16 @@ gboolean g_attrib_set_destroy_function(GAttrib *attrib,
 	return TRUE;
 }
 
-static gboolean disconnect_timeout(gpointer data)
+/*
+ * Escalation: fail every request and tear the link down. Shutting the
+ * socket down makes the owner's G_IO_HUP watch run its usual disconnect
+ * path, and the peer sees the link go away as well.
+ */
+static void disconnect_timeout(struct _GAttrib *attrib)
 {
-	struct _GAttrib *attrib = data;
 	struct command *c;
 
-	g_attrib_ref(attrib);
+	attrib->timeout_stats.escalations++;
 
 	c = g_queue_pop_head(attrib->requests);
 	if (c == NULL)
@@ -281,88 +433,324 @@ static gboolean disconnect_timeout(gpointer data)
 
 done:
 	attrib->stale = true;
+	shutdown(g_io_channel_unix_get_fd(attrib->io), SHUT_RDWR);
+}
 
-	g_attrib_unref(attrib);
+static void wake_up_sender(struct _GAttrib *attrib);
+
+static void drop_timed_out(struct _GAttrib *attrib, struct command *cmd)
+{
+	g_queue_remove(attrib->requests, cmd);
+	command_destroy(cmd);
 
-	return FALSE;
+	if (!g_queue_is_empty(attrib->requests) ||
+					!g_queue_is_empty(attrib->responses))
+		wake_up_sender(attrib);
 }
 
-static gboolean can_write_data(GIOChannel *io, GIOCondition cond,
-								gpointer data)
+/*
+ * A sent request ran out of time. Only that request fails; it then stays
+ * at the head of the queue for late_grace_ms so that a late response is
+ * consumed by it instead of being matched to the next request.
+ */
+static void command_timeout(struct wheel_timer *timer, void *user_data)
 {
-	struct _GAttrib *attrib = data;
-	struct command *cmd;
-	GError *gerr = NULL;
-	gsize len;
-	GIOStatus iostat;
-	GQueue *queue;
+	struct command *cmd = user_data;
+	struct _GAttrib *attrib = cmd->attrib;
+	GAttribResultFunc func;
+
+	g_attrib_ref(attrib);
+
+	if (cmd->timed_out) {
+		drop_timed_out(attrib, cmd);
+		goto done;
+	}
+
+	attrib->timeout_stats.timeouts++;
+	attrib->consecutive_timeouts++;
+
+	if (attrib->max_timeouts > 0 &&
+			attrib->consecutive_timeouts >= attrib->max_timeouts) {
+		disconnect_timeout(attrib);
+		goto done;
+	}
+
+	func = cmd->func;
+	cmd->func = NULL;
+	cmd->timed_out = true;
+
+	if (func)
+		func(ATT_ECODE_TIMEOUT, NULL, 0, cmd->user_data);
 
 	if (attrib->stale)
-		return FALSE;
+		goto done;
 
-	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL))
-		return FALSE;
+	if (attrib->late_grace_ms > 0)
+		wheel_timer_add(&cmd->timer, attrib->late_grace_ms);
+	else
+		drop_timed_out(attrib, cmd);
 
-	queue = attrib->responses;
-	cmd = g_queue_peek_head(queue);
-	if (cmd == NULL) {
-		queue = attrib->requests;
-		cmd = g_queue_peek_head(queue);
+done:
+	g_attrib_unref(attrib);
+}
+
+static void update_tx_stats(struct _GAttrib *attrib, guint batch)
+{
+	attrib->tx_stats.pdus += batch;
+	attrib->tx_stats.last_batch = batch;
+	if (batch > attrib->tx_stats.max_batch)
+		attrib->tx_stats.max_batch = batch;
+}
+
+static void command_sent(struct _GAttrib *attrib, GQueue *queue,
+							struct command *cmd)
+{
+	if (cmd->deadline_ms)
+		attrib->deadline_stats.on_time++;
+
+	if (cmd->expected == 0) {
+		/* Callbacks may have queued new commands in front of it */
+		g_queue_remove(queue, cmd);
+		command_destroy(cmd);
+		return;
 	}
-	if (cmd == NULL)
-		return FALSE;
 
-	/*
-	 * Verify that we didn't already send this command. This can only
-	 * happen with elementes from attrib->requests.
-	 */
-	if (cmd->sent)
-		return FALSE;
+	cmd->sent = true;
 
-	iostat = g_io_channel_write_chars(io, (char *) cmd->pdu, cmd->len,
-								&len, &gerr);
-	if (iostat != G_IO_STATUS_NORMAL) {
-		if (gerr) {
-			error("%s", gerr->message);
-			g_error_free(gerr);
-		}
+	if (cmd->timeout_ms > 0)
+		wheel_timer_add(&cmd->timer, cmd->timeout_ms);
+}
 
-		return FALSE;
+/*
+ * Unlink every unsent command whose deadline has passed, then report and
+ * free them. Callbacks run only after the queue walk, so they are free to
+ * queue new commands.
+ */
+static void drop_expired(struct _GAttrib *attrib, GQueue *queue, guint64 now)
+{
+	GSList *expired = NULL, *l;
+	GList *link, *next;
+
+	for (link = g_queue_peek_head_link(queue); link; link = next) {
+		struct command *cmd = link->data;
+
+		next = link->next;
+
+		if (cmd->sent || cmd->deadline_ms == 0 || now <= cmd->deadline_ms)
+			continue;
+
+		g_queue_delete_link(queue, link);
+		expired = g_slist_prepend(expired, cmd);
 	}
 
-	if (cmd->expected == 0) {
-		g_queue_pop_head(queue);
+	expired = g_slist_reverse(expired);
+
+	for (l = expired; l; l = l->next) {
+		struct command *cmd = l->data;
+		guint64 overrun = now - cmd->deadline_ms;
+
+		attrib->deadline_stats.expired++;
+		if (overrun > attrib->deadline_stats.max_overrun_ms)
+			attrib->deadline_stats.max_overrun_ms = overrun;
+
+		if (attrib->expire_func)
+			attrib->expire_func(cmd->id, cmd->pdu, cmd->len, overrun,
+						attrib->expire_user_data);
+
+		if (cmd->func)
+			cmd->func(ATT_ECODE_TIMEOUT, NULL, 0, cmd->user_data);
+
 		command_destroy(cmd);
+	}
 
-		return TRUE;
+	g_slist_free(expired);
+}
+
+static void update_watch(struct _GAttrib *attrib)
+{
+	uint32_t events = 0;
+
+	if (attrib->watch == NULL)
+		return;
+
+	if (attrib->reading)
+		events |= EVENT_IN;
+	if (attrib->writing)
+		events |= EVENT_OUT;
+
+	event_io_modify(attrib->watch, events);
+}
+
+static void stop_writing(struct _GAttrib *attrib)
+{
+	if (!attrib->writing)
+		return;
+
+	attrib->writing = false;
+	update_watch(attrib);
+}
+
+/*
+ * Send as many queued PDUs as the socket accepts per writable wakeup.
+ * Responses go first, then requests and commands in queue order. PDUs
+ * that expect no reply are sent back to back with sendmmsg(); the batch
+ * ends with the first request since only one may be outstanding.
+ *
+ * Returns true if the batch budget ran out with PDUs left to send.
+ */
+static bool can_write_data(struct _GAttrib *attrib, int fd)
+{
+	struct command *batch[GATTRIB_TX_VECTOR];
+	struct mmsghdr *msgs = attrib->tx_msgs;
+	guint total = 0;
+
+	if (attrib->stale) {
+		stop_writing(attrib);
+		return false;
 	}
 
-	cmd->sent = true;
+	attrib->tx_stats.wakeups++;
+
+	while (total < GATTRIB_TX_MAX_BATCH) {
+		GQueue *queues[2] = { attrib->responses, attrib->requests };
+		guint nresp = 0, count = 0;
+		bool request = false;
+		int q, n, i;
+
+		/* Late vehicle commands do more harm than good, drop them */
+		if (attrib->deadlines) {
+			guint64 now = timer_wheel_now();
+
+			drop_expired(attrib, attrib->responses, now);
+			drop_expired(attrib, attrib->requests, now);
+
+			if (attrib->stale)
+				break;
+		}
+
+		for (q = 0; q < 2 && !request; q++) {
+			GList *l;
+
+			for (l = g_queue_peek_head_link(queues[q]);
+					l && count < GATTRIB_TX_VECTOR; l = l->next) {
+				struct command *cmd = l->data;
+
+				/*
+				 * Only the head of attrib->requests can have
+				 * been sent, and it is still waiting for its
+				 * response.
+				 */
+				if (cmd->sent) {
+					request = true;
+					break;
+				}
+
+				attrib->tx_iov[count][0].iov_base = cmd->pdu;
+				attrib->tx_iov[count][0].iov_len = cmd->len;
+				msgs[count].msg_hdr.msg_iovlen = 1;
+
+				/* Shared payloads go out straight from the buffer */
+				if (cmd->payload) {
+					attrib->tx_iov[count][1].iov_base =
+							cmd->payload->data;
+					attrib->tx_iov[count][1].iov_len =
+							cmd->payload->len;
+					msgs[count].msg_hdr.msg_iovlen = 2;
+				}
+
+				batch[count++] = cmd;
+
+				if (cmd->expected != 0) {
+					request = true;
+					break;
+				}
+			}
+
+			if (q == 0)
+				nresp = count;
+		}
 
-	if (attrib->timeout_watch == 0)
-		attrib->timeout_watch = g_timeout_add_seconds(GATT_TIMEOUT,
-						disconnect_timeout, attrib);
+		if (count == 0)
+			break;
 
-	return FALSE;
+		n = sendmmsg(fd, msgs, count, MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				attrib->tx_stats.eagain++;
+				goto out;
+			}
+
+			error("sendmmsg: %s", strerror(errno));
+			if (total > 0)
+				update_tx_stats(attrib, total);
+			stop_writing(attrib);
+			return false;
+		}
+
+		for (i = 0; i < n; i++)
+			command_sent(attrib, (guint) i < nresp ?
+				attrib->responses : attrib->requests, batch[i]);
+
+		total += n;
+
+		/* Socket buffer is full, wait until it is writable again */
+		if ((guint) n < count) {
+			attrib->tx_stats.eagain++;
+			goto out;
+		}
+
+		if (request)
+			break;
+	}
+
+	if (total > 0)
+		update_tx_stats(attrib, total);
+
+	/* Stop watching unless the batch budget ran out with work left */
+	if (total >= GATTRIB_TX_MAX_BATCH)
+		return true;
+
+	stop_writing(attrib);
+
+	return false;
+
+out:
+	if (total > 0)
+		update_tx_stats(attrib, total);
+
+	return false;
 }
 
-static void destroy_sender(gpointer data)
+void g_attrib_get_tx_stats(GAttrib *attrib, struct gattrib_tx_stats *stats)
 {
-	struct _GAttrib *attrib = data;
+	if (attrib == NULL || stats == NULL)
+		return;
 
-	attrib->write_watch = 0;
-	g_attrib_unref(attrib);
+	*stats = attrib->tx_stats;
+}
+
+void g_attrib_get_queue_stats(GAttrib *attrib,
+				struct gattrib_queue_stats *stats)
+{
+	if (attrib == NULL || stats == NULL)
+		return;
+
+	stats->requests = g_queue_get_length(attrib->requests);
+	stats->responses = g_queue_get_length(attrib->responses);
+	stats->max_requests = attrib->max_requests;
+	stats->max_responses = attrib->max_responses;
 }
 
 static void wake_up_sender(struct _GAttrib *attrib)
 {
-	if (attrib->write_watch > 0)
+	if (attrib->writing || attrib->watch == NULL)
 		return;
 
-	attrib = g_attrib_ref(attrib);
-	attrib->write_watch = g_io_add_watch_full(attrib->io,
-				G_PRIORITY_DEFAULT, G_IO_OUT,
-				can_write_data, attrib, destroy_sender);
+	attrib->writing = true;
+	update_watch(attrib);
 }
 
 static bool match_event(struct event *evt, const uint8_t *pdu, gsize len)
@@ -389,31 +777,12 @@ static bool match_event(struct event *evt, const uint8_t *pdu, gsize len)
 	return false;
 }
 
-static gboolean received_data(GIOChannel *io, GIOCondition cond, gpointer data)
+static gboolean process_pdu(struct _GAttrib *attrib, const uint8_t *buf,
+								gsize len)
 {
-	struct _GAttrib *attrib = data;
 	struct command *cmd = NULL;
 	GSList *l;
-	uint8_t buf[512], status;
-	gsize len;
-	GIOStatus iostat;
-
-	if (attrib->stale)
-		return FALSE;
-
-	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
-		attrib->read_watch = 0;
-		return FALSE;
-	}
-
-	memset(buf, 0, sizeof(buf));
-
-	iostat = g_io_channel_read_chars(io, (char *) buf, sizeof(buf),
-								&len, NULL);
-	if (iostat != G_IO_STATUS_NORMAL) {
-		status = ATT_ECODE_IO;
-		goto done;
-	}
+	uint8_t status;
 
 	for (l = attrib->events; l; l = l->next) {
 		struct event *evt = l->data;
@@ -425,19 +794,24 @@ static gboolean received_data(GIOChannel *io, GIOCondition cond, gpointer data)
 	if (!is_response(buf[0]))
 		return TRUE;
 
-	if (attrib->timeout_watch > 0) {
-		g_source_remove(attrib->timeout_watch);
-		attrib->timeout_watch = 0;
-	}
-
 	cmd = g_queue_pop_head(attrib->requests);
 	if (cmd == NULL) {
 		/* Keep the watch if we have events to report */
 		return attrib->events != NULL;
 	}
 
+	wheel_timer_del(&cmd->timer);
+	attrib->consecutive_timeouts = 0;
+
+	if (cmd->timed_out) {
+		/* Its requester already got ATT_ECODE_TIMEOUT */
+		attrib->timeout_stats.late_responses++;
+		status = 0;
+		goto done;
+	}
+
 	if (buf[0] == ATT_OP_ERROR) {
-		status = buf[4];
+		status = (len > 4) ? buf[4] : ATT_ECODE_IO;
 		goto done;
 	}
 
@@ -453,16 +827,154 @@ done:
 					!g_queue_is_empty(attrib->responses))
 		wake_up_sender(attrib);
 
-	if (cmd) {
-		if (cmd->func)
-			cmd->func(status, buf, len, cmd->user_data);
+	if (cmd->func)
+		cmd->func(status, buf, len, cmd->user_data);
 
-		command_destroy(cmd);
-	}
+	command_destroy(cmd);
 
 	return TRUE;
 }
 
+static void update_rx_stats(struct _GAttrib *attrib, guint batch)
+{
+	struct gattrib_rx_stats *stats = &attrib->rx_stats;
+	guint bucket = 0;
+
+	stats->wakeups++;
+	stats->pdus += batch;
+	stats->last_batch = batch;
+	if (batch > stats->max_batch)
+		stats->max_batch = batch;
+
+	while (batch > 0 && bucket < GATTRIB_RX_HIST_BUCKETS - 1) {
+		batch >>= 1;
+		bucket++;
+	}
+	stats->batch_hist[bucket]++;
+}
+
+static void stop_reading(struct _GAttrib *attrib)
+{
+	if (!attrib->reading)
+		return;
+
+	attrib->reading = false;
+	update_watch(attrib);
+}
+
+/*
+ * Drain every PDU queued on the socket, up to GATTRIB_RX_MAX_BATCH, so a
+ * burst of notifications costs one main loop iteration instead of one per
+ * packet. ATT runs over SOCK_SEQPACKET, so each message is exactly one PDU.
+ *
+ * Returns true if the batch budget ran out before the socket was drained.
+ */
+static bool received_data(struct _GAttrib *attrib, int fd)
+{
+	struct mmsghdr *msgs = attrib->rx_msgs;
+	gboolean keep = TRUE;
+	bool drained = false;
+	guint batch = 0;
+	int n, i;
+
+	if (attrib->stale) {
+		stop_reading(attrib);
+		return false;
+	}
+
+	while (batch < GATTRIB_RX_MAX_BATCH && !attrib->stale) {
+		for (i = 0; i < GATTRIB_RX_VECTOR; i++)
+			msgs[i].msg_hdr.msg_iov->iov_len = GATTRIB_RX_PDU_LEN;
+
+		n = recvmmsg(fd, msgs, GATTRIB_RX_VECTOR, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				error("recvmmsg: %s", strerror(errno));
+			drained = true;
+			break;
+		}
+
+		for (i = 0; i < n && !attrib->stale; i++) {
+			gsize len = msgs[i].msg_len;
+
+			if (len == 0)
+				continue;
+
+			batch++;
+			keep = process_pdu(attrib, attrib->rx_bufs[i], len);
+			if (!keep)
+				break;
+		}
+
+		if (!keep)
+			break;
+
+		if (n < GATTRIB_RX_VECTOR) {
+			drained = true;
+			break;
+		}
+	}
+
+	update_rx_stats(attrib, batch);
+
+	if (!keep || attrib->stale) {
+		stop_reading(attrib);
+		return false;
+	}
+
+	return !drained;
+}
+
+static bool attrib_io_cb(struct event_io *io, int fd, uint32_t events,
+							void *user_data)
+{
+	struct _GAttrib *attrib = user_data;
+	bool again = false;
+
+	if (events & (EVENT_HUP | EVENT_ERR)) {
+		event_io_remove(io);
+		attrib->watch = NULL;
+		attrib->reading = attrib->writing = false;
+		return false;
+	}
+
+	/* Callbacks may drop the last external reference */
+	g_attrib_ref(attrib);
+
+	if ((events & EVENT_IN) && attrib->reading)
+		again = received_data(attrib, fd);
+
+	if ((events & EVENT_OUT) && attrib->writing)
+		again = can_write_data(attrib, fd) || again;
+
+	g_attrib_unref(attrib);
+
+	return again;
+}
+
+void g_attrib_get_rx_stats(GAttrib *attrib, struct gattrib_rx_stats *stats)
+{
+	if (attrib == NULL || stats == NULL)
+		return;
+
+	*stats = attrib->rx_stats;
+}
+
+static int socket_domain(GIOChannel *io)
+{
+	int domain = AF_UNSPEC;
+	socklen_t len = sizeof(domain);
+
+	if (getsockopt(g_io_channel_unix_get_fd(io), SOL_SOCKET, SO_DOMAIN,
+							&domain, &len) < 0)
+		return AF_UNSPEC;
+
+	return domain;
+}
+
 GAttrib *g_attrib_new(GIOChannel *io)
 {
 	struct _GAttrib *attrib;
@@ -470,16 +982,23 @@ GAttrib *g_attrib_new(GIOChannel *io)
 	uint16_t att_mtu;
 	uint16_t cid;
 	GError *gerr = NULL;
+	int i;
 
 	g_io_channel_set_encoding(io, NULL, NULL);
 	g_io_channel_set_buffered(io, FALSE);
 
-	bt_io_get(io, &gerr, BT_IO_OPT_IMTU, &imtu,
+	if (socket_domain(io) == AF_UNIX) {
+		/* Local peers such as simulated vehicles behave like LE */
+		imtu = ATT_DEFAULT_LE_MTU;
+		cid = ATT_CID;
+	} else {
+		bt_io_get(io, &gerr, BT_IO_OPT_IMTU, &imtu,
 				BT_IO_OPT_CID, &cid, BT_IO_OPT_INVALID);
-	if (gerr) {
-		error("%s", gerr->message);
-		g_error_free(gerr);
-		return NULL;
+		if (gerr) {
+			error("%s", gerr->message);
+			g_error_free(gerr);
+			return NULL;
+		}
 	}
 
 	attrib = g_try_new0(struct _GAttrib, 1);
@@ -490,43 +1009,48 @@ GAttrib *g_attrib_new(GIOChannel *io)
 
 	attrib->buf = g_malloc0(att_mtu);
 	attrib->buflen = att_mtu;
+	attrib->pool_size = att_mtu;
+
+	attrib->rx_bufs = g_malloc0(GATTRIB_RX_VECTOR * GATTRIB_RX_PDU_LEN);
+	for (i = 0; i < GATTRIB_RX_VECTOR; i++) {
+		attrib->rx_iov[i].iov_base = attrib->rx_bufs[i];
+		attrib->rx_iov[i].iov_len = GATTRIB_RX_PDU_LEN;
+		attrib->rx_msgs[i].msg_hdr.msg_iov = &attrib->rx_iov[i];
+		attrib->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (i = 0; i < GATTRIB_TX_VECTOR; i++) {
+		attrib->tx_msgs[i].msg_hdr.msg_iov = attrib->tx_iov[i];
+		attrib->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	attrib->default_timeout_ms = GATTRIB_DEFAULT_TIMEOUT_MS;
+	attrib->max_timeouts = GATTRIB_DEFAULT_MAX_TIMEOUTS;
+	attrib->late_grace_ms = GATTRIB_DEFAULT_LATE_GRACE_MS;
 
 	attrib->io = g_io_channel_ref(io);
 	attrib->requests = g_queue_new();
 	attrib->responses = g_queue_new();
 
-	attrib->read_watch = g_io_add_watch(attrib->io,
-			G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-			received_data, attrib);
+	attrib->reading = true;
+	attrib->watch = event_io_add(g_io_channel_unix_get_fd(io), EVENT_IN,
+							attrib_io_cb, attrib);
+	if (attrib->watch == NULL) {
+		attrib_destroy(attrib);
+		return NULL;
+	}
 
 	return g_attrib_ref(attrib);
 }
 
-guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
-			GAttribResultFunc func, gpointer user_data,
-			GDestroyNotify notify)
+static guint command_enqueue(struct _GAttrib *attrib, guint id,
+							struct command *c)
 {
-	struct command *c;
 	GQueue *queue;
-	uint8_t opcode;
-
-	if (attrib->stale)
-		return 0;
-
-	c = g_try_new0(struct command, 1);
-	if (c == NULL)
-		return 0;
-
-	opcode = pdu[0];
+	uint8_t opcode = c->pdu[0];
 
 	c->opcode = opcode;
 	c->expected = opcode2expected(opcode);
-	c->pdu = g_malloc(len);
-	memcpy(c->pdu, pdu, len);
-	c->len = len;
-	c->func = func;
-	c->user_data = user_data;
-	c->notify = notify;
 
 	if (is_response(opcode))
 		queue = attrib->responses;
@@ -553,9 +1077,107 @@ guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
 	if (g_queue_get_length(queue) == 1)
 		wake_up_sender(attrib);
 
+	if (queue == attrib->requests)
+		attrib->max_requests = MAX(attrib->max_requests,
+					g_queue_get_length(queue));
+	else
+		attrib->max_responses = MAX(attrib->max_responses,
+					g_queue_get_length(queue));
+
 	return c->id;
 }
 
+guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
+			GAttribResultFunc func, gpointer user_data,
+			GDestroyNotify notify)
+{
+	struct command *c;
+
+	if (attrib->stale)
+		return 0;
+
+	c = command_alloc(attrib, len);
+	if (c == NULL)
+		return 0;
+
+	memcpy(c->pdu, pdu, len);
+	c->len = len;
+	c->func = func;
+	c->user_data = user_data;
+	c->notify = notify;
+
+	return command_enqueue(attrib, id, c);
+}
+
+guint8 *g_attrib_reserve(GAttrib *attrib, guint16 len,
+						struct gattrib_pdu **pdu)
+{
+	struct command *c;
+
+	if (attrib == NULL || pdu == NULL || attrib->stale)
+		return NULL;
+
+	c = command_alloc(attrib, len);
+	if (c == NULL)
+		return NULL;
+
+	*pdu = (struct gattrib_pdu *) c;
+
+	return c->pdu;
+}
+
+guint g_attrib_commit(GAttrib *attrib, struct gattrib_pdu *pdu, guint16 len,
+			GAttribResultFunc func, gpointer user_data,
+			GDestroyNotify notify)
+{
+	struct command *c = (struct command *) pdu;
+
+	if (attrib->stale || len == 0 || len > c->size) {
+		command_destroy(c);
+		return 0;
+	}
+
+	c->len = len;
+	c->func = func;
+	c->user_data = user_data;
+	c->notify = notify;
+
+	return command_enqueue(attrib, 0, c);
+}
+
+void g_attrib_abort(GAttrib *attrib, struct gattrib_pdu *pdu)
+{
+	if (pdu)
+		command_destroy((struct command *) pdu);
+}
+
+guint g_attrib_send_buf(GAttrib *attrib, const guint8 *hdr, guint16 hdrlen,
+			struct gattrib_buf *payload,
+			GAttribResultFunc func, gpointer user_data,
+			GDestroyNotify notify)
+{
+	struct command *c;
+
+	if (attrib->stale || hdrlen == 0)
+		return 0;
+
+	if (hdrlen + payload->len > attrib->buflen)
+		return 0;
+
+	c = command_alloc(attrib, hdrlen);
+	if (c == NULL)
+		return 0;
+
+	memcpy(c->pdu, hdr, hdrlen);
+	c->len = hdrlen;
+	c->payload = g_attrib_buf_ref(payload);
+	c->func = func;
+	c->user_data = user_data;
+	c->notify = notify;
+
+	return command_enqueue(attrib, 0, c);
+}
+
 static int command_cmp_by_id(gconstpointer a, gconstpointer b)
 {
 	const struct command *cmd = a;
@@ -641,6 +1263,113 @@ gboolean g_attrib_cancel_all(GAttrib *attrib)
 	return ret;
 }
 
+gboolean g_attrib_set_timeout(GAttrib *attrib, guint id, guint timeout_ms)
+{
+	struct command *cmd;
+	GList *l;
+
+	if (attrib == NULL || attrib->requests == NULL)
+		return FALSE;
+
+	l = g_queue_find_custom(attrib->requests, GUINT_TO_POINTER(id),
+							command_cmp_by_id);
+	if (l == NULL)
+		return FALSE;
+
+	cmd = l->data;
+	if (cmd->timed_out)
+		return FALSE;
+
+	cmd->timeout_ms = timeout_ms;
+
+	/* Already on the air, restart its clock with the new deadline */
+	if (cmd->sent) {
+		if (timeout_ms > 0)
+			wheel_timer_add(&cmd->timer, timeout_ms);
+		else
+			wheel_timer_del(&cmd->timer);
+	}
+
+	return TRUE;
+}
+
+gboolean g_attrib_set_deadline(GAttrib *attrib, guint id, guint64 deadline_ms)
+{
+	struct command *cmd;
+	GList *l = NULL;
+
+	if (attrib == NULL)
+		return FALSE;
+
+	if (attrib->requests)
+		l = g_queue_find_custom(attrib->requests, GUINT_TO_POINTER(id),
+							command_cmp_by_id);
+	if (l == NULL && attrib->responses)
+		l = g_queue_find_custom(attrib->responses, GUINT_TO_POINTER(id),
+							command_cmp_by_id);
+	if (l == NULL)
+		return FALSE;
+
+	cmd = l->data;
+	if (cmd->sent)
+		return FALSE;
+
+	if (cmd->deadline_ms == 0 && deadline_ms != 0)
+		attrib->deadlines++;
+	else if (cmd->deadline_ms != 0 && deadline_ms == 0)
+		attrib->deadlines--;
+
+	cmd->deadline_ms = deadline_ms;
+
+	return TRUE;
+}
+
+void g_attrib_set_expire_function(GAttrib *attrib, GAttribExpireFunc func,
+							gpointer user_data)
+{
+	if (attrib == NULL)
+		return;
+
+	attrib->expire_func = func;
+	attrib->expire_user_data = user_data;
+}
+
+void g_attrib_get_deadline_stats(GAttrib *attrib,
+				struct gattrib_deadline_stats *stats)
+{
+	if (attrib == NULL || stats == NULL)
+		return;
+
+	*stats = attrib->deadline_stats;
+}
+
+void g_attrib_set_default_timeout(GAttrib *attrib, guint timeout_ms)
+{
+	if (attrib == NULL)
+		return;
+
+	attrib->default_timeout_ms = timeout_ms;
+}
+
+void g_attrib_set_timeout_policy(GAttrib *attrib, guint max_timeouts,
+							guint late_grace_ms)
+{
+	if (attrib == NULL)
+		return;
+
+	attrib->max_timeouts = max_timeouts;
+	attrib->late_grace_ms = late_grace_ms;
+}
+
+void g_attrib_get_timeout_stats(GAttrib *attrib,
+				struct gattrib_timeout_stats *stats)
+{
+	if (attrib == NULL || stats == NULL)
+		return;
+
+	*stats = attrib->timeout_stats;
+}
+
 gboolean g_attrib_set_debug(GAttrib *attrib,
 		GAttribDebugFunc func, gpointer user_data)
 {
@@ -666,6 +1395,10 @@ gboolean g_attrib_set_mtu(GAttrib *attrib, int mtu)
 
 	attrib->buflen = mtu;
 
+	/* Pooled commands are sized for the old MTU */
+	pool_flush(attrib);
+	attrib->pool_size = mtu;
+
 	return TRUE;
 }
 
@@ -35,9 +35,54 @@ extern "C" {
 struct _GAttrib;
 typedef struct _GAttrib GAttrib;
 
+/* Defaults of g_attrib_set_timeout_policy() */
+#define GATTRIB_DEFAULT_MAX_TIMEOUTS	3
+#define GATTRIB_DEFAULT_LATE_GRACE_MS	250
+
+/* batch_hist[0] counts empty wakeups, batch_hist[n] batches of 2^(n-1)..2^n-1 PDUs */
+#define GATTRIB_RX_HIST_BUCKETS 8
+
+struct gattrib_rx_stats {
+	guint64 wakeups;
+	guint64 pdus;
+	guint last_batch;
+	guint max_batch;
+	guint64 batch_hist[GATTRIB_RX_HIST_BUCKETS];
+};
+
+struct gattrib_timeout_stats {
+	guint64 timeouts;
+	guint64 late_responses;
+	guint64 escalations;
+};
+
+struct gattrib_deadline_stats {
+	guint64 expired;
+	guint64 on_time;
+	guint64 max_overrun_ms;
+};
+
+struct gattrib_tx_stats {
+	guint64 wakeups;
+	guint64 pdus;
+	guint64 eagain;
+	guint last_batch;
+	guint max_batch;
+};
+
+/* Current queue lengths, and the longest they have been */
+struct gattrib_queue_stats {
+	guint requests;
+	guint responses;
+	guint max_requests;
+	guint max_responses;
+};
+
 typedef void (*GAttribResultFunc) (guint8 status, const guint8 *pdu,
 					guint16 len, gpointer user_data);
 typedef void (*GAttribDisconnectFunc)(gpointer user_data);
+typedef void (*GAttribExpireFunc)(guint id, const guint8 *pdu, guint16 len,
+					guint64 overrun_ms, gpointer user_data);
 typedef void (*GAttribDebugFunc)(const char *str, gpointer user_data);
 typedef void (*GAttribNotifyFunc)(const guint8 *pdu, guint16 len,
 							gpointer user_data);
@@ -55,9 +100,70 @@ guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
 			GAttribResultFunc func, gpointer user_data,
 			GDestroyNotify notify);
 
+/*
+ * Zero-copy send: reserve a PDU slot of up to len bytes, encode straight
+ * into it and commit the actual length. A reserved slot must be either
+ * committed or aborted.
+ */
+struct gattrib_pdu;
+
+guint8 *g_attrib_reserve(GAttrib *attrib, guint16 len,
+						struct gattrib_pdu **pdu);
+guint g_attrib_commit(GAttrib *attrib, struct gattrib_pdu *pdu, guint16 len,
+			GAttribResultFunc func, gpointer user_data,
+			GDestroyNotify notify);
+void g_attrib_abort(GAttrib *attrib, struct gattrib_pdu *pdu);
+
+/*
+ * Refcounted payload for sending the same value on many connections. Each
+ * send copies only the PDU header; the payload is written from the shared
+ * buffer and released once the last PDU referencing it has gone out.
+ */
+struct gattrib_buf {
+	int refs;
+	guint16 len;
+	guint8 data[];
+};
+
+struct gattrib_buf *g_attrib_buf_new(guint16 len);
+struct gattrib_buf *g_attrib_buf_ref(struct gattrib_buf *buf);
+void g_attrib_buf_unref(struct gattrib_buf *buf);
+
+guint g_attrib_send_buf(GAttrib *attrib, const guint8 *hdr, guint16 hdrlen,
+			struct gattrib_buf *payload,
+			GAttribResultFunc func, gpointer user_data,
+			GDestroyNotify notify);
+
 gboolean g_attrib_cancel(GAttrib *attrib, guint id);
 gboolean g_attrib_cancel_all(GAttrib *attrib);
 
+/*
+ * Requests time out individually. An expired request completes with
+ * ATT_ECODE_TIMEOUT and the queue moves on after late_grace_ms; after
+ * max_timeouts consecutive timeouts (0 = never) every request is aborted
+ * and the link is shut down, so the owner's G_IO_HUP watch disconnects.
+ * A timeout of 0 disables the deadline.
+ */
+gboolean g_attrib_set_timeout(GAttrib *attrib, guint id, guint timeout_ms);
+void g_attrib_set_default_timeout(GAttrib *attrib, guint timeout_ms);
+void g_attrib_set_timeout_policy(GAttrib *attrib, guint max_timeouts,
+							guint late_grace_ms);
+void g_attrib_get_timeout_stats(GAttrib *attrib,
+				struct gattrib_timeout_stats *stats);
+
+/*
+ * Commands may carry an absolute CLOCK_MONOTONIC deadline in ms (see
+ * timer_wheel_now()). A command still queued when its deadline passes is
+ * dropped before transmission: the expire function is told, a request
+ * completes with ATT_ECODE_TIMEOUT and the command is freed. Only commands
+ * not yet sent can be given a deadline; 0 clears it.
+ */
+gboolean g_attrib_set_deadline(GAttrib *attrib, guint id, guint64 deadline_ms);
+void g_attrib_set_expire_function(GAttrib *attrib, GAttribExpireFunc func,
+							gpointer user_data);
+void g_attrib_get_deadline_stats(GAttrib *attrib,
+				struct gattrib_deadline_stats *stats);
+
 gboolean g_attrib_set_debug(GAttrib *attrib,
 		GAttribDebugFunc func, gpointer user_data);
 
@@ -70,6 +176,11 @@ gboolean g_attrib_is_encrypted(GAttrib *attrib);
 uint8_t *g_attrib_get_buffer(GAttrib *attrib, size_t *len);
 gboolean g_attrib_set_mtu(GAttrib *attrib, int mtu);
 
+void g_attrib_get_rx_stats(GAttrib *attrib, struct gattrib_rx_stats *stats);
+void g_attrib_get_tx_stats(GAttrib *attrib, struct gattrib_tx_stats *stats);
+void g_attrib_get_queue_stats(GAttrib *attrib,
+				struct gattrib_queue_stats *stats);
+
 gboolean g_attrib_unregister(GAttrib *attrib, guint id);
 gboolean g_attrib_unregister_all(GAttrib *attrib);
 
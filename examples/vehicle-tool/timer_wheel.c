@@ -0,0 +1,230 @@
+/*
+ *
+ *  Copyright (C) 2014  Anki, Inc.
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "event_loop.h"
+#include "timer_wheel.h"
+
+struct timer_wheel {
+	struct wheel_timer *slots[TIMER_WHEEL_SLOTS];
+	uint64_t tick;			/* last processed tick */
+	unsigned int count;
+	unsigned int source;
+	uint64_t wake_tick;		/* tick the source is armed for */
+	bool started;
+};
+
+static struct timer_wheel wheel;
+
+uint64_t timer_wheel_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool wheel_tick(void *user_data);
+
+static void wheel_arm(uint64_t tick)
+{
+	uint64_t now = timer_wheel_now();
+	uint64_t wake = tick * TIMER_WHEEL_TICK_MS;
+
+	if (wheel.source != 0)
+		event_timeout_remove(wheel.source);
+
+	wheel.wake_tick = tick;
+	wheel.source = event_timeout_add(wake > now ? wake - now : 0,
+							wheel_tick, NULL);
+}
+
+/*
+ * Arm the source for the first slot holding a timer. Timers more than one
+ * revolution out only cause a wakeup per revolution. Cancelled timers may
+ * leave the source armed early, which costs one spurious wakeup.
+ */
+static void wheel_schedule(void)
+{
+	uint64_t tick;
+
+	if (wheel.count == 0)
+		return;
+
+	for (tick = wheel.tick + 1; tick <= wheel.tick + TIMER_WHEEL_SLOTS; tick++) {
+		if (wheel.slots[tick % TIMER_WHEEL_SLOTS])
+			break;
+	}
+
+	wheel_arm(tick);
+}
+
+static bool wheel_tick(void *user_data)
+{
+	/* One-shot: rearmed below for the next pending timer, if any */
+	wheel.source = 0;
+
+	/* Callbacks may arm timers, but others can still be due sooner */
+	timer_wheel_advance(timer_wheel_now());
+	wheel_schedule();
+
+	return false;
+}
+
+static void link_timer(struct wheel_timer **head, struct wheel_timer *timer)
+{
+	timer->next = *head;
+	if (timer->next)
+		timer->next->pprev = &timer->next;
+	timer->pprev = head;
+	*head = timer;
+}
+
+static void unlink_timer(struct wheel_timer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+void wheel_timer_init(struct wheel_timer *timer, wheel_timer_func_t func,
+							void *user_data)
+{
+	memset(timer, 0, sizeof(*timer));
+	timer->func = func;
+	timer->user_data = user_data;
+}
+
+bool wheel_timer_pending(const struct wheel_timer *timer)
+{
+	return timer->pprev != NULL;
+}
+
+void wheel_timer_add(struct wheel_timer *timer, unsigned int timeout_ms)
+{
+	uint64_t now = timer_wheel_now();
+	uint64_t tick;
+
+	if (wheel_timer_pending(timer))
+		wheel_timer_del(timer);
+
+	/* Nothing pending, skip straight to the current tick */
+	if (!wheel.started || wheel.count == 0) {
+		wheel.tick = now / TIMER_WHEEL_TICK_MS;
+		wheel.started = true;
+	}
+
+	timer->expires = now + timeout_ms;
+
+	tick = (timer->expires + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+	if (tick <= wheel.tick)
+		tick = wheel.tick + 1;
+
+	link_timer(&wheel.slots[tick % TIMER_WHEEL_SLOTS], timer);
+	wheel.count++;
+
+	if (wheel.source == 0 || tick < wheel.wake_tick)
+		wheel_arm(tick);
+}
+
+void wheel_timer_del(struct wheel_timer *timer)
+{
+	if (!wheel_timer_pending(timer))
+		return;
+
+	unlink_timer(timer);
+	wheel.count--;
+}
+
+/* Move timers from a slot that are due by limit to the expired list */
+static void collect_slot(struct wheel_timer **slot, uint64_t limit,
+					struct wheel_timer **expired)
+{
+	struct wheel_timer *timer = *slot, *next;
+
+	for (; timer; timer = next) {
+		next = timer->next;
+
+		/* Timers more than one wheel revolution out stay put */
+		if (timer->expires > limit)
+			continue;
+
+		unlink_timer(timer);
+		link_timer(expired, timer);
+	}
+}
+
+unsigned int timer_wheel_advance(uint64_t now_ms)
+{
+	struct wheel_timer *expired = NULL;
+	uint64_t now_tick = now_ms / TIMER_WHEEL_TICK_MS;
+	unsigned int fired = 0;
+	int i;
+
+	if (!wheel.started || now_tick <= wheel.tick)
+		return 0;
+
+	if (now_tick - wheel.tick >= TIMER_WHEEL_SLOTS) {
+		/* Fell behind by a whole revolution, scan everything once */
+		for (i = 0; i < TIMER_WHEEL_SLOTS; i++)
+			collect_slot(&wheel.slots[i], now_ms, &expired);
+		wheel.tick = now_tick;
+	} else {
+		while (wheel.tick < now_tick) {
+			wheel.tick++;
+			collect_slot(&wheel.slots[wheel.tick % TIMER_WHEEL_SLOTS],
+					wheel.tick * TIMER_WHEEL_TICK_MS,
+					&expired);
+		}
+	}
+
+	/*
+	 * Callbacks may arm or cancel any timer, including others on the
+	 * expired list, so pop one at a time.
+	 */
+	while (expired) {
+		struct wheel_timer *timer = expired;
+
+		unlink_timer(timer);
+		wheel.count--;
+		fired++;
+
+		timer->func(timer, timer->user_data);
+	}
+
+	return fired;
+}
+
+unsigned int timer_wheel_count(void)
+{
+	return wheel.count;
+}
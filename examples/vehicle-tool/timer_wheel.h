@@ -0,0 +1,75 @@
+/*
+ *
+ *  Copyright (C) 2014  Anki, Inc.
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __TIMER_WHEEL_H
+#define __TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Hashed timer wheel shared by all connections in the process.
+ *
+ * Timers are intrusive and owned by the caller, so arming and cancelling
+ * never allocates and costs O(1). A single one-shot main loop timeout is
+ * armed for the first tick that holds a timer, instead of one event source
+ * per timer or a periodic tick, so a pending timeout costs no wakeups
+ * until it is due.
+ */
+
+#define TIMER_WHEEL_TICK_MS	10
+#define TIMER_WHEEL_SLOTS	256
+
+struct wheel_timer;
+
+typedef void (*wheel_timer_func_t)(struct wheel_timer *timer,
+							void *user_data);
+
+struct wheel_timer {
+	struct wheel_timer *next;
+	struct wheel_timer **pprev;
+	uint64_t expires;		/* monotonic ms */
+	wheel_timer_func_t func;
+	void *user_data;
+};
+
+void wheel_timer_init(struct wheel_timer *timer, wheel_timer_func_t func,
+							void *user_data);
+
+/* (Re)arm timer to fire timeout_ms from now, rounded up to a tick */
+void wheel_timer_add(struct wheel_timer *timer, unsigned int timeout_ms);
+void wheel_timer_del(struct wheel_timer *timer);
+bool wheel_timer_pending(const struct wheel_timer *timer);
+
+uint64_t timer_wheel_now(void);
+
+/* Fire every timer that expired by now_ms. Returns the number fired. */
+unsigned int timer_wheel_advance(uint64_t now_ms);
+unsigned int timer_wheel_count(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
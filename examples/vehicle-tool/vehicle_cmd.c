@@ -43,6 +43,8 @@
 #include "att.h"
 #include "gattrib.h"
 #include "gatt.h"
+#include "timer_wheel.h"
+#include "event_loop.h"
 #include "utils.h"
 #include "client/display.h"
 
@@ -61,6 +63,7 @@ static int opt_psm = 0;
 static int opt_mtu = 0;
 static int start;
 static int end;
+static unsigned int drive_deadline_ms = 0;
 
 
 typedef struct anki_vehicle {
@@ -167,6 +170,13 @@ static void events_handler(const uint8_t *pdu, uint16_t len, gpointer user_data)
         }
 }
 
+static void expired_cb(guint id, const guint8 *pdu, guint16 len,
+				guint64 overrun_ms, gpointer user_data)
+{
+	error("Dropped command %u, %llu ms past its deadline\n", id,
+					(unsigned long long) overrun_ms);
+}
+
 static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
 {
 	if (err) {
@@ -180,6 +190,7 @@ static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
 						events_handler, attrib, NULL);
 	g_attrib_register(attrib, ATT_OP_HANDLE_IND, GATTRIB_ALL_HANDLES,
 						events_handler, attrib, NULL);
+	g_attrib_set_expire_function(attrib, expired_cb, NULL);
 	set_state(STATE_CONNECTED);
 	rl_printf("Connection successful\n");
 
@@ -202,45 +213,61 @@ static void disconnect_io()
 	set_state(STATE_DISCONNECTED);
 }
 
-static void discover_char_cb(GSList *characteristics, guint8 status, gpointer user_data)
-{
-	GSList *l;
+enum {
+	ANKI_CHAR_READ,
+	ANKI_CHAR_WRITE,
+	ANKI_CHAR_COUNT
+};
 
-	if (status) {
-		error("Discover all characteristics failed: %s\n",
-							att_ecode2str(status));
-		return;
-	}
+static struct gatt_char_match anki_chars[ANKI_CHAR_COUNT];
 
-	for (l = characteristics; l; l = l->next) {
-		struct gatt_char *chars = l->data;
+static void print_char(const char *name, const struct gatt_char *chars)
+{
+	rl_printf("Anki %s Characteristic: %s ", name, chars->uuid);
+	rl_printf("[handle: 0x%04x, char properties: 0x%02x, char value "
+			"handle: 0x%04x]\n", chars->handle,
+			chars->properties, chars->value_handle);
+}
 
-                if (strncasecmp(chars->uuid, ANKI_STR_CHR_READ_UUID, strlen(ANKI_STR_CHR_READ_UUID)) == 0) {
-                        memmove(&(vehicle.read_char), chars, sizeof(struct gatt_char));
-                        rl_printf("Anki Read Characteristic: %s ", chars->uuid);
-		        rl_printf("[handle: 0x%04x, char properties: 0x%02x, char value "
-				"handle: 0x%04x]\n", chars->handle,
-				chars->properties, chars->value_handle);
-                }
+static void enable_notify_cb(guint8 status, const guint8 *pdu, guint16 plen,
+							gpointer user_data)
+{
+	if (status != 0)
+		error("Enabling notifications failed: %s\n",
+						att_ecode2str(status));
+}
 
-                if (strncasecmp(chars->uuid, ANKI_STR_CHR_WRITE_UUID, strlen(ANKI_STR_CHR_WRITE_UUID)) == 0) {
-                        memmove(&(vehicle.write_char), chars, sizeof(struct gatt_char));
-                        rl_printf("Anki Write Characteristic: %s ", chars->uuid);
-		        rl_printf("[handle: 0x%04x, char properties: 0x%02x, char value "
-				"handle: 0x%04x]\n", chars->handle,
-				chars->properties, chars->value_handle);
-                }
+static void discover_char_cb(guint8 status, unsigned int index,
+							gpointer user_data)
+{
+	uint8_t notify_cmd[] = { 0x01, 0x00 };
+
+	switch (index) {
+	case ANKI_CHAR_READ:
+		memcpy(&vehicle.read_char, &anki_chars[index].chr,
+						sizeof(struct gatt_char));
+		print_char("Read", &vehicle.read_char);
+
+		/*
+		 * Turn on notifications without waiting for the rest of
+		 * discovery. The vehicle keeps the client characteristic
+		 * configuration descriptor right after the read value.
+		 */
+		gatt_write_char(attrib, vehicle.read_char.value_handle + 1,
+				notify_cmd, sizeof(notify_cmd),
+				enable_notify_cb, NULL);
+		break;
+	case ANKI_CHAR_WRITE:
+		memcpy(&vehicle.write_char, &anki_chars[index].chr,
+						sizeof(struct gatt_char));
+		print_char("Write", &vehicle.write_char);
+		break;
+	default:
+		if (status)
+			error("Discover characteristics failed: %s\n",
+							att_ecode2str(status));
+		break;
 	}
-
-        if (vehicle.read_char.handle > 0 && vehicle.write_char.handle > 0) {
-                // register for notifications when the vehicle sends data.
-                // We do this by setting the notification bit on the
-                // client configuration characteristic:
-                // see:
-                // https://developer.bluetooth.org/gatt/descriptors/Pages/DescriptorViewer.aspx?u=org.bluetooth.descriptor.gatt.client_characteristic_configuration.xml
-                uint8_t notify_cmd[] = { 0x01, 0x00 };
-                gatt_write_cmd(attrib, vehicle.write_char.properties, notify_cmd,  2, NULL, NULL);
-        }
 }
 
 static void char_read_cb(guint8 status, const guint8 *pdu, guint16 plen,
@@ -338,7 +365,19 @@ static void discover_services_cb(GSList *ranges, guint8 status,
                 rl_printf("Starting handle: 0x%04x Ending handle: 0x%04x\n",
                                                 range->start, range->end);
         }
-	gatt_discover_char(attrib, 0x1, 0xffff, NULL, discover_char_cb, NULL);
+
+        // Only look inside the Anki service
+        struct att_range *range = ranges->data;
+        memset(&vehicle, 0, sizeof(vehicle));
+        if (bt_string_to_uuid(&anki_chars[ANKI_CHAR_READ].uuid, ANKI_STR_CHR_READ_UUID) < 0 ||
+            bt_string_to_uuid(&anki_chars[ANKI_CHAR_WRITE].uuid, ANKI_STR_CHR_WRITE_UUID) < 0) {
+                error("Invalid characteristic UUID\n");
+                return;
+        }
+
+        gatt_discover_char_match(attrib, range->start, range->end,
+                                anki_chars, ANKI_CHAR_COUNT,
+                                discover_char_cb, NULL);
 }
 
 
@@ -392,6 +431,77 @@ static void cmd_anki_vehicle_read(int argcp, char **argvp)
 	gatt_read_char(attrib, handle, char_read_cb, attrib);
 }
 
+static void read_multi_cb(guint8 status, struct gatt_read_item *items,
+					size_t count, gpointer user_data)
+{
+	size_t i;
+	int j;
+
+	for (i = 0; i < count; i++) {
+		if (items[i].status) {
+			rl_printf("0x%04x: %s\n", items[i].handle,
+					att_ecode2str(items[i].status));
+			continue;
+		}
+
+		rl_printf("0x%04x:", items[i].handle);
+		for (j = 0; j < items[i].received; j++)
+			rl_printf(" %02x", items[i].value[j]);
+		rl_printf("\n");
+	}
+
+	g_free(user_data);
+}
+
+static void cmd_read_multi(int argcp, char **argvp)
+{
+	struct gatt_read_item *items;
+	uint8_t *values;
+	size_t count, i;
+	char *e;
+
+	if (conn_state != STATE_CONNECTED) {
+		failed("Disconnected\n");
+		return;
+	}
+
+	if (argcp < 2) {
+		rl_printf("Usage: read-multi <handle[:len]> ...\n");
+		return;
+	}
+
+	count = argcp - 1;
+
+	/* Items and value buffers in one block, freed by the callback */
+	items = g_malloc0(count * (sizeof(*items) + ATT_MAX_VALUE_LEN));
+	values = (uint8_t *) &items[count];
+
+	for (i = 0; i < count; i++) {
+		unsigned long handle, len = ATT_DEFAULT_LE_MTU - 1;
+
+		errno = 0;
+		handle = strtoul(argvp[i + 1], &e, 16);
+		if (*e == ':')
+			len = strtoul(e + 1, &e, 0);
+		if (errno != 0 || *e != '\0' || handle == 0 ||
+				handle > 0xffff || len == 0 ||
+				len > ATT_MAX_VALUE_LEN) {
+			error("Invalid handle: %s\n", argvp[i + 1]);
+			g_free(items);
+			return;
+		}
+
+		items[i].handle = handle;
+		items[i].len = len;
+		items[i].value = &values[i * ATT_MAX_VALUE_LEN];
+	}
+
+	if (gatt_read_batch(attrib, items, count, read_multi_cb, items) == 0) {
+		failed("Unable to queue read\n");
+		g_free(items);
+	}
+}
+
 static void char_write_req_cb(guint8 status, const guint8 *pdu, guint16 plen,
 							gpointer user_data)
 {
@@ -409,11 +519,31 @@ static void char_write_req_cb(guint8 status, const guint8 *pdu, guint16 plen,
 	rl_printf("Characteristic value was written successfully\n");
 }
 
+/* Commands still queued after drive_deadline_ms are dropped */
+static void vehicle_msg_deadline(guint id)
+{
+	if (id != 0 && drive_deadline_ms > 0)
+		g_attrib_set_deadline(attrib, id,
+				timer_wheel_now() + drive_deadline_ms);
+}
+
+/* Queue an encoded message for the vehicle write characteristic */
+static guint vehicle_msg_write(anki_vehicle_msg_t *msg, size_t plen)
+{
+	guint id;
+
+	id = gatt_write_char(attrib, vehicle.write_char.value_handle,
+					(uint8_t *)msg, plen, NULL, NULL);
+	vehicle_msg_deadline(id);
+	return id;
+}
+
 static void cmd_anki_vehicle_write(int argcp, char **argvp)
 {
         uint8_t *value;
         size_t plen;
         int handle;
+        guint id;
 
         if (conn_state != STATE_CONNECTED) {
                 failed("Disconnected\n");
@@ -434,19 +564,53 @@ static void cmd_anki_vehicle_write(int argcp, char **argvp)
         }
 
         if (g_strcmp0("send-data-req", argvp[0]) == 0)
-                gatt_write_char(attrib, handle, value, plen,
+                id = gatt_write_char(attrib, handle, value, plen,
                                         char_write_req_cb, NULL);
         else
-                gatt_write_cmd(attrib, handle, value, plen, NULL, NULL);
+                id = gatt_write_cmd(attrib, handle, value, plen, NULL, NULL);
+        vehicle_msg_deadline(id);
 
         g_free(value);
 }
 
+/*
+ * Reserve a Write Request for the vehicle write characteristic and return
+ * its value area, so a message can be encoded straight into the PDU.
+ */
+static anki_vehicle_msg_t *vehicle_msg_reserve(struct gattrib_pdu **pdu)
+{
+	uint8_t *value;
+	size_t vlen;
+
+	value = gatt_write_reserve(attrib, vehicle.write_char.value_handle,
+							TRUE, &vlen, pdu);
+	if (value == NULL)
+		return NULL;
+
+	if (vlen < sizeof(anki_vehicle_msg_t)) {
+		g_attrib_abort(attrib, *pdu);
+		return NULL;
+	}
+
+	return (anki_vehicle_msg_t *)value;
+}
+
+static void vehicle_msg_commit(struct gattrib_pdu *pdu, size_t plen)
+{
+	guint id;
+
+	id = gatt_write_commit(attrib, pdu, plen, NULL, NULL);
+	if (id == 0) {
+		failed("Unable to queue message\n");
+		return;
+	}
+
+	vehicle_msg_deadline(id);
+}
+
 static void cmd_anki_vehicle_disconnect(int argcp, char **argvp)
 {
-        uint8_t *value;
         size_t plen;
-        int handle;
 
         if (conn_state != STATE_CONNECTED) {
                 failed("Disconnected\n");
@@ -458,21 +622,15 @@ static void cmd_anki_vehicle_disconnect(int argcp, char **argvp)
                 return;
         }
 
-        handle = vehicle.write_char.value_handle;
-
         anki_vehicle_msg_t msg;
         plen = anki_vehicle_msg_disconnect(&msg);
-        value = (uint8_t *)&msg;
 
-        gatt_write_char(attrib, handle, value, plen,
-                                        NULL, NULL);
+        vehicle_msg_write(&msg, plen);
 }
 
 static void cmd_anki_vehicle_sdk_mode(int argcp, char **argvp)
 {
-        uint8_t *value;
         size_t plen;
-        int handle;
 
         if (conn_state != STATE_CONNECTED) {
                 failed("Disconnected\n");
@@ -484,23 +642,17 @@ static void cmd_anki_vehicle_sdk_mode(int argcp, char **argvp)
                 return;
         }
 
-        handle = vehicle.write_char.value_handle;
-
         int arg = atoi(argvp[1]);
 
         anki_vehicle_msg_t msg;
         plen = anki_vehicle_msg_set_sdk_mode(&msg, arg);
-        value = (uint8_t *)&msg;
 
-        gatt_write_char(attrib, handle, value, plen,
-                                        NULL, NULL);
+        vehicle_msg_write(&msg, plen);
 }
 
 static void cmd_anki_vehicle_ping(int argcp, char **argvp)
 {
-        uint8_t *value;
         size_t plen;
-        int handle;
 
         if (conn_state != STATE_CONNECTED) {
                 failed("Disconnected\n");
@@ -512,20 +664,15 @@ static void cmd_anki_vehicle_ping(int argcp, char **argvp)
                 return;
         }
 
-        handle = vehicle.write_char.value_handle;
-
         anki_vehicle_msg_t msg;
         plen = anki_vehicle_msg_ping(&msg);
-        value = (uint8_t *)&msg;
 
-        gatt_write_char(attrib, handle, value, plen, NULL, NULL);
+        vehicle_msg_write(&msg, plen);
 }
 
 static void cmd_anki_vehicle_get_version(int argcp, char **argvp)
 {
-        uint8_t *value;
         size_t plen;
-        int handle;
         
         if (conn_state != STATE_CONNECTED) {
                 failed("Disconnected\n");
@@ -537,20 +684,17 @@ static void cmd_anki_vehicle_get_version(int argcp, char **argvp)
                 return;
         }
 
-        handle = vehicle.write_char.value_handle;
-
         anki_vehicle_msg_t msg;
         plen = anki_vehicle_msg_get_version(&msg);
-        value = (uint8_t *)&msg;
 
-        gatt_write_char(attrib, handle, value, plen, NULL, NULL);
+        vehicle_msg_write(&msg, plen);
 }
 
 static void cmd_anki_vehicle_set_speed(int argcp, char **argvp)
 {
-        uint8_t *value;
+        struct gattrib_pdu *pdu;
+        anki_vehicle_msg_t *msg;
         size_t plen;
-        int handle;
 
         if (conn_state != STATE_CONNECTED) {
                 failed("Disconnected\n");
@@ -562,8 +706,6 @@ static void cmd_anki_vehicle_set_speed(int argcp, char **argvp)
                 return;
         }
 
-        handle = vehicle.write_char.value_handle;
-
         int16_t speed = (int16_t)atoi(argvp[1]);
         int16_t accel = 25000;
         if (argcp > 2) {
@@ -571,12 +713,14 @@ static void cmd_anki_vehicle_set_speed(int argcp, char **argvp)
         }
         rl_printf("setting speed to %d (accel = %d)\n", speed, accel);
 
-        anki_vehicle_msg_t msg;
-        plen = anki_vehicle_msg_set_speed(&msg, speed, accel);
-        value = (uint8_t *)&msg;
+        msg = vehicle_msg_reserve(&pdu);
+        if (msg == NULL) {
+                failed("Unable to allocate message\n");
+                return;
+        }
 
-        gatt_write_char(attrib, handle, value, plen,
-                                        NULL, NULL);
+        plen = anki_vehicle_msg_set_speed(msg, speed, accel);
+        vehicle_msg_commit(pdu, plen);
 }
 
 static void cmd_anki_vehicle_change_lane(int argcp, char **argvp)
@@ -591,8 +735,6 @@ static void cmd_anki_vehicle_change_lane(int argcp, char **argvp)
                 return;
         }
 
-        int handle = vehicle.write_char.value_handle;
-
         int16_t hspeed = (int16_t)atoi(argvp[1]);
         float offset = 1.0;
         if (argcp > 2) {
@@ -600,13 +742,22 @@ static void cmd_anki_vehicle_change_lane(int argcp, char **argvp)
         }
         rl_printf("changing lane at %d (offset = %1.2f)\n", hspeed, offset);
 
-        anki_vehicle_msg_t msg;
-        size_t plen = anki_vehicle_msg_set_offset_from_road_center(&msg, 0.0);
-        gatt_write_char(attrib, handle, (uint8_t*)&msg, plen, NULL, NULL);
+        struct gattrib_pdu *pdu;
+        anki_vehicle_msg_t *msg = vehicle_msg_reserve(&pdu);
+        if (msg == NULL) {
+                failed("Unable to allocate message\n");
+                return;
+        }
+        size_t plen = anki_vehicle_msg_set_offset_from_road_center(msg, 0.0);
+        vehicle_msg_commit(pdu, plen);
 
-        anki_vehicle_msg_t lane_msg;
-        size_t lane_plen = anki_vehicle_msg_change_lane(&lane_msg, hspeed, offset);
-        gatt_write_char(attrib, handle, (uint8_t*)&lane_msg, lane_plen, NULL, NULL);
+        msg = vehicle_msg_reserve(&pdu);
+        if (msg == NULL) {
+                failed("Unable to allocate message\n");
+                return;
+        }
+        plen = anki_vehicle_msg_change_lane(msg, hspeed, offset);
+        vehicle_msg_commit(pdu, plen);
 }
 
 anki_vehicle_light_channel_t get_channel_by_name(const char *name)
@@ -650,9 +801,7 @@ anki_vehicle_light_effect_t get_effect_by_name(const char *name)
 
 static void cmd_anki_vehicle_lights_pattern(int argcp, char **argvp)
 {
-        uint8_t *value;
         size_t plen;
-        int handle;
 
         if (conn_state != STATE_CONNECTED) {
                 failed("Disconnected\n");
@@ -666,8 +815,6 @@ static void cmd_anki_vehicle_lights_pattern(int argcp, char **argvp)
                 return;
         }
 
-        handle = vehicle.write_char.value_handle;
-
         uint8_t channel = get_channel_by_name(argvp[1]);
         if (channel == channel_invalid) {
             rl_printf("Unrecognized channel: %s\n", argvp[1]);
@@ -686,12 +833,11 @@ static void cmd_anki_vehicle_lights_pattern(int argcp, char **argvp)
 
         anki_vehicle_msg_t msg;
         plen = anki_vehicle_msg_lights_pattern(&msg, channel, effect, start, end, cycles_per_min);
-        value = (uint8_t *)&msg;
 
-        gatt_write_char(attrib, handle, value, plen, NULL, NULL);
+        vehicle_msg_write(&msg, plen);
 }
 
-static void vehicle_set_rgb_lights(int handle, uint8_t effect, uint8_t start_red, uint8_t end_red, uint8_t start_green, uint8_t end_green, uint8_t start_blue, uint8_t end_blue, uint16_t cycles_per_min)
+static void vehicle_set_rgb_lights(uint8_t effect, uint8_t start_red, uint8_t end_red, uint8_t start_green, uint8_t end_green, uint8_t start_blue, uint8_t end_blue, uint16_t cycles_per_min)
 {
         anki_vehicle_msg_t msg_red;
         size_t plen_red = anki_vehicle_msg_lights_pattern(&msg_red, LIGHT_RED, effect, start_red, end_red, cycles_per_min);
@@ -702,12 +848,9 @@ static void vehicle_set_rgb_lights(int handle, uint8_t effect, uint8_t start_red
         anki_vehicle_msg_t msg_blue;
         size_t plen_blue = anki_vehicle_msg_lights_pattern(&msg_blue, LIGHT_BLUE, effect, start_blue, end_blue, cycles_per_min);
 
-        uint8_t *value = (uint8_t *)&msg_red;
-        gatt_write_char(attrib, handle, value, plen_red, NULL, NULL);
-        value = (uint8_t *)&msg_green;
-        gatt_write_char(attrib, handle, value, plen_green, NULL, NULL);
-        value = (uint8_t *)&msg_blue;
-        gatt_write_char(attrib, handle, value, plen_blue, NULL, NULL);
+        vehicle_msg_write(&msg_red, plen_red);
+        vehicle_msg_write(&msg_green, plen_green);
+        vehicle_msg_write(&msg_blue, plen_blue);
 }
 
 static void cmd_anki_vehicle_engine_lights(int argcp, char **argvp)
@@ -736,11 +879,10 @@ static void cmd_anki_vehicle_engine_lights(int argcp, char **argvp)
         uint8_t effect = get_effect_by_name(argvp[4]);
         uint16_t cycles_per_min = atoi(argvp[5]);
 
-        int handle = vehicle.write_char.value_handle;
         if (effect == EFFECT_STEADY) {
-            vehicle_set_rgb_lights(handle, effect, r, r, g, g, b, b, 0); 
+            vehicle_set_rgb_lights(effect, r, r, g, g, b, b, 0); 
         } else {
-            vehicle_set_rgb_lights(handle, effect, 0, r, 0, g, b, 0, cycles_per_min); 
+            vehicle_set_rgb_lights(effect, 0, r, 0, g, b, 0, cycles_per_min); 
         }
 }
 
@@ -801,6 +943,103 @@ static void cmd_mtu(int argcp, char **argvp)
 	gatt_exchange_mtu(attrib, opt_mtu, exchange_mtu_cb, NULL);
 }
 
+static void cmd_stats(int argcp, char **argvp)
+{
+	struct gattrib_rx_stats rx;
+	struct gattrib_tx_stats tx;
+	struct gattrib_timeout_stats to;
+	struct gattrib_deadline_stats dl;
+	int i;
+
+	if (conn_state != STATE_CONNECTED) {
+		failed("Disconnected\n");
+		return;
+	}
+
+	g_attrib_get_rx_stats(attrib, &rx);
+	g_attrib_get_tx_stats(attrib, &tx);
+	g_attrib_get_timeout_stats(attrib, &to);
+	g_attrib_get_deadline_stats(attrib, &dl);
+
+	rl_printf("tx: %llu PDUs in %llu wakeups, last batch %u, max batch %u, %llu EAGAIN\n",
+			(unsigned long long) tx.pdus,
+			(unsigned long long) tx.wakeups,
+			tx.last_batch, tx.max_batch,
+			(unsigned long long) tx.eagain);
+	rl_printf("timeouts: %llu, late responses: %llu, escalations: %llu\n",
+			(unsigned long long) to.timeouts,
+			(unsigned long long) to.late_responses,
+			(unsigned long long) to.escalations);
+	rl_printf("deadlines: %llu on time, %llu expired, max overrun %llu ms\n",
+			(unsigned long long) dl.on_time,
+			(unsigned long long) dl.expired,
+			(unsigned long long) dl.max_overrun_ms);
+
+	rl_printf("rx: %llu PDUs in %llu wakeups, last batch %u, max batch %u\n",
+			(unsigned long long) rx.pdus,
+			(unsigned long long) rx.wakeups,
+			rx.last_batch, rx.max_batch);
+	for (i = 0; i < GATTRIB_RX_HIST_BUCKETS; i++) {
+		if (rx.batch_hist[i] == 0)
+			continue;
+		rl_printf("  batch %3u-%-3u %llu\n",
+				i ? 1u << (i - 1) : 0, i ? (1u << i) - 1 : 0,
+				(unsigned long long) rx.batch_hist[i]);
+	}
+}
+
+static void cmd_timeout(int argcp, char **argvp)
+{
+	unsigned long timeout_ms;
+	unsigned long max_timeouts = GATTRIB_DEFAULT_MAX_TIMEOUTS;
+	unsigned long grace_ms = GATTRIB_DEFAULT_LATE_GRACE_MS;
+
+	if (conn_state != STATE_CONNECTED) {
+		failed("Disconnected\n");
+		return;
+	}
+
+	if (argcp < 2) {
+		rl_printf("Usage: timeout <ms> [max timeouts [late grace ms]]\n");
+		return;
+	}
+
+	errno = 0;
+	timeout_ms = strtoul(argvp[1], NULL, 0);
+	if (argcp > 2)
+		max_timeouts = strtoul(argvp[2], NULL, 0);
+	if (argcp > 3)
+		grace_ms = strtoul(argvp[3], NULL, 0);
+	if (errno != 0) {
+		error("Invalid value\n");
+		return;
+	}
+
+	g_attrib_set_default_timeout(attrib, timeout_ms);
+	g_attrib_set_timeout_policy(attrib, max_timeouts, grace_ms);
+}
+
+static void cmd_deadline(int argcp, char **argvp)
+{
+	unsigned long deadline_ms;
+
+	if (argcp < 2) {
+		rl_printf("Vehicle command deadline: %u ms%s\n",
+				drive_deadline_ms,
+				drive_deadline_ms ? "" : " (disabled)");
+		return;
+	}
+
+	errno = 0;
+	deadline_ms = strtoul(argvp[1], NULL, 0);
+	if (errno != 0 || deadline_ms > G_MAXUINT) {
+		error("Invalid value\n");
+		return;
+	}
+
+	drive_deadline_ms = deadline_ms;
+}
+
 static struct {
 	const char *cmd;
 	void (*func)(int argcp, char **argvp);
@@ -819,6 +1058,12 @@ static struct {
 		"Disconnect from a remote device" },
 	{ "mtu",		cmd_mtu,	"<value>",
 		"Exchange MTU for GATT/ATT" },
+	{ "stats",		cmd_stats,	"",
+		"Show ATT transport statistics" },
+	{ "timeout",		cmd_timeout,	"<ms> [max timeouts [grace ms]]",
+		"Set the request timeout and disconnect policy" },
+	{ "deadline",		cmd_deadline,	"[ms]",
+		"Drop vehicle commands still queued after ms (0 = never)" },
         { "sdk-mode",           cmd_anki_vehicle_sdk_mode,   "[on]",
                 "Set SDK Mode"},
         { "ping",           cmd_anki_vehicle_ping,   "",
@@ -841,6 +1086,8 @@ static struct {
 		"Write data to vehicle (No response)" },
 	{ "read-data",	cmd_anki_vehicle_read,	"",
 		"Read last message from vehicle" },
+	{ "read-multi",	cmd_read_multi,	"<handle[:len]> ...",
+		"Read several attributes with as few requests as possible" },
 	{ NULL, NULL, NULL}
 };
 
@@ -1028,6 +1275,7 @@ int interactive(const char *src, const char *dst,
 {
 	guint input;
 	guint signal;
+	guint transport;
 
 	opt_sec_level = g_strdup("low");
 
@@ -1043,6 +1291,9 @@ int interactive(const char *src, const char *dst,
 	input = setup_standard_input();
 	signal = setup_signalfd();
 
+	/* No-op unless the ATT transport runs on its own epoll loop */
+	transport = event_loop_glib_attach();
+
 	rl_attempted_completion_function = commands_completion;
 	rl_erase_empty_line = 1;
 	rl_callback_handler_install(get_prompt(), parse_line);
@@ -1053,6 +1304,8 @@ int interactive(const char *src, const char *dst,
 	cmd_disconnect(0, NULL);
 	g_source_remove(input);
 	g_source_remove(signal);
+	if (transport)
+		g_source_remove(transport);
 	g_main_loop_unref(event_loop);
 	g_string_free(prompt, TRUE);
 
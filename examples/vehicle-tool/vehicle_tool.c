@@ -41,6 +41,7 @@
 #include "gattrib.h"
 #include "gatt.h"
 #include "utils.h"
+#include "event_loop.h"
 
 static char *opt_src = NULL;
 static char *opt_dst = NULL;
@@ -51,6 +52,7 @@ static bt_uuid_t *opt_uuid = NULL;
 static int opt_handle = -1;
 static int opt_mtu = 0;
 static int opt_psm = 0;
+static gboolean opt_epoll = FALSE;
 static GMainLoop *event_loop;
 static gboolean got_error = FALSE;
 static GSourceFunc operation;
@@ -110,6 +112,8 @@ static GOptionEntry options[] = {
 		"Specify the PSM for GATT/ATT over BR/EDR", "PSM" },
 	{ "sec-level", 'l', 0, G_OPTION_ARG_STRING, &opt_sec_level,
 		"Set security level. Default: low", "[low | medium | high]"},
+	{ "epoll", 'e', 0, G_OPTION_ARG_NONE, &opt_epoll,
+		"Run the ATT transport on epoll instead of GLib", NULL },
 	{ NULL },
 };
 
@@ -131,6 +135,12 @@ int main(int argc, char *argv[])
 		g_clear_error(&gerr);
 	}
 
+	if (opt_epoll && event_loop_init(EVENT_LOOP_EPOLL) < 0) {
+		g_printerr("Unable to set up the epoll event loop\n");
+		got_error = TRUE;
+		goto done;
+	}
+
 	interactive(opt_src, opt_dst, opt_dst_type, opt_psm);
 
 done:
@@ -20,7 +20,19 @@
 #include "ankidrive/version.h"
 #include "ankidrive/uuid.h"
 #include "ankidrive/advertisement.h"
+#include "ankidrive/adv_prefilter.h"
 #include "ankidrive/protocol.h"
 #include "ankidrive/vehicle_gatt_profile.h"
+#include "ankidrive/vehicle_stats.h"
+#include "ankidrive/vehicle_msg_ring.h"
+#include "ankidrive/track_map.h"
+#include "ankidrive/vehicle_predictor.h"
+#include "ankidrive/vehicle_cmd_gate.h"
+#include "ankidrive/fleet_controller.h"
+#include "ankidrive/timeline.h"
+#include "ankidrive/lap_timer.h"
+#include "ankidrive/vehicle_state_table.h"
+#include "ankidrive/session_log.h"
+#include "ankidrive/vehicle_sim.h"
 
 #endif
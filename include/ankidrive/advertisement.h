@@ -140,6 +140,61 @@ uint8_t anki_vehicle_parse_mfg_data(const uint8_t *bytes, uint8_t len, anki_vehi
  */
 uint8_t anki_vehicle_parse_local_name(const uint8_t *bytes, uint8_t len, anki_vehicle_adv_info_t *local_name);
 
+/** State bits of the first LOCAL_NAME byte, as stored in the batch state column. */
+#define ANKI_VEHICLE_ADV_STATE_FULL_BATTERY  (1 << 4)
+#define ANKI_VEHICLE_ADV_STATE_LOW_BATTERY   (1 << 5)
+#define ANKI_VEHICLE_ADV_STATE_ON_CHARGER    (1 << 6)
+#define ANKI_VEHICLE_ADV_STATE_MASK          (0x70)
+
+/** Number of uint64_t words needed for a validity bitmap of count rows. */
+#define ANKI_VEHICLE_ADV_BITMAP_WORDS(count) (((count) + 63) / 64)
+
+/**
+ * Caller-provided column storage for anki_vehicle_parse_adv_batch().
+ *
+ * Each value column holds one entry per report. Any column may be NULL
+ * if the caller does not need it. Rows whose record is missing are set to 0.
+ *
+ * - identifier, model_id, product_id: MANUFACTURER_DATA values
+ * - version, state: LOCAL_NAME values, state holds ANKI_VEHICLE_ADV_STATE_* bits
+ * - name_offset, name_len: Location of the UTF-8 vehicle name inside the
+ *   report bytes, so names can be read without copying
+ * - valid_uuid: Bitmap of reports carrying the Anki vehicle service UUID
+ * - valid_mfg: Bitmap of reports with a well-formed MANUFACTURER_DATA record
+ * - valid_name: Bitmap of reports with a LOCAL_NAME record
+ *
+ * Bitmaps hold ANKI_VEHICLE_ADV_BITMAP_WORDS(count) words. Bit (i % 64)
+ * of word (i / 64) refers to report i.
+ */
+typedef struct anki_vehicle_adv_columns {
+    uint32_t    *identifier;
+    uint8_t     *model_id;
+    uint16_t    *product_id;
+    uint16_t    *version;
+    uint8_t     *state;
+    uint16_t    *name_offset;
+    uint8_t     *name_len;
+    uint64_t    *valid_uuid;
+    uint64_t    *valid_mfg;
+    uint64_t    *valid_name;
+} anki_vehicle_adv_columns_t;
+
+/**
+ * Parse a batch of advertising reports into columns.
+ *
+ * Unlike anki_vehicle_parse_adv_record(), unknown record types are skipped
+ * and parsing of a report stops at the first malformed record, so a single
+ * bad report never affects other rows.
+ *
+ * @param reports Array of count pointers to raw advertising data.
+ * @param lens Array of count report lengths in bytes.
+ * @param count Number of reports.
+ * @param columns Column storage with room for count rows.
+ *
+ * @return Number of reports carrying the Anki vehicle service UUID.
+ */
+size_t anki_vehicle_parse_adv_batch(const uint8_t *const *reports, const size_t *lens, size_t count, anki_vehicle_adv_columns_t *columns);
+
 ANKI_END_DECL
 
 #endif
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_fleet_controller_h
+#define INCLUDE_fleet_controller_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "vehicle_cmd_gate.h"
+#include "vehicle_predictor.h"
+
+ANKI_BEGIN_DECL
+
+/** Largest fleet a controller handles, the same as a predictor tracks. */
+#define ANKI_FLEET_MAX_VEHICLES     ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES
+
+/** Largest number of lanes in a controller configuration. */
+#define ANKI_FLEET_MAX_LANES        8
+
+/** Largest number of worker threads a controller starts. */
+#define ANKI_FLEET_MAX_WORKERS      8
+
+/** Lane value meaning "no lane chosen". */
+#define ANKI_FLEET_LANE_NONE        0xff
+
+/**
+ * Called for every command the controller sends. msg is only valid for the
+ * duration of the call.
+ */
+typedef void (*anki_fleet_emit_func_t)(uint8_t vehicle, const anki_vehicle_msg_t *msg,
+                                       uint8_t len, void *user_data);
+
+/**
+ * Controller parameters. Fill in with anki_fleet_config_default and adjust.
+ *
+ * - tick_us: Control period used by anki_fleet_controller_poll
+ * - budget_us: Tick cost above which a tick counts as an overrun. The tick
+ *   after an overrun skips overtake planning to stay within budget.
+ * - min_gap_mm: Distance to the car ahead below which a car is stopped
+ * - time_gap_sec: Extra following distance per mm/sec of own speed
+ * - gap_gain: Speed correction per mm of gap error, in 1/sec
+ * - lane_width_mm: Cars closer than this laterally share a lane
+ * - overtake_distance_mm: Consider overtaking a slower car closer than this
+ * - overtake_margin_mm_per_sec: ... that is at least this much slower than cruise
+ * - clear_behind_mm, clear_ahead_mm: Target lane must be free over this range
+ * - lane_hold_us: Minimum time between lane changes of one car
+ * - accel_mm_per_sec2: Acceleration sent with speed commands
+ * - lane_speed_mm_per_sec: Horizontal speed sent with lane changes
+ * - lane_count, lane_offsets_mm: Lane centers as offsets from the road center
+ * - workers: Worker threads used in addition to the calling thread
+ * - parallel_min: Fleets smaller than this are planned on the calling thread only.
+ *   Handing a tick to the workers costs several microseconds, which only pays
+ *   off once planning costs more than that; examples/fleet-bench measures the
+ *   crossover for a machine and worker count.
+ */
+typedef struct anki_fleet_config {
+    uint32_t    tick_us;
+    uint32_t    budget_us;
+    float       min_gap_mm;
+    float       time_gap_sec;
+    float       gap_gain;
+    float       lane_width_mm;
+    float       overtake_distance_mm;
+    float       overtake_margin_mm_per_sec;
+    float       clear_behind_mm;
+    float       clear_ahead_mm;
+    uint32_t    lane_hold_us;
+    uint16_t    accel_mm_per_sec2;
+    uint16_t    lane_speed_mm_per_sec;
+    uint8_t     lane_count;
+    float       lane_offsets_mm[ANKI_FLEET_MAX_LANES];
+    uint8_t     workers;
+    uint8_t     parallel_min;
+} anki_fleet_config_t;
+
+/**
+ * Tick cost statistics.
+ *
+ * - ticks: Ticks run
+ * - skipped: Ticks missed because poll was called late
+ * - overruns: Ticks that took longer than budget_us
+ * - degraded: Ticks run without overtake planning after an overrun
+ * - parallel: Ticks planned across the worker threads
+ * - last_us, max_us, total_us: Wall-clock cost of the ticks
+ */
+typedef struct anki_fleet_stats {
+    uint64_t    ticks;
+    uint64_t    skipped;
+    uint64_t    overruns;
+    uint64_t    degraded;
+    uint64_t    parallel;
+    uint32_t    last_us;
+    uint32_t    max_us;
+    uint64_t    total_us;
+} anki_fleet_stats_t;
+
+struct anki_fleet_workers;
+
+/**
+ * Gap-keeping and overtaking controller for a fleet of vehicles.
+ *
+ * Every tick, each car follows the nearest car ahead in its lane with a
+ * constant time-gap policy, capped at its cruise speed. A car that is held
+ * up by a slower one moves to an adjacent lane when that lane is clear.
+ * The resulting commands go through one anki_vehicle_cmd_gate_t per car,
+ * so only changed commands reach the emit function.
+ *
+ * Planning a car only reads the shared positions, so large fleets are
+ * split across worker threads. Commands are emitted on the calling thread.
+ * A tick is O(n^2) in the number of cars, bounded by ANKI_FLEET_MAX_VEHICLES.
+ */
+typedef struct anki_fleet_controller {
+    anki_fleet_config_t     config;
+    anki_fleet_emit_func_t  emit;
+    void                    *user_data;
+
+    uint16_t    cruise[ANKI_FLEET_MAX_VEHICLES];
+    anki_vehicle_cmd_gate_t gates[ANKI_FLEET_MAX_VEHICLES];
+    uint8_t     target_lane[ANKI_FLEET_MAX_VEHICLES];
+    uint64_t    lane_hold_until_us[ANKI_FLEET_MAX_VEHICLES];
+
+    // Plan of the current tick
+    uint16_t    plan_speed[ANKI_FLEET_MAX_VEHICLES];
+    uint8_t     plan_lane[ANKI_FLEET_MAX_VEHICLES];
+
+    // Inputs of the current tick
+    uint8_t     count;
+    const float *distance_mm;
+    const float *offset_mm;
+    const float *speed_mm_per_sec;
+    const uint8_t *active;
+    float       track_length_mm;
+    uint64_t    now_us;
+    uint8_t     overtake;
+
+    // Prediction buffers used by anki_fleet_controller_poll
+    float       predicted_distance_mm[ANKI_FLEET_MAX_VEHICLES];
+    float       predicted_offset_mm[ANKI_FLEET_MAX_VEHICLES];
+    float       predicted_speed[ANKI_FLEET_MAX_VEHICLES];
+
+    uint64_t    next_tick_us;
+    anki_fleet_stats_t stats;
+    struct anki_fleet_workers *workers;
+} anki_fleet_controller_t;
+
+/**
+ * Fill in default parameters for standard four-lane track pieces.
+ */
+void anki_fleet_config_default(anki_fleet_config_t *config);
+
+/**
+ * Initialize a controller and start its worker threads.
+ *
+ * @param ctrl Controller to initialize.
+ * @param config Parameters, copied into the controller.
+ * @param emit Function receiving the commands to send.
+ * @param user_data Passed to emit.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_fleet_controller_init(anki_fleet_controller_t *ctrl, const anki_fleet_config_t *config,
+                                   anki_fleet_emit_func_t emit, void *user_data);
+
+/**
+ * Stop the worker threads of a controller.
+ */
+void anki_fleet_controller_destroy(anki_fleet_controller_t *ctrl);
+
+/**
+ * Set the speed a car drives at when nothing is in its way. 0 stops the car.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_fleet_controller_set_cruise(anki_fleet_controller_t *ctrl, uint8_t vehicle,
+                                         uint16_t speed_mm_per_sec);
+
+/**
+ * Run one control tick over explicit vehicle states.
+ *
+ * @param ctrl Controller.
+ * @param timestamp_us Current time.
+ * @param count Number of vehicles, at most ANKI_FLEET_MAX_VEHICLES.
+ * @param distance_mm Distance of each vehicle along the track.
+ * @param offset_mm Lane offset of each vehicle.
+ * @param speed_mm_per_sec Speed of each vehicle.
+ * @param active Nonzero for vehicles to control; NULL controls all.
+ * @param track_length_mm Length of one lap.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_fleet_controller_tick(anki_fleet_controller_t *ctrl, uint64_t timestamp_us, uint8_t count,
+                                   const float *distance_mm, const float *offset_mm,
+                                   const float *speed_mm_per_sec, const uint8_t *active,
+                                   float track_length_mm);
+
+/**
+ * Run a tick from predicted positions if one is due at timestamp_us.
+ * Ticks missed since the last call are skipped and counted.
+ *
+ * @return 1 if a tick ran, 0 otherwise.
+ */
+uint8_t anki_fleet_controller_poll(anki_fleet_controller_t *ctrl, uint64_t timestamp_us,
+                                   const anki_vehicle_predictor_t *pred);
+
+ANKI_END_DECL
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_vehicle_msg_ring_h
+#define INCLUDE_vehicle_msg_ring_h
+
+#include <stdint.h>
+#include "common.h"
+#include "protocol.h"
+
+ANKI_BEGIN_DECL
+
+/** Cache line size assumed for padding shared ring state. */
+#define ANKI_VEHICLE_MSG_RING_CACHE_LINE    64
+
+/**
+ * A vehicle message as stored in the ring.
+ *
+ * - timestamp_us: Receive time supplied by the producer
+ * - vehicle_id: Producer-defined identifier of the sending vehicle
+ * - len: Number of valid bytes in msg
+ * - msg: Message as received from the vehicle
+ */
+typedef struct anki_vehicle_msg_ring_entry {
+    uint64_t            timestamp_us;
+    uint32_t            vehicle_id;
+    uint8_t             len;
+    anki_vehicle_msg_t  msg;
+} anki_vehicle_msg_ring_entry_t;
+
+/**
+ * Ring slot. seq is a per-slot sequence lock: odd while the producer is
+ * writing, otherwise 2 * (message sequence + 1).
+ */
+typedef struct anki_vehicle_msg_ring_slot {
+    uint64_t                        seq;
+    anki_vehicle_msg_ring_entry_t   entry;
+} anki_vehicle_msg_ring_slot_t;
+
+/**
+ * Single-producer, multi-consumer broadcast ring.
+ *
+ * Every consumer sees every message through its own cursor. The producer
+ * never waits for consumers: when a consumer falls more than a full ring
+ * behind, the oldest messages are overwritten and that consumer is told
+ * how many it missed. Slot storage is supplied by the caller, so neither
+ * publishing nor reading allocates.
+ */
+typedef struct anki_vehicle_msg_ring {
+    anki_vehicle_msg_ring_slot_t *slots;
+    uint32_t    mask;
+    uint8_t     _pad0[ANKI_VEHICLE_MSG_RING_CACHE_LINE - sizeof(void *) - sizeof(uint32_t)];
+
+    // Written only by the producer, on its own cache line
+    uint64_t    head;
+    uint8_t     _pad1[ANKI_VEHICLE_MSG_RING_CACHE_LINE - sizeof(uint64_t)];
+} anki_vehicle_msg_ring_t;
+
+/**
+ * Read position of one consumer.
+ *
+ * - next: Sequence number of the next message to read
+ * - missed: Total messages overwritten before this consumer read them
+ */
+typedef struct anki_vehicle_msg_ring_cursor {
+    uint64_t    next;
+    uint64_t    missed;
+} anki_vehicle_msg_ring_cursor_t;
+
+/**
+ * Initialize a ring over caller-provided slots.
+ *
+ * @param ring Ring to initialize.
+ * @param slots Storage for capacity slots.
+ * @param capacity Number of slots, a power of two.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_vehicle_msg_ring_init(anki_vehicle_msg_ring_t *ring,
+                                   anki_vehicle_msg_ring_slot_t *slots,
+                                   uint32_t capacity);
+
+/**
+ * Publish a message to every consumer. Must only be called from one thread.
+ *
+ * @param ring Ring to publish to.
+ * @param vehicle_id Identifier of the sending vehicle.
+ * @param timestamp_us Receive time of the message.
+ * @param data Message bytes as received from the vehicle.
+ * @param len Number of bytes in data, at most ANKI_VEHICLE_MSG_MAX_SIZE.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_vehicle_msg_ring_publish(anki_vehicle_msg_ring_t *ring,
+                                      uint32_t vehicle_id,
+                                      uint64_t timestamp_us,
+                                      const uint8_t *data, uint8_t len);
+
+/**
+ * Attach a consumer. The cursor starts at the next message to be published.
+ */
+void anki_vehicle_msg_ring_cursor_init(const anki_vehicle_msg_ring_t *ring,
+                                       anki_vehicle_msg_ring_cursor_t *cursor);
+
+/**
+ * Read the next message for one consumer.
+ * Each cursor must only be used from one thread at a time.
+ *
+ * @param ring Ring to read from.
+ * @param cursor Read position of the consumer. If the consumer was overrun,
+ *        the cursor skips to the oldest message still available and
+ *        cursor->missed grows by the number of messages skipped.
+ * @param entry Receives the message.
+ *
+ * @return 1 if a message was read, 0 if the consumer is caught up.
+ */
+uint8_t anki_vehicle_msg_ring_read(const anki_vehicle_msg_ring_t *ring,
+                                   anki_vehicle_msg_ring_cursor_t *cursor,
+                                   anki_vehicle_msg_ring_entry_t *entry);
+
+/**
+ * Number of published messages the consumer has not read yet, including
+ * any that have already been overwritten.
+ */
+uint64_t anki_vehicle_msg_ring_lag(const anki_vehicle_msg_ring_t *ring,
+                                   const anki_vehicle_msg_ring_cursor_t *cursor);
+
+ANKI_END_DECL
+
+#endif
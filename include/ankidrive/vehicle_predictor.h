@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_vehicle_predictor_h
+#define INCLUDE_vehicle_predictor_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "track_map.h"
+
+ANKI_BEGIN_DECL
+
+/** Number of vehicles a predictor tracks. */
+#define ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES     64
+
+/** Number of distance buckets used to find the piece at a track distance. */
+#define ANKI_VEHICLE_PREDICTOR_BUCKETS          256
+
+/** Default time over which a correction is blended in. */
+#define ANKI_VEHICLE_PREDICTOR_DEFAULT_BLEND_US 100000
+
+/**
+ * Predicted state of one vehicle.
+ *
+ * - distance_mm: Distance along the track from the start of piece 0
+ * - piece: Index of the piece at distance_mm
+ * - offset_mm: Lane offset from the road center
+ * - speed_mm_per_sec: Predicted forward speed
+ */
+typedef struct anki_vehicle_prediction {
+    float       distance_mm;
+    uint8_t     piece;
+    float       offset_mm;
+    float       speed_mm_per_sec;
+} anki_vehicle_prediction_t;
+
+/**
+ * Dead-reckoning predictor for a fleet of vehicles on one track map.
+ *
+ * Each vehicle's state is rebased whenever an update or command arrives:
+ * distance, speed and offset at a base time, the commanded speed and
+ * acceleration, and the lane change target. A prediction at any later time
+ * is a closed form of that state, so queries are constant time.
+ *
+ * When an update disagrees with the prediction, the difference is kept as
+ * a residual that fades out linearly over blend_us, so predicted positions
+ * never jump.
+ *
+ * Per-vehicle state is stored as parallel arrays so that
+ * anki_vehicle_predictor_predict_all is a single loop the compiler can
+ * vectorize. Fields other than blend_us are internal.
+ */
+typedef struct anki_vehicle_predictor {
+    double      base_sec[ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES];
+    float       distance_mm[ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES];
+    float       speed[ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES];
+    float       target_speed[ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES];
+    float       accel[ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES];
+    float       ramp_sec[ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES];
+    float       offset_mm[ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES];
+    float       target_offset_mm[ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES];
+    float       offset_rate[ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES];
+    float       residual_mm[ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES];
+    float       residual_offset_mm[ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES];
+    uint8_t     valid[ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES];
+    uint8_t     count;
+
+    uint32_t    blend_us;
+
+    // Track geometry copied from the map
+    uint8_t     piece_count;
+    float       track_length_mm;
+    float       piece_start_mm[ANKI_TRACK_MAP_MAX_PIECES + 1];
+    uint8_t     bucket_piece[ANKI_VEHICLE_PREDICTOR_BUCKETS];
+} anki_vehicle_predictor_t;
+
+/**
+ * Initialize a predictor for vehicles driving on a complete track map.
+ *
+ * Pieces whose length has not been measured are given the mean length of
+ * the measured ones.
+ *
+ * @param pred Predictor to initialize.
+ * @param map Complete track map. Only its geometry is copied.
+ * @param vehicle_count Number of vehicles, at most ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_vehicle_predictor_init(anki_vehicle_predictor_t *pred,
+                                    const anki_track_map_t *map,
+                                    uint8_t vehicle_count);
+
+/**
+ * Record a speed command sent to a vehicle, using the same parameters as
+ * anki_vehicle_msg_set_speed.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_vehicle_predictor_set_speed(anki_vehicle_predictor_t *pred, uint8_t vehicle,
+                                         uint64_t timestamp_us,
+                                         uint16_t speed_mm_per_sec, uint16_t accel_mm_per_sec2);
+
+/**
+ * Record a lane change command sent to a vehicle, using the same parameters
+ * as anki_vehicle_msg_change_lane.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_vehicle_predictor_change_lane(anki_vehicle_predictor_t *pred, uint8_t vehicle,
+                                           uint64_t timestamp_us,
+                                           uint16_t horizontal_speed_mm_per_sec,
+                                           float offset_from_center_mm);
+
+/**
+ * Correct a vehicle from a transition update: it entered the given piece
+ * at timestamp_us.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_vehicle_predictor_transition(anki_vehicle_predictor_t *pred, uint8_t vehicle,
+                                          uint64_t timestamp_us, uint8_t piece);
+
+/**
+ * Correct a vehicle from a position update: it is somewhere on the given
+ * piece, driving at the reported speed and offset.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_vehicle_predictor_position(anki_vehicle_predictor_t *pred, uint8_t vehicle,
+                                        uint64_t timestamp_us, uint8_t piece,
+                                        uint16_t speed_mm_per_sec, float offset_mm);
+
+/**
+ * Predict the state of one vehicle at timestamp_us.
+ *
+ * @return 0 on success, 1 if the vehicle has not been located yet.
+ */
+uint8_t anki_vehicle_predictor_predict(const anki_vehicle_predictor_t *pred, uint8_t vehicle,
+                                       uint64_t timestamp_us, anki_vehicle_prediction_t *out);
+
+/**
+ * Predict distance, offset and speed of every vehicle at timestamp_us.
+ * Entries for vehicles that have not been located are undefined.
+ *
+ * @param distance_mm Receives pred->count distances.
+ * @param offset_mm Receives pred->count offsets.
+ * @param speed_mm_per_sec Receives pred->count speeds.
+ */
+void anki_vehicle_predictor_predict_all(const anki_vehicle_predictor_t *pred, uint64_t timestamp_us,
+                                        float *distance_mm, float *offset_mm, float *speed_mm_per_sec);
+
+/**
+ * Index of the piece at a distance along the track.
+ */
+uint8_t anki_vehicle_predictor_piece_at(const anki_vehicle_predictor_t *pred, float distance_mm);
+
+ANKI_END_DECL
+
+#endif
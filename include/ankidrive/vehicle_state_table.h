@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_vehicle_state_table_h
+#define INCLUDE_vehicle_state_table_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "advertisement.h"
+
+ANKI_BEGIN_DECL
+
+/** "AKVS" read as a little-endian 32-bit word. */
+#define ANKI_VEHICLE_STATE_TABLE_MAGIC      0x53564b41
+
+/** Layout version, bumped whenever the header or slot layout changes. */
+#define ANKI_VEHICLE_STATE_TABLE_VERSION    1
+
+/** Size of the table header and of every slot. */
+#define ANKI_VEHICLE_STATE_TABLE_CACHE_LINE 64
+
+/**
+ * Attempts anki_vehicle_state_table_read makes before it gives up on a
+ * slot the writer keeps busy, e.g. because the writer died mid-update.
+ */
+#define ANKI_VEHICLE_STATE_TABLE_READ_TRIES 1024
+
+/** Connection status of a vehicle */
+typedef enum anki_vehicle_connection {
+    ANKI_VEHICLE_DISCONNECTED = 0,
+    ANKI_VEHICLE_CONNECTING = 1,
+    ANKI_VEHICLE_CONNECTED = 2,
+} anki_vehicle_connection_t;
+
+/** Bits in anki_vehicle_state_t.flags */
+#define ANKI_VEHICLE_STATE_LOCALIZED        (1 << 0)
+#define ANKI_VEHICLE_STATE_REVERSE          (1 << 1)
+#define ANKI_VEHICLE_STATE_FULL_BATTERY     (1 << 2)
+#define ANKI_VEHICLE_STATE_LOW_BATTERY      (1 << 3)
+#define ANKI_VEHICLE_STATE_ON_CHARGER       (1 << 4)
+
+/**
+ * Current state of one vehicle.
+ *
+ * - updated_us: Time of the latest change to this record
+ * - position_us: Time of the latest position or transition update
+ * - address: Bluetooth address, most significant byte first
+ * - connection: anki_vehicle_connection_t
+ * - flags: ANKI_VEHICLE_STATE_* bits
+ * - road_piece_id, location_id: Latest position update
+ * - speed_mm_per_sec, offset_mm: Latest reported speed and lane offset
+ * - battery_mv: Latest battery level response, 0 if unknown
+ * - version: Firmware version, 0 if unknown
+ * - transitions: Road piece transitions seen since the slot was set up
+ */
+typedef struct anki_vehicle_state {
+    uint64_t    updated_us;
+    uint64_t    position_us;
+    uint8_t     address[6];
+    uint8_t     connection;
+    uint8_t     flags;
+    uint8_t     road_piece_id;
+    uint8_t     location_id;
+    uint16_t    speed_mm_per_sec;
+    float       offset_mm;
+    uint16_t    battery_mv;
+    uint16_t    version;
+    uint32_t    transitions;
+} anki_vehicle_state_t;
+
+/**
+ * One cache line per vehicle. seq is odd while the writer updates state.
+ */
+typedef struct anki_vehicle_state_slot {
+    uint32_t                seq;
+    uint32_t                _reserved;
+    anki_vehicle_state_t    state;
+    uint8_t                 _pad[ANKI_VEHICLE_STATE_TABLE_CACHE_LINE - 2 * sizeof(uint32_t) - sizeof(anki_vehicle_state_t)];
+} anki_vehicle_state_slot_t;
+
+/**
+ * Header of a state table region.
+ *
+ * - magic: ANKI_VEHICLE_STATE_TABLE_MAGIC, stored last when a table is set up
+ * - version: ANKI_VEHICLE_STATE_TABLE_VERSION of the writer
+ * - slot_size: sizeof(anki_vehicle_state_slot_t) of the writer
+ * - capacity: Number of slots
+ * - count: Slots written so far; readers only need to look at these
+ */
+typedef struct anki_vehicle_state_table_header {
+    uint32_t    magic;
+    uint16_t    version;
+    uint16_t    slot_size;
+    uint32_t    capacity;
+    uint32_t    count;
+    uint8_t     _pad[ANKI_VEHICLE_STATE_TABLE_CACHE_LINE - 4 * sizeof(uint32_t)];
+} anki_vehicle_state_table_header_t;
+
+/**
+ * Fleet state shared between one writer and any number of readers, usually
+ * in different processes.
+ *
+ * The table is a header followed by capacity slots, all one cache line in
+ * size, so no two vehicles share a line. Every slot is guarded by a
+ * sequence lock: readers copy a record and retry if the writer touched it
+ * meanwhile, so they never block the writer and never see a torn record.
+ * Once mapped, reading takes no system calls.
+ *
+ * Only one thread may write to a table.
+ */
+typedef struct anki_vehicle_state_table {
+    anki_vehicle_state_table_header_t   header;
+    anki_vehicle_state_slot_t           slots[];
+} anki_vehicle_state_table_t;
+
+/**
+ * Size in bytes of a table with capacity slots.
+ */
+size_t anki_vehicle_state_table_size(uint32_t capacity);
+
+/**
+ * Set up an empty table in caller-provided memory, such as a shared mapping.
+ * mem should be aligned to ANKI_VEHICLE_STATE_TABLE_CACHE_LINE.
+ *
+ * @return the table, or NULL if size is too small.
+ */
+anki_vehicle_state_table_t *anki_vehicle_state_table_init(void *mem, size_t size, uint32_t capacity);
+
+/**
+ * Check that mem holds a table with this library's layout.
+ *
+ * @return the table, or NULL if mem is not set up, too small, or uses
+ *         another layout version.
+ */
+const anki_vehicle_state_table_t *anki_vehicle_state_table_attach(const void *mem, size_t size);
+
+/**
+ * Start updating the state of a vehicle in place. Every call must be
+ * followed by anki_vehicle_state_table_end for the same slot.
+ *
+ * @return the state to modify, or NULL if index is out of range.
+ */
+anki_vehicle_state_t *anki_vehicle_state_table_begin(anki_vehicle_state_table_t *table, uint32_t index);
+
+/**
+ * Publish the changes made since anki_vehicle_state_table_begin.
+ */
+void anki_vehicle_state_table_end(anki_vehicle_state_table_t *table, uint32_t index);
+
+/**
+ * Replace the state of a vehicle.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_vehicle_state_table_write(anki_vehicle_state_table_t *table, uint32_t index,
+                                       const anki_vehicle_state_t *state);
+
+/**
+ * Copy a consistent snapshot of the state of a vehicle. Safe from any
+ * thread or process; never blocks the writer, and returns even if the
+ * writer stopped in the middle of an update.
+ *
+ * @return 0 on success, 1 if index is out of range, 2 if the slot was
+ *         being written on every one of ANKI_VEHICLE_STATE_TABLE_READ_TRIES
+ *         attempts. state is undefined unless 0 is returned.
+ */
+uint8_t anki_vehicle_state_table_read(const anki_vehicle_state_table_t *table, uint32_t index,
+                                      anki_vehicle_state_t *state);
+
+/**
+ * Reset the state of a slot to all zeroes, e.g. before another vehicle
+ * takes it over.
+ *
+ * @return 0 on success, 1 if index is out of range.
+ */
+uint8_t anki_vehicle_state_table_clear(anki_vehicle_state_table_t *table, uint32_t index);
+
+/**
+ * Record the connection status of a vehicle.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_vehicle_state_table_set_connection(anki_vehicle_state_table_t *table, uint32_t index,
+                                                uint64_t timestamp_us, const uint8_t address[6],
+                                                anki_vehicle_connection_t connection);
+
+/**
+ * Record the battery bits of an advertisement from a vehicle.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_vehicle_state_table_set_adv_state(anki_vehicle_state_table_t *table, uint32_t index,
+                                               uint64_t timestamp_us, anki_vehicle_adv_state_t adv_state);
+
+/**
+ * Update the state of a vehicle from a message it sent. Messages that
+ * carry no state are ignored.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_vehicle_state_table_handle_msg(anki_vehicle_state_table_t *table, uint32_t index,
+                                            uint64_t timestamp_us, const anki_vehicle_msg_t *msg,
+                                            uint8_t len);
+
+/**
+ * Create an empty table with capacity slots at path, typically under
+ * /dev/shm, and map it for writing. An existing table at path is replaced
+ * rather than truncated: readers that still map it keep the old copy until
+ * they reopen path.
+ *
+ * @return the table, or NULL on failure.
+ */
+anki_vehicle_state_table_t *anki_vehicle_state_table_create(const char *path, uint32_t capacity);
+
+/**
+ * Map the table at path read-only.
+ *
+ * @return the table, or NULL on failure or layout mismatch.
+ */
+const anki_vehicle_state_table_t *anki_vehicle_state_table_open(const char *path);
+
+/**
+ * Unmap a table returned by anki_vehicle_state_table_create or
+ * anki_vehicle_state_table_open.
+ */
+void anki_vehicle_state_table_unmap(const anki_vehicle_state_table_t *table);
+
+ANKI_END_DECL
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_vehicle_stats_h
+#define INCLUDE_vehicle_stats_h
+
+#include <stdint.h>
+#include "common.h"
+
+ANKI_BEGIN_DECL
+
+/** Number of recent RSSI samples kept for trend estimation. */
+#define ANKI_VEHICLE_STATS_RSSI_WINDOW          32
+
+/** Number of recent advertising intervals kept for the interval histogram. */
+#define ANKI_VEHICLE_STATS_INTERVAL_WINDOW      32
+
+/**
+ * Number of interval histogram buckets.
+ * Bucket 0 counts intervals below 1ms, bucket i counts intervals
+ * in [2^(i-1), 2^i) ms. The last bucket also counts anything longer.
+ */
+#define ANKI_VEHICLE_STATS_INTERVAL_BUCKETS     16
+
+/**
+ * Reports closer together than this belong to the same advertising event,
+ * e.g. an advertisement and its scan response. BLE advertising intervals
+ * are at least 20ms.
+ */
+#define ANKI_VEHICLE_STATS_SAME_EVENT_US        5000
+
+/** Default smoothing factor for the RSSI exponentially weighted moving average. */
+#define ANKI_VEHICLE_STATS_DEFAULT_EWMA_ALPHA   0.125f
+
+/** Default process / measurement noise for the 1-D RSSI Kalman filter (dB^2). */
+#define ANKI_VEHICLE_STATS_DEFAULT_KALMAN_Q     0.05f
+#define ANKI_VEHICLE_STATS_DEFAULT_KALMAN_R     4.0f
+
+/**
+ * Rolling signal statistics for a single vehicle.
+ *
+ * All storage is fixed-size and every update is O(1), so a stats record can be
+ * embedded directly in a scanner's per-vehicle registry entry.
+ *
+ * - count: Number of advertising reports seen
+ * - events: Number of distinct advertising events seen
+ * - missed: Estimated number of advertisements that were not received
+ * - rssi_*: Last, minimum, maximum and smoothed signal strength in dBm
+ * - nominal_interval_us: Estimated advertising interval of the vehicle
+ * - interval_histogram: Intervals in the recent window, see
+ *   ANKI_VEHICLE_STATS_INTERVAL_BUCKETS
+ *
+ * Fields prefixed with an underscore are internal ring buffer state.
+ * ewma_alpha, kalman_q and kalman_r may be adjusted after initialization.
+ */
+typedef struct anki_vehicle_stats {
+    uint32_t    count;
+    uint32_t    events;
+    uint32_t    missed;
+    uint64_t    first_timestamp_us;
+    uint64_t    last_timestamp_us;
+
+    int8_t      rssi_last;
+    int8_t      rssi_min;
+    int8_t      rssi_max;
+    float       rssi_ewma;
+    float       rssi_kalman;
+    float       rssi_kalman_variance;
+
+    float       ewma_alpha;
+    float       kalman_q;
+    float       kalman_r;
+
+    uint32_t    nominal_interval_us;
+    uint32_t    interval_histogram[ANKI_VEHICLE_STATS_INTERVAL_BUCKETS];
+
+    int8_t      _rssi_ring[ANKI_VEHICLE_STATS_RSSI_WINDOW];
+    uint8_t     _rssi_head;
+    uint8_t     _rssi_count;
+    int32_t     _rssi_sum;          // sum of y over the window
+    int32_t     _rssi_weighted_sum; // sum of k * y, k = 0 for the oldest sample
+
+    uint32_t    _interval_ring[ANKI_VEHICLE_STATS_INTERVAL_WINDOW];
+    uint8_t     _interval_head;
+    uint8_t     _interval_count;
+    uint64_t    _interval_sum;
+    uint64_t    _event_timestamp_us;
+} anki_vehicle_stats_t;
+
+/**
+ * Initialize a stats record with default filter parameters.
+ *
+ * @param stats Pointer to the structure to initialize.
+ */
+void anki_vehicle_stats_init(anki_vehicle_stats_t *stats);
+
+/**
+ * Record an advertising report.
+ *
+ * @param stats Pointer to an initialized stats record.
+ * @param timestamp_us Time the report was received, in microseconds.
+ *        Reports with a timestamp older than the previous one update RSSI
+ *        statistics only.
+ * @param rssi Received signal strength of the report in dBm.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_vehicle_stats_update(anki_vehicle_stats_t *stats, uint64_t timestamp_us, int8_t rssi);
+
+/**
+ * Least-squares slope of RSSI over the recent sample window.
+ *
+ * @return Change in dB per advertising report, 0 if fewer than 2 samples.
+ */
+float anki_vehicle_stats_rssi_slope(const anki_vehicle_stats_t *stats);
+
+/**
+ * RSSI slope scaled by the observed report rate.
+ * A steadily negative value indicates a vehicle moving out of range.
+ *
+ * @return Change in dB per second, 0 if not enough data.
+ */
+float anki_vehicle_stats_rssi_trend(const anki_vehicle_stats_t *stats);
+
+/**
+ * Mean advertising interval over the recent window.
+ *
+ * @return Interval in microseconds, 0 if no intervals have been recorded.
+ */
+uint32_t anki_vehicle_stats_interval_mean_us(const anki_vehicle_stats_t *stats);
+
+/**
+ * Fraction of advertisements estimated lost since the first report.
+ *
+ * @return Value in [0, 1].
+ */
+float anki_vehicle_stats_loss_ratio(const anki_vehicle_stats_t *stats);
+
+/**
+ * Number of advertisements that were expected but not received since
+ * the last report. Grows while a vehicle is going out of range.
+ *
+ * @param stats Pointer to a stats record.
+ * @param now_us Current time on the same clock as the report timestamps.
+ *
+ * @return Number of overdue advertisements, 0 if unknown.
+ */
+uint32_t anki_vehicle_stats_overdue(const anki_vehicle_stats_t *stats, uint64_t now_us);
+
+ANKI_END_DECL
+
+#endif
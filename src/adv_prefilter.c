@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "adv_prefilter.h"
+#include "vehicle_gatt_profile.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define ANKI_PREFILTER_X86 1
+# include <immintrin.h>
+#endif
+
+#define UUID_LEN 16
+
+static const uint8_t anki_service_uuid[UUID_LEN] = ANKI_SERVICE_UUID_LE;
+
+typedef uint8_t (*prefilter_match_fn)(const uint8_t *data, size_t len);
+
+static uint8_t match_scalar_from(const uint8_t *data, size_t len, size_t start)
+{
+    size_t i;
+
+    if (len < UUID_LEN)
+        return 0;
+
+    for (i = start; i + UUID_LEN <= len; i++) {
+        if (data[i] == anki_service_uuid[0] &&
+            data[i + UUID_LEN - 1] == anki_service_uuid[UUID_LEN - 1] &&
+            memcmp(&data[i], anki_service_uuid, UUID_LEN) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+static uint8_t match_scalar(const uint8_t *data, size_t len)
+{
+    return match_scalar_from(data, len, 0);
+}
+
+#ifdef ANKI_PREFILTER_X86
+
+/*
+ * Compare the first and last UUID byte at 16 consecutive offsets at once,
+ * then confirm each hit with a full 16-byte compare. Block i covers offsets
+ * i .. i+15, whose last bytes end at i+30, so a 31-byte legacy advertising
+ * report is covered by a single block.
+ */
+__attribute__((target("sse2")))
+static uint8_t match_sse2_from(const uint8_t *data, size_t len, size_t start)
+{
+    const __m128i first = _mm_set1_epi8((char)anki_service_uuid[0]);
+    const __m128i last = _mm_set1_epi8((char)anki_service_uuid[UUID_LEN - 1]);
+    const __m128i pattern = _mm_loadu_si128((const __m128i *)anki_service_uuid);
+    size_t i;
+
+    for (i = start; i + 2 * UUID_LEN - 1 <= len; i += 16) {
+        __m128i head = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i tail = _mm_loadu_si128((const __m128i *)(data + i + UUID_LEN - 1));
+        unsigned int bits = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first),
+                                                            _mm_cmpeq_epi8(tail, last)));
+        while (bits != 0) {
+            __m128i candidate = _mm_loadu_si128((const __m128i *)(data + i + __builtin_ctz(bits)));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(candidate, pattern)) == 0xffff)
+                return 1;
+            bits &= bits - 1;
+        }
+    }
+
+    return match_scalar_from(data, len, i);
+}
+
+__attribute__((target("sse2")))
+static uint8_t match_sse2(const uint8_t *data, size_t len)
+{
+    return match_sse2_from(data, len, 0);
+}
+
+/* Same as the SSE2 search with 32 offsets per block, for extended advertising data. */
+__attribute__((target("avx2")))
+static uint8_t match_avx2(const uint8_t *data, size_t len)
+{
+    const __m256i first = _mm256_set1_epi8((char)anki_service_uuid[0]);
+    const __m256i last = _mm256_set1_epi8((char)anki_service_uuid[UUID_LEN - 1]);
+    const __m128i pattern = _mm_loadu_si128((const __m128i *)anki_service_uuid);
+    size_t i;
+
+    for (i = 0; i + 32 + UUID_LEN - 1 <= len; i += 32) {
+        __m256i head = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i tail = _mm256_loadu_si256((const __m256i *)(data + i + UUID_LEN - 1));
+        unsigned int bits = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first),
+                                                                  _mm256_cmpeq_epi8(tail, last)));
+        while (bits != 0) {
+            __m128i candidate = _mm_loadu_si128((const __m128i *)(data + i + __builtin_ctz(bits)));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(candidate, pattern)) == 0xffff)
+                return 1;
+            bits &= bits - 1;
+        }
+    }
+
+    return match_sse2_from(data, len, i);
+}
+
+#endif
+
+static anki_adv_prefilter_impl_t prefilter_impl = ANKI_ADV_PREFILTER_AUTO;
+static prefilter_match_fn prefilter_match = NULL;
+
+static uint8_t impl_supported(anki_adv_prefilter_impl_t impl)
+{
+    switch (impl) {
+        case ANKI_ADV_PREFILTER_SCALAR:
+            return 1;
+#ifdef ANKI_PREFILTER_X86
+        case ANKI_ADV_PREFILTER_SSE2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2") ? 1 : 0;
+        case ANKI_ADV_PREFILTER_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") ? 1 : 0;
+#endif
+        default:
+            return 0;
+    }
+}
+
+uint8_t anki_vehicle_adv_prefilter_set_impl(anki_adv_prefilter_impl_t impl)
+{
+    if (impl == ANKI_ADV_PREFILTER_AUTO) {
+        if (impl_supported(ANKI_ADV_PREFILTER_AVX2))
+            impl = ANKI_ADV_PREFILTER_AVX2;
+        else if (impl_supported(ANKI_ADV_PREFILTER_SSE2))
+            impl = ANKI_ADV_PREFILTER_SSE2;
+        else
+            impl = ANKI_ADV_PREFILTER_SCALAR;
+    } else if (!impl_supported(impl)) {
+        return 1;
+    }
+
+    switch (impl) {
+#ifdef ANKI_PREFILTER_X86
+        case ANKI_ADV_PREFILTER_SSE2:
+            prefilter_match = match_sse2;
+            break;
+        case ANKI_ADV_PREFILTER_AVX2:
+            prefilter_match = match_avx2;
+            break;
+#endif
+        default:
+            prefilter_match = match_scalar;
+            break;
+    }
+    prefilter_impl = impl;
+
+    return 0;
+}
+
+anki_adv_prefilter_impl_t anki_vehicle_adv_prefilter_get_impl(void)
+{
+    if (prefilter_match == NULL)
+        anki_vehicle_adv_prefilter_set_impl(ANKI_ADV_PREFILTER_AUTO);
+
+    return prefilter_impl;
+}
+
+size_t anki_vehicle_adv_prefilter(const uint8_t *const *reports, const size_t *lens, size_t count, uint64_t *mask)
+{
+    prefilter_match_fn match;
+    size_t candidates = 0;
+    size_t i;
+
+    if (prefilter_match == NULL)
+        anki_vehicle_adv_prefilter_set_impl(ANKI_ADV_PREFILTER_AUTO);
+    match = prefilter_match;
+
+    memset(mask, 0, ANKI_ADV_PREFILTER_MASK_WORDS(count) * sizeof(uint64_t));
+
+    for (i = 0; i < count; i++) {
+        if (reports[i] == NULL || !match(reports[i], lens[i]))
+            continue;
+
+        mask[i / 64] |= (uint64_t)1 << (i % 64);
+        candidates++;
+    }
+
+    return candidates;
+}
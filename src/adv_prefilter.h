@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_adv_prefilter_h
+#define INCLUDE_adv_prefilter_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include "common.h"
+
+ANKI_BEGIN_DECL
+
+/**
+ * Implementation used by anki_vehicle_adv_prefilter().
+ *
+ * - AUTO: Fastest implementation supported by the running CPU
+ * - SCALAR: Portable byte-wise search
+ * - SSE2: 16 candidate offsets per step (x86 only)
+ * - AVX2: 32 candidate offsets per step for long reports (x86 only)
+ */
+typedef enum {
+    ANKI_ADV_PREFILTER_AUTO = 0,
+    ANKI_ADV_PREFILTER_SCALAR,
+    ANKI_ADV_PREFILTER_SSE2,
+    ANKI_ADV_PREFILTER_AVX2,
+} anki_adv_prefilter_impl_t;
+
+/** Number of uint64_t words needed for a prefilter mask of count reports. */
+#define ANKI_ADV_PREFILTER_MASK_WORDS(count)  (((count) + 63) / 64)
+
+/**
+ * Select the prefilter implementation.
+ * Intended for benchmarks and tests; the default is ANKI_ADV_PREFILTER_AUTO.
+ *
+ * @param impl Implementation to use.
+ *
+ * @return 0 on success, 1 if the implementation is not supported on this CPU.
+ */
+uint8_t anki_vehicle_adv_prefilter_set_impl(anki_adv_prefilter_impl_t impl);
+
+/**
+ * Implementation currently used by the prefilter, after resolving AUTO.
+ */
+anki_adv_prefilter_impl_t anki_vehicle_adv_prefilter_get_impl(void);
+
+/**
+ * Find advertising reports that may belong to an Anki Drive vehicle.
+ *
+ * Each report is searched for the 16-byte ANKI_SERVICE_UUID_LE pattern
+ * anywhere in its data. This is a cheap superset test: every report that
+ * anki_vehicle_adv_record_has_anki_uuid() accepts is a candidate, and only
+ * candidates need to be fully parsed.
+ *
+ * @param reports Array of count pointers to raw advertising data.
+ * @param lens Array of count report lengths in bytes.
+ * @param count Number of reports.
+ * @param mask Bitmask of ANKI_ADV_PREFILTER_MASK_WORDS(count) words.
+ *        Bit (i % 64) of mask[i / 64] is set if report i is a candidate.
+ *
+ * @return Number of candidate reports.
+ */
+size_t anki_vehicle_adv_prefilter(const uint8_t *const *reports, const size_t *lens, size_t count, uint64_t *mask);
+
+ANKI_END_DECL
+
+#endif
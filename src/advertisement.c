@@ -8,9 +8,9 @@
 #include "uuid.h"
 #include "anki_util.h"
 
-#define VEHICLE_STATE_FULL_BATTERY  (1 << 4)
-#define VEHICLE_STATE_LOW_BATTERY   (1 << 5)
-#define VEHICLE_STATE_ON_CHARGER    (1 << 6)
+#define VEHICLE_STATE_FULL_BATTERY  ANKI_VEHICLE_ADV_STATE_FULL_BATTERY
+#define VEHICLE_STATE_LOW_BATTERY   ANKI_VEHICLE_ADV_STATE_LOW_BATTERY
+#define VEHICLE_STATE_ON_CHARGER    ANKI_VEHICLE_ADV_STATE_ON_CHARGER
 #define IS_VEHICLE_STATE_SET(state, flag) ( ((state) & (flag)) == (flag) )
 
 int is_anki_vehicle_service_uuid(uuid128_t *a);
@@ -130,3 +130,97 @@ uint8_t anki_vehicle_parse_local_name(const uint8_t *bytes, uint8_t len, anki_ve
 
     return 0;
 }
+
+#define BITMAP_SET(bitmap, i) \
+    do { if ((bitmap) != NULL) (bitmap)[(i) / 64] |= (uint64_t)1 << ((i) % 64); } while (0)
+
+#define COLUMN_SET(column, i, value) \
+    do { if ((column) != NULL) (column)[(i)] = (value); } while (0)
+
+static void clear_bitmap(uint64_t *bitmap, size_t count)
+{
+    if (bitmap != NULL)
+        memset(bitmap, 0, ANKI_VEHICLE_ADV_BITMAP_WORDS(count) * sizeof(uint64_t));
+}
+
+size_t anki_vehicle_parse_adv_batch(const uint8_t *const *reports, const size_t *lens, size_t count, anki_vehicle_adv_columns_t *columns)
+{
+    static const uint8_t ANKI_SERVICE_UUID_BYTES[16] = ANKI_SERVICE_UUID_LE;
+    size_t matched = 0;
+    size_t row;
+
+    if (columns == NULL)
+        return 0;
+
+    clear_bitmap(columns->valid_uuid, count);
+    clear_bitmap(columns->valid_mfg, count);
+    clear_bitmap(columns->valid_name, count);
+
+    for (row = 0; row < count; row++) {
+        const uint8_t *scan_data = reports[row];
+        size_t scan_data_len = (scan_data != NULL) ? lens[row] : 0;
+        size_t i = 0;
+        uint8_t anki = 0;
+
+        COLUMN_SET(columns->identifier, row, 0);
+        COLUMN_SET(columns->model_id, row, 0);
+        COLUMN_SET(columns->product_id, row, 0);
+        COLUMN_SET(columns->version, row, 0);
+        COLUMN_SET(columns->state, row, 0);
+        COLUMN_SET(columns->name_offset, row, 0);
+        COLUMN_SET(columns->name_len, row, 0);
+
+        while (i + 1 < scan_data_len) {
+            uint8_t len = scan_data[i];
+            if (len == 0 || i + 1 + len > scan_data_len)
+                break;
+
+            ble_adv_record_type_t type = scan_data[i + 1];
+            const uint8_t *data = &scan_data[i + 2];
+            uint8_t data_len = len - 1;
+
+            switch (type) {
+                case ADV_TYPE_UUID_128:
+                    if (data_len == sizeof(uuid128_t) &&
+                        memcmp(data, ANKI_SERVICE_UUID_BYTES, sizeof(uuid128_t)) == 0) {
+                        BITMAP_SET(columns->valid_uuid, row);
+                        // A report may repeat the record, count it once
+                        if (!anki)
+                            matched++;
+                        anki = 1;
+                    }
+                    break;
+                case ADV_TYPE_MANUFACTURER_DATA:
+                {
+                    anki_vehicle_adv_mfg_t mfg;
+                    if (anki_vehicle_parse_mfg_data(data, data_len, &mfg) != 0)
+                        break;
+                    COLUMN_SET(columns->identifier, row, mfg.identifier);
+                    COLUMN_SET(columns->model_id, row, mfg.model_id);
+                    COLUMN_SET(columns->product_id, row, mfg.product_id);
+                    BITMAP_SET(columns->valid_mfg, row);
+                    break;
+                }
+                case ADV_TYPE_LOCAL_NAME:
+                    // Same layout as anki_vehicle_parse_local_name()
+                    if (data_len == 0)
+                        break;
+                    COLUMN_SET(columns->state, row, data[0] & ANKI_VEHICLE_ADV_STATE_MASK);
+                    if (data_len > 1)
+                        COLUMN_SET(columns->version, row, data[1] | ((data_len > 2) ? (data[2] << 8) : 0));
+                    if (data_len > 8) {
+                        COLUMN_SET(columns->name_offset, row, (uint16_t)(i + 2 + 8));
+                        COLUMN_SET(columns->name_len, row, data_len - 8);
+                    }
+                    BITMAP_SET(columns->valid_name, row);
+                    break;
+                default:
+                    break;
+            }
+
+            i += 1 + len;
+        }
+    }
+
+    return matched;
+}
@@ -0,0 +1,464 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fleet_controller.h"
+#include "timeline.h"
+
+struct anki_fleet_worker {
+    struct anki_fleet_workers *pool;
+    uint8_t     index;
+    pthread_t   thread;
+};
+
+struct anki_fleet_workers {
+    anki_fleet_controller_t *ctrl;
+    struct anki_fleet_worker workers[ANKI_FLEET_MAX_WORKERS];
+    uint8_t     count;
+    uint8_t     parts;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  start;
+    pthread_cond_t  done;
+    uint32_t    generation;
+    uint8_t     pending;
+    uint8_t     quit;
+};
+
+void anki_fleet_config_default(anki_fleet_config_t *config)
+{
+    memset(config, 0, sizeof(anki_fleet_config_t));
+    config->tick_us = 20000;
+    config->budget_us = 2000;
+    config->min_gap_mm = 150.0f;
+    config->time_gap_sec = 0.4f;
+    config->gap_gain = 2.0f;
+    config->lane_width_mm = 30.0f;
+    config->overtake_distance_mm = 500.0f;
+    config->overtake_margin_mm_per_sec = 100.0f;
+    config->clear_behind_mm = 200.0f;
+    config->clear_ahead_mm = 400.0f;
+    config->lane_hold_us = 1500000;
+    config->accel_mm_per_sec2 = 1000;
+    config->lane_speed_mm_per_sec = 100;
+    config->lane_count = 4;
+    config->lane_offsets_mm[0] = -68.0f;
+    config->lane_offsets_mm[1] = -23.0f;
+    config->lane_offsets_mm[2] = 23.0f;
+    config->lane_offsets_mm[3] = 68.0f;
+    config->workers = 0;
+    // Crossover measured by fleet-bench with one worker: handing off a tick
+    // costs about 7.5us, half of the planning of 32 cars
+    config->parallel_min = 32;
+}
+
+static inline float absf(float x)
+{
+    return (x < 0.0f) ? -x : x;
+}
+
+// Distance from a to b driving forward, in [0, length)
+static inline float gap_ahead(float a, float b, float length)
+{
+    float d = b - a;
+    while (d < 0.0f)
+        d += length;
+    while (d >= length)
+        d -= length;
+    return d;
+}
+
+static uint8_t nearest_lane(const anki_fleet_config_t *config, float offset_mm)
+{
+    uint8_t best = 0;
+    uint8_t k;
+
+    for (k = 1; k < config->lane_count; k++) {
+        if (absf(config->lane_offsets_mm[k] - offset_mm) < absf(config->lane_offsets_mm[best] - offset_mm))
+            best = k;
+    }
+    return best;
+}
+
+static inline uint8_t is_active(const anki_fleet_controller_t *ctrl, uint8_t i)
+{
+    return ctrl->active == NULL || ctrl->active[i];
+}
+
+// No other car in or moving to the given lane within the clearance window
+// around distance d. Target lanes only change on the calling thread, so
+// workers see those of the previous tick.
+static uint8_t lane_clear(const anki_fleet_controller_t *ctrl, uint8_t self, uint8_t lane)
+{
+    const anki_fleet_config_t *config = &ctrl->config;
+    float lane_offset = config->lane_offsets_mm[lane];
+    float d = ctrl->distance_mm[self];
+    uint8_t j;
+
+    for (j = 0; j < ctrl->count; j++) {
+        float ahead;
+
+        if (j == self || !is_active(ctrl, j))
+            continue;
+        if (absf(ctrl->offset_mm[j] - lane_offset) >= config->lane_width_mm &&
+            ctrl->target_lane[j] != lane)
+            continue;
+
+        ahead = gap_ahead(d, ctrl->distance_mm[j], ctrl->track_length_mm);
+        if (ahead < config->clear_ahead_mm || ctrl->track_length_mm - ahead < config->clear_behind_mm)
+            return 0;
+    }
+    return 1;
+}
+
+static void plan_vehicle(anki_fleet_controller_t *ctrl, uint8_t i)
+{
+    const anki_fleet_config_t *config = &ctrl->config;
+    float d = ctrl->distance_mm[i];
+    float offset = ctrl->offset_mm[i];
+    float target_offset = offset;
+    float cruise = ctrl->cruise[i];
+    float best_gap = ctrl->track_length_mm;
+    float command = cruise;
+    uint8_t lane_choice = ctrl->target_lane[i];
+    int16_t leader = -1;
+    uint8_t j;
+
+    if (ctrl->target_lane[i] != ANKI_FLEET_LANE_NONE)
+        target_offset = config->lane_offsets_mm[ctrl->target_lane[i]];
+
+    // Nearest car ahead in the lane this car is in or moving to
+    for (j = 0; j < ctrl->count; j++) {
+        float gap;
+
+        if (j == i || !is_active(ctrl, j))
+            continue;
+        if (absf(ctrl->offset_mm[j] - offset) >= config->lane_width_mm &&
+            absf(ctrl->offset_mm[j] - target_offset) >= config->lane_width_mm)
+            continue;
+
+        gap = gap_ahead(d, ctrl->distance_mm[j], ctrl->track_length_mm);
+        if (gap > 0.0f && gap < best_gap) {
+            best_gap = gap;
+            leader = j;
+        }
+    }
+
+    if (leader >= 0) {
+        float lead_speed = ctrl->speed_mm_per_sec[leader];
+        float desired = config->min_gap_mm + config->time_gap_sec * ctrl->speed_mm_per_sec[i];
+        float follow = lead_speed + config->gap_gain * (best_gap - desired);
+
+        if (best_gap < config->min_gap_mm)
+            follow = 0.0f;
+        if (follow < command)
+            command = follow;
+        if (command < 0.0f)
+            command = 0.0f;
+
+        // Held up by a slower car: try the adjacent lanes
+        if (ctrl->overtake && cruise > 0.0f && ctrl->now_us >= ctrl->lane_hold_until_us[i] &&
+            best_gap < config->overtake_distance_mm &&
+            lead_speed + config->overtake_margin_mm_per_sec < cruise) {
+            uint8_t lane = nearest_lane(config, offset);
+            uint8_t candidates[2];
+            uint8_t n = 0, k;
+
+            if (lane + 1 < config->lane_count)
+                candidates[n++] = lane + 1;
+            if (lane > 0)
+                candidates[n++] = lane - 1;
+
+            for (k = 0; k < n; k++) {
+                if (lane_clear(ctrl, i, candidates[k])) {
+                    lane_choice = candidates[k];
+                    break;
+                }
+            }
+        }
+    }
+
+    ctrl->plan_speed[i] = (uint16_t)(command + 0.5f);
+    ctrl->plan_lane[i] = lane_choice;
+}
+
+static void plan_range(anki_fleet_controller_t *ctrl, uint8_t part, uint8_t parts)
+{
+    uint8_t begin = (uint8_t)((uint32_t)ctrl->count * part / parts);
+    uint8_t end = (uint8_t)((uint32_t)ctrl->count * (part + 1) / parts);
+    uint8_t i;
+
+    for (i = begin; i < end; i++) {
+        if (is_active(ctrl, i))
+            plan_vehicle(ctrl, i);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct anki_fleet_worker *worker = arg;
+    struct anki_fleet_workers *pool = worker->pool;
+    uint32_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == seen && !pool->quit)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->quit)
+            break;
+        seen = pool->generation;
+
+        // Part 0 is planned by the calling thread
+        if (worker->index + 1 < pool->parts) {
+            pthread_mutex_unlock(&pool->lock);
+            plan_range(pool->ctrl, worker->index + 1, pool->parts);
+            pthread_mutex_lock(&pool->lock);
+        }
+
+        if (--pool->pending == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void stop_workers(struct anki_fleet_workers *pool, uint8_t count)
+{
+    uint8_t i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < count; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+static struct anki_fleet_workers *start_workers(anki_fleet_controller_t *ctrl, uint8_t count)
+{
+    struct anki_fleet_workers *pool = calloc(1, sizeof(struct anki_fleet_workers));
+    uint8_t i;
+
+    if (pool == NULL)
+        return NULL;
+
+    pool->ctrl = ctrl;
+    pool->count = count;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (i = 0; i < count; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0) {
+            stop_workers(pool, i);
+            free(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+static void plan_parallel(anki_fleet_controller_t *ctrl)
+{
+    struct anki_fleet_workers *pool = ctrl->workers;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->parts = pool->count + 1;
+    pool->pending = pool->count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    plan_range(ctrl, 0, pool->count + 1);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+uint8_t anki_fleet_controller_init(anki_fleet_controller_t *ctrl, const anki_fleet_config_t *config,
+                                   anki_fleet_emit_func_t emit, void *user_data)
+{
+    uint8_t i;
+
+    if (ctrl == NULL || config == NULL || emit == NULL)
+        return 1;
+    if (config->lane_count == 0 || config->lane_count > ANKI_FLEET_MAX_LANES ||
+        config->workers > ANKI_FLEET_MAX_WORKERS || config->tick_us == 0)
+        return 1;
+
+    memset(ctrl, 0, sizeof(anki_fleet_controller_t));
+    ctrl->config = *config;
+    ctrl->emit = emit;
+    ctrl->user_data = user_data;
+
+    for (i = 0; i < ANKI_FLEET_MAX_VEHICLES; i++) {
+        anki_vehicle_cmd_gate_init(&ctrl->gates[i]);
+        ctrl->target_lane[i] = ANKI_FLEET_LANE_NONE;
+    }
+
+    if (config->workers > 0) {
+        ctrl->workers = start_workers(ctrl, config->workers);
+        if (ctrl->workers == NULL)
+            return 1;
+    }
+
+    return 0;
+}
+
+void anki_fleet_controller_destroy(anki_fleet_controller_t *ctrl)
+{
+    if (ctrl == NULL || ctrl->workers == NULL)
+        return;
+
+    stop_workers(ctrl->workers, ctrl->workers->count);
+    free(ctrl->workers);
+    ctrl->workers = NULL;
+}
+
+uint8_t anki_fleet_controller_set_cruise(anki_fleet_controller_t *ctrl, uint8_t vehicle,
+                                         uint16_t speed_mm_per_sec)
+{
+    if (ctrl == NULL || vehicle >= ANKI_FLEET_MAX_VEHICLES)
+        return 1;
+
+    ctrl->cruise[vehicle] = speed_mm_per_sec;
+    return 0;
+}
+
+uint8_t anki_fleet_controller_tick(anki_fleet_controller_t *ctrl, uint64_t timestamp_us, uint8_t count,
+                                   const float *distance_mm, const float *offset_mm,
+                                   const float *speed_mm_per_sec, const uint8_t *active,
+                                   float track_length_mm)
+{
+    const anki_fleet_config_t *config;
+    anki_vehicle_msg_t msg;
+    uint64_t started = anki_timeline_now_us();
+    uint32_t cost;
+    uint8_t len;
+    uint8_t i;
+
+    if (ctrl == NULL || count > ANKI_FLEET_MAX_VEHICLES || track_length_mm <= 0.0f)
+        return 1;
+    if (count > 0 && (distance_mm == NULL || offset_mm == NULL || speed_mm_per_sec == NULL))
+        return 1;
+
+    config = &ctrl->config;
+    ctrl->count = count;
+    ctrl->distance_mm = distance_mm;
+    ctrl->offset_mm = offset_mm;
+    ctrl->speed_mm_per_sec = speed_mm_per_sec;
+    ctrl->active = active;
+    ctrl->track_length_mm = track_length_mm;
+    ctrl->now_us = timestamp_us;
+
+    // Shed overtake planning for one tick after going over budget
+    ctrl->overtake = !(ctrl->stats.ticks > 0 && ctrl->stats.last_us > config->budget_us);
+    if (!ctrl->overtake)
+        ctrl->stats.degraded++;
+
+    if (ctrl->workers != NULL && count >= config->parallel_min) {
+        plan_parallel(ctrl);
+        ctrl->stats.parallel++;
+    } else
+        plan_range(ctrl, 0, 1);
+
+    // Commands go out on the calling thread, through the change-suppressing gates
+    for (i = 0; i < count; i++) {
+        if (!is_active(ctrl, i))
+            continue;
+
+        len = anki_vehicle_cmd_gate_set_speed(&ctrl->gates[i], timestamp_us, &msg,
+                                              ctrl->plan_speed[i], config->accel_mm_per_sec2);
+        if (len > 0)
+            ctrl->emit(i, &msg, len, ctrl->user_data);
+
+        // Cars planned in the same tick may pick the same lane, the first one gets it
+        if (ctrl->plan_lane[i] != ctrl->target_lane[i]) {
+            if (lane_clear(ctrl, i, ctrl->plan_lane[i])) {
+                ctrl->target_lane[i] = ctrl->plan_lane[i];
+                ctrl->lane_hold_until_us[i] = timestamp_us + config->lane_hold_us;
+            } else {
+                ctrl->plan_lane[i] = ctrl->target_lane[i];
+            }
+        }
+
+        if (ctrl->plan_lane[i] != ANKI_FLEET_LANE_NONE) {
+            len = anki_vehicle_cmd_gate_change_lane(&ctrl->gates[i], timestamp_us, &msg,
+                                                    config->lane_speed_mm_per_sec,
+                                                    config->lane_offsets_mm[ctrl->plan_lane[i]]);
+            if (len > 0)
+                ctrl->emit(i, &msg, len, ctrl->user_data);
+        }
+    }
+
+    ctrl->distance_mm = NULL;
+    ctrl->offset_mm = NULL;
+    ctrl->speed_mm_per_sec = NULL;
+    ctrl->active = NULL;
+
+    cost = (uint32_t)(anki_timeline_now_us() - started);
+    ctrl->stats.ticks++;
+    ctrl->stats.last_us = cost;
+    ctrl->stats.total_us += cost;
+    if (cost > ctrl->stats.max_us)
+        ctrl->stats.max_us = cost;
+    if (cost > config->budget_us)
+        ctrl->stats.overruns++;
+
+    return 0;
+}
+
+uint8_t anki_fleet_controller_poll(anki_fleet_controller_t *ctrl, uint64_t timestamp_us,
+                                   const anki_vehicle_predictor_t *pred)
+{
+    uint64_t late;
+
+    if (ctrl == NULL || pred == NULL)
+        return 0;
+
+    if (ctrl->next_tick_us == 0)
+        ctrl->next_tick_us = timestamp_us;
+    if (timestamp_us < ctrl->next_tick_us)
+        return 0;
+
+    late = (timestamp_us - ctrl->next_tick_us) / ctrl->config.tick_us;
+    ctrl->stats.skipped += late;
+    ctrl->next_tick_us += (late + 1) * ctrl->config.tick_us;
+
+    anki_vehicle_predictor_predict_all(pred, timestamp_us, ctrl->predicted_distance_mm,
+                                       ctrl->predicted_offset_mm, ctrl->predicted_speed);
+
+    return anki_fleet_controller_tick(ctrl, timestamp_us, pred->count,
+                                      ctrl->predicted_distance_mm, ctrl->predicted_offset_mm,
+                                      ctrl->predicted_speed, pred->valid,
+                                      pred->track_length_mm) == 0;
+}
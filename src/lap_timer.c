@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "lap_timer.h"
+#include "seqlock.h"
+
+static inline uint32_t elapsed_us(uint64_t from_us, uint64_t to_us)
+{
+    uint64_t d = to_us - from_us;
+    return (d > UINT32_MAX) ? UINT32_MAX : (uint32_t)d;
+}
+
+// The board is only modified between these two calls, by the updating thread
+static inline void board_write_begin(anki_lap_timer_t *timer)
+{
+    ANKI_SEQLOCK_WRITE_BEGIN(&timer->seq, timer->seq + 1);
+}
+
+static inline void board_write_end(anki_lap_timer_t *timer)
+{
+    ANKI_SEQLOCK_WRITE_END(&timer->seq, timer->seq + 1);
+}
+
+static inline uint8_t ahead_of(const anki_lap_result_t *a, const anki_lap_result_t *b)
+{
+    return a->laps > b->laps || (a->laps == b->laps && a->last_crossing_us < b->last_crossing_us);
+}
+
+// Move vehicle up the order after it crossed the line. Crossing never moves
+// a vehicle back, so one insertion step keeps the order sorted.
+static void board_promote(anki_lap_board_t *board, uint8_t vehicle)
+{
+    uint8_t pos;
+
+    for (pos = 0; pos < board->count; pos++) {
+        if (board->order[pos] == vehicle)
+            break;
+    }
+    if (pos == board->count)
+        board->order[board->count++] = vehicle;
+
+    while (pos > 0 && ahead_of(&board->results[vehicle], &board->results[board->order[pos - 1]])) {
+        board->order[pos] = board->order[pos - 1];
+        pos--;
+    }
+    board->order[pos] = vehicle;
+}
+
+static void record_sector(anki_lap_result_t *result, uint8_t sector, uint32_t time_us)
+{
+    result->last_sector_us[sector] = time_us;
+    if (result->best_sector_us[sector] == 0 || time_us < result->best_sector_us[sector])
+        result->best_sector_us[sector] = time_us;
+}
+
+static void cross_line(anki_lap_timer_t *timer, uint8_t vehicle, uint64_t t)
+{
+    anki_lap_vehicle_state_t *state = &timer->state[vehicle];
+    anki_lap_result_t *result = &timer->board.results[vehicle];
+    uint32_t lap_us = 0;
+
+    if (!timer->racing || t < timer->race_start_us)
+        return;
+
+    if (state->timing) {
+        lap_us = elapsed_us(state->lap_start_us, t);
+        if (lap_us < timer->config.min_lap_us)
+            return;
+    }
+
+    board_write_begin(timer);
+    if (state->timing) {
+        record_sector(result, state->sector, elapsed_us(state->sector_start_us, t));
+        result->laps++;
+        result->last_lap_us = lap_us;
+        if (result->best_lap_us == 0 || lap_us < result->best_lap_us)
+            result->best_lap_us = lap_us;
+        if (timer->board.best_lap_us == 0 || lap_us < timer->board.best_lap_us) {
+            timer->board.best_lap_us = lap_us;
+            timer->board.best_lap_vehicle = vehicle;
+        }
+    }
+    result->last_crossing_us = t;
+    board_promote(&timer->board, vehicle);
+    board_write_end(timer);
+
+    state->timing = 1;
+    state->lap_start_us = t;
+    state->sector_start_us = t;
+    state->sector = 0;
+    state->pieces = 0;
+}
+
+static void enter_piece(anki_lap_timer_t *timer, uint8_t vehicle, uint64_t t)
+{
+    anki_lap_vehicle_state_t *state = &timer->state[vehicle];
+
+    if (!state->timing)
+        return;
+
+    state->pieces++;
+    if (state->sector + 1 < timer->config.sector_count &&
+        state->pieces == timer->config.sector_end_piece[state->sector]) {
+        board_write_begin(timer);
+        record_sector(&timer->board.results[vehicle], state->sector, elapsed_us(state->sector_start_us, t));
+        board_write_end(timer);
+
+        state->sector++;
+        state->sector_start_us = t;
+    }
+}
+
+void anki_lap_timer_config_default(anki_lap_timer_config_t *config)
+{
+    memset(config, 0, sizeof(anki_lap_timer_config_t));
+    config->finish_piece_id = ANKI_LAP_TIMER_DEFAULT_FINISH_PIECE_ID;
+    config->min_lap_us = ANKI_LAP_TIMER_DEFAULT_MIN_LAP_US;
+    config->sector_count = 1;
+}
+
+uint8_t anki_lap_timer_init(anki_lap_timer_t *timer, const anki_lap_timer_config_t *config,
+                            uint8_t vehicle_count)
+{
+    uint8_t i;
+
+    if (timer == NULL || config == NULL)
+        return 1;
+    if (vehicle_count == 0 || vehicle_count > ANKI_LAP_TIMER_MAX_VEHICLES)
+        return 1;
+    if (config->sector_count == 0 || config->sector_count > ANKI_LAP_TIMER_MAX_SECTORS)
+        return 1;
+
+    // Sector ends must be strictly increasing piece counts
+    for (i = 0; i + 1 < config->sector_count; i++) {
+        if (config->sector_end_piece[i] == 0)
+            return 1;
+        if (i > 0 && config->sector_end_piece[i] <= config->sector_end_piece[i - 1])
+            return 1;
+    }
+
+    memset(timer, 0, sizeof(anki_lap_timer_t));
+    timer->config = *config;
+    timer->vehicle_count = vehicle_count;
+
+    return 0;
+}
+
+void anki_lap_timer_start_race(anki_lap_timer_t *timer, uint64_t start_us)
+{
+    board_write_begin(timer);
+    memset(&timer->board, 0, sizeof(anki_lap_board_t));
+    board_write_end(timer);
+
+    memset(timer->state, 0, sizeof(timer->state));
+    timer->race_start_us = start_us;
+    timer->racing = 1;
+}
+
+uint8_t anki_lap_timer_transition(anki_lap_timer_t *timer, uint8_t vehicle, uint64_t timestamp_us)
+{
+    if (timer == NULL || vehicle >= timer->vehicle_count)
+        return 1;
+
+    timer->state[vehicle].transition_us = timestamp_us;
+    timer->state[vehicle].has_transition = 1;
+
+    return 0;
+}
+
+uint8_t anki_lap_timer_position(anki_lap_timer_t *timer, uint8_t vehicle, uint8_t road_piece_id)
+{
+    anki_lap_vehicle_state_t *state;
+
+    if (timer == NULL || vehicle >= timer->vehicle_count)
+        return 1;
+
+    state = &timer->state[vehicle];
+    if (!state->has_transition)
+        return 0;
+
+    // Time the piece change at the transition, which is reported when the
+    // vehicle actually leaves the previous piece
+    state->has_transition = 0;
+    if (road_piece_id == timer->config.finish_piece_id)
+        cross_line(timer, vehicle, state->transition_us);
+    else
+        enter_piece(timer, vehicle, state->transition_us);
+
+    return 0;
+}
+
+uint8_t anki_lap_timer_handle_msg(anki_lap_timer_t *timer, uint8_t vehicle, uint64_t timestamp_us,
+                                  const anki_vehicle_msg_t *msg, uint8_t len)
+{
+    if (timer == NULL || msg == NULL || len < ANKI_VEHICLE_MSG_BASE_SIZE + 1)
+        return 1;
+    if (vehicle >= timer->vehicle_count)
+        return 1;
+
+    switch (msg->msg_id) {
+    case ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE:
+        if (len < ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE_SIZE + ANKI_VEHICLE_MSG_BASE_SIZE)
+            return 1;
+        return anki_lap_timer_position(timer, vehicle,
+                ((const anki_vehicle_msg_localization_position_update_t *)msg)->road_piece_id);
+
+    case ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE:
+        return anki_lap_timer_transition(timer, vehicle, timestamp_us);
+
+    case ANKI_VEHICLE_MSG_V2C_VEHICLE_DELOCALIZED:
+        // Pieces may have been missed: restart timing at the next crossing
+        timer->state[vehicle].has_transition = 0;
+        timer->state[vehicle].timing = 0;
+        return 0;
+
+    default:
+        return 0;
+    }
+}
+
+void anki_lap_timer_read_board(const anki_lap_timer_t *timer, anki_lap_board_t *board)
+{
+    for (;;) {
+        uint32_t before = ANKI_SEQLOCK_READ_BEGIN(&timer->seq);
+
+        if (before & 1)
+            continue;
+
+        memcpy(board, &timer->board, sizeof(anki_lap_board_t));
+        if (!ANKI_SEQLOCK_READ_RETRY(&timer->seq, before))
+            return;
+    }
+}
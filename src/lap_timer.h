@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_lap_timer_h
+#define INCLUDE_lap_timer_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "protocol.h"
+
+ANKI_BEGIN_DECL
+
+/** Largest number of vehicles in a race. */
+#define ANKI_LAP_TIMER_MAX_VEHICLES     16
+
+/** Largest number of sectors a lap is split into. */
+#define ANKI_LAP_TIMER_MAX_SECTORS      4
+
+/** Road piece id of the start/finish line piece. */
+#define ANKI_LAP_TIMER_DEFAULT_FINISH_PIECE_ID  33
+
+/** Crossings closer together than this are not counted as laps. */
+#define ANKI_LAP_TIMER_DEFAULT_MIN_LAP_US       1000000
+
+/**
+ * Lap timer parameters.
+ *
+ * - finish_piece_id: Entering this road piece crosses the start/finish line
+ * - min_lap_us: Shortest lap accepted; filters repeated line reports
+ * - sector_count: Number of sectors per lap, 1 for lap times only
+ * - sector_end_piece: Number of pieces entered after the line at which
+ *   each sector but the last ends. The last sector ends at the line.
+ */
+typedef struct anki_lap_timer_config {
+    uint8_t     finish_piece_id;
+    uint32_t    min_lap_us;
+    uint8_t     sector_count;
+    uint8_t     sector_end_piece[ANKI_LAP_TIMER_MAX_SECTORS - 1];
+} anki_lap_timer_config_t;
+
+/**
+ * Race results of one vehicle. Times are in microseconds; 0 means
+ * "not yet recorded".
+ *
+ * - laps: Completed laps
+ * - last_lap_us, best_lap_us: Lap times
+ * - last_sector_us, best_sector_us: Sector times, see anki_lap_timer_config_t
+ * - last_crossing_us: Timestamp of the latest start/finish crossing
+ */
+typedef struct anki_lap_result {
+    uint16_t    laps;
+    uint32_t    last_lap_us;
+    uint32_t    best_lap_us;
+    uint32_t    last_sector_us[ANKI_LAP_TIMER_MAX_SECTORS];
+    uint32_t    best_sector_us[ANKI_LAP_TIMER_MAX_SECTORS];
+    uint64_t    last_crossing_us;
+} anki_lap_result_t;
+
+/**
+ * Leaderboard of a race.
+ *
+ * - count: Number of vehicles that have crossed the line
+ * - order: Vehicle indices by race position: most laps first, then
+ *          earliest last crossing
+ * - results: Results indexed by vehicle
+ * - best_lap_us, best_lap_vehicle: Fastest lap of the race
+ */
+typedef struct anki_lap_board {
+    uint8_t             count;
+    uint8_t             order[ANKI_LAP_TIMER_MAX_VEHICLES];
+    anki_lap_result_t   results[ANKI_LAP_TIMER_MAX_VEHICLES];
+    uint32_t            best_lap_us;
+    uint8_t             best_lap_vehicle;
+} anki_lap_board_t;
+
+/** Per-vehicle timing state, internal to the lap timer. */
+typedef struct anki_lap_vehicle_state {
+    uint64_t    transition_us;
+    uint64_t    lap_start_us;
+    uint64_t    sector_start_us;
+    uint16_t    pieces;
+    uint8_t     sector;
+    uint8_t     has_transition;
+    uint8_t     timing;
+} anki_lap_vehicle_state_t;
+
+/**
+ * Lap and sector timing for a race.
+ *
+ * A transition update marks the time a vehicle enters a new road piece, and
+ * the position update that follows says which piece it was. Entering the
+ * finish piece completes a lap; the first crossing after the race starts
+ * begins timing (flying start).
+ *
+ * All updates must come from one thread. The leaderboard is published
+ * with a sequence lock, so any number of other threads can read it with
+ * anki_lap_timer_read_board without blocking the updating thread.
+ */
+typedef struct anki_lap_timer {
+    anki_lap_timer_config_t     config;
+    uint8_t                     vehicle_count;
+    uint8_t                     racing;
+    uint64_t                    race_start_us;
+    anki_lap_vehicle_state_t    state[ANKI_LAP_TIMER_MAX_VEHICLES];
+
+    uint32_t                    seq;
+    anki_lap_board_t            board;
+} anki_lap_timer_t;
+
+/**
+ * Fill in default parameters: laps only, finish on the start line piece.
+ */
+void anki_lap_timer_config_default(anki_lap_timer_config_t *config);
+
+/**
+ * Initialize a lap timer.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_lap_timer_init(anki_lap_timer_t *timer, const anki_lap_timer_config_t *config,
+                            uint8_t vehicle_count);
+
+/**
+ * Clear the leaderboard and start a race. Crossings before start_us are ignored.
+ */
+void anki_lap_timer_start_race(anki_lap_timer_t *timer, uint64_t start_us);
+
+/**
+ * Record that a vehicle entered a new road piece at timestamp_us.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_lap_timer_transition(anki_lap_timer_t *timer, uint8_t vehicle, uint64_t timestamp_us);
+
+/**
+ * Record the road piece a vehicle is on. Completes a pending transition,
+ * which is timed with the timestamp of the transition.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_lap_timer_position(anki_lap_timer_t *timer, uint8_t vehicle, uint8_t road_piece_id);
+
+/**
+ * Dispatch a received vehicle message to the lap timer.
+ * Messages unrelated to localization are ignored. A delocalized vehicle
+ * may have missed pieces, so its timing restarts at the next crossing.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_lap_timer_handle_msg(anki_lap_timer_t *timer, uint8_t vehicle, uint64_t timestamp_us,
+                                  const anki_vehicle_msg_t *msg, uint8_t len);
+
+/**
+ * Copy a consistent snapshot of the leaderboard. Safe to call from any thread.
+ */
+void anki_lap_timer_read_board(const anki_lap_timer_t *timer, anki_lap_board_t *board);
+
+ANKI_END_DECL
+
+#endif
@@ -40,6 +40,10 @@ enum {
     ANKI_VEHICLE_MSG_C2V_VERSION_REQUEST = 0x18,
     ANKI_VEHICLE_MSG_V2C_VERSION_RESPONSE = 0x19,
 
+    // Battery level
+    ANKI_VEHICLE_MSG_C2V_BATTERY_LEVEL_REQUEST = 0x1a,
+    ANKI_VEHICLE_MSG_V2C_BATTERY_LEVEL_RESPONSE = 0x1b,
+
     // Lights
     ANKI_VEHICLE_MSG_C2V_SET_LIGHTS = 0x1d,
 
@@ -50,6 +54,12 @@ enum {
     ANKI_VEHICLE_MSG_C2V_TURN_180 = 0x32,
     ANKI_VEHICLE_MSG_C2V_SET_OFFSET_FROM_ROAD_CENTER = 0x2c,
 
+    // Vehicle position updates
+    ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE = 0x27,
+    ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE = 0x29,
+    ANKI_VEHICLE_MSG_V2C_LOCALIZATION_INTERSECTION_UPDATE = 0x2a,
+    ANKI_VEHICLE_MSG_V2C_VEHICLE_DELOCALIZED = 0x2b,
+
     // Light Patterns
     ANKI_VEHICLE_MSG_C2V_LIGHTS_PATTERN = 0x33,
 
@@ -80,6 +90,13 @@ typedef struct anki_vehicle_msg_version_response {
 } ATTRIBUTE_PACKED anki_vehicle_msg_version_response_t;
 #define ANKI_VEHICLE_MSG_V2C_VERSION_RESPONSE_SIZE   3
 
+typedef struct anki_vehicle_msg_battery_level_response {
+    uint8_t     size;
+    uint8_t     msg_id;
+    uint16_t    battery_level;
+} ATTRIBUTE_PACKED anki_vehicle_msg_battery_level_response_t;
+#define ANKI_VEHICLE_MSG_V2C_BATTERY_LEVEL_RESPONSE_SIZE   3
+
 typedef struct anki_vehicle_msg_sdk_mode {
     uint8_t     size;
     uint8_t     msg_id;
@@ -112,6 +129,80 @@ typedef struct anki_vehicle_msg_change_lane {
 } ATTRIBUTE_PACKED anki_vehicle_msg_change_lane_t;
 #define ANKI_VEHICLE_MSG_C2V_CHANGE_LANE_SIZE    9
 
+// Localization
+// Bits in the parsing_flags field of a position update
+#define PARSEFLAGS_MASK_NUM_BITS            0x0f
+#define PARSEFLAGS_MASK_REVERSE_DRIVING     0x20
+#define PARSEFLAGS_MASK_REVERSE_PARSING     0x40
+#define PARSEFLAGS_MASK_INVERTED_COLOR      0x80
+
+typedef enum anki_vehicle_driving_direction {
+    FORWARD = 0,
+    REVERSE = 1,
+} anki_vehicle_driving_direction_t;
+
+typedef struct anki_vehicle_msg_localization_position_update {
+    uint8_t     size;
+    uint8_t     msg_id;
+    uint8_t     location_id;
+    uint8_t     road_piece_id;
+    float       offset_from_road_center_mm;
+    uint16_t    speed_mm_per_sec;
+    uint8_t     parsing_flags;
+
+    // ACK commands received
+    uint8_t     last_recv_lane_change_cmd_id;
+    uint8_t     last_exec_lane_change_cmd_id;
+    uint16_t    last_desired_horizontal_speed_mm_per_sec;
+    uint16_t    last_desired_speed_mm_per_sec;
+} ATTRIBUTE_PACKED anki_vehicle_msg_localization_position_update_t;
+#define ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE_SIZE  16
+
+typedef struct anki_vehicle_msg_localization_transition_update {
+    uint8_t     size;
+    uint8_t     msg_id;
+    uint8_t     road_piece_idx;
+    uint8_t     road_piece_idx_prev;
+    float       offset_from_road_center_mm;
+
+    uint8_t     driving_direction;
+
+    // ACK commands received
+    uint8_t     last_recv_lane_change_id;
+    uint8_t     last_exec_lane_change_id;
+    uint16_t    last_desired_horizontal_speed_mm_per_sec;
+    uint16_t    last_desired_speed_mm_per_sec;
+
+    // Track grade detection
+    uint8_t     uphill_counter;
+    uint8_t     downhill_counter;
+
+    // Wheel displacement (cm) since the last transition bar
+    uint8_t     left_wheel_dist_cm;
+    uint8_t     right_wheel_dist_cm;
+} ATTRIBUTE_PACKED anki_vehicle_msg_localization_transition_update_t;
+#define ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE_SIZE    18
+
+typedef enum {
+    INTERSECTION_CODE_ENTRY_FIRST,
+    INTERSECTION_CODE_EXIT_FIRST,
+    INTERSECTION_CODE_ENTRY_SECOND,
+    INTERSECTION_CODE_EXIT_SECOND,
+} anki_intersection_code_t;
+
+typedef struct anki_vehicle_msg_localization_intersection_update {
+    uint8_t     size;
+    uint8_t     msg_id;
+    uint8_t     road_piece_idx;
+    float       offset_from_road_center_mm;
+
+    uint8_t     driving_direction;
+    uint8_t     intersection_code;
+    uint8_t     intersection_turn;
+    uint8_t     is_exiting;
+} ATTRIBUTE_PACKED anki_vehicle_msg_localization_intersection_update_t;
+#define ANKI_VEHICLE_MSG_V2C_LOCALIZATION_INTERSECTION_UPDATE_SIZE  10
+
 
 // Lights
 // The bits in the simple light message (ANKI_VEHICLE_MSG_C2V_SET_LIGHTS) corresponding to
@@ -284,6 +375,17 @@ uint8_t anki_vehicle_msg_ping(anki_vehicle_msg_t *msg);
  */
 uint8_t anki_vehicle_msg_get_version(anki_vehicle_msg_t *);
 
+/**
+ * Create a message to request the vehicle battery level.
+ *
+ * The vehicle will respond with a anki_vehicle_msg_battery_level_response_t message.
+ *
+ * @param msg A pointer to the vehicle message struct to be written.
+ *
+ * @return size of bytes written to msg
+ */
+uint8_t anki_vehicle_msg_get_battery_level(anki_vehicle_msg_t *msg);
+
 /**
  * Create a message to cancel a requested lane change.
  *
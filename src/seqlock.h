@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_seqlock_h
+#define INCLUDE_seqlock_h
+
+// Sequence lock shared by the lap timer, the vehicle state table and the
+// message ring. Not installed.
+//
+// One thread writes the protected data, any number of threads copy it out
+// without blocking the writer. The sequence is odd while a write is under
+// way; a reader copies the data between ANKI_SEQLOCK_READ_BEGIN and
+// ANKI_SEQLOCK_READ_RETRY and throws the copy away if the sequence was odd
+// or changed in between. The macros work on sequences of any integer width;
+// each caller picks the odd and even values it stores.
+
+// Mark the data as being written. Readers that see any of the new data
+// also see the odd sequence.
+#define ANKI_SEQLOCK_WRITE_BEGIN(seq, odd)                  \
+    do {                                                    \
+        __atomic_store_n((seq), (odd), __ATOMIC_RELAXED);   \
+        __atomic_thread_fence(__ATOMIC_RELEASE);            \
+    } while (0)
+
+// Publish the data written since ANKI_SEQLOCK_WRITE_BEGIN
+#define ANKI_SEQLOCK_WRITE_END(seq, even) \
+    __atomic_store_n((seq), (even), __ATOMIC_RELEASE)
+
+// Sequence to pass to ANKI_SEQLOCK_READ_RETRY. Odd means a write is under way.
+#define ANKI_SEQLOCK_READ_BEGIN(seq) \
+    __atomic_load_n((seq), __ATOMIC_ACQUIRE)
+
+// Nonzero if the data copied since ANKI_SEQLOCK_READ_BEGIN returned before
+// may be torn
+#define ANKI_SEQLOCK_READ_RETRY(seq, before)                            \
+    (((before) & 1) != 0 ||                                             \
+     (__atomic_thread_fence(__ATOMIC_ACQUIRE),                          \
+      __atomic_load_n((seq), __ATOMIC_RELAXED) != (before)))
+
+#endif
@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "session_log.h"
+#include "timeline.h"
+
+typedef char header_size_is_fixed[(sizeof(anki_session_log_header_t) == 32) ? 1 : -1];
+typedef char block_header_size_is_fixed[(sizeof(anki_session_block_header_t) == 32) ? 1 : -1];
+typedef char record_header_size_is_fixed[(sizeof(anki_session_record_header_t) == 8) ? 1 : -1];
+
+#define RECORD_SIZE(len) (sizeof(anki_session_record_header_t) + (((size_t)(len) + 3) & ~(size_t)3))
+
+// The header takes the first block
+static off_t block_offset(uint32_t index)
+{
+    return ((off_t)index + 1) * ANKI_SESSION_LOG_BLOCK_SIZE;
+}
+
+// CRC-32 (IEEE 802.3) four bits at a time; pass the previous result to continue it
+static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t len)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+    size_t i;
+
+    crc = ~crc;
+    for (i = 0; i < len; i++) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ table[crc & 0x0f];
+        crc = (crc >> 4) ^ table[crc & 0x0f];
+    }
+
+    return ~crc;
+}
+
+// used must already be known to fit in the block
+static uint32_t block_crc(const anki_session_block_header_t *block)
+{
+    anki_session_block_header_t header = *block;
+
+    header.crc = 0;
+    return crc32(crc32(0, (const uint8_t *)&header, sizeof(header)),
+                 (const uint8_t *)(block + 1), block->used - sizeof(header));
+}
+
+static uint8_t pwrite_all(int fd, const void *buf, size_t len, off_t offset)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+static void recorder_reset_block(anki_session_recorder_t *rec)
+{
+    memset(&rec->block, 0, sizeof(rec->block));
+    rec->block.header.magic = ANKI_SESSION_LOG_BLOCK_MAGIC;
+    rec->block.header.index = rec->block_index;
+    rec->block.header.used = sizeof(anki_session_block_header_t);
+}
+
+uint8_t anki_session_recorder_create(anki_session_recorder_t *rec, const char *path)
+{
+    union {
+        anki_session_log_header_t   header;
+        uint8_t                     bytes[ANKI_SESSION_LOG_BLOCK_SIZE];
+    } first;
+    struct timespec ts;
+    char *tmp;
+
+    if (rec == NULL || path == NULL)
+        return 1;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->fd = -1;
+
+    // A reader may have the previous log mapped; truncating it in place
+    // would fault the reader, so the new log replaces it under the same name
+    tmp = malloc(strlen(path) + sizeof(".XXXXXX"));
+    if (tmp == NULL)
+        return 1;
+    sprintf(tmp, "%s.XXXXXX", path);
+
+    rec->fd = mkstemp(tmp);
+    if (rec->fd < 0) {
+        free(tmp);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    memset(&first, 0, sizeof(first));
+    first.header.magic = ANKI_SESSION_LOG_MAGIC;
+    first.header.version = ANKI_SESSION_LOG_VERSION;
+    first.header.header_size = ANKI_SESSION_LOG_BLOCK_SIZE;
+    first.header.block_size = ANKI_SESSION_LOG_BLOCK_SIZE;
+    first.header.created_unix_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+    if (fchmod(rec->fd, 0644) != 0 ||
+        pwrite_all(rec->fd, first.bytes, sizeof(first.bytes), 0) != 0 ||
+        rename(tmp, path) != 0) {
+        close(rec->fd);
+        rec->fd = -1;
+        unlink(tmp);
+        free(tmp);
+        return 1;
+    }
+    free(tmp);
+
+    recorder_reset_block(rec);
+
+    return 0;
+}
+
+static uint8_t recorder_write_block(anki_session_recorder_t *rec)
+{
+    rec->block.header.crc = block_crc(&rec->block.header);
+    return pwrite_all(rec->fd, rec->block.bytes, ANKI_SESSION_LOG_BLOCK_SIZE,
+                      block_offset(rec->block_index));
+}
+
+uint8_t anki_session_recorder_record(anki_session_recorder_t *rec, uint64_t timestamp_us,
+                                     uint8_t vehicle, uint8_t kind,
+                                     const uint8_t *data, uint8_t len)
+{
+    anki_session_block_header_t *block;
+    anki_session_record_header_t *record;
+    size_t size = RECORD_SIZE(len);
+
+    if (rec == NULL || rec->fd < 0 || (data == NULL && len > 0))
+        return 1;
+    if (kind != ANKI_SESSION_RECORD_TX && kind != ANKI_SESSION_RECORD_RX)
+        return 1;
+    if (rec->records > 0 && timestamp_us < rec->last_us)
+        return 1;
+
+    block = &rec->block.header;
+
+    // Start a new block when this one is full or offsets would overflow
+    if (block->count > 0 &&
+        (block->used + size > ANKI_SESSION_LOG_BLOCK_SIZE ||
+         timestamp_us - block->first_us > UINT32_MAX ||
+         block->count == UINT16_MAX)) {
+        if (recorder_write_block(rec) != 0)
+            return 1;
+        rec->block_index++;
+        recorder_reset_block(rec);
+    }
+
+    if (block->count == 0)
+        block->first_us = timestamp_us;
+
+    record = (anki_session_record_header_t *)&rec->block.bytes[block->used];
+    record->offset_us = (uint32_t)(timestamp_us - block->first_us);
+    record->vehicle = vehicle;
+    record->kind = kind;
+    record->len = len;
+    if (len > 0)
+        memcpy(record + 1, data, len);
+
+    block->used += size;
+    block->count++;
+    block->last_us = timestamp_us;
+    rec->last_us = timestamp_us;
+    rec->records++;
+
+    return 0;
+}
+
+uint8_t anki_session_recorder_flush(anki_session_recorder_t *rec)
+{
+    if (rec == NULL || rec->fd < 0)
+        return 1;
+
+    if (rec->block.header.count == 0)
+        return 0;
+
+    return recorder_write_block(rec);
+}
+
+uint8_t anki_session_recorder_close(anki_session_recorder_t *rec)
+{
+    uint8_t result;
+
+    if (rec == NULL || rec->fd < 0)
+        return 1;
+
+    result = anki_session_recorder_flush(rec);
+    if (close(rec->fd) != 0)
+        result = 1;
+    rec->fd = -1;
+
+    return result;
+}
+
+static const anki_session_block_header_t *log_block(const anki_session_log_t *log, uint32_t index)
+{
+    return (const anki_session_block_header_t *)(log->data + block_offset(index));
+}
+
+static uint8_t block_is_valid(const anki_session_block_header_t *block, uint32_t index)
+{
+    return block->magic == ANKI_SESSION_LOG_BLOCK_MAGIC &&
+           block->index == index &&
+           block->count > 0 &&
+           block->used >= sizeof(anki_session_block_header_t) &&
+           block->used <= ANKI_SESSION_LOG_BLOCK_SIZE &&
+           block->last_us >= block->first_us &&
+           block->crc == block_crc(block);
+}
+
+uint8_t anki_session_log_init(anki_session_log_t *log, const void *mem, size_t size)
+{
+    const anki_session_log_header_t *header = (const anki_session_log_header_t *)mem;
+    uint32_t index;
+
+    if (log == NULL || mem == NULL || size < sizeof(*header))
+        return 1;
+
+    if (header->magic != ANKI_SESSION_LOG_MAGIC ||
+        header->version != ANKI_SESSION_LOG_VERSION ||
+        header->header_size != ANKI_SESSION_LOG_BLOCK_SIZE ||
+        header->block_size != ANKI_SESSION_LOG_BLOCK_SIZE)
+        return 1;
+
+    memset(log, 0, sizeof(*log));
+    log->data = (const uint8_t *)mem;
+    log->size = size;
+
+    // Count leading valid blocks; a block torn or damaged after a crash ends the log
+    for (index = 0; (size_t)block_offset(index + 1) <= size; index++) {
+        const anki_session_block_header_t *block = log_block(log, index);
+
+        if (!block_is_valid(block, index))
+            break;
+        if (index > 0 && block->first_us < log->last_us)
+            break;
+        if (index == 0)
+            log->first_us = block->first_us;
+        log->last_us = block->last_us;
+        log->records += block->count;
+    }
+    log->block_count = index;
+
+    return 0;
+}
+
+uint8_t anki_session_log_open(anki_session_log_t *log, const char *path)
+{
+    struct stat st;
+    void *mem;
+    int fd;
+
+    if (log == NULL || path == NULL)
+        return 1;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(anki_session_log_header_t)) {
+        close(fd);
+        return 1;
+    }
+
+    mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return 1;
+
+    if (anki_session_log_init(log, mem, st.st_size) != 0) {
+        munmap(mem, st.st_size);
+        return 1;
+    }
+
+    // Replay reads the log front to back
+    posix_madvise(mem, st.st_size, POSIX_MADV_SEQUENTIAL);
+    log->mapped = 1;
+
+    return 0;
+}
+
+void anki_session_log_close(anki_session_log_t *log)
+{
+    if (log == NULL)
+        return;
+
+    if (log->mapped)
+        munmap((void *)log->data, log->size);
+
+    memset(log, 0, sizeof(*log));
+}
+
+void anki_session_log_rewind(const anki_session_log_t *log, anki_session_log_cursor_t *cursor)
+{
+    (void)log;
+    cursor->block = 0;
+    cursor->offset = sizeof(anki_session_block_header_t);
+}
+
+uint8_t anki_session_log_next(const anki_session_log_t *log, anki_session_log_cursor_t *cursor,
+                              anki_session_record_t *record)
+{
+    while (cursor->block < log->block_count) {
+        const anki_session_block_header_t *block = log_block(log, cursor->block);
+        const anki_session_record_header_t *header;
+
+        if (cursor->offset + sizeof(*header) <= block->used) {
+            header = (const anki_session_record_header_t *)((const uint8_t *)block + cursor->offset);
+
+            if (cursor->offset + RECORD_SIZE(header->len) <= block->used) {
+                record->timestamp_us = block->first_us + header->offset_us;
+                record->vehicle = header->vehicle;
+                record->kind = header->kind;
+                record->len = header->len;
+                record->data = (const uint8_t *)(header + 1);
+                cursor->offset += RECORD_SIZE(header->len);
+                return 1;
+            }
+        }
+
+        cursor->block++;
+        cursor->offset = sizeof(anki_session_block_header_t);
+    }
+
+    return 0;
+}
+
+void anki_session_log_seek(const anki_session_log_t *log, anki_session_log_cursor_t *cursor,
+                           uint64_t timestamp_us)
+{
+    anki_session_log_cursor_t prev;
+    anki_session_record_t record;
+    uint32_t lo = 0, hi = log->block_count;
+
+    // First block whose last record is not before timestamp_us
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (log_block(log, mid)->last_us < timestamp_us)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    cursor->block = lo;
+    cursor->offset = sizeof(anki_session_block_header_t);
+
+    for (prev = *cursor; anki_session_log_next(log, cursor, &record); prev = *cursor) {
+        if (record.timestamp_us >= timestamp_us)
+            break;
+    }
+    *cursor = prev;
+}
+
+static void sleep_until(uint64_t deadline_us)
+{
+    struct timespec ts;
+
+    ts.tv_sec = deadline_us / 1000000;
+    ts.tv_nsec = (deadline_us % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+uint64_t anki_session_replay(const anki_session_log_t *log, anki_session_log_cursor_t *cursor,
+                             uint64_t end_us, double speed,
+                             anki_session_replay_func_t handler, void *user_data)
+{
+    anki_session_log_cursor_t prev = *cursor;
+    anki_session_record_t record;
+    uint64_t origin_log_us = 0, origin_us = 0;
+    uint64_t delivered = 0;
+
+    if (handler == NULL)
+        return 0;
+
+    while (anki_session_log_next(log, cursor, &record)) {
+        if (record.timestamp_us >= end_us) {
+            *cursor = prev;
+            break;
+        }
+
+        if (speed > 0) {
+            if (delivered == 0) {
+                origin_log_us = record.timestamp_us;
+                origin_us = anki_timeline_now_us();
+            } else {
+                uint64_t due_us = origin_us + (uint64_t)((record.timestamp_us - origin_log_us) / speed);
+                if (due_us > anki_timeline_now_us())
+                    sleep_until(due_us);
+            }
+        }
+
+        handler(&record, user_data);
+        delivered++;
+        prev = *cursor;
+    }
+
+    return delivered;
+}
@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_session_log_h
+#define INCLUDE_session_log_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "common.h"
+
+ANKI_BEGIN_DECL
+
+/** "AKSL" read as a little-endian 32-bit word. */
+#define ANKI_SESSION_LOG_MAGIC          0x4c534b41
+
+/** "AKSB", starts every block. */
+#define ANKI_SESSION_LOG_BLOCK_MAGIC    0x42534b41
+
+/** Format version, bumped whenever the file, block or record layout changes. */
+#define ANKI_SESSION_LOG_VERSION        2
+
+/** Size of every block, including its header. */
+#define ANKI_SESSION_LOG_BLOCK_SIZE     4096
+
+/** Direction of a recorded message */
+typedef enum anki_session_record_kind {
+    ANKI_SESSION_RECORD_TX = 1,     // Message written to a vehicle
+    ANKI_SESSION_RECORD_RX = 2,     // Notification received from a vehicle
+} anki_session_record_kind_t;
+
+/**
+ * File header, zero-padded to ANKI_SESSION_LOG_BLOCK_SIZE bytes and followed
+ * by blocks of that size. Every block starts at a multiple of the block
+ * size, so writing one never straddles two device blocks.
+ *
+ * - header_size: Bytes before the first block
+ * - created_unix_us: Wall clock time the log was created, for display only
+ */
+typedef struct anki_session_log_header {
+    uint32_t    magic;
+    uint16_t    version;
+    uint16_t    header_size;
+    uint32_t    block_size;
+    uint32_t    _reserved0;
+    uint64_t    created_unix_us;
+    uint64_t    _reserved1;
+} anki_session_log_header_t;
+
+/**
+ * Block header. Block headers double as the index of the log: blocks have a
+ * fixed size, so a reader finds block i without scanning and can binary
+ * search their time ranges.
+ *
+ * - index: Position of the block in the log
+ * - count: Records in the block
+ * - used: Bytes in use, including this header
+ * - crc: CRC-32 of the first used bytes, computed with crc set to 0
+ * - first_us, last_us: Timestamps of the first and last record
+ */
+typedef struct anki_session_block_header {
+    uint32_t    magic;
+    uint32_t    index;
+    uint16_t    count;
+    uint16_t    used;
+    uint32_t    crc;
+    uint64_t    first_us;
+    uint64_t    last_us;
+} anki_session_block_header_t;
+
+/**
+ * Record header as stored in a block, followed by len bytes of message,
+ * padded to a multiple of 4 bytes.
+ *
+ * - offset_us: Timestamp relative to first_us of the block
+ * - vehicle: Recorder-defined vehicle index
+ * - kind: anki_session_record_kind_t
+ */
+typedef struct anki_session_record_header {
+    uint32_t    offset_us;
+    uint8_t     vehicle;
+    uint8_t     kind;
+    uint8_t     len;
+    uint8_t     _reserved;
+} anki_session_record_header_t;
+
+/**
+ * A record read back from a log. data points into the log.
+ */
+typedef struct anki_session_record {
+    uint64_t        timestamp_us;
+    uint8_t         vehicle;
+    uint8_t         kind;
+    uint8_t         len;
+    const uint8_t   *data;
+} anki_session_record_t;
+
+/**
+ * Append-only writer of a session log.
+ *
+ * Records are collected in a block buffer and the block is written once it
+ * is full, so recording a message is a copy in the common case. Flushing
+ * writes the partial block in place; it is rewritten, never duplicated,
+ * when more records arrive. A crash loses at most the records since the
+ * last flush, unless it tears the rewrite of the partial block: its
+ * checksum then fails and readers drop that block, including its records
+ * flushed earlier. Blocks before it are never written again.
+ *
+ * Only one thread may use a recorder.
+ */
+typedef struct anki_session_recorder {
+    int         fd;
+    uint32_t    block_index;
+    uint64_t    last_us;
+    uint64_t    records;
+    union {
+        anki_session_block_header_t header;
+        uint8_t                     bytes[ANKI_SESSION_LOG_BLOCK_SIZE];
+    } block;
+} anki_session_recorder_t;
+
+/**
+ * Read-only view of a session log, usually mapped from a file.
+ *
+ * - block_count: Valid blocks; the log ends before the first block that is
+ *   torn or fails its checksum
+ * - records: Records in the valid blocks
+ * - first_us, last_us: Time range of the records
+ */
+typedef struct anki_session_log {
+    const uint8_t   *data;
+    size_t          size;
+    uint8_t         mapped;
+    uint32_t        block_count;
+    uint64_t        records;
+    uint64_t        first_us;
+    uint64_t        last_us;
+} anki_session_log_t;
+
+/**
+ * Read position in a session log.
+ */
+typedef struct anki_session_log_cursor {
+    uint32_t    block;
+    uint32_t    offset;
+} anki_session_log_cursor_t;
+
+/**
+ * Called for every replayed record. TX records are meant for a stand-in
+ * vehicle, RX records for decoders and state engines.
+ */
+typedef void (*anki_session_replay_func_t)(const anki_session_record_t *record, void *user_data);
+
+/**
+ * Create a new log at path and start recording. An existing log at path is
+ * replaced rather than truncated: readers that still map it keep the old
+ * copy until they reopen path.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_session_recorder_create(anki_session_recorder_t *rec, const char *path);
+
+/**
+ * Record a message.
+ *
+ * @param rec Recorder.
+ * @param timestamp_us Monotonic timestamp, not before the previous record.
+ * @param vehicle Caller-defined vehicle index.
+ * @param kind anki_session_record_kind_t.
+ * @param data Message bytes as sent or received.
+ * @param len Number of bytes in data.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_session_recorder_record(anki_session_recorder_t *rec, uint64_t timestamp_us,
+                                     uint8_t vehicle, uint8_t kind,
+                                     const uint8_t *data, uint8_t len);
+
+/**
+ * Write the records of the current block to the file.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_session_recorder_flush(anki_session_recorder_t *rec);
+
+/**
+ * Flush and close the log.
+ *
+ * @return 0 on success, 1 if the final flush failed.
+ */
+uint8_t anki_session_recorder_close(anki_session_recorder_t *rec);
+
+/**
+ * Set up a log over caller-provided memory holding a complete log file.
+ *
+ * @return 0 on success, 1 if mem does not hold a log of this version.
+ */
+uint8_t anki_session_log_init(anki_session_log_t *log, const void *mem, size_t size);
+
+/**
+ * Map the log at path read-only. The log may still be recorded to; only
+ * blocks flushed before this call are visible.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_session_log_open(anki_session_log_t *log, const char *path);
+
+/**
+ * Unmap a log opened with anki_session_log_open.
+ */
+void anki_session_log_close(anki_session_log_t *log);
+
+/**
+ * Place cursor at the first record of the log.
+ */
+void anki_session_log_rewind(const anki_session_log_t *log, anki_session_log_cursor_t *cursor);
+
+/**
+ * Place cursor at the first record at or after timestamp_us, using a binary
+ * search over the block headers.
+ */
+void anki_session_log_seek(const anki_session_log_t *log, anki_session_log_cursor_t *cursor,
+                           uint64_t timestamp_us);
+
+/**
+ * Read the record at cursor and advance it.
+ *
+ * @return 1 if a record was read, 0 at the end of the log.
+ */
+uint8_t anki_session_log_next(const anki_session_log_t *log, anki_session_log_cursor_t *cursor,
+                              anki_session_record_t *record);
+
+/**
+ * Deliver records in log order, from cursor up to but not including end_us.
+ *
+ * Records keep their recorded timestamps whatever the pace, so anything
+ * driven from handler reaches the same state on every replay.
+ *
+ * @param log Log to replay.
+ * @param cursor Start position, left after the last delivered record.
+ * @param end_us Stop at the first record at or after this time.
+ * @param speed 0 to replay as fast as possible, 1 for the original pace,
+ *        2 for twice as fast and so on. Paced replay sleeps on
+ *        CLOCK_MONOTONIC between records.
+ * @param handler Called for every record.
+ * @param user_data Passed to handler.
+ *
+ * @return number of records delivered.
+ */
+uint64_t anki_session_replay(const anki_session_log_t *log, anki_session_log_cursor_t *cursor,
+                             uint64_t end_us, double speed,
+                             anki_session_replay_func_t handler, void *user_data);
+
+ANKI_END_DECL
+
+#endif
@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+#include "timeline.h"
+
+static uint8_t late_bucket(uint64_t late_us)
+{
+    uint8_t bucket = 0;
+
+    while (late_us != 0 && bucket < (ANKI_TIMELINE_LATE_BUCKETS - 1)) {
+        late_us >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+static inline uint8_t entry_before(const anki_timeline_entry_t *a, const anki_timeline_entry_t *b)
+{
+    return a->time_us < b->time_us || (a->time_us == b->time_us && a->seq < b->seq);
+}
+
+static inline void swap_entries(anki_timeline_entry_t *a, anki_timeline_entry_t *b)
+{
+    anki_timeline_entry_t tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void sift_up(anki_timeline_entry_t *heap, uint32_t i)
+{
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (!entry_before(&heap[i], &heap[parent]))
+            break;
+        swap_entries(&heap[i], &heap[parent]);
+        i = parent;
+    }
+}
+
+static void sift_down(anki_timeline_entry_t *heap, uint32_t size, uint32_t i)
+{
+    for (;;) {
+        uint32_t left = 2 * i + 1;
+        uint32_t smallest = i;
+
+        if (left < size && entry_before(&heap[left], &heap[smallest]))
+            smallest = left;
+        if (left + 1 < size && entry_before(&heap[left + 1], &heap[smallest]))
+            smallest = left + 1;
+        if (smallest == i)
+            break;
+
+        swap_entries(&heap[i], &heap[smallest]);
+        i = smallest;
+    }
+}
+
+uint8_t anki_timeline_init(anki_timeline_t *tl, anki_timeline_entry_t *entries, uint32_t capacity)
+{
+    if (tl == NULL || entries == NULL || capacity == 0)
+        return 1;
+
+    memset(tl, 0, sizeof(anki_timeline_t));
+    tl->entries = entries;
+    tl->capacity = capacity;
+
+    return 0;
+}
+
+uint8_t anki_timeline_add_msg(anki_timeline_t *tl, uint64_t time_us, uint8_t vehicle,
+                              const anki_vehicle_msg_t *msg, uint8_t len)
+{
+    anki_timeline_entry_t *entry;
+
+    if (tl == NULL || msg == NULL || len == 0 || len > sizeof(anki_vehicle_msg_t))
+        return 1;
+    if (tl->count >= tl->capacity)
+        return 1;
+
+    // Keep fired entries packed after the heap
+    if (tl->pending < tl->count)
+        tl->entries[tl->count] = tl->entries[tl->pending];
+    tl->count++;
+
+    entry = &tl->entries[tl->pending];
+    entry->time_us = time_us;
+    entry->seq = tl->next_seq++;
+    entry->vehicle = vehicle;
+    entry->len = len;
+    memcpy(&entry->msg, msg, len);
+
+    sift_up(tl->entries, tl->pending);
+    tl->pending++;
+
+    return 0;
+}
+
+uint8_t anki_timeline_add_set_speed(anki_timeline_t *tl, uint64_t time_us, uint8_t vehicle,
+                                    uint16_t speed_mm_per_sec, uint16_t accel_mm_per_sec2)
+{
+    anki_vehicle_msg_t msg;
+    uint8_t len = anki_vehicle_msg_set_speed(&msg, speed_mm_per_sec, accel_mm_per_sec2);
+
+    return anki_timeline_add_msg(tl, time_us, vehicle, &msg, len);
+}
+
+uint8_t anki_timeline_add_lights_pattern(anki_timeline_t *tl, uint64_t time_us, uint8_t vehicle,
+                                         uint8_t channel, uint8_t effect, uint8_t start,
+                                         uint8_t end, uint16_t cycles_per_min)
+{
+    anki_vehicle_msg_t msg;
+    uint8_t len = anki_vehicle_msg_lights_pattern(&msg, channel, effect, start, end, cycles_per_min);
+
+    return anki_timeline_add_msg(tl, time_us, vehicle, &msg, len);
+}
+
+uint8_t anki_timeline_add_turn_180(anki_timeline_t *tl, uint64_t time_us, uint8_t vehicle)
+{
+    anki_vehicle_msg_t msg;
+    uint8_t len = anki_vehicle_msg_turn_180(&msg);
+
+    return anki_timeline_add_msg(tl, time_us, vehicle, &msg, len);
+}
+
+void anki_timeline_start(anki_timeline_t *tl, uint64_t start_us)
+{
+    tl->start_us = start_us;
+    tl->running = 1;
+}
+
+void anki_timeline_restart(anki_timeline_t *tl, uint64_t start_us)
+{
+    uint32_t i;
+
+    tl->pending = tl->count;
+    for (i = tl->count / 2; i > 0; i--)
+        sift_down(tl->entries, tl->pending, i - 1);
+
+    anki_timeline_start(tl, start_us);
+}
+
+uint8_t anki_timeline_next_deadline(const anki_timeline_t *tl, uint64_t *deadline_us)
+{
+    if (!tl->running || tl->pending == 0)
+        return 1;
+
+    *deadline_us = tl->start_us + tl->entries[0].time_us;
+    return 0;
+}
+
+uint32_t anki_timeline_fire(anki_timeline_t *tl, uint64_t now_us,
+                            anki_timeline_emit_func_t emit, void *user_data)
+{
+    uint32_t fired = 0;
+
+    if (!tl->running)
+        return 0;
+
+    while (tl->pending > 0) {
+        anki_timeline_entry_t *entry;
+        uint64_t deadline = tl->start_us + tl->entries[0].time_us;
+        uint64_t sent_us;
+        uint64_t late;
+
+        if (deadline > now_us)
+            break;
+
+        // Move the root past the end of the heap, where it stays for restarts
+        tl->pending--;
+        swap_entries(&tl->entries[0], &tl->entries[tl->pending]);
+        sift_down(tl->entries, tl->pending, 0);
+        entry = &tl->entries[tl->pending];
+
+        sent_us = emit(entry->vehicle, &entry->msg, entry->len, deadline, user_data);
+
+        late = (sent_us > deadline) ? sent_us - deadline : 0;
+        tl->stats.fired++;
+        tl->stats.total_late_us += late;
+        if (late > tl->stats.max_late_us)
+            tl->stats.max_late_us = (late > UINT32_MAX) ? UINT32_MAX : (uint32_t)late;
+        tl->stats.late_histogram[late_bucket(late)]++;
+        fired++;
+    }
+
+    return fired;
+}
+
+uint64_t anki_timeline_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#ifdef __linux__
+int anki_timeline_timerfd_create(void)
+{
+    return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+uint8_t anki_timeline_timerfd_arm(const anki_timeline_t *tl, int fd)
+{
+    struct itimerspec its;
+    uint64_t deadline;
+
+    memset(&its, 0, sizeof(its));
+    if (anki_timeline_next_deadline(tl, &deadline) == 0) {
+        deadline = (deadline > tl->spin_us) ? deadline - tl->spin_us : 0;
+        // An all-zero it_value would disarm the timer
+        if (deadline == 0)
+            deadline = 1;
+        its.it_value.tv_sec = deadline / 1000000;
+        its.it_value.tv_nsec = (deadline % 1000000) * 1000;
+    }
+
+    return timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) == 0 ? 0 : 1;
+}
+
+uint32_t anki_timeline_timerfd_dispatch(anki_timeline_t *tl, int fd,
+                                        anki_timeline_emit_func_t emit, void *user_data)
+{
+    uint64_t expirations;
+    uint64_t deadline;
+    uint64_t now;
+    uint32_t fired;
+
+    while (read(fd, &expirations, sizeof(expirations)) < 0 && errno == EINTR)
+        ;
+
+    now = anki_timeline_now_us();
+
+    // Woken spin_us early: wait out the rest for an exact send time
+    if (tl->spin_us > 0 && anki_timeline_next_deadline(tl, &deadline) == 0 &&
+        deadline > now && deadline - now <= tl->spin_us) {
+        while (now < deadline)
+            now = anki_timeline_now_us();
+    }
+
+    fired = anki_timeline_fire(tl, now, emit, user_data);
+    anki_timeline_timerfd_arm(tl, fd);
+
+    return fired;
+}
+#endif
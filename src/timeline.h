@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_timeline_h
+#define INCLUDE_timeline_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "protocol.h"
+
+ANKI_BEGIN_DECL
+
+/**
+ * Number of lateness histogram buckets.
+ * Bucket 0 counts commands sent less than 1us late, bucket i counts
+ * lateness in [2^(i-1), 2^i) us. The last bucket also counts anything later.
+ */
+#define ANKI_TIMELINE_LATE_BUCKETS  24
+
+/**
+ * A command scheduled on a timeline, encoded when it is added.
+ *
+ * - time_us: Time relative to the start of the timeline
+ * - seq: Insertion order, keeps commands at the same time in order
+ * - vehicle: Caller-defined vehicle index
+ * - len: Number of bytes of msg to send
+ */
+typedef struct anki_timeline_entry {
+    uint64_t            time_us;
+    uint32_t            seq;
+    uint8_t             vehicle;
+    uint8_t             len;
+    anki_vehicle_msg_t  msg;
+} anki_timeline_entry_t;
+
+/**
+ * Achieved versus planned send times.
+ *
+ * - fired: Commands sent
+ * - total_late_us, max_late_us: Lateness of sent commands
+ * - late_histogram: See ANKI_TIMELINE_LATE_BUCKETS
+ */
+typedef struct anki_timeline_stats {
+    uint32_t    fired;
+    uint64_t    total_late_us;
+    uint32_t    max_late_us;
+    uint32_t    late_histogram[ANKI_TIMELINE_LATE_BUCKETS];
+} anki_timeline_stats_t;
+
+/**
+ * Called for every command when it is due.
+ *
+ * @param vehicle Vehicle index given when the command was added.
+ * @param msg Pre-encoded message.
+ * @param len Number of bytes of msg to send.
+ * @param planned_us Absolute CLOCK_MONOTONIC deadline of the command.
+ *
+ * @return CLOCK_MONOTONIC time the command was sent, usually
+ *         anki_timeline_now_us() after writing it. Lateness is measured
+ *         from this, so slow emits delay the commands after them.
+ */
+typedef uint64_t (*anki_timeline_emit_func_t)(uint8_t vehicle, const anki_vehicle_msg_t *msg, uint8_t len,
+                                              uint64_t planned_us, void *user_data);
+
+/**
+ * Timeline of pre-encoded vehicle commands.
+ *
+ * Pending commands are kept in a binary min-heap on (time_us, seq) over
+ * caller-provided storage, so adding and firing are O(log n) and nothing
+ * is allocated. Fired commands stay in storage after the heap, so a show
+ * can be replayed with anki_timeline_restart.
+ *
+ * spin_us may be set after initialization: the timerfd helpers then wake
+ * that much early and busy-wait for the exact deadline, trading CPU for
+ * lower jitter.
+ */
+typedef struct anki_timeline {
+    anki_timeline_entry_t *entries;
+    uint32_t    capacity;
+    uint32_t    count;      // Entries stored, pending or fired
+    uint32_t    pending;    // Heap size
+    uint32_t    next_seq;
+    uint64_t    start_us;
+    uint8_t     running;
+    uint32_t    spin_us;
+    anki_timeline_stats_t stats;
+} anki_timeline_t;
+
+/**
+ * Initialize an empty timeline over caller-provided entry storage.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_timeline_init(anki_timeline_t *tl, anki_timeline_entry_t *entries, uint32_t capacity);
+
+/**
+ * Add an encoded message to the timeline.
+ *
+ * @param tl Timeline.
+ * @param time_us Send time relative to the start of the timeline.
+ * @param vehicle Vehicle index passed back to the emit function.
+ * @param msg Message to send.
+ * @param len Number of bytes of msg to send.
+ *
+ * @return 0 on success, 1 on failure (including a full timeline).
+ */
+uint8_t anki_timeline_add_msg(anki_timeline_t *tl, uint64_t time_us, uint8_t vehicle,
+                              const anki_vehicle_msg_t *msg, uint8_t len);
+
+/**
+ * Add a speed change. See anki_vehicle_msg_set_speed.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_timeline_add_set_speed(anki_timeline_t *tl, uint64_t time_us, uint8_t vehicle,
+                                    uint16_t speed_mm_per_sec, uint16_t accel_mm_per_sec2);
+
+/**
+ * Add a lights pattern. See anki_vehicle_msg_lights_pattern.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_timeline_add_lights_pattern(anki_timeline_t *tl, uint64_t time_us, uint8_t vehicle,
+                                         uint8_t channel, uint8_t effect, uint8_t start,
+                                         uint8_t end, uint16_t cycles_per_min);
+
+/**
+ * Add a 180 degree turn. See anki_vehicle_msg_turn_180.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_timeline_add_turn_180(anki_timeline_t *tl, uint64_t time_us, uint8_t vehicle);
+
+/**
+ * Start playing the timeline: time 0 is start_us on CLOCK_MONOTONIC.
+ */
+void anki_timeline_start(anki_timeline_t *tl, uint64_t start_us);
+
+/**
+ * Make every stored command pending again and start playing from start_us.
+ * Statistics are kept.
+ */
+void anki_timeline_restart(anki_timeline_t *tl, uint64_t start_us);
+
+/**
+ * Absolute deadline of the next pending command.
+ *
+ * @return 0 on success, 1 if the timeline is not running or nothing is pending.
+ */
+uint8_t anki_timeline_next_deadline(const anki_timeline_t *tl, uint64_t *deadline_us);
+
+/**
+ * Send every command due at now_us, in time order. The lateness of each
+ * command is the time emit reports minus its deadline.
+ *
+ * @return number of commands sent.
+ */
+uint32_t anki_timeline_fire(anki_timeline_t *tl, uint64_t now_us,
+                            anki_timeline_emit_func_t emit, void *user_data);
+
+/**
+ * Current CLOCK_MONOTONIC time in microseconds.
+ */
+uint64_t anki_timeline_now_us(void);
+
+#ifdef __linux__
+/**
+ * Create a non-blocking CLOCK_MONOTONIC timerfd for driving a timeline.
+ *
+ * @return file descriptor, or -1 on failure.
+ */
+int anki_timeline_timerfd_create(void);
+
+/**
+ * Arm fd for the next deadline (minus spin_us) as an absolute time, or
+ * disarm it when nothing is pending.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_timeline_timerfd_arm(const anki_timeline_t *tl, int fd);
+
+/**
+ * Handle fd becoming readable: send everything due and re-arm fd.
+ *
+ * @return number of commands sent.
+ */
+uint32_t anki_timeline_timerfd_dispatch(anki_timeline_t *tl, int fd,
+                                        anki_timeline_emit_func_t emit, void *user_data);
+#endif
+
+ANKI_END_DECL
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "track_geometry.h"
+
+uint8_t anki_track_geometry_build(const anki_track_map_t *map, float *piece_start_mm,
+                                  uint8_t *bucket_piece, uint32_t buckets)
+{
+    uint32_t measured_total = 0;
+    uint8_t measured = 0;
+    float fallback_mm;
+    float start = 0.0f;
+    float length;
+    uint32_t b;
+    uint8_t i, p;
+
+    for (i = 0; i < map->count; i++) {
+        if (map->pieces[i].length_mm > 0) {
+            measured_total += map->pieces[i].length_mm;
+            measured++;
+        }
+    }
+    if (measured == 0)
+        return 1;
+    fallback_mm = (float)measured_total / measured;
+
+    for (i = 0; i < map->count; i++) {
+        piece_start_mm[i] = start;
+        start += (map->pieces[i].length_mm > 0) ? (float)map->pieces[i].length_mm : fallback_mm;
+    }
+    piece_start_mm[map->count] = start;
+    length = start;
+
+    p = 0;
+    for (b = 0; b < buckets; b++) {
+        float bucket_start = length * b / buckets;
+        while (p + 1 < map->count && piece_start_mm[p + 1] <= bucket_start)
+            p++;
+        bucket_piece[b] = p;
+    }
+
+    return 0;
+}
+
+uint8_t anki_track_geometry_piece_at(const float *piece_start_mm, uint8_t piece_count,
+                                     const uint8_t *bucket_piece, uint32_t buckets,
+                                     float distance_mm)
+{
+    int32_t b = (int32_t)(distance_mm * buckets / piece_start_mm[piece_count]);
+    uint8_t p;
+
+    if (b < 0)
+        b = 0;
+    if (b >= (int32_t)buckets)
+        b = buckets - 1;
+
+    p = bucket_piece[b];
+    while (p + 1 < piece_count && piece_start_mm[p + 1] <= distance_mm)
+        p++;
+
+    return p;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_track_geometry_h
+#define INCLUDE_track_geometry_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "track_map.h"
+
+ANKI_BEGIN_DECL
+
+// Track geometry shared by the predictor and the simulator. Not installed.
+//
+// The inline helpers avoid libm and only select between values that are
+// already computed, so that the per-vehicle loops using them are
+// if-converted and vectorized without relaxed floating point.
+
+// Wrap a distance into [0, length)
+static inline float anki_track_wrap_distance(float d, float length)
+{
+    float r = d - (float)(int32_t)(d / length) * length;
+
+    return r + length * (float)(r < 0.0f);
+}
+
+// Offset after moving towards target at rate for dt seconds
+static inline float anki_track_steer(float offset, float target, float rate, float dt)
+{
+    float diff = target - offset;
+    float step = rate * dt;
+    float lo = -step;
+
+    diff = (diff < lo) ? lo : diff;
+    diff = (diff > step) ? step : diff;
+    return offset + diff;
+}
+
+// Fill in the start of every piece of a complete map, and of the lap after
+// the last piece, which is the track length. Pieces whose length has not
+// been measured get the mean length of the measured ones. bucket_piece
+// receives the first piece overlapping each of buckets equal slices of the
+// track, so lookups take at most a few steps.
+//
+// Returns 0 on success, 1 if no piece has been measured.
+uint8_t anki_track_geometry_build(const anki_track_map_t *map, float *piece_start_mm,
+                                  uint8_t *bucket_piece, uint32_t buckets);
+
+// Index of the piece at distance_mm, which must be in [0, track length)
+uint8_t anki_track_geometry_piece_at(const float *piece_start_mm, uint8_t piece_count,
+                                     const uint8_t *bucket_piece, uint32_t buckets,
+                                     float distance_mm);
+
+ANKI_END_DECL
+
+#endif
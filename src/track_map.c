@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "track_map.h"
+
+// Traversals averaged into a piece length before it becomes a moving average
+#define LENGTH_AVERAGE_WINDOW   16
+
+#define SAVE_HEADER_SIZE        6
+#define SAVE_PIECE_SIZE         12
+
+static const uint8_t save_magic[4] = { 'A', 'K', 'T', 'M' };
+
+anki_track_piece_type_t anki_track_piece_type_for_id(uint8_t road_piece_id)
+{
+    switch (road_piece_id) {
+    case 17: case 18: case 20: case 23: case 24: case 27:
+        return ANKI_TRACK_PIECE_CURVE;
+    case 36: case 39: case 40: case 48: case 51:
+        return ANKI_TRACK_PIECE_STRAIGHT;
+    case 33:
+        return ANKI_TRACK_PIECE_START;
+    case 34:
+        return ANKI_TRACK_PIECE_FINISH;
+    case 10:
+        return ANKI_TRACK_PIECE_INTERSECTION;
+    default:
+        return ANKI_TRACK_PIECE_UNKNOWN;
+    }
+}
+
+static void piece_init(anki_track_piece_t *piece, uint8_t road_piece_id)
+{
+    memset(piece, 0, sizeof(anki_track_piece_t));
+    piece->road_piece_id = road_piece_id;
+    piece->type = anki_track_piece_type_for_id(road_piece_id);
+    piece->link = ANKI_TRACK_PIECE_NONE;
+    piece->offset_min_mm = INT16_MAX;
+    piece->offset_max_mm = INT16_MIN;
+}
+
+void anki_track_map_init(anki_track_map_t *map)
+{
+    memset(map, 0, sizeof(anki_track_map_t));
+    map->state = ANKI_TRACK_MAP_EMPTY;
+    map->current = ANKI_TRACK_PIECE_NONE;
+    map->open_intersection = ANKI_TRACK_PIECE_NONE;
+}
+
+static void add_length_sample(anki_track_piece_t *piece, uint32_t sample_mm)
+{
+    int32_t n;
+
+    if (sample_mm > UINT16_MAX)
+        sample_mm = UINT16_MAX;
+
+    if (piece->length_samples == 0) {
+        piece->length_mm = (uint16_t)sample_mm;
+    } else {
+        n = piece->length_samples + 1;
+        if (n > LENGTH_AVERAGE_WINDOW)
+            n = LENGTH_AVERAGE_WINDOW;
+        piece->length_mm = (uint16_t)((int32_t)piece->length_mm +
+                                      ((int32_t)sample_mm - (int32_t)piece->length_mm) / n);
+    }
+
+    if (piece->length_samples < UINT8_MAX)
+        piece->length_samples++;
+    piece->flags |= ANKI_TRACK_PIECE_FLAG_MEASURED;
+}
+
+// Pair the two passes over an intersection while mapping a figure eight
+static void note_intersection(anki_track_map_t *map, uint8_t index)
+{
+    anki_track_piece_t *piece = &map->pieces[index];
+
+    piece->flags |= ANKI_TRACK_PIECE_FLAG_INTERSECTION;
+    if (map->state != ANKI_TRACK_MAP_MAPPING || piece->link != ANKI_TRACK_PIECE_NONE)
+        return;
+
+    if (map->open_intersection != ANKI_TRACK_PIECE_NONE && map->open_intersection != index) {
+        piece->link = map->open_intersection;
+        map->pieces[map->open_intersection].link = index;
+        map->open_intersection = ANKI_TRACK_PIECE_NONE;
+    } else {
+        map->open_intersection = index;
+    }
+}
+
+static void close_loop(anki_track_map_t *map)
+{
+    // The provisional piece at the end is the anchor piece seen again
+    map->count = map->current;
+    map->current = 0;
+    map->state = ANKI_TRACK_MAP_COMPLETE;
+    map->open_intersection = ANKI_TRACK_PIECE_NONE;
+}
+
+// Converting a float that does not fit is undefined, so NaN, infinities and
+// offsets beyond the int16_t range are rejected. NaN fails both comparisons.
+static uint8_t offset_to_mm(float offset, int16_t *mm)
+{
+    if (!(offset >= INT16_MIN && offset <= INT16_MAX))
+        return 1;
+    *mm = (int16_t)(offset < 0 ? offset - 0.5f : offset + 0.5f);
+    return 0;
+}
+
+uint8_t anki_track_map_position_update(anki_track_map_t *map,
+                                       const anki_vehicle_msg_localization_position_update_t *update)
+{
+    anki_track_piece_t *piece;
+    uint8_t id;
+    int16_t offset;
+
+    if (map == NULL || update == NULL)
+        return 1;
+    if (offset_to_mm(update->offset_from_road_center_mm, &offset) != 0)
+        return 1;
+
+    id = update->road_piece_id;
+
+    switch (map->state) {
+    case ANKI_TRACK_MAP_EMPTY:
+    {
+        anki_track_piece_type_t type = anki_track_piece_type_for_id(id);
+        if (type != ANKI_TRACK_PIECE_START && type != ANKI_TRACK_PIECE_FINISH)
+            return 0;
+
+        // Anchor the map on the start line. Unless a transition was seen
+        // first, the vehicle is part way along this piece and its length is
+        // left for the next lap.
+        piece_init(&map->pieces[0], id);
+        map->count = 1;
+        map->current = 0;
+        map->state = ANKI_TRACK_MAP_MAPPING;
+        break;
+    }
+
+    case ANKI_TRACK_MAP_MAPPING:
+        piece = &map->pieces[map->current];
+        if (piece->road_piece_id == ANKI_TRACK_PIECE_ID_UNKNOWN) {
+            if (map->current > 0 && id == map->pieces[0].road_piece_id) {
+                close_loop(map);
+            } else {
+                piece->road_piece_id = id;
+                piece->type = anki_track_piece_type_for_id(id);
+                if (piece->type == ANKI_TRACK_PIECE_INTERSECTION)
+                    note_intersection(map, map->current);
+            }
+        } else if (piece->road_piece_id != id) {
+            map->mismatches++;
+            return 0;
+        }
+        break;
+
+    case ANKI_TRACK_MAP_COMPLETE:
+        if (map->current != ANKI_TRACK_PIECE_NONE) {
+            piece = &map->pieces[map->current];
+            if (piece->road_piece_id == ANKI_TRACK_PIECE_ID_UNKNOWN) {
+                piece->road_piece_id = id;
+                piece->type = anki_track_piece_type_for_id(id);
+            } else if (piece->road_piece_id != id) {
+                map->mismatches++;
+                map->current = ANKI_TRACK_PIECE_NONE;
+            }
+        }
+
+        // Lost or never placed: wait for the anchor piece to come around
+        if (map->current == ANKI_TRACK_PIECE_NONE) {
+            if (id != map->pieces[0].road_piece_id)
+                return 0;
+            map->current = 0;
+        }
+        break;
+
+    default:
+        return 1;
+    }
+
+    piece = &map->pieces[map->current];
+    if (offset < piece->offset_min_mm)
+        piece->offset_min_mm = offset;
+    if (offset > piece->offset_max_mm)
+        piece->offset_max_mm = offset;
+    if (update->location_id > piece->location_max)
+        piece->location_max = update->location_id;
+
+    return 0;
+}
+
+uint8_t anki_track_map_transition_update(anki_track_map_t *map,
+                                         const anki_vehicle_msg_localization_transition_update_t *update)
+{
+    uint32_t sample_mm;
+
+    if (map == NULL || update == NULL)
+        return 1;
+
+    // Wheel displacement covers the piece that was just left
+    sample_mm = ((uint32_t)update->left_wheel_dist_cm + update->right_wheel_dist_cm) * 5;
+    if (map->current != ANKI_TRACK_PIECE_NONE && map->current_whole && sample_mm > 0)
+        add_length_sample(&map->pieces[map->current], sample_mm);
+
+    switch (map->state) {
+    case ANKI_TRACK_MAP_EMPTY:
+        break;
+
+    case ANKI_TRACK_MAP_MAPPING:
+        // Pieces are recorded in forward driving order only
+        if (update->driving_direction != FORWARD) {
+            anki_track_map_init(map);
+            return 0;
+        }
+        // count includes the provisional piece, which may be the anchor
+        if (map->count > ANKI_TRACK_MAP_MAX_PIECES) {
+            anki_track_map_init(map);
+            return 1;
+        }
+        piece_init(&map->pieces[map->count], ANKI_TRACK_PIECE_ID_UNKNOWN);
+        map->current = map->count++;
+        break;
+
+    case ANKI_TRACK_MAP_COMPLETE:
+        if (map->current == ANKI_TRACK_PIECE_NONE)
+            break;
+        if (update->driving_direction == FORWARD)
+            map->current = (map->current + 1) % map->count;
+        else
+            map->current = (map->current + map->count - 1) % map->count;
+        break;
+
+    default:
+        return 1;
+    }
+
+    map->current_whole = 1;
+    return 0;
+}
+
+uint8_t anki_track_map_intersection_update(anki_track_map_t *map,
+                                           const anki_vehicle_msg_localization_intersection_update_t *update)
+{
+    if (map == NULL || update == NULL)
+        return 1;
+
+    if (map->current != ANKI_TRACK_PIECE_NONE)
+        note_intersection(map, map->current);
+
+    return 0;
+}
+
+void anki_track_map_delocalized(anki_track_map_t *map)
+{
+    if (map->state == ANKI_TRACK_MAP_MAPPING) {
+        anki_track_map_init(map);
+    } else {
+        map->current = ANKI_TRACK_PIECE_NONE;
+        map->current_whole = 0;
+    }
+}
+
+uint8_t anki_track_map_handle_msg(anki_track_map_t *map, const anki_vehicle_msg_t *msg, uint8_t len)
+{
+    if (map == NULL || msg == NULL || len < ANKI_VEHICLE_MSG_BASE_SIZE + 1)
+        return 1;
+
+    switch (msg->msg_id) {
+    case ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE:
+        if (len < ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE_SIZE + ANKI_VEHICLE_MSG_BASE_SIZE)
+            return 1;
+        return anki_track_map_position_update(map, (const anki_vehicle_msg_localization_position_update_t *)msg);
+
+    case ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE:
+        if (len < ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE_SIZE + ANKI_VEHICLE_MSG_BASE_SIZE)
+            return 1;
+        return anki_track_map_transition_update(map, (const anki_vehicle_msg_localization_transition_update_t *)msg);
+
+    case ANKI_VEHICLE_MSG_V2C_LOCALIZATION_INTERSECTION_UPDATE:
+        if (len < ANKI_VEHICLE_MSG_V2C_LOCALIZATION_INTERSECTION_UPDATE_SIZE + ANKI_VEHICLE_MSG_BASE_SIZE)
+            return 1;
+        return anki_track_map_intersection_update(map, (const anki_vehicle_msg_localization_intersection_update_t *)msg);
+
+    case ANKI_VEHICLE_MSG_V2C_VEHICLE_DELOCALIZED:
+        anki_track_map_delocalized(map);
+        return 0;
+
+    default:
+        return 0;
+    }
+}
+
+uint32_t anki_track_map_length_mm(const anki_track_map_t *map)
+{
+    uint32_t total = 0;
+    uint8_t i;
+
+    for (i = 0; i < map->count; i++)
+        total += map->pieces[i].length_mm;
+
+    return total;
+}
+
+size_t anki_track_map_serialized_size(const anki_track_map_t *map)
+{
+    return SAVE_HEADER_SIZE + (size_t)map->count * SAVE_PIECE_SIZE;
+}
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+size_t anki_track_map_save(const anki_track_map_t *map, uint8_t *buf, size_t len)
+{
+    size_t size;
+    uint8_t i;
+
+    if (map == NULL || buf == NULL || map->state != ANKI_TRACK_MAP_COMPLETE)
+        return 0;
+
+    size = anki_track_map_serialized_size(map);
+    if (len < size)
+        return 0;
+
+    memcpy(buf, save_magic, sizeof(save_magic));
+    buf[4] = ANKI_TRACK_MAP_FORMAT_VERSION;
+    buf[5] = map->count;
+
+    for (i = 0; i < map->count; i++) {
+        const anki_track_piece_t *piece = &map->pieces[i];
+        uint8_t *p = buf + SAVE_HEADER_SIZE + (size_t)i * SAVE_PIECE_SIZE;
+
+        p[0] = piece->road_piece_id;
+        p[1] = piece->type;
+        p[2] = piece->flags;
+        p[3] = piece->link;
+        put_le16(p + 4, piece->length_mm);
+        p[6] = piece->length_samples;
+        p[7] = piece->location_max;
+        put_le16(p + 8, (uint16_t)piece->offset_min_mm);
+        put_le16(p + 10, (uint16_t)piece->offset_max_mm);
+    }
+
+    return size;
+}
+
+uint8_t anki_track_map_load(anki_track_map_t *map, const uint8_t *buf, size_t len)
+{
+    uint8_t count;
+    uint8_t i;
+
+    if (map == NULL)
+        return 1;
+
+    anki_track_map_init(map);
+
+    if (buf == NULL || len < SAVE_HEADER_SIZE)
+        return 1;
+    if (memcmp(buf, save_magic, sizeof(save_magic)) != 0 || buf[4] != ANKI_TRACK_MAP_FORMAT_VERSION)
+        return 1;
+
+    count = buf[5];
+    if (count == 0 || count > ANKI_TRACK_MAP_MAX_PIECES)
+        return 1;
+    if (len != SAVE_HEADER_SIZE + (size_t)count * SAVE_PIECE_SIZE)
+        return 1;
+
+    for (i = 0; i < count; i++) {
+        anki_track_piece_t *piece = &map->pieces[i];
+        const uint8_t *p = buf + SAVE_HEADER_SIZE + (size_t)i * SAVE_PIECE_SIZE;
+
+        piece->road_piece_id = p[0];
+        piece->type = p[1];
+        piece->flags = p[2];
+        piece->link = p[3];
+        piece->length_mm = get_le16(p + 4);
+        piece->length_samples = p[6];
+        piece->location_max = p[7];
+        piece->offset_min_mm = (int16_t)get_le16(p + 8);
+        piece->offset_max_mm = (int16_t)get_le16(p + 10);
+
+        if (piece->type > ANKI_TRACK_PIECE_INTERSECTION)
+            goto invalid;
+    }
+
+    // Intersection links must pair up
+    for (i = 0; i < count; i++) {
+        uint8_t link = map->pieces[i].link;
+        if (link == ANKI_TRACK_PIECE_NONE)
+            continue;
+        if (link >= count || link == i || map->pieces[link].link != i)
+            goto invalid;
+    }
+
+    map->count = count;
+    map->state = ANKI_TRACK_MAP_COMPLETE;
+    return 0;
+
+invalid:
+    anki_track_map_init(map);
+    return 1;
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_track_map_h
+#define INCLUDE_track_map_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "common.h"
+#include "protocol.h"
+
+ANKI_BEGIN_DECL
+
+/** Largest number of road pieces in a mapped track. */
+#define ANKI_TRACK_MAP_MAX_PIECES   64
+
+/** Index value meaning "no piece". */
+#define ANKI_TRACK_PIECE_NONE       0xff
+
+/** Road piece id not yet reported by the vehicle. */
+#define ANKI_TRACK_PIECE_ID_UNKNOWN 0
+
+/** Serialization format version written by anki_track_map_save. */
+#define ANKI_TRACK_MAP_FORMAT_VERSION   1
+
+typedef enum {
+    ANKI_TRACK_PIECE_UNKNOWN = 0,
+    ANKI_TRACK_PIECE_STRAIGHT,
+    ANKI_TRACK_PIECE_CURVE,
+    ANKI_TRACK_PIECE_START,
+    ANKI_TRACK_PIECE_FINISH,
+    ANKI_TRACK_PIECE_INTERSECTION,
+} anki_track_piece_type_t;
+
+/** Piece was seen carrying an intersection update. */
+#define ANKI_TRACK_PIECE_FLAG_INTERSECTION  0x01
+/** Piece length has been measured over a whole traversal. */
+#define ANKI_TRACK_PIECE_FLAG_MEASURED      0x02
+
+/**
+ * One road piece of a mapped track, in driving order.
+ *
+ * - road_piece_id: Road piece id reported in position updates
+ * - type: See anki_track_piece_type_t
+ * - flags: ANKI_TRACK_PIECE_FLAG_* bits
+ * - link: Index of the other piece crossing the same intersection,
+ *         or ANKI_TRACK_PIECE_NONE
+ * - length_mm: Estimated driven length, from wheel displacement
+ * - length_samples: Number of traversals averaged into length_mm (saturates)
+ * - offset_min_mm, offset_max_mm: Range of lane offsets observed
+ * - location_max: Highest location id observed, a proxy for lane count
+ */
+typedef struct anki_track_piece {
+    uint8_t     road_piece_id;
+    uint8_t     type;
+    uint8_t     flags;
+    uint8_t     link;
+    uint16_t    length_mm;
+    uint8_t     length_samples;
+    uint8_t     location_max;
+    int16_t     offset_min_mm;
+    int16_t     offset_max_mm;
+} anki_track_piece_t;
+
+typedef enum {
+    ANKI_TRACK_MAP_EMPTY = 0,   // Waiting for the start line
+    ANKI_TRACK_MAP_MAPPING,     // Recording pieces, loop not yet closed
+    ANKI_TRACK_MAP_COMPLETE,    // Loop closed or loaded, pieces are tracked
+} anki_track_map_state_t;
+
+/**
+ * Track map built from the localization updates of one vehicle.
+ *
+ * Mapping starts at the first start or finish piece and the loop is closed
+ * when the vehicle reaches that piece again. After that, updates keep
+ * refining lengths and offsets and follow the vehicle around the map.
+ * All updates are constant time.
+ */
+typedef struct anki_track_map {
+    // One spare slot while mapping, for the provisional piece that turns
+    // out to be the anchor piece when the loop closes
+    anki_track_piece_t  pieces[ANKI_TRACK_MAP_MAX_PIECES + 1];
+    uint8_t     count;
+    uint8_t     state;
+    uint8_t     current;        // Piece the vehicle is on, or ANKI_TRACK_PIECE_NONE
+    uint8_t     current_whole;  // Vehicle entered the current piece at its start
+    uint8_t     open_intersection;
+    uint32_t    mismatches;     // Position updates that disagreed with the map
+} anki_track_map_t;
+
+/**
+ * Classify a road piece id reported by the vehicle.
+ */
+anki_track_piece_type_t anki_track_piece_type_for_id(uint8_t road_piece_id);
+
+/**
+ * Reset a track map to the empty state.
+ */
+void anki_track_map_init(anki_track_map_t *map);
+
+/**
+ * Apply a position update to the map.
+ *
+ * Updates whose offset is not a finite value within the int16_t range are
+ * rejected without changing the map.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_track_map_position_update(anki_track_map_t *map,
+                                       const anki_vehicle_msg_localization_position_update_t *update);
+
+/**
+ * Apply a transition update to the map.
+ *
+ * @return 0 on success, 1 on failure (including running out of pieces while mapping).
+ */
+uint8_t anki_track_map_transition_update(anki_track_map_t *map,
+                                         const anki_vehicle_msg_localization_transition_update_t *update);
+
+/**
+ * Apply an intersection update to the map.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_track_map_intersection_update(anki_track_map_t *map,
+                                           const anki_vehicle_msg_localization_intersection_update_t *update);
+
+/**
+ * Record that the vehicle lost track of its position. An unfinished map is
+ * discarded since its piece sequence can no longer be trusted.
+ */
+void anki_track_map_delocalized(anki_track_map_t *map);
+
+/**
+ * Dispatch a received vehicle message to the matching update function.
+ * Messages unrelated to localization are ignored.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_track_map_handle_msg(anki_track_map_t *map, const anki_vehicle_msg_t *msg, uint8_t len);
+
+/**
+ * Sum of the estimated lengths of all mapped pieces, in mm.
+ */
+uint32_t anki_track_map_length_mm(const anki_track_map_t *map);
+
+/**
+ * Number of bytes anki_track_map_save needs for this map.
+ */
+size_t anki_track_map_serialized_size(const anki_track_map_t *map);
+
+/**
+ * Serialize a complete map into a portable byte buffer.
+ *
+ * @param map Map to save. Must be in the ANKI_TRACK_MAP_COMPLETE state.
+ * @param buf Output buffer.
+ * @param len Size of buf in bytes.
+ *
+ * @return number of bytes written, 0 on failure.
+ */
+size_t anki_track_map_save(const anki_track_map_t *map, uint8_t *buf, size_t len);
+
+/**
+ * Load a map written by anki_track_map_save.
+ *
+ * The loaded map is complete but not localized: the vehicle is placed on it
+ * the next time it reports the anchor piece.
+ *
+ * @return 0 on success, 1 on failure (map is left empty).
+ */
+uint8_t anki_track_map_load(anki_track_map_t *map, const uint8_t *buf, size_t len);
+
+ANKI_END_DECL
+
+#endif
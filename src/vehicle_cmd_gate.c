@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "vehicle_cmd_gate.h"
+
+void anki_vehicle_cmd_gate_init(anki_vehicle_cmd_gate_t *gate)
+{
+    memset(gate, 0, sizeof(anki_vehicle_cmd_gate_t));
+    gate->speed_deadband_mm_per_sec = ANKI_VEHICLE_CMD_GATE_DEFAULT_SPEED_DEADBAND;
+    gate->offset_deadband_mm = ANKI_VEHICLE_CMD_GATE_DEFAULT_OFFSET_DEADBAND;
+    gate->refresh_us = ANKI_VEHICLE_CMD_GATE_DEFAULT_REFRESH_US;
+}
+
+void anki_vehicle_cmd_gate_reset(anki_vehicle_cmd_gate_t *gate)
+{
+    gate->speed_valid = 0;
+    gate->lane_valid = 0;
+}
+
+static uint8_t refresh_due(const anki_vehicle_cmd_gate_t *gate, uint64_t sent_us, uint64_t timestamp_us)
+{
+    return gate->refresh_us > 0 && timestamp_us >= sent_us + gate->refresh_us;
+}
+
+uint8_t anki_vehicle_cmd_gate_set_speed(anki_vehicle_cmd_gate_t *gate, uint64_t timestamp_us,
+                                        anki_vehicle_msg_t *msg,
+                                        uint16_t speed_mm_per_sec, uint16_t accel_mm_per_sec2)
+{
+    if (gate->speed_valid && accel_mm_per_sec2 == gate->accel_mm_per_sec2 &&
+        !refresh_due(gate, gate->speed_sent_us, timestamp_us)) {
+        // Compare against the last value sent, so slow drifts still get through
+        uint16_t diff = (speed_mm_per_sec > gate->speed_mm_per_sec)
+                            ? speed_mm_per_sec - gate->speed_mm_per_sec
+                            : gate->speed_mm_per_sec - speed_mm_per_sec;
+        if (diff < gate->speed_deadband_mm_per_sec || diff == 0) {
+            gate->suppressed++;
+            return 0;
+        }
+    }
+
+    gate->speed_mm_per_sec = speed_mm_per_sec;
+    gate->accel_mm_per_sec2 = accel_mm_per_sec2;
+    gate->speed_sent_us = timestamp_us;
+    gate->speed_valid = 1;
+    gate->sent++;
+
+    return anki_vehicle_msg_set_speed(msg, speed_mm_per_sec, accel_mm_per_sec2);
+}
+
+uint8_t anki_vehicle_cmd_gate_change_lane(anki_vehicle_cmd_gate_t *gate, uint64_t timestamp_us,
+                                          anki_vehicle_msg_t *msg,
+                                          uint16_t horizontal_speed_mm_per_sec,
+                                          float offset_from_center_mm)
+{
+    if (gate->lane_valid && !refresh_due(gate, gate->lane_sent_us, timestamp_us)) {
+        float diff = offset_from_center_mm - gate->offset_mm;
+        if (diff < 0.0f)
+            diff = -diff;
+        if (diff < gate->offset_deadband_mm || diff == 0.0f) {
+            gate->suppressed++;
+            return 0;
+        }
+    }
+
+    gate->offset_mm = offset_from_center_mm;
+    gate->horizontal_speed_mm_per_sec = horizontal_speed_mm_per_sec;
+    gate->lane_sent_us = timestamp_us;
+    gate->lane_valid = 1;
+    gate->sent++;
+
+    return anki_vehicle_msg_change_lane(msg, horizontal_speed_mm_per_sec, offset_from_center_mm);
+}
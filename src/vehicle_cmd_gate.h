@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_vehicle_cmd_gate_h
+#define INCLUDE_vehicle_cmd_gate_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "protocol.h"
+
+ANKI_BEGIN_DECL
+
+/** Default speed change below which a speed command is suppressed. */
+#define ANKI_VEHICLE_CMD_GATE_DEFAULT_SPEED_DEADBAND    10
+/** Default offset change below which a lane change command is suppressed. */
+#define ANKI_VEHICLE_CMD_GATE_DEFAULT_OFFSET_DEADBAND   2.0f
+/** Default interval after which an unchanged command is sent again. */
+#define ANKI_VEHICLE_CMD_GATE_DEFAULT_REFRESH_US        1000000
+
+/**
+ * Change-suppressed command path for one vehicle.
+ *
+ * Controllers running at a fixed rate would otherwise send the same speed
+ * and lane commands every tick. The gate builds a command message only when
+ * it differs from the last one sent by more than a deadband, or when
+ * refresh_us has passed so a lost write is eventually repeated.
+ *
+ * The deadbands and refresh_us may be adjusted after initialization; a
+ * refresh_us of 0 never repeats unchanged commands.
+ */
+typedef struct anki_vehicle_cmd_gate {
+    uint16_t    speed_mm_per_sec;
+    uint16_t    accel_mm_per_sec2;
+    uint64_t    speed_sent_us;
+    float       offset_mm;
+    uint16_t    horizontal_speed_mm_per_sec;
+    uint64_t    lane_sent_us;
+    uint8_t     speed_valid;
+    uint8_t     lane_valid;
+
+    uint16_t    speed_deadband_mm_per_sec;
+    float       offset_deadband_mm;
+    uint32_t    refresh_us;
+
+    uint32_t    sent;
+    uint32_t    suppressed;
+} anki_vehicle_cmd_gate_t;
+
+/**
+ * Initialize a gate with default deadbands. The first command of each
+ * kind is always sent.
+ */
+void anki_vehicle_cmd_gate_init(anki_vehicle_cmd_gate_t *gate);
+
+/**
+ * Forget the last commands sent, e.g. after reconnecting.
+ */
+void anki_vehicle_cmd_gate_reset(anki_vehicle_cmd_gate_t *gate);
+
+/**
+ * Build a speed command unless it would repeat the last one sent.
+ *
+ * @param gate Gate of the target vehicle.
+ * @param timestamp_us Current time.
+ * @param msg Receives the message.
+ * @param speed_mm_per_sec See anki_vehicle_msg_set_speed.
+ * @param accel_mm_per_sec2 See anki_vehicle_msg_set_speed.
+ *
+ * @return size of bytes written to msg, 0 if the command was suppressed.
+ */
+uint8_t anki_vehicle_cmd_gate_set_speed(anki_vehicle_cmd_gate_t *gate, uint64_t timestamp_us,
+                                        anki_vehicle_msg_t *msg,
+                                        uint16_t speed_mm_per_sec, uint16_t accel_mm_per_sec2);
+
+/**
+ * Build a lane change command unless it would repeat the last one sent.
+ *
+ * @param gate Gate of the target vehicle.
+ * @param timestamp_us Current time.
+ * @param msg Receives the message.
+ * @param horizontal_speed_mm_per_sec See anki_vehicle_msg_change_lane.
+ * @param offset_from_center_mm See anki_vehicle_msg_change_lane.
+ *
+ * @return size of bytes written to msg, 0 if the command was suppressed.
+ */
+uint8_t anki_vehicle_cmd_gate_change_lane(anki_vehicle_cmd_gate_t *gate, uint64_t timestamp_us,
+                                          anki_vehicle_msg_t *msg,
+                                          uint16_t horizontal_speed_mm_per_sec,
+                                          float offset_from_center_mm);
+
+ANKI_END_DECL
+
+#endif
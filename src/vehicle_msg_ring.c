@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "vehicle_msg_ring.h"
+#include "seqlock.h"
+
+// Slot sequence value once message seq has been fully written
+#define SLOT_READY(seq)     (2 * ((seq) + 1))
+#define SLOT_WRITING(seq)   (2 * (seq) + 1)
+
+uint8_t anki_vehicle_msg_ring_init(anki_vehicle_msg_ring_t *ring,
+                                   anki_vehicle_msg_ring_slot_t *slots,
+                                   uint32_t capacity)
+{
+    if (ring == NULL || slots == NULL)
+        return 1;
+
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+        return 1;
+
+    memset(ring, 0, sizeof(anki_vehicle_msg_ring_t));
+    memset(slots, 0, capacity * sizeof(anki_vehicle_msg_ring_slot_t));
+    ring->slots = slots;
+    ring->mask = capacity - 1;
+
+    return 0;
+}
+
+uint8_t anki_vehicle_msg_ring_publish(anki_vehicle_msg_ring_t *ring,
+                                      uint32_t vehicle_id,
+                                      uint64_t timestamp_us,
+                                      const uint8_t *data, uint8_t len)
+{
+    anki_vehicle_msg_ring_slot_t *slot;
+    uint64_t seq;
+
+    if (ring == NULL || (data == NULL && len > 0) || len > sizeof(anki_vehicle_msg_t))
+        return 1;
+
+    // Only the producer writes head, a plain read is enough
+    seq = ring->head;
+    slot = &ring->slots[seq & ring->mask];
+
+    ANKI_SEQLOCK_WRITE_BEGIN(&slot->seq, SLOT_WRITING(seq));
+
+    slot->entry.timestamp_us = timestamp_us;
+    slot->entry.vehicle_id = vehicle_id;
+    slot->entry.len = len;
+    if (len > 0)
+        memcpy(&slot->entry.msg, data, len);
+
+    ANKI_SEQLOCK_WRITE_END(&slot->seq, SLOT_READY(seq));
+    __atomic_store_n(&ring->head, seq + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void anki_vehicle_msg_ring_cursor_init(const anki_vehicle_msg_ring_t *ring,
+                                       anki_vehicle_msg_ring_cursor_t *cursor)
+{
+    cursor->next = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    cursor->missed = 0;
+}
+
+uint8_t anki_vehicle_msg_ring_read(const anki_vehicle_msg_ring_t *ring,
+                                   anki_vehicle_msg_ring_cursor_t *cursor,
+                                   anki_vehicle_msg_ring_entry_t *entry)
+{
+    uint64_t capacity = (uint64_t)ring->mask + 1;
+
+    for (;;) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        const anki_vehicle_msg_ring_slot_t *slot;
+        uint64_t seq, before;
+
+        if (cursor->next >= head)
+            return 0;
+
+        // Lapped by the producer: skip to the oldest slot not yet reused
+        if (head - cursor->next > capacity) {
+            cursor->missed += head - capacity - cursor->next;
+            cursor->next = head - capacity;
+        }
+
+        seq = cursor->next;
+        slot = &ring->slots[seq & ring->mask];
+
+        before = ANKI_SEQLOCK_READ_BEGIN(&slot->seq);
+        if (before == SLOT_READY(seq)) {
+            memcpy(entry, &slot->entry, sizeof(anki_vehicle_msg_ring_entry_t));
+            if (!ANKI_SEQLOCK_READ_RETRY(&slot->seq, before)) {
+                cursor->next = seq + 1;
+                return 1;
+            }
+        }
+
+        // The slot was reused while we looked at it, which only happens once
+        // the producer is a full ring ahead. Count it and catch up.
+        cursor->missed++;
+        cursor->next = seq + 1;
+    }
+}
+
+uint64_t anki_vehicle_msg_ring_lag(const anki_vehicle_msg_ring_t *ring,
+                                   const anki_vehicle_msg_ring_cursor_t *cursor)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    return (head > cursor->next) ? (head - cursor->next) : 0;
+}
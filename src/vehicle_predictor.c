@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "vehicle_predictor.h"
+#include "track_geometry.h"
+
+// The helpers below follow the rules of track_geometry.h: no libm and no
+// branches, so that the prediction loop vectorizes.
+
+// Wrap a distance difference into [-length/2, length/2)
+static inline float wrap_delta(float d, float length)
+{
+    d = anki_track_wrap_distance(d, length);
+    return (d >= 0.5f * length) ? d - length : d;
+}
+
+static inline double to_sec(uint64_t timestamp_us)
+{
+    return (double)timestamp_us * 1e-6;
+}
+
+static inline float elapsed_sec(double base_sec, double now_sec)
+{
+    float dt = (float)(now_sec - base_sec);
+    return (dt > 0.0f) ? dt : 0.0f;
+}
+
+// Distance covered in dt seconds starting at v0, accelerating at a towards
+// vt, which is reached after ramp seconds
+static inline float advance(float v0, float vt, float a, float ramp, float dt, float *speed)
+{
+    float as = a * ((vt < v0) ? -1.0f : 1.0f);
+    float tt = (dt < ramp) ? dt : ramp;
+
+    *speed = v0 + as * tt;
+    return v0 * tt + 0.5f * as * tt * tt + vt * (dt - tt);
+}
+
+// Residual fraction left dt seconds after a correction; scale is 1 / blend time
+static inline float blend_weight(float scale, float dt)
+{
+    float w = 1.0f - dt * scale;
+    return (w > 0.0f) ? w : 0.0f;
+}
+
+static inline float blend_scale(uint32_t blend_us)
+{
+    // A zero blend time applies corrections immediately
+    return (blend_us > 0) ? 1e6f / (float)blend_us : 1e30f;
+}
+
+uint8_t anki_vehicle_predictor_init(anki_vehicle_predictor_t *pred,
+                                    const anki_track_map_t *map,
+                                    uint8_t vehicle_count)
+{
+    if (pred == NULL || map == NULL || map->state != ANKI_TRACK_MAP_COMPLETE || map->count == 0)
+        return 1;
+    if (vehicle_count > ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES)
+        return 1;
+
+    memset(pred, 0, sizeof(anki_vehicle_predictor_t));
+    if (anki_track_geometry_build(map, pred->piece_start_mm, pred->bucket_piece,
+                                  ANKI_VEHICLE_PREDICTOR_BUCKETS) != 0)
+        return 1;
+
+    pred->count = vehicle_count;
+    pred->blend_us = ANKI_VEHICLE_PREDICTOR_DEFAULT_BLEND_US;
+    pred->piece_count = map->count;
+    pred->track_length_mm = pred->piece_start_mm[map->count];
+
+    return 0;
+}
+
+uint8_t anki_vehicle_predictor_piece_at(const anki_vehicle_predictor_t *pred, float distance_mm)
+{
+    return anki_track_geometry_piece_at(pred->piece_start_mm, pred->piece_count, pred->bucket_piece,
+                                        ANKI_VEHICLE_PREDICTOR_BUCKETS,
+                                        anki_track_wrap_distance(distance_mm, pred->track_length_mm));
+}
+
+// Keep the division out of the prediction loops
+static void update_ramp(anki_vehicle_predictor_t *pred, uint8_t i)
+{
+    float dv = pred->target_speed[i] - pred->speed[i];
+
+    if (dv < 0.0f)
+        dv = -dv;
+    pred->ramp_sec[i] = (pred->accel[i] > 0.0f) ? dv / pred->accel[i] : 0.0f;
+}
+
+// Move a vehicle's base state forward to timestamp_us, keeping what is shown continuous
+static void rebase(anki_vehicle_predictor_t *pred, uint8_t i, uint64_t timestamp_us)
+{
+    double now = to_sec(timestamp_us);
+    float dt = elapsed_sec(pred->base_sec[i], now);
+    float w = blend_weight(blend_scale(pred->blend_us), dt);
+    float speed;
+    float d = advance(pred->speed[i], pred->target_speed[i], pred->accel[i], pred->ramp_sec[i], dt, &speed);
+
+    pred->distance_mm[i] = anki_track_wrap_distance(pred->distance_mm[i] + d, pred->track_length_mm);
+    pred->speed[i] = speed;
+    update_ramp(pred, i);
+    pred->offset_mm[i] = anki_track_steer(pred->offset_mm[i], pred->target_offset_mm[i], pred->offset_rate[i], dt);
+    pred->residual_mm[i] *= w;
+    pred->residual_offset_mm[i] *= w;
+    if (now > pred->base_sec[i])
+        pred->base_sec[i] = now;
+}
+
+// Snap the base state to a measured distance, keeping the error as a residual to fade out
+static void correct_distance(anki_vehicle_predictor_t *pred, uint8_t i, float measured_mm)
+{
+    float shown = pred->distance_mm[i] + pred->residual_mm[i];
+
+    pred->residual_mm[i] = wrap_delta(shown - measured_mm, pred->track_length_mm);
+    pred->distance_mm[i] = measured_mm;
+}
+
+static void locate(anki_vehicle_predictor_t *pred, uint8_t i, uint64_t timestamp_us,
+                   float distance_mm, float speed, float offset_mm)
+{
+    pred->base_sec[i] = to_sec(timestamp_us);
+    pred->distance_mm[i] = distance_mm;
+    pred->speed[i] = speed;
+    if (pred->accel[i] == 0.0f)
+        pred->target_speed[i] = speed;
+    pred->offset_mm[i] = offset_mm;
+    pred->target_offset_mm[i] = offset_mm;
+    pred->offset_rate[i] = 0.0f;
+    pred->residual_mm[i] = 0.0f;
+    pred->residual_offset_mm[i] = 0.0f;
+    pred->valid[i] = 1;
+    update_ramp(pred, i);
+}
+
+uint8_t anki_vehicle_predictor_set_speed(anki_vehicle_predictor_t *pred, uint8_t vehicle,
+                                         uint64_t timestamp_us,
+                                         uint16_t speed_mm_per_sec, uint16_t accel_mm_per_sec2)
+{
+    if (pred == NULL || vehicle >= pred->count)
+        return 1;
+
+    if (pred->valid[vehicle])
+        rebase(pred, vehicle, timestamp_us);
+
+    pred->target_speed[vehicle] = speed_mm_per_sec;
+    pred->accel[vehicle] = accel_mm_per_sec2;
+    update_ramp(pred, vehicle);
+
+    return 0;
+}
+
+uint8_t anki_vehicle_predictor_change_lane(anki_vehicle_predictor_t *pred, uint8_t vehicle,
+                                           uint64_t timestamp_us,
+                                           uint16_t horizontal_speed_mm_per_sec,
+                                           float offset_from_center_mm)
+{
+    if (pred == NULL || vehicle >= pred->count || !pred->valid[vehicle])
+        return 1;
+
+    rebase(pred, vehicle, timestamp_us);
+    pred->target_offset_mm[vehicle] = offset_from_center_mm;
+    pred->offset_rate[vehicle] = horizontal_speed_mm_per_sec;
+
+    return 0;
+}
+
+uint8_t anki_vehicle_predictor_transition(anki_vehicle_predictor_t *pred, uint8_t vehicle,
+                                          uint64_t timestamp_us, uint8_t piece)
+{
+    if (pred == NULL || vehicle >= pred->count || piece >= pred->piece_count)
+        return 1;
+
+    if (!pred->valid[vehicle]) {
+        locate(pred, vehicle, timestamp_us, pred->piece_start_mm[piece], 0.0f, 0.0f);
+        return 0;
+    }
+
+    rebase(pred, vehicle, timestamp_us);
+    correct_distance(pred, vehicle, pred->piece_start_mm[piece]);
+
+    return 0;
+}
+
+uint8_t anki_vehicle_predictor_position(anki_vehicle_predictor_t *pred, uint8_t vehicle,
+                                        uint64_t timestamp_us, uint8_t piece,
+                                        uint16_t speed_mm_per_sec, float offset_mm)
+{
+    float start, length, shown, rel, shown_offset;
+
+    if (pred == NULL || vehicle >= pred->count || piece >= pred->piece_count)
+        return 1;
+
+    start = pred->piece_start_mm[piece];
+    length = pred->piece_start_mm[piece + 1] - start;
+
+    if (!pred->valid[vehicle]) {
+        locate(pred, vehicle, timestamp_us, start, speed_mm_per_sec, offset_mm);
+        return 0;
+    }
+
+    rebase(pred, vehicle, timestamp_us);
+
+    // A position update only says which piece the vehicle is on. Pull the
+    // prediction onto the nearest end of that piece if it has left it.
+    shown = pred->distance_mm[vehicle] + pred->residual_mm[vehicle];
+    rel = anki_track_wrap_distance(shown - start, pred->track_length_mm);
+    if (rel >= length) {
+        if (rel - length < pred->track_length_mm - rel)
+            correct_distance(pred, vehicle, start + length * 0.99f);
+        else
+            correct_distance(pred, vehicle, start);
+    }
+
+    pred->speed[vehicle] = speed_mm_per_sec;
+    if (pred->accel[vehicle] == 0.0f)
+        pred->target_speed[vehicle] = speed_mm_per_sec;
+    update_ramp(pred, vehicle);
+
+    shown_offset = pred->offset_mm[vehicle] + pred->residual_offset_mm[vehicle];
+    pred->residual_offset_mm[vehicle] = shown_offset - offset_mm;
+    // Once a lane change has completed, follow the reported offset
+    if (pred->offset_mm[vehicle] == pred->target_offset_mm[vehicle]) {
+        pred->target_offset_mm[vehicle] = offset_mm;
+        pred->offset_rate[vehicle] = 0.0f;
+    }
+    pred->offset_mm[vehicle] = offset_mm;
+
+    return 0;
+}
+
+uint8_t anki_vehicle_predictor_predict(const anki_vehicle_predictor_t *pred, uint8_t vehicle,
+                                       uint64_t timestamp_us, anki_vehicle_prediction_t *out)
+{
+    float dt, w, d;
+
+    if (pred == NULL || out == NULL || vehicle >= pred->count || !pred->valid[vehicle])
+        return 1;
+
+    dt = elapsed_sec(pred->base_sec[vehicle], to_sec(timestamp_us));
+    w = blend_weight(blend_scale(pred->blend_us), dt);
+    d = advance(pred->speed[vehicle], pred->target_speed[vehicle], pred->accel[vehicle],
+                pred->ramp_sec[vehicle], dt, &out->speed_mm_per_sec);
+
+    out->distance_mm = anki_track_wrap_distance(pred->distance_mm[vehicle] + d + pred->residual_mm[vehicle] * w,
+                                     pred->track_length_mm);
+    out->piece = anki_vehicle_predictor_piece_at(pred, out->distance_mm);
+    out->offset_mm = anki_track_steer(pred->offset_mm[vehicle], pred->target_offset_mm[vehicle],
+                           pred->offset_rate[vehicle], dt) + pred->residual_offset_mm[vehicle] * w;
+
+    return 0;
+}
+
+void anki_vehicle_predictor_predict_all(const anki_vehicle_predictor_t *pred, uint64_t timestamp_us,
+                                        float *distance_mm, float *offset_mm, float *speed_mm_per_sec)
+{
+    const float length = pred->track_length_mm;
+    const float scale = blend_scale(pred->blend_us);
+    const double now = to_sec(timestamp_us);
+    uint8_t i;
+
+    for (i = 0; i < pred->count; i++) {
+        float dt = elapsed_sec(pred->base_sec[i], now);
+        float w = blend_weight(scale, dt);
+        float d = advance(pred->speed[i], pred->target_speed[i], pred->accel[i], pred->ramp_sec[i],
+                          dt, &speed_mm_per_sec[i]);
+
+        distance_mm[i] = anki_track_wrap_distance(pred->distance_mm[i] + d + pred->residual_mm[i] * w, length);
+        offset_mm[i] = anki_track_steer(pred->offset_mm[i], pred->target_offset_mm[i], pred->offset_rate[i], dt)
+                       + pred->residual_offset_mm[i] * w;
+    }
+}
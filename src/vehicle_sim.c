@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "vehicle_sim.h"
+#include "track_geometry.h"
+
+#define SIM_BUCKETS     256
+
+// Vehicles per array are rounded up so every array spans whole vectors
+#define SIM_PAD         16
+
+static size_t array_size(uint32_t count, size_t elem_size)
+{
+    size_t n = ((size_t)count + SIM_PAD - 1) / SIM_PAD * SIM_PAD;
+    size_t bytes = n * elem_size;
+
+    return (bytes + ANKI_VEHICLE_SIM_ALIGN - 1) / ANKI_VEHICLE_SIM_ALIGN * ANKI_VEHICLE_SIM_ALIGN;
+}
+
+size_t anki_vehicle_sim_storage_size(uint32_t vehicle_count)
+{
+    return 9 * array_size(vehicle_count, sizeof(float)) +
+           array_size(vehicle_count, sizeof(int32_t)) +
+           4 * array_size(vehicle_count, sizeof(uint8_t));
+}
+
+static void *carve(uint8_t **p, uint32_t count, size_t elem_size)
+{
+    void *array = *p;
+
+    *p += array_size(count, elem_size);
+    return array;
+}
+
+static uint8_t piece_at(const anki_vehicle_sim_t *sim, float distance_mm)
+{
+    return anki_track_geometry_piece_at(sim->piece_start_mm, sim->piece_count, sim->bucket_piece,
+                                        SIM_BUCKETS, distance_mm);
+}
+
+static void reset_vehicle(anki_vehicle_sim_t *sim, uint32_t i, float distance_mm, float offset_mm)
+{
+    sim->distance_mm[i] = anki_track_wrap_distance(distance_mm, sim->track_length_mm);
+    sim->speed[i] = 0.0f;
+    sim->target_speed[i] = 0.0f;
+    sim->accel[i] = 0.0f;
+    sim->offset_mm[i] = offset_mm;
+    sim->target_offset_mm[i] = offset_mm;
+    sim->offset_rate[i] = 0.0f;
+    sim->direction[i] = 1.0f;
+    sim->odometer_mm[i] = 0.0f;
+    sim->location[i] = (int32_t)(sim->distance_mm[i] / sim->location_spacing_mm);
+    sim->piece[i] = piece_at(sim, sim->distance_mm[i]);
+    sim->report[i] = 0;
+}
+
+uint8_t anki_vehicle_sim_init(anki_vehicle_sim_t *sim, const anki_track_map_t *map,
+                              void *storage, size_t size, uint32_t vehicle_count,
+                              uint64_t start_us)
+{
+    uint8_t *p = (uint8_t *)storage;
+    uint32_t i;
+
+    if (sim == NULL || map == NULL || map->state != ANKI_TRACK_MAP_COMPLETE || map->count == 0)
+        return 1;
+    if (storage == NULL || ((uintptr_t)storage % ANKI_VEHICLE_SIM_ALIGN) != 0 ||
+        size < anki_vehicle_sim_storage_size(vehicle_count))
+        return 1;
+
+    memset(sim, 0, sizeof(anki_vehicle_sim_t));
+    if (anki_track_geometry_build(map, sim->piece_start_mm, sim->bucket_piece, SIM_BUCKETS) != 0)
+        return 1;
+    memset(storage, 0, anki_vehicle_sim_storage_size(vehicle_count));
+
+    sim->count = vehicle_count;
+    sim->now_us = start_us;
+    sim->location_spacing_mm = ANKI_VEHICLE_SIM_DEFAULT_LOCATION_SPACING_MM;
+    sim->version = ANKI_VEHICLE_SIM_DEFAULT_VERSION;
+    sim->battery_mv = ANKI_VEHICLE_SIM_DEFAULT_BATTERY_MV;
+
+    sim->distance_mm = carve(&p, vehicle_count, sizeof(float));
+    sim->speed = carve(&p, vehicle_count, sizeof(float));
+    sim->target_speed = carve(&p, vehicle_count, sizeof(float));
+    sim->accel = carve(&p, vehicle_count, sizeof(float));
+    sim->offset_mm = carve(&p, vehicle_count, sizeof(float));
+    sim->target_offset_mm = carve(&p, vehicle_count, sizeof(float));
+    sim->offset_rate = carve(&p, vehicle_count, sizeof(float));
+    sim->direction = carve(&p, vehicle_count, sizeof(float));
+    sim->odometer_mm = carve(&p, vehicle_count, sizeof(float));
+    sim->location = carve(&p, vehicle_count, sizeof(int32_t));
+    sim->piece = carve(&p, vehicle_count, sizeof(uint8_t));
+    sim->report = carve(&p, vehicle_count, sizeof(uint8_t));
+    sim->lights = carve(&p, vehicle_count, sizeof(uint8_t));
+    sim->lane_change_id = carve(&p, vehicle_count, sizeof(uint8_t));
+
+    sim->piece_count = map->count;
+    sim->track_length_mm = sim->piece_start_mm[map->count];
+    for (i = 0; i < map->count; i++)
+        sim->road_piece_id[i] = map->pieces[i].road_piece_id;
+
+    for (i = 0; i < vehicle_count; i++) {
+        float lane = (float)(i % ANKI_VEHICLE_SIM_LANES) - 0.5f * (ANKI_VEHICLE_SIM_LANES - 1);
+        reset_vehicle(sim, i, sim->track_length_mm * i / vehicle_count, lane * ANKI_VEHICLE_SIM_LANE_WIDTH_MM);
+    }
+
+    return 0;
+}
+
+uint8_t anki_vehicle_sim_place(anki_vehicle_sim_t *sim, uint32_t vehicle, uint8_t piece,
+                               float offset_mm)
+{
+    if (sim == NULL || vehicle >= sim->count || piece >= sim->piece_count)
+        return 1;
+
+    reset_vehicle(sim, vehicle, sim->piece_start_mm[piece], offset_mm);
+    return 0;
+}
+
+static uint8_t emit_simple(anki_vehicle_sim_t *sim, uint32_t vehicle, uint8_t msg_id, uint16_t value,
+                           uint8_t has_value, anki_vehicle_sim_emit_func_t emit, void *user_data)
+{
+    anki_vehicle_msg_t msg;
+    uint8_t len = ANKI_VEHICLE_MSG_BASE_SIZE + 1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.size = ANKI_VEHICLE_MSG_BASE_SIZE;
+    msg.msg_id = msg_id;
+    if (has_value) {
+        msg.size += sizeof(value);
+        memcpy(msg.payload, &value, sizeof(value));
+        len += sizeof(value);
+    }
+
+    if (emit)
+        emit(vehicle, &msg, len, sim->now_us, user_data);
+    return 0;
+}
+
+uint8_t anki_vehicle_sim_handle_msg(anki_vehicle_sim_t *sim, uint32_t vehicle,
+                                    const anki_vehicle_msg_t *msg, uint8_t len,
+                                    anki_vehicle_sim_emit_func_t emit, void *user_data)
+{
+    if (sim == NULL || msg == NULL || vehicle >= sim->count || len < ANKI_VEHICLE_MSG_BASE_SIZE + 1)
+        return 1;
+
+    switch (msg->msg_id) {
+    case ANKI_VEHICLE_MSG_C2V_SET_SPEED:
+    {
+        const anki_vehicle_msg_set_speed_t *m = (const anki_vehicle_msg_set_speed_t *)msg;
+        if (len < sizeof(*m))
+            return 1;
+        sim->target_speed[vehicle] = (m->speed_mm_per_sec > 0) ? (float)m->speed_mm_per_sec : 0.0f;
+        sim->accel[vehicle] = (m->accel_mm_per_sec2 > 0) ? (float)m->accel_mm_per_sec2 : 0.0f;
+        return 0;
+    }
+
+    case ANKI_VEHICLE_MSG_C2V_CHANGE_LANE:
+    {
+        const anki_vehicle_msg_change_lane_t *m = (const anki_vehicle_msg_change_lane_t *)msg;
+        if (len < sizeof(*m))
+            return 1;
+        sim->target_offset_mm[vehicle] = m->offset_from_road_center_mm;
+        sim->offset_rate[vehicle] = (float)m->horizontal_speed_mm_per_sec;
+        sim->lane_change_id[vehicle]++;
+        return 0;
+    }
+
+    case ANKI_VEHICLE_MSG_C2V_CANCEL_LANE_CHANGE:
+        sim->target_offset_mm[vehicle] = sim->offset_mm[vehicle];
+        return 0;
+
+    case ANKI_VEHICLE_MSG_C2V_SET_OFFSET_FROM_ROAD_CENTER:
+    {
+        const anki_vehicle_msg_set_offset_from_road_center_t *m =
+            (const anki_vehicle_msg_set_offset_from_road_center_t *)msg;
+        if (len < sizeof(*m))
+            return 1;
+        sim->offset_mm[vehicle] = m->offset_mm;
+        sim->target_offset_mm[vehicle] = m->offset_mm;
+        return 0;
+    }
+
+    case ANKI_VEHICLE_MSG_C2V_TURN_180:
+        sim->direction[vehicle] = -sim->direction[vehicle];
+        return 0;
+
+    case ANKI_VEHICLE_MSG_C2V_SET_LIGHTS:
+    {
+        const anki_vehicle_msg_set_lights_t *m = (const anki_vehicle_msg_set_lights_t *)msg;
+        uint8_t valid, values;
+        if (len < sizeof(*m))
+            return 1;
+        valid = m->light_mask & 0x0f;
+        values = (m->light_mask >> 4) & 0x0f;
+        sim->lights[vehicle] = (sim->lights[vehicle] & ~valid) | (values & valid);
+        return 0;
+    }
+
+    case ANKI_VEHICLE_MSG_C2V_LIGHTS_PATTERN:
+        return (len < sizeof(anki_vehicle_msg_lights_pattern_t)) ? 1 : 0;
+
+    case ANKI_VEHICLE_MSG_C2V_SDK_MODE:
+    case ANKI_VEHICLE_MSG_C2V_DISCONNECT:
+        return 0;
+
+    case ANKI_VEHICLE_MSG_C2V_PING_REQUEST:
+        return emit_simple(sim, vehicle, ANKI_VEHICLE_MSG_V2C_PING_RESPONSE, 0, 0, emit, user_data);
+
+    case ANKI_VEHICLE_MSG_C2V_VERSION_REQUEST:
+        return emit_simple(sim, vehicle, ANKI_VEHICLE_MSG_V2C_VERSION_RESPONSE, sim->version, 1,
+                           emit, user_data);
+
+    case ANKI_VEHICLE_MSG_C2V_BATTERY_LEVEL_REQUEST:
+        return emit_simple(sim, vehicle, ANKI_VEHICLE_MSG_V2C_BATTERY_LEVEL_RESPONSE, sim->battery_mv, 1,
+                           emit, user_data);
+
+    default:
+        return 1;
+    }
+}
+
+// Advance every vehicle by dt and flag those that reached a new location
+// code. One branch-free pass over parallel arrays; the arrays are restrict
+// parameters rather than struct members so that the compiler can vectorize
+// it without runtime alias checks.
+static void step_kinematics(uint32_t n, float dt, float length, float inv_spacing,
+                            float *restrict distance, float *restrict speed,
+                            const float *restrict target_speed, const float *restrict accel,
+                            float *restrict offset, const float *restrict target_offset,
+                            const float *restrict offset_rate, const float *restrict direction,
+                            float *restrict odometer, int32_t *restrict location,
+                            uint8_t *restrict report)
+{
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        float v0 = speed[i];
+        float dv = target_speed[i] - v0;
+        float max_dv = accel[i] * dt;
+        float min_dv = -max_dv;
+        float d, dist;
+        int32_t loc;
+
+        dv = (dv < min_dv) ? min_dv : dv;
+        dv = (dv > max_dv) ? max_dv : dv;
+        speed[i] = v0 + dv;
+
+        d = (v0 + 0.5f * dv) * dt;
+        dist = anki_track_wrap_distance(distance[i] + direction[i] * d, length);
+        distance[i] = dist;
+        odometer[i] += d;
+        offset[i] = anki_track_steer(offset[i], target_offset[i], offset_rate[i], dt);
+
+        loc = (int32_t)(dist * inv_spacing);
+        report[i] = (uint8_t)(loc != location[i]);
+        location[i] = loc;
+    }
+}
+
+static void emit_transition(anki_vehicle_sim_t *sim, uint32_t i, uint8_t prev, float driven_mm,
+                            anki_vehicle_sim_emit_func_t emit, void *user_data)
+{
+    anki_vehicle_msg_localization_transition_update_t m;
+    float cm = driven_mm * 0.1f;
+    uint8_t wheel_cm = (cm > 255.0f) ? 255 : (uint8_t)(cm + 0.5f);
+
+    memset(&m, 0, sizeof(m));
+    m.size = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE_SIZE;
+    m.msg_id = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE;
+    m.road_piece_idx = sim->piece[i];
+    m.road_piece_idx_prev = prev;
+    m.offset_from_road_center_mm = sim->offset_mm[i];
+    m.driving_direction = (sim->direction[i] < 0.0f) ? REVERSE : FORWARD;
+    m.last_recv_lane_change_id = sim->lane_change_id[i];
+    m.last_exec_lane_change_id = sim->lane_change_id[i];
+    m.last_desired_horizontal_speed_mm_per_sec = (uint16_t)sim->offset_rate[i];
+    m.last_desired_speed_mm_per_sec = (uint16_t)sim->target_speed[i];
+    m.left_wheel_dist_cm = wheel_cm;
+    m.right_wheel_dist_cm = wheel_cm;
+
+    emit(i, (const anki_vehicle_msg_t *)&m, sizeof(m), sim->now_us, user_data);
+}
+
+static void emit_position(anki_vehicle_sim_t *sim, uint32_t i,
+                          anki_vehicle_sim_emit_func_t emit, void *user_data)
+{
+    anki_vehicle_msg_localization_position_update_t m;
+    uint8_t p = sim->piece[i];
+    float into = sim->distance_mm[i] - sim->piece_start_mm[p];
+    int32_t location_id = (int32_t)(into / sim->location_spacing_mm);
+
+    memset(&m, 0, sizeof(m));
+    m.size = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE_SIZE;
+    m.msg_id = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE;
+    m.location_id = (location_id < 0) ? 0 : (location_id > UINT8_MAX) ? UINT8_MAX : (uint8_t)location_id;
+    m.road_piece_id = sim->road_piece_id[p];
+    m.offset_from_road_center_mm = sim->offset_mm[i];
+    m.speed_mm_per_sec = (uint16_t)(sim->speed[i] + 0.5f);
+    m.parsing_flags = (sim->direction[i] < 0.0f) ? PARSEFLAGS_MASK_REVERSE_DRIVING : 0;
+    m.last_recv_lane_change_cmd_id = sim->lane_change_id[i];
+    m.last_exec_lane_change_cmd_id = sim->lane_change_id[i];
+    m.last_desired_horizontal_speed_mm_per_sec = (uint16_t)sim->offset_rate[i];
+    m.last_desired_speed_mm_per_sec = (uint16_t)sim->target_speed[i];
+
+    emit(i, (const anki_vehicle_msg_t *)&m, sizeof(m), sim->now_us, user_data);
+}
+
+uint32_t anki_vehicle_sim_step(anki_vehicle_sim_t *sim, uint64_t now_us,
+                               anki_vehicle_sim_emit_func_t emit, void *user_data)
+{
+    uint32_t emitted = 0;
+    uint32_t i;
+
+    if (sim == NULL || now_us <= sim->now_us)
+        return 0;
+
+    step_kinematics(sim->count, (float)(now_us - sim->now_us) * 1e-6f,
+                    sim->track_length_mm, 1.0f / sim->location_spacing_mm,
+                    sim->distance_mm, sim->speed, sim->target_speed, sim->accel,
+                    sim->offset_mm, sim->target_offset_mm, sim->offset_rate, sim->direction,
+                    sim->odometer_mm, sim->location, sim->report);
+    sim->now_us = now_us;
+
+    for (i = 0; i < sim->count; i++) {
+        uint8_t piece, prev;
+
+        if (!sim->report[i])
+            continue;
+
+        piece = piece_at(sim, sim->distance_mm[i]);
+        if (piece != sim->piece[i]) {
+            // Updates trail the piece boundary by up to one location code;
+            // the distance driven past it counts towards the new piece
+            float past = (sim->direction[i] > 0.0f) ?
+                sim->distance_mm[i] - sim->piece_start_mm[piece] :
+                sim->piece_start_mm[piece + 1] - sim->distance_mm[i];
+
+            prev = sim->piece[i];
+            sim->piece[i] = piece;
+            if (emit)
+                emit_transition(sim, i, prev, sim->odometer_mm[i] - past, emit, user_data);
+            sim->odometer_mm[i] = past;
+            emitted++;
+        }
+
+        if (emit)
+            emit_position(sim, i, emit, user_data);
+        emitted++;
+    }
+
+    return emitted;
+}
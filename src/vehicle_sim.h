@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_vehicle_sim_h
+#define INCLUDE_vehicle_sim_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "track_map.h"
+
+ANKI_BEGIN_DECL
+
+/** Alignment of caller-provided storage and of every per-vehicle array. */
+#define ANKI_VEHICLE_SIM_ALIGN                          64
+
+/** Default distance between location codes on a piece. */
+#define ANKI_VEHICLE_SIM_DEFAULT_LOCATION_SPACING_MM    30
+
+/** Default firmware version and battery level reported by simulated vehicles. */
+#define ANKI_VEHICLE_SIM_DEFAULT_VERSION                0x2676
+#define ANKI_VEHICLE_SIM_DEFAULT_BATTERY_MV             3900
+
+/** Lane offsets that vehicles are spread over by anki_vehicle_sim_init. */
+#define ANKI_VEHICLE_SIM_LANES                          4
+#define ANKI_VEHICLE_SIM_LANE_WIDTH_MM                  44.5f
+
+/**
+ * Called for every notification a simulated vehicle sends.
+ *
+ * @param vehicle Index of the vehicle.
+ * @param msg Encoded message.
+ * @param len Number of bytes of msg.
+ * @param timestamp_us Simulation time the message was sent.
+ */
+typedef void (*anki_vehicle_sim_emit_func_t)(uint32_t vehicle, const anki_vehicle_msg_t *msg, uint8_t len,
+                                             uint64_t timestamp_us, void *user_data);
+
+/**
+ * Simulation of a fleet of vehicles driving on one track map.
+ *
+ * Vehicles accelerate towards their commanded speed, steer towards their
+ * commanded lane offset and follow the pieces of the map, in reverse
+ * after a U-turn. Like real vehicles they send a position update whenever
+ * they pass a location code and a transition update whenever they enter
+ * a new piece, and they answer ping, version and battery requests.
+ *
+ * Per-vehicle state is kept as parallel arrays in caller-provided storage,
+ * so anki_vehicle_sim_step is one branch-free loop over all vehicles that
+ * the compiler vectorizes, followed by a pass that only looks at vehicles
+ * with something to report. Hundreds of vehicles step in microseconds.
+ *
+ * location_spacing_mm, version and battery_mv may be changed after
+ * initialization. All other fields are internal.
+ */
+typedef struct anki_vehicle_sim {
+    uint32_t    count;
+    uint64_t    now_us;
+
+    // Kinematics, one entry per vehicle
+    float       *distance_mm;       // Along the track from the start of piece 0
+    float       *speed;             // mm/s
+    float       *target_speed;
+    float       *accel;             // mm/s^2, always positive
+    float       *offset_mm;
+    float       *target_offset_mm;
+    float       *offset_rate;       // mm/s
+    float       *direction;         // 1 forward, -1 after a U-turn
+    float       *odometer_mm;       // Driven since the last transition
+    int32_t     *location;          // Location code index the vehicle is on
+    uint8_t     *piece;             // Piece index the vehicle is on
+    uint8_t     *report;            // Set by the kinematics pass
+
+    // Command state reported back in updates
+    uint8_t     *lights;
+    uint8_t     *lane_change_id;
+
+    float       location_spacing_mm;
+    uint16_t    version;
+    uint16_t    battery_mv;
+
+    // Track geometry copied from the map
+    uint8_t     piece_count;
+    float       track_length_mm;
+    float       piece_start_mm[ANKI_TRACK_MAP_MAX_PIECES + 1];
+    uint8_t     road_piece_id[ANKI_TRACK_MAP_MAX_PIECES];
+    uint8_t     bucket_piece[256];
+} anki_vehicle_sim_t;
+
+/**
+ * Bytes of storage needed for vehicle_count vehicles.
+ */
+size_t anki_vehicle_sim_storage_size(uint32_t vehicle_count);
+
+/**
+ * Initialize a simulation. Vehicles start at rest, spread evenly around
+ * the track and over ANKI_VEHICLE_SIM_LANES lanes.
+ *
+ * @param sim Simulation to initialize.
+ * @param map Complete track map. Pieces without a measured length get the
+ *        mean measured length.
+ * @param storage Storage of anki_vehicle_sim_storage_size(vehicle_count)
+ *        bytes, aligned to ANKI_VEHICLE_SIM_ALIGN.
+ * @param size Size of storage in bytes.
+ * @param vehicle_count Number of vehicles.
+ * @param start_us Simulation time to start at.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_vehicle_sim_init(anki_vehicle_sim_t *sim, const anki_track_map_t *map,
+                              void *storage, size_t size, uint32_t vehicle_count,
+                              uint64_t start_us);
+
+/**
+ * Put a vehicle at rest at the start of a piece.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t anki_vehicle_sim_place(anki_vehicle_sim_t *sim, uint32_t vehicle, uint8_t piece,
+                               float offset_mm);
+
+/**
+ * Deliver a message written to a vehicle. Responses are emitted at the
+ * current simulation time.
+ *
+ * @return 0 on success, 1 if the message is unknown or malformed.
+ */
+uint8_t anki_vehicle_sim_handle_msg(anki_vehicle_sim_t *sim, uint32_t vehicle,
+                                    const anki_vehicle_msg_t *msg, uint8_t len,
+                                    anki_vehicle_sim_emit_func_t emit, void *user_data);
+
+/**
+ * Advance every vehicle to now_us and emit the updates they send on the
+ * way. A vehicle sends at most one position and one transition update per
+ * step, so steps should be shorter than the time between location codes
+ * (about 30 ms at full speed) for realistic update rates.
+ *
+ * @return number of messages emitted.
+ */
+uint32_t anki_vehicle_sim_step(anki_vehicle_sim_t *sim, uint64_t now_us,
+                               anki_vehicle_sim_emit_func_t emit, void *user_data);
+
+ANKI_END_DECL
+
+#endif
@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vehicle_state_table.h"
+#include "seqlock.h"
+
+typedef char slot_is_one_cache_line[(sizeof(anki_vehicle_state_slot_t) == ANKI_VEHICLE_STATE_TABLE_CACHE_LINE) ? 1 : -1];
+typedef char header_is_one_cache_line[(sizeof(anki_vehicle_state_table_header_t) == ANKI_VEHICLE_STATE_TABLE_CACHE_LINE) ? 1 : -1];
+
+size_t anki_vehicle_state_table_size(uint32_t capacity)
+{
+    return sizeof(anki_vehicle_state_table_header_t) + (size_t)capacity * sizeof(anki_vehicle_state_slot_t);
+}
+
+anki_vehicle_state_table_t *anki_vehicle_state_table_init(void *mem, size_t size, uint32_t capacity)
+{
+    anki_vehicle_state_table_t *table = (anki_vehicle_state_table_t *)mem;
+
+    if (mem == NULL || capacity == 0 || size < anki_vehicle_state_table_size(capacity))
+        return NULL;
+
+    memset(mem, 0, anki_vehicle_state_table_size(capacity));
+    table->header.version = ANKI_VEHICLE_STATE_TABLE_VERSION;
+    table->header.slot_size = sizeof(anki_vehicle_state_slot_t);
+    table->header.capacity = capacity;
+
+    // Readers that see the magic also see a complete header
+    __atomic_store_n(&table->header.magic, ANKI_VEHICLE_STATE_TABLE_MAGIC, __ATOMIC_RELEASE);
+
+    return table;
+}
+
+const anki_vehicle_state_table_t *anki_vehicle_state_table_attach(const void *mem, size_t size)
+{
+    const anki_vehicle_state_table_t *table = (const anki_vehicle_state_table_t *)mem;
+
+    if (mem == NULL || size < sizeof(anki_vehicle_state_table_header_t))
+        return NULL;
+
+    if (__atomic_load_n(&table->header.magic, __ATOMIC_ACQUIRE) != ANKI_VEHICLE_STATE_TABLE_MAGIC)
+        return NULL;
+
+    if (table->header.version != ANKI_VEHICLE_STATE_TABLE_VERSION ||
+        table->header.slot_size != sizeof(anki_vehicle_state_slot_t))
+        return NULL;
+
+    if (table->header.capacity == 0 || size < anki_vehicle_state_table_size(table->header.capacity))
+        return NULL;
+
+    return table;
+}
+
+anki_vehicle_state_t *anki_vehicle_state_table_begin(anki_vehicle_state_table_t *table, uint32_t index)
+{
+    anki_vehicle_state_slot_t *slot;
+
+    if (table == NULL || index >= table->header.capacity)
+        return NULL;
+
+    // Only the writer changes seq, a plain read is enough
+    slot = &table->slots[index];
+    ANKI_SEQLOCK_WRITE_BEGIN(&slot->seq, slot->seq + 1);
+
+    return &slot->state;
+}
+
+void anki_vehicle_state_table_end(anki_vehicle_state_table_t *table, uint32_t index)
+{
+    anki_vehicle_state_slot_t *slot = &table->slots[index];
+
+    ANKI_SEQLOCK_WRITE_END(&slot->seq, slot->seq + 1);
+
+    if (index >= table->header.count)
+        __atomic_store_n(&table->header.count, index + 1, __ATOMIC_RELEASE);
+}
+
+uint8_t anki_vehicle_state_table_write(anki_vehicle_state_table_t *table, uint32_t index,
+                                       const anki_vehicle_state_t *state)
+{
+    anki_vehicle_state_t *dst;
+
+    if (state == NULL)
+        return 1;
+
+    dst = anki_vehicle_state_table_begin(table, index);
+    if (dst == NULL)
+        return 1;
+
+    memcpy(dst, state, sizeof(anki_vehicle_state_t));
+    anki_vehicle_state_table_end(table, index);
+
+    return 0;
+}
+
+uint8_t anki_vehicle_state_table_read(const anki_vehicle_state_table_t *table, uint32_t index,
+                                      anki_vehicle_state_t *state)
+{
+    const anki_vehicle_state_slot_t *slot;
+    uint32_t tries;
+
+    if (table == NULL || state == NULL || index >= table->header.capacity)
+        return 1;
+
+    slot = &table->slots[index];
+
+    for (tries = 0; tries < ANKI_VEHICLE_STATE_TABLE_READ_TRIES; tries++) {
+        uint32_t before = ANKI_SEQLOCK_READ_BEGIN(&slot->seq);
+
+        if (before & 1)
+            continue;
+
+        memcpy(state, &slot->state, sizeof(anki_vehicle_state_t));
+        if (!ANKI_SEQLOCK_READ_RETRY(&slot->seq, before))
+            return 0;
+    }
+
+    // A writer that died mid-update leaves seq odd for good
+    return 2;
+}
+
+uint8_t anki_vehicle_state_table_clear(anki_vehicle_state_table_t *table, uint32_t index)
+{
+    anki_vehicle_state_t *state = anki_vehicle_state_table_begin(table, index);
+
+    if (state == NULL)
+        return 1;
+
+    memset(state, 0, sizeof(anki_vehicle_state_t));
+
+    anki_vehicle_state_table_end(table, index);
+    return 0;
+}
+
+uint8_t anki_vehicle_state_table_set_connection(anki_vehicle_state_table_t *table, uint32_t index,
+                                                uint64_t timestamp_us, const uint8_t address[6],
+                                                anki_vehicle_connection_t connection)
+{
+    anki_vehicle_state_t *state = anki_vehicle_state_table_begin(table, index);
+
+    if (state == NULL)
+        return 1;
+
+    if (address != NULL)
+        memcpy(state->address, address, sizeof(state->address));
+    state->connection = connection;
+    if (connection != ANKI_VEHICLE_CONNECTED)
+        state->flags &= ~(ANKI_VEHICLE_STATE_LOCALIZED | ANKI_VEHICLE_STATE_REVERSE);
+    state->updated_us = timestamp_us;
+
+    anki_vehicle_state_table_end(table, index);
+    return 0;
+}
+
+uint8_t anki_vehicle_state_table_set_adv_state(anki_vehicle_state_table_t *table, uint32_t index,
+                                               uint64_t timestamp_us, anki_vehicle_adv_state_t adv_state)
+{
+    anki_vehicle_state_t *state = anki_vehicle_state_table_begin(table, index);
+
+    if (state == NULL)
+        return 1;
+
+    state->flags &= ~(ANKI_VEHICLE_STATE_FULL_BATTERY | ANKI_VEHICLE_STATE_LOW_BATTERY |
+                      ANKI_VEHICLE_STATE_ON_CHARGER);
+    if (adv_state.full_battery)
+        state->flags |= ANKI_VEHICLE_STATE_FULL_BATTERY;
+    if (adv_state.low_battery)
+        state->flags |= ANKI_VEHICLE_STATE_LOW_BATTERY;
+    if (adv_state.on_charger)
+        state->flags |= ANKI_VEHICLE_STATE_ON_CHARGER;
+    state->updated_us = timestamp_us;
+
+    anki_vehicle_state_table_end(table, index);
+    return 0;
+}
+
+// Minimum length of each message that carries state, 0 for the rest
+static uint8_t state_msg_len(uint8_t msg_id)
+{
+    switch (msg_id) {
+    case ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE:
+        return ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE_SIZE + ANKI_VEHICLE_MSG_BASE_SIZE;
+    case ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE:
+        return ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE_SIZE + ANKI_VEHICLE_MSG_BASE_SIZE;
+    case ANKI_VEHICLE_MSG_V2C_VEHICLE_DELOCALIZED:
+        return ANKI_VEHICLE_MSG_BASE_SIZE + 1;
+    case ANKI_VEHICLE_MSG_V2C_BATTERY_LEVEL_RESPONSE:
+        return ANKI_VEHICLE_MSG_V2C_BATTERY_LEVEL_RESPONSE_SIZE + ANKI_VEHICLE_MSG_BASE_SIZE;
+    case ANKI_VEHICLE_MSG_V2C_VERSION_RESPONSE:
+        return ANKI_VEHICLE_MSG_V2C_VERSION_RESPONSE_SIZE + ANKI_VEHICLE_MSG_BASE_SIZE;
+    default:
+        return 0;
+    }
+}
+
+uint8_t anki_vehicle_state_table_handle_msg(anki_vehicle_state_table_t *table, uint32_t index,
+                                            uint64_t timestamp_us, const anki_vehicle_msg_t *msg,
+                                            uint8_t len)
+{
+    anki_vehicle_state_t *state;
+    uint8_t min_len;
+
+    if (table == NULL || msg == NULL || len < ANKI_VEHICLE_MSG_BASE_SIZE + 1)
+        return 1;
+    if (index >= table->header.capacity)
+        return 1;
+
+    min_len = state_msg_len(msg->msg_id);
+    if (min_len == 0)
+        return 0;
+    if (len < min_len)
+        return 1;
+
+    state = anki_vehicle_state_table_begin(table, index);
+
+    switch (msg->msg_id) {
+    case ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE:
+    {
+        const anki_vehicle_msg_localization_position_update_t *m =
+            (const anki_vehicle_msg_localization_position_update_t *)msg;
+        state->road_piece_id = m->road_piece_id;
+        state->location_id = m->location_id;
+        state->speed_mm_per_sec = m->speed_mm_per_sec;
+        state->offset_mm = m->offset_from_road_center_mm;
+        state->flags |= ANKI_VEHICLE_STATE_LOCALIZED;
+        if (m->parsing_flags & PARSEFLAGS_MASK_REVERSE_DRIVING)
+            state->flags |= ANKI_VEHICLE_STATE_REVERSE;
+        else
+            state->flags &= ~ANKI_VEHICLE_STATE_REVERSE;
+        state->position_us = timestamp_us;
+        break;
+    }
+    case ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE:
+    {
+        const anki_vehicle_msg_localization_transition_update_t *m =
+            (const anki_vehicle_msg_localization_transition_update_t *)msg;
+        state->offset_mm = m->offset_from_road_center_mm;
+        state->transitions++;
+        state->position_us = timestamp_us;
+        break;
+    }
+    case ANKI_VEHICLE_MSG_V2C_VEHICLE_DELOCALIZED:
+        state->flags &= ~(ANKI_VEHICLE_STATE_LOCALIZED | ANKI_VEHICLE_STATE_REVERSE);
+        break;
+    case ANKI_VEHICLE_MSG_V2C_BATTERY_LEVEL_RESPONSE:
+        state->battery_mv = ((const anki_vehicle_msg_battery_level_response_t *)msg)->battery_level;
+        break;
+    case ANKI_VEHICLE_MSG_V2C_VERSION_RESPONSE:
+        state->version = ((const anki_vehicle_msg_version_response_t *)msg)->version;
+        break;
+    }
+    state->updated_us = timestamp_us;
+
+    anki_vehicle_state_table_end(table, index);
+    return 0;
+}
+
+anki_vehicle_state_table_t *anki_vehicle_state_table_create(const char *path, uint32_t capacity)
+{
+    size_t size = anki_vehicle_state_table_size(capacity);
+    anki_vehicle_state_table_t *table = NULL;
+    void *mem = MAP_FAILED;
+    char *tmp;
+    int fd;
+
+    if (path == NULL || capacity == 0)
+        return NULL;
+
+    // Readers may still map the old table; truncating it in place would
+    // fault them, so the new one replaces it under the same name instead
+    tmp = malloc(strlen(path) + sizeof(".XXXXXX"));
+    if (tmp == NULL)
+        return NULL;
+    sprintf(tmp, "%s.XXXXXX", path);
+
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        free(tmp);
+        return NULL;
+    }
+
+    if (fchmod(fd, 0644) == 0 && ftruncate(fd, size) == 0)
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (mem != MAP_FAILED) {
+        table = anki_vehicle_state_table_init(mem, size, capacity);
+        if (table != NULL && rename(tmp, path) < 0)
+            table = NULL;
+        if (table == NULL)
+            munmap(mem, size);
+    }
+
+    if (table == NULL)
+        unlink(tmp);
+    free(tmp);
+
+    return table;
+}
+
+const anki_vehicle_state_table_t *anki_vehicle_state_table_open(const char *path)
+{
+    const anki_vehicle_state_table_t *table;
+    struct stat st;
+    void *mem;
+    int fd;
+
+    if (path == NULL)
+        return NULL;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(anki_vehicle_state_table_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    // Unmapping relies on the size following from the header
+    table = anki_vehicle_state_table_attach(mem, st.st_size);
+    if (table == NULL || anki_vehicle_state_table_size(table->header.capacity) != (size_t)st.st_size) {
+        munmap(mem, st.st_size);
+        return NULL;
+    }
+
+    return table;
+}
+
+void anki_vehicle_state_table_unmap(const anki_vehicle_state_table_t *table)
+{
+    if (table == NULL)
+        return;
+
+    munmap((void *)table, anki_vehicle_state_table_size(table->header.capacity));
+}
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2014 Anki, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "vehicle_stats.h"
+
+void anki_vehicle_stats_init(anki_vehicle_stats_t *stats)
+{
+    memset(stats, 0, sizeof(anki_vehicle_stats_t));
+    stats->ewma_alpha = ANKI_VEHICLE_STATS_DEFAULT_EWMA_ALPHA;
+    stats->kalman_q = ANKI_VEHICLE_STATS_DEFAULT_KALMAN_Q;
+    stats->kalman_r = ANKI_VEHICLE_STATS_DEFAULT_KALMAN_R;
+}
+
+static uint8_t interval_bucket(uint32_t interval_us)
+{
+    uint32_t ms = interval_us / 1000;
+    uint8_t bucket = 0;
+
+    while (ms != 0 && bucket < (ANKI_VEHICLE_STATS_INTERVAL_BUCKETS - 1)) {
+        ms >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+static void push_rssi(anki_vehicle_stats_t *stats, int8_t rssi)
+{
+    if (stats->_rssi_count < ANKI_VEHICLE_STATS_RSSI_WINDOW) {
+        stats->_rssi_weighted_sum += (int32_t)stats->_rssi_count * rssi;
+        stats->_rssi_sum += rssi;
+        stats->_rssi_count++;
+    } else {
+        // Dropping the oldest sample shifts every remaining sample down one position
+        int8_t oldest = stats->_rssi_ring[stats->_rssi_head];
+        stats->_rssi_weighted_sum -= stats->_rssi_sum - oldest;
+        stats->_rssi_weighted_sum += (int32_t)(ANKI_VEHICLE_STATS_RSSI_WINDOW - 1) * rssi;
+        stats->_rssi_sum += rssi - oldest;
+    }
+
+    stats->_rssi_ring[stats->_rssi_head] = rssi;
+    stats->_rssi_head = (stats->_rssi_head + 1) % ANKI_VEHICLE_STATS_RSSI_WINDOW;
+}
+
+static void push_interval(anki_vehicle_stats_t *stats, uint32_t interval_us)
+{
+    if (stats->_interval_count < ANKI_VEHICLE_STATS_INTERVAL_WINDOW) {
+        stats->_interval_count++;
+    } else {
+        uint32_t oldest = stats->_interval_ring[stats->_interval_head];
+        stats->interval_histogram[interval_bucket(oldest)]--;
+        stats->_interval_sum -= oldest;
+    }
+
+    stats->_interval_ring[stats->_interval_head] = interval_us;
+    stats->_interval_head = (stats->_interval_head + 1) % ANKI_VEHICLE_STATS_INTERVAL_WINDOW;
+    stats->_interval_sum += interval_us;
+    stats->interval_histogram[interval_bucket(interval_us)]++;
+}
+
+// Number of nominal intervals covered by interval_us, rounded to nearest.
+static uint32_t nominal_periods(uint32_t nominal_us, uint64_t interval_us)
+{
+    return (uint32_t)((2 * interval_us + nominal_us) / (2 * (uint64_t)nominal_us));
+}
+
+static void update_interval(anki_vehicle_stats_t *stats, uint32_t interval_us)
+{
+    uint32_t periods;
+
+    push_interval(stats, interval_us);
+
+    if (stats->nominal_interval_us == 0) {
+        stats->nominal_interval_us = interval_us;
+        return;
+    }
+
+    periods = nominal_periods(stats->nominal_interval_us, interval_us);
+    if (periods == 0) {
+        // Nominal interval was overestimated, e.g. the first interval spanned a loss
+        stats->nominal_interval_us = interval_us;
+    } else if (periods == 1) {
+        int32_t delta = (int32_t)interval_us - (int32_t)stats->nominal_interval_us;
+        stats->nominal_interval_us += delta / 8;
+    } else {
+        stats->missed += periods - 1;
+    }
+}
+
+static void update_rssi(anki_vehicle_stats_t *stats, int8_t rssi)
+{
+    float gain;
+
+    stats->rssi_last = rssi;
+
+    if (stats->count == 0) {
+        stats->rssi_min = rssi;
+        stats->rssi_max = rssi;
+        stats->rssi_ewma = rssi;
+        stats->rssi_kalman = rssi;
+        stats->rssi_kalman_variance = stats->kalman_r;
+    } else {
+        if (rssi < stats->rssi_min)
+            stats->rssi_min = rssi;
+        if (rssi > stats->rssi_max)
+            stats->rssi_max = rssi;
+
+        stats->rssi_ewma += stats->ewma_alpha * ((float)rssi - stats->rssi_ewma);
+
+        // Random walk model: predict, then correct with the new measurement
+        stats->rssi_kalman_variance += stats->kalman_q;
+        gain = stats->rssi_kalman_variance / (stats->rssi_kalman_variance + stats->kalman_r);
+        stats->rssi_kalman += gain * ((float)rssi - stats->rssi_kalman);
+        stats->rssi_kalman_variance *= (1.0f - gain);
+    }
+
+    push_rssi(stats, rssi);
+}
+
+uint8_t anki_vehicle_stats_update(anki_vehicle_stats_t *stats, uint64_t timestamp_us, int8_t rssi)
+{
+    if (stats == NULL)
+        return 1;
+
+    update_rssi(stats, rssi);
+
+    if (stats->count == 0) {
+        stats->first_timestamp_us = timestamp_us;
+        stats->last_timestamp_us = timestamp_us;
+        stats->_event_timestamp_us = timestamp_us;
+        stats->events = 1;
+    } else if (timestamp_us >= stats->last_timestamp_us) {
+        uint64_t interval_us = timestamp_us - stats->_event_timestamp_us;
+
+        stats->last_timestamp_us = timestamp_us;
+        if (interval_us >= ANKI_VEHICLE_STATS_SAME_EVENT_US) {
+            if (interval_us > UINT32_MAX)
+                interval_us = UINT32_MAX;
+            update_interval(stats, (uint32_t)interval_us);
+            stats->_event_timestamp_us = timestamp_us;
+            stats->events++;
+        }
+    }
+
+    stats->count++;
+
+    return 0;
+}
+
+float anki_vehicle_stats_rssi_slope(const anki_vehicle_stats_t *stats)
+{
+    int64_t n = stats->_rssi_count;
+    int64_t sum_x, numerator, denominator;
+
+    if (n < 2)
+        return 0;
+
+    // Closed form sums for x = 0 .. n-1
+    sum_x = n * (n - 1) / 2;
+    numerator = n * stats->_rssi_weighted_sum - sum_x * stats->_rssi_sum;
+    denominator = n * n * (n * n - 1) / 12;
+
+    return (float)numerator / (float)denominator;
+}
+
+float anki_vehicle_stats_rssi_trend(const anki_vehicle_stats_t *stats)
+{
+    uint64_t span_us = stats->last_timestamp_us - stats->first_timestamp_us;
+    float reports_per_second;
+
+    if (stats->count < 2 || span_us == 0)
+        return 0;
+
+    reports_per_second = (float)(stats->count - 1) * 1000000.0f / (float)span_us;
+    return anki_vehicle_stats_rssi_slope(stats) * reports_per_second;
+}
+
+uint32_t anki_vehicle_stats_interval_mean_us(const anki_vehicle_stats_t *stats)
+{
+    if (stats->_interval_count == 0)
+        return 0;
+
+    return (uint32_t)(stats->_interval_sum / stats->_interval_count);
+}
+
+float anki_vehicle_stats_loss_ratio(const anki_vehicle_stats_t *stats)
+{
+    uint32_t expected = stats->events + stats->missed;
+
+    if (expected == 0)
+        return 0;
+
+    return (float)stats->missed / (float)expected;
+}
+
+uint32_t anki_vehicle_stats_overdue(const anki_vehicle_stats_t *stats, uint64_t now_us)
+{
+    uint32_t periods;
+
+    if (stats->count == 0 || stats->nominal_interval_us == 0)
+        return 0;
+
+    if (now_us <= stats->_event_timestamp_us)
+        return 0;
+
+    periods = nominal_periods(stats->nominal_interval_us, now_us - stats->_event_timestamp_us);
+    return (periods > 1) ? (periods - 1) : 0;
+}
@@ -35,4 +35,6 @@
 #define ASSERT_BYTES_EQm(MSG, EXP, GOT, LEN) ANKI_GREATEST_ASSERT_BYTES_EQm(MSG, EXP, GOT, LEN)
 #define ASSERT_BYTES_EQ(EXP, GOT, LEN)  ANKI_GREATEST_ASSERT_BYTES_EQ(EXP, GOT, LEN)
 
+#define ASSERT_NEAR(EXP, GOT, TOL) ASSERT(((GOT) - (EXP)) < (TOL) && ((EXP) - (GOT)) < (TOL))
+
 #endif
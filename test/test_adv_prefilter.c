@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "greatest.h"
+#include "anki_greatest.h"
+
+#include "adv_prefilter.h"
+#include "vehicle_gatt_profile.h"
+#include "adv_data.h"
+
+SUITE(adv_prefilter);
+
+static const anki_adv_prefilter_impl_t impls[] = {
+    ANKI_ADV_PREFILTER_SCALAR,
+    ANKI_ADV_PREFILTER_SSE2,
+    ANKI_ADV_PREFILTER_AVX2,
+};
+
+TEST test_prefilter_vehicle_reports(void) {
+    const uint8_t *reports[4] = { adv0_scan, adv1_scan, st0_scan, st1_scan };
+    size_t lens[4] = { sizeof(adv0_scan), sizeof(adv1_scan), sizeof(st0_scan), sizeof(st1_scan) };
+    uint64_t mask[1];
+
+    int i;
+    for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (anki_vehicle_adv_prefilter_set_impl(impls[i]) != 0)
+            continue;
+
+        mask[0] = ~0ULL;
+        ASSERT_EQ(anki_vehicle_adv_prefilter(reports, lens, 4, mask), 1);
+        ASSERT_EQ(mask[0], 0x1);
+    }
+
+    anki_vehicle_adv_prefilter_set_impl(ANKI_ADV_PREFILTER_AUTO);
+    PASS();
+}
+
+TEST test_prefilter_every_offset(void) {
+    static const uint8_t uuid[16] = ANKI_SERVICE_UUID_LE;
+    static uint8_t data[255][255];
+    const uint8_t *reports[255];
+    size_t lens[255];
+    uint64_t expect[ANKI_ADV_PREFILTER_MASK_WORDS(255)];
+    uint64_t mask[ANKI_ADV_PREFILTER_MASK_WORDS(255)];
+
+    // Report i is i bytes long and holds the UUID at offset i - 16 (if it fits),
+    // every third report only holds a near miss with a corrupted middle byte.
+    memset(expect, 0, sizeof(expect));
+    int i;
+    for (i = 0; i < 255; i++) {
+        memset(data[i], uuid[0], sizeof(data[i]));
+        reports[i] = data[i];
+        lens[i] = i;
+        if (i < 16)
+            continue;
+
+        memcpy(&data[i][i - 16], uuid, 16);
+        if (i % 3 == 0) {
+            data[i][i - 8] ^= 0x01;
+        } else {
+            expect[i / 64] |= (uint64_t)1 << (i % 64);
+        }
+    }
+
+    int j;
+    for (j = 0; j < sizeof(impls) / sizeof(impls[0]); j++) {
+        if (anki_vehicle_adv_prefilter_set_impl(impls[j]) != 0)
+            continue;
+
+        ASSERT_EQ(anki_vehicle_adv_prefilter_get_impl(), impls[j]);
+        anki_vehicle_adv_prefilter(reports, lens, 255, mask);
+        ASSERT_BYTES_EQ(expect, mask, sizeof(mask));
+    }
+
+    anki_vehicle_adv_prefilter_set_impl(ANKI_ADV_PREFILTER_AUTO);
+    PASS();
+}
+
+GREATEST_SUITE(adv_prefilter) {
+    RUN_TEST(test_prefilter_vehicle_reports);
+    RUN_TEST(test_prefilter_every_offset);
+}
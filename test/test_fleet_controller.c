@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "greatest.h"
+
+#include "fleet_controller.h"
+
+SUITE(fleet_controller);
+
+#define TRACK_LENGTH 3000.0f
+
+typedef struct {
+    uint32_t speed_cmds[ANKI_FLEET_MAX_VEHICLES];
+    uint32_t lane_cmds[ANKI_FLEET_MAX_VEHICLES];
+    uint16_t speed[ANKI_FLEET_MAX_VEHICLES];
+    float offset[ANKI_FLEET_MAX_VEHICLES];
+} recorder_t;
+
+static void record(uint8_t vehicle, const anki_vehicle_msg_t *msg, uint8_t len, void *user_data) {
+    recorder_t *rec = (recorder_t *)user_data;
+
+    if (msg->msg_id == ANKI_VEHICLE_MSG_C2V_SET_SPEED) {
+        const anki_vehicle_msg_set_speed_t *m = (const anki_vehicle_msg_set_speed_t *)msg;
+        rec->speed_cmds[vehicle]++;
+        rec->speed[vehicle] = m->speed_mm_per_sec;
+    } else if (msg->msg_id == ANKI_VEHICLE_MSG_C2V_CHANGE_LANE) {
+        const anki_vehicle_msg_change_lane_t *m = (const anki_vehicle_msg_change_lane_t *)msg;
+        rec->lane_cmds[vehicle]++;
+        rec->offset[vehicle] = m->offset_from_road_center_mm;
+    }
+}
+
+TEST test_gate_suppresses_unchanged(void) {
+    anki_vehicle_cmd_gate_t gate;
+    anki_vehicle_msg_t msg;
+
+    anki_vehicle_cmd_gate_init(&gate);
+    ASSERT_EQ(anki_vehicle_cmd_gate_set_speed(&gate, 0, &msg, 500, 1000), sizeof(anki_vehicle_msg_set_speed_t));
+    ASSERT_EQ(msg.msg_id, ANKI_VEHICLE_MSG_C2V_SET_SPEED);
+    ASSERT_EQ(anki_vehicle_cmd_gate_set_speed(&gate, 1000, &msg, 500, 1000), 0);
+    ASSERT_EQ(anki_vehicle_cmd_gate_set_speed(&gate, 2000, &msg, 505, 1000), 0);
+    ASSERT(anki_vehicle_cmd_gate_set_speed(&gate, 3000, &msg, 520, 1000) > 0);
+    ASSERT(anki_vehicle_cmd_gate_set_speed(&gate, 4000, &msg, 520, 2000) > 0);
+
+    // Unchanged commands are repeated once the refresh interval has passed
+    ASSERT_EQ(anki_vehicle_cmd_gate_set_speed(&gate, 4000 + ANKI_VEHICLE_CMD_GATE_DEFAULT_REFRESH_US - 1, &msg, 520, 2000), 0);
+    ASSERT(anki_vehicle_cmd_gate_set_speed(&gate, 4000 + ANKI_VEHICLE_CMD_GATE_DEFAULT_REFRESH_US, &msg, 520, 2000) > 0);
+
+    ASSERT_EQ(anki_vehicle_cmd_gate_change_lane(&gate, 0, &msg, 100, 23.0f), sizeof(anki_vehicle_msg_change_lane_t));
+    ASSERT_EQ(anki_vehicle_cmd_gate_change_lane(&gate, 10, &msg, 100, 23.5f), 0);
+    ASSERT(anki_vehicle_cmd_gate_change_lane(&gate, 20, &msg, 100, -23.0f) > 0);
+
+    anki_vehicle_cmd_gate_reset(&gate);
+    ASSERT(anki_vehicle_cmd_gate_change_lane(&gate, 30, &msg, 100, -23.0f) > 0);
+
+    ASSERT_EQ(gate.sent, 7);
+    ASSERT_EQ(gate.suppressed, 4);
+    PASS();
+}
+
+TEST test_free_road_cruises(void) {
+    anki_fleet_config_t config;
+    anki_fleet_controller_t ctrl;
+    recorder_t rec;
+    float distance[1] = { 0.0f }, offset[1] = { -68.0f }, speed[1] = { 0.0f };
+
+    memset(&rec, 0, sizeof(rec));
+    anki_fleet_config_default(&config);
+    ASSERT_EQ(anki_fleet_controller_init(&ctrl, &config, record, &rec), 0);
+    anki_fleet_controller_set_cruise(&ctrl, 0, 600);
+
+    anki_fleet_controller_tick(&ctrl, 0, 1, distance, offset, speed, NULL, TRACK_LENGTH);
+    anki_fleet_controller_tick(&ctrl, 20000, 1, distance, offset, speed, NULL, TRACK_LENGTH);
+    ASSERT_EQ(rec.speed_cmds[0], 1);
+    ASSERT_EQ(rec.speed[0], 600);
+    ASSERT_EQ(rec.lane_cmds[0], 0);
+    ASSERT_EQ(ctrl.stats.ticks, 2);
+
+    anki_fleet_controller_destroy(&ctrl);
+    PASS();
+}
+
+TEST test_keeps_gap_when_blocked(void) {
+    anki_fleet_config_t config;
+    anki_fleet_controller_t ctrl;
+    recorder_t rec;
+    // Car 1 is slow ahead of car 0, car 2 blocks the only adjacent lane
+    float distance[3] = { 0.0f, 300.0f, 100.0f };
+    float offset[3] = { -68.0f, -68.0f, -23.0f };
+    float speed[3] = { 600.0f, 300.0f, 600.0f };
+
+    memset(&rec, 0, sizeof(rec));
+    anki_fleet_config_default(&config);
+    anki_fleet_controller_init(&ctrl, &config, record, &rec);
+    anki_fleet_controller_set_cruise(&ctrl, 0, 600);
+    anki_fleet_controller_set_cruise(&ctrl, 1, 300);
+    anki_fleet_controller_set_cruise(&ctrl, 2, 600);
+
+    anki_fleet_controller_tick(&ctrl, 0, 3, distance, offset, speed, NULL, TRACK_LENGTH);
+
+    // desired gap 150 + 0.4 * 600 = 390, so 300 + 2 * (300 - 390) = 120
+    ASSERT_EQ(rec.speed[0], 120);
+    ASSERT_EQ(rec.lane_cmds[0], 0);
+    ASSERT_EQ(rec.speed[1], 300);
+
+    // Too close: stop
+    distance[1] = 100.0f;
+    distance[2] = 1000.0f;
+    anki_fleet_controller_set_cruise(&ctrl, 1, 700);
+    anki_fleet_controller_tick(&ctrl, 20000, 3, distance, offset, speed, NULL, TRACK_LENGTH);
+    ASSERT_EQ(rec.speed[0], 0);
+
+    anki_fleet_controller_destroy(&ctrl);
+    PASS();
+}
+
+TEST test_overtakes_when_clear(void) {
+    anki_fleet_config_t config;
+    anki_fleet_controller_t ctrl;
+    recorder_t rec;
+    float distance[3] = { 0.0f, 300.0f, 1500.0f };
+    float offset[3] = { -68.0f, -68.0f, -23.0f };
+    float speed[3] = { 600.0f, 300.0f, 600.0f };
+    uint8_t active[3] = { 1, 1, 0 };
+
+    memset(&rec, 0, sizeof(rec));
+    anki_fleet_config_default(&config);
+    anki_fleet_controller_init(&ctrl, &config, record, &rec);
+    anki_fleet_controller_set_cruise(&ctrl, 0, 600);
+    anki_fleet_controller_set_cruise(&ctrl, 1, 300);
+
+    anki_fleet_controller_tick(&ctrl, 0, 3, distance, offset, speed, active, TRACK_LENGTH);
+    ASSERT_EQ(rec.lane_cmds[0], 1);
+    ASSERT_EQ(rec.offset[0], -23.0f);
+    ASSERT_EQ(rec.speed_cmds[2], 0);
+
+    // The lane command is not repeated while the car moves over
+    offset[0] = -40.0f;
+    anki_fleet_controller_tick(&ctrl, 20000, 3, distance, offset, speed, active, TRACK_LENGTH);
+    ASSERT_EQ(rec.lane_cmds[0], 1);
+
+    anki_fleet_controller_destroy(&ctrl);
+    PASS();
+}
+
+TEST test_lane_claimed_once(void) {
+    anki_fleet_config_t config;
+    anki_fleet_controller_t ctrl;
+    recorder_t rec;
+    // Cars 0 and 2 are both held up and both see lane 1 free, car 4 blocks lane 3
+    float distance[5] = { 0.0f, 300.0f, 100.0f, 400.0f, 100.0f };
+    float offset[5] = { -68.0f, -68.0f, 23.0f, 23.0f, 68.0f };
+    float speed[5] = { 600.0f, 300.0f, 600.0f, 300.0f, 0.0f };
+
+    memset(&rec, 0, sizeof(rec));
+    anki_fleet_config_default(&config);
+    anki_fleet_controller_init(&ctrl, &config, record, &rec);
+    anki_fleet_controller_set_cruise(&ctrl, 0, 600);
+    anki_fleet_controller_set_cruise(&ctrl, 1, 300);
+    anki_fleet_controller_set_cruise(&ctrl, 2, 600);
+    anki_fleet_controller_set_cruise(&ctrl, 3, 300);
+
+    anki_fleet_controller_tick(&ctrl, 0, 5, distance, offset, speed, NULL, TRACK_LENGTH);
+    ASSERT_EQ(rec.lane_cmds[0], 1);
+    ASSERT_EQ(rec.offset[0], -23.0f);
+    ASSERT_EQ(rec.lane_cmds[2], 0);
+
+    // Car 0 is still on its way, so lane 1 stays taken
+    offset[0] = -50.0f;
+    anki_fleet_controller_tick(&ctrl, 20000, 5, distance, offset, speed, NULL, TRACK_LENGTH);
+    ASSERT_EQ(rec.lane_cmds[2], 0);
+
+    anki_fleet_controller_destroy(&ctrl);
+    PASS();
+}
+
+TEST test_parallel_matches_serial(void) {
+    anki_fleet_config_t config;
+    anki_fleet_controller_t serial, parallel;
+    recorder_t rec_serial, rec_parallel;
+    float distance[48], offset[48], speed[48];
+    uint8_t i;
+    uint32_t t;
+
+    for (i = 0; i < 48; i++) {
+        distance[i] = (float)((i * 137) % 3000);
+        offset[i] = (i % 4) * 45.0f - 68.0f;
+        speed[i] = 300.0f + (i % 5) * 100.0f;
+    }
+
+    memset(&rec_serial, 0, sizeof(rec_serial));
+    memset(&rec_parallel, 0, sizeof(rec_parallel));
+    anki_fleet_config_default(&config);
+    anki_fleet_controller_init(&serial, &config, record, &rec_serial);
+    config.workers = 3;
+    config.parallel_min = 1;
+    ASSERT_EQ(anki_fleet_controller_init(&parallel, &config, record, &rec_parallel), 0);
+
+    for (i = 0; i < 48; i++) {
+        anki_fleet_controller_set_cruise(&serial, i, 400 + (i % 3) * 150);
+        anki_fleet_controller_set_cruise(&parallel, i, 400 + (i % 3) * 150);
+    }
+
+    for (t = 0; t < 20; t++) {
+        anki_fleet_controller_tick(&serial, t * 20000, 48, distance, offset, speed, NULL, TRACK_LENGTH);
+        anki_fleet_controller_tick(&parallel, t * 20000, 48, distance, offset, speed, NULL, TRACK_LENGTH);
+        for (i = 0; i < 48; i++)
+            distance[i] += speed[i] * 0.02f;
+    }
+
+    ASSERT_EQ(memcmp(&rec_serial, &rec_parallel, sizeof(recorder_t)), 0);
+    ASSERT_EQ(parallel.stats.ticks, 20);
+
+    anki_fleet_controller_destroy(&serial);
+    anki_fleet_controller_destroy(&parallel);
+    PASS();
+}
+
+TEST test_poll_runs_fixed_ticks(void) {
+    anki_track_map_t map;
+    anki_vehicle_predictor_t pred;
+    anki_fleet_config_t config;
+    anki_fleet_controller_t ctrl;
+    recorder_t rec;
+    uint8_t i;
+
+    anki_track_map_init(&map);
+    for (i = 0; i < 4; i++) {
+        map.pieces[i].road_piece_id = 33;
+        map.pieces[i].length_mm = 500;
+    }
+    map.count = 4;
+    map.state = ANKI_TRACK_MAP_COMPLETE;
+    anki_vehicle_predictor_init(&pred, &map, 2);
+    anki_vehicle_predictor_position(&pred, 0, 1000, 0, 500, -68.0f);
+
+    memset(&rec, 0, sizeof(rec));
+    anki_fleet_config_default(&config);
+    anki_fleet_controller_init(&ctrl, &config, record, &rec);
+    anki_fleet_controller_set_cruise(&ctrl, 0, 500);
+    anki_fleet_controller_set_cruise(&ctrl, 1, 500);
+
+    ASSERT_EQ(anki_fleet_controller_poll(&ctrl, 1000, &pred), 1);
+    ASSERT_EQ(anki_fleet_controller_poll(&ctrl, 1000 + config.tick_us - 1, &pred), 0);
+    ASSERT_EQ(anki_fleet_controller_poll(&ctrl, 1000 + config.tick_us, &pred), 1);
+    // Late by two and a half periods: two ticks are skipped
+    ASSERT_EQ(anki_fleet_controller_poll(&ctrl, 1000 + config.tick_us * 9 / 2, &pred), 1);
+    ASSERT_EQ(ctrl.stats.ticks, 3);
+    ASSERT_EQ(ctrl.stats.skipped, 2);
+
+    // Vehicle 1 has not been located and gets no commands
+    ASSERT_EQ(rec.speed_cmds[0], 1);
+    ASSERT_EQ(rec.speed_cmds[1], 0);
+
+    anki_fleet_controller_destroy(&ctrl);
+    PASS();
+}
+
+TEST test_poll_plans_in_parallel(void) {
+    anki_track_map_t map;
+    anki_vehicle_predictor_t pred;
+    anki_fleet_config_t config;
+    anki_fleet_controller_t ctrl;
+    recorder_t rec;
+    uint8_t i;
+
+    anki_track_map_init(&map);
+    for (i = 0; i < 4; i++) {
+        map.pieces[i].road_piece_id = 33;
+        map.pieces[i].length_mm = 500;
+    }
+    map.count = 4;
+    map.state = ANKI_TRACK_MAP_COMPLETE;
+    ASSERT_EQ(anki_vehicle_predictor_init(&pred, &map, ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES), 0);
+    for (i = 0; i < ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES; i++)
+        anki_vehicle_predictor_position(&pred, i, 1000, i % 4, 500, -68.0f + ((i / 4) % 4) * 45.0f);
+
+    // The controller plans every car the predictor tracks
+    memset(&rec, 0, sizeof(rec));
+    anki_fleet_config_default(&config);
+    config.workers = 3;
+    ASSERT_EQ(ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES, ANKI_FLEET_MAX_VEHICLES);
+    ASSERT(ANKI_FLEET_MAX_VEHICLES >= config.parallel_min);
+    ASSERT_EQ(anki_fleet_controller_init(&ctrl, &config, record, &rec), 0);
+    for (i = 0; i < ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES; i++)
+        anki_fleet_controller_set_cruise(&ctrl, i, 500);
+
+    ASSERT_EQ(anki_fleet_controller_poll(&ctrl, 1000, &pred), 1);
+    ASSERT_EQ(ctrl.stats.parallel, 1);
+    for (i = 0; i < ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES; i++)
+        ASSERT_EQ(rec.speed_cmds[i], 1);
+
+    anki_fleet_controller_destroy(&ctrl);
+    PASS();
+}
+
+SUITE(fleet_controller) {
+    RUN_TEST(test_gate_suppresses_unchanged);
+    RUN_TEST(test_free_road_cruises);
+    RUN_TEST(test_keeps_gap_when_blocked);
+    RUN_TEST(test_overtakes_when_clear);
+    RUN_TEST(test_lane_claimed_once);
+    RUN_TEST(test_parallel_matches_serial);
+    RUN_TEST(test_poll_runs_fixed_ticks);
+    RUN_TEST(test_poll_plans_in_parallel);
+}
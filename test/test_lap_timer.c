@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "greatest.h"
+
+#include "lap_timer.h"
+
+SUITE(lap_timer);
+
+#define FINISH  ANKI_LAP_TIMER_DEFAULT_FINISH_PIECE_ID
+
+static void enter(anki_lap_timer_t *timer, uint8_t vehicle, uint64_t t, uint8_t road_piece_id) {
+    anki_lap_timer_transition(timer, vehicle, t);
+    anki_lap_timer_position(timer, vehicle, road_piece_id);
+}
+
+TEST test_lap_times(void) {
+    anki_lap_timer_config_t config;
+    anki_lap_timer_t timer;
+    anki_lap_board_t board;
+
+    anki_lap_timer_config_default(&config);
+    ASSERT_EQ(anki_lap_timer_init(&timer, &config, 2), 0);
+    anki_lap_timer_start_race(&timer, 1000000);
+
+    // Crossing before the start does not count
+    enter(&timer, 0, 500000, FINISH);
+    anki_lap_timer_read_board(&timer, &board);
+    ASSERT_EQ(board.count, 0);
+
+    // Flying start: first crossing begins the first lap
+    enter(&timer, 0, 2000000, FINISH);
+    enter(&timer, 0, 3000000, 17);
+    enter(&timer, 0, 6500250, FINISH);
+    enter(&timer, 0, 10500500, FINISH);
+
+    anki_lap_timer_read_board(&timer, &board);
+    ASSERT_EQ(board.count, 1);
+    ASSERT_EQ(board.order[0], 0);
+    ASSERT_EQ(board.results[0].laps, 2);
+    ASSERT_EQ(board.results[0].last_lap_us, 4000250);
+    ASSERT_EQ(board.results[0].best_lap_us, 4000250);
+    ASSERT_EQ(board.results[0].last_crossing_us, 10500500);
+    ASSERT_EQ(board.best_lap_us, 4000250);
+    ASSERT_EQ(board.best_lap_vehicle, 0);
+    PASS();
+}
+
+TEST test_transition_times_crossing(void) {
+    anki_lap_timer_config_t config;
+    anki_lap_timer_t timer;
+    anki_lap_board_t board;
+
+    anki_lap_timer_config_default(&config);
+    config.min_lap_us = 1000;
+    ASSERT_EQ(anki_lap_timer_init(&timer, &config, 1), 0);
+    anki_lap_timer_start_race(&timer, 0);
+
+    // Position updates without a transition do not cross the line
+    anki_lap_timer_position(&timer, 0, FINISH);
+    anki_lap_timer_read_board(&timer, &board);
+    ASSERT_EQ(board.count, 0);
+
+    // Lap is timed by the transitions, not by later position updates
+    enter(&timer, 0, 100, FINISH);
+    anki_lap_timer_position(&timer, 0, FINISH);
+    enter(&timer, 0, 5100, 20);
+    anki_lap_timer_transition(&timer, 0, 9100);
+    anki_lap_timer_position(&timer, 0, FINISH);
+    anki_lap_timer_position(&timer, 0, FINISH);
+
+    anki_lap_timer_read_board(&timer, &board);
+    ASSERT_EQ(board.results[0].laps, 1);
+    ASSERT_EQ(board.results[0].last_lap_us, 9000);
+
+    // Reported again within min_lap_us: ignored
+    enter(&timer, 0, 9500, FINISH);
+    anki_lap_timer_read_board(&timer, &board);
+    ASSERT_EQ(board.results[0].laps, 1);
+    ASSERT_EQ(board.results[0].last_crossing_us, 9100);
+    PASS();
+}
+
+TEST test_sector_splits(void) {
+    anki_lap_timer_config_t config;
+    anki_lap_timer_t timer;
+    anki_lap_board_t board;
+    uint64_t t = 0;
+    uint8_t lap, piece;
+
+    anki_lap_timer_config_default(&config);
+    config.sector_count = 3;
+    config.sector_end_piece[0] = 2;
+    config.sector_end_piece[1] = 5;
+    ASSERT_EQ(anki_lap_timer_init(&timer, &config, 1), 0);
+    anki_lap_timer_start_race(&timer, 0);
+
+    // 8 pieces per lap; second lap is slower on every piece
+    for (lap = 0; lap < 2; lap++) {
+        for (piece = 0; piece < 8; piece++) {
+            enter(&timer, 0, t, piece == 0 ? FINISH : 17);
+            t += 1000000 + lap * 100;
+        }
+    }
+    enter(&timer, 0, t, FINISH);
+
+    anki_lap_timer_read_board(&timer, &board);
+    ASSERT_EQ(board.results[0].laps, 2);
+    ASSERT_EQ(board.results[0].best_sector_us[0], 2000000);
+    ASSERT_EQ(board.results[0].best_sector_us[1], 3000000);
+    ASSERT_EQ(board.results[0].best_sector_us[2], 3000000);
+    ASSERT_EQ(board.results[0].last_sector_us[0], 2000200);
+    ASSERT_EQ(board.results[0].last_sector_us[1], 3000300);
+    ASSERT_EQ(board.results[0].last_sector_us[2], 3000300);
+    ASSERT_EQ(board.results[0].last_sector_us[3], 0);
+    ASSERT_EQ(board.results[0].last_lap_us, 8000800);
+
+    // Sector ends must increase
+    config.sector_end_piece[1] = 2;
+    ASSERT_EQ(anki_lap_timer_init(&timer, &config, 1), 1);
+    config.sector_count = ANKI_LAP_TIMER_MAX_SECTORS + 1;
+    ASSERT_EQ(anki_lap_timer_init(&timer, &config, 1), 1);
+    PASS();
+}
+
+TEST test_leaderboard_order(void) {
+    anki_lap_timer_config_t config;
+    anki_lap_timer_t timer;
+    anki_lap_board_t board;
+
+    anki_lap_timer_config_default(&config);
+    ASSERT_EQ(anki_lap_timer_init(&timer, &config, 3), 0);
+    ASSERT_EQ(anki_lap_timer_transition(&timer, 3, 0), 1);
+    anki_lap_timer_start_race(&timer, 0);
+
+    enter(&timer, 2, 1000000, FINISH);
+    enter(&timer, 0, 1100000, FINISH);
+    enter(&timer, 1, 1200000, FINISH);
+
+    anki_lap_timer_read_board(&timer, &board);
+    ASSERT_EQ(board.count, 3);
+    ASSERT_EQ(board.order[0], 2);
+    ASSERT_EQ(board.order[1], 0);
+    ASSERT_EQ(board.order[2], 1);
+
+    // Vehicle 1 completes a lap first and leads; 0 overtakes 2 on the line
+    enter(&timer, 1, 5000000, FINISH);
+    enter(&timer, 0, 5100000, FINISH);
+    enter(&timer, 2, 5300000, FINISH);
+
+    anki_lap_timer_read_board(&timer, &board);
+    ASSERT_EQ(board.order[0], 1);
+    ASSERT_EQ(board.order[1], 0);
+    ASSERT_EQ(board.order[2], 2);
+    ASSERT_EQ(board.best_lap_us, 3800000);
+    ASSERT_EQ(board.best_lap_vehicle, 1);
+
+    // A new race clears the board
+    anki_lap_timer_start_race(&timer, 6000000);
+    anki_lap_timer_read_board(&timer, &board);
+    ASSERT_EQ(board.count, 0);
+    ASSERT_EQ(board.results[1].laps, 0);
+    PASS();
+}
+
+TEST test_handle_msg(void) {
+    anki_lap_timer_config_t config;
+    anki_lap_timer_t timer;
+    anki_lap_board_t board;
+    anki_vehicle_msg_localization_position_update_t pos;
+    anki_vehicle_msg_localization_transition_update_t trans;
+    anki_vehicle_msg_t deloc;
+
+    memset(&pos, 0, sizeof(pos));
+    pos.size = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE_SIZE;
+    pos.msg_id = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE;
+    pos.road_piece_id = FINISH;
+    memset(&trans, 0, sizeof(trans));
+    trans.size = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE_SIZE;
+    trans.msg_id = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE;
+    memset(&deloc, 0, sizeof(deloc));
+    deloc.size = ANKI_VEHICLE_MSG_BASE_SIZE;
+    deloc.msg_id = ANKI_VEHICLE_MSG_V2C_VEHICLE_DELOCALIZED;
+
+    anki_lap_timer_config_default(&config);
+    ASSERT_EQ(anki_lap_timer_init(&timer, &config, 1), 0);
+    anki_lap_timer_start_race(&timer, 0);
+
+#define HANDLE(t, m) anki_lap_timer_handle_msg(&timer, 0, (t), (const anki_vehicle_msg_t *)&(m), sizeof(m))
+    ASSERT_EQ(HANDLE(1000000, trans), 0);
+    ASSERT_EQ(HANDLE(1010000, pos), 0);
+    ASSERT_EQ(HANDLE(4000000, trans), 0);
+    ASSERT_EQ(HANDLE(4010000, pos), 0);
+
+    anki_lap_timer_read_board(&timer, &board);
+    ASSERT_EQ(board.results[0].laps, 1);
+    ASSERT_EQ(board.results[0].last_lap_us, 3000000);
+
+    // After delocalizing, the next crossing only restarts timing
+    ASSERT_EQ(HANDLE(5000000, deloc), 0);
+    ASSERT_EQ(HANDLE(9000000, trans), 0);
+    ASSERT_EQ(HANDLE(9010000, pos), 0);
+    ASSERT_EQ(HANDLE(12000000, trans), 0);
+    ASSERT_EQ(HANDLE(12010000, pos), 0);
+#undef HANDLE
+
+    anki_lap_timer_read_board(&timer, &board);
+    ASSERT_EQ(board.results[0].laps, 2);
+    ASSERT_EQ(board.results[0].last_lap_us, 3000000);
+
+    // Truncated position update
+    ASSERT_EQ(anki_lap_timer_handle_msg(&timer, 0, 0, (const anki_vehicle_msg_t *)&pos, 4), 1);
+    PASS();
+}
+
+SUITE(lap_timer) {
+    RUN_TEST(test_lap_times);
+    RUN_TEST(test_transition_times_crossing);
+    RUN_TEST(test_sector_splits);
+    RUN_TEST(test_leaderboard_order);
+    RUN_TEST(test_handle_msg);
+}
@@ -12,6 +12,12 @@ SUITE(vehicle_protocol);
 
 TEST test_struct_attribute_packed(void) {
     ASSERT_EQ(sizeof(anki_vehicle_msg_sdk_mode_t), ANKI_VEHICLE_MSG_SDK_MODE_SIZE+ANKI_VEHICLE_MSG_BASE_SIZE);
+    ASSERT_EQ(sizeof(anki_vehicle_msg_localization_position_update_t),
+              ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE_SIZE+ANKI_VEHICLE_MSG_BASE_SIZE);
+    ASSERT_EQ(sizeof(anki_vehicle_msg_localization_transition_update_t),
+              ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE_SIZE+ANKI_VEHICLE_MSG_BASE_SIZE);
+    ASSERT_EQ(sizeof(anki_vehicle_msg_localization_intersection_update_t),
+              ANKI_VEHICLE_MSG_V2C_LOCALIZATION_INTERSECTION_UPDATE_SIZE+ANKI_VEHICLE_MSG_BASE_SIZE);
     PASS();
 }
 
@@ -57,10 +63,22 @@ TEST test_disconnect(void) {
     PASS();
 }
 
+TEST test_get_battery_level(void) {
+    anki_vehicle_msg_t msg;
+    uint8_t size = anki_vehicle_msg_get_battery_level(&msg);
+    ASSERT_EQ(size, 2);
+
+    uint8_t expect[2] = { ANKI_VEHICLE_MSG_BASE_SIZE, ANKI_VEHICLE_MSG_C2V_BATTERY_LEVEL_REQUEST };
+    ASSERT_BYTES_EQ(&msg, expect, 2);
+
+    PASS();
+}
+
 GREATEST_SUITE(vehicle_protocol) {
     RUN_TEST(test_struct_attribute_packed);
     RUN_TEST(test_set_sdk_mode);
     RUN_TEST(test_set_speed);
     RUN_TEST(test_set_offset_from_center);
     RUN_TEST(test_disconnect);
+    RUN_TEST(test_get_battery_level);
 }
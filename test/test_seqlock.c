@@ -0,0 +1,97 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "greatest.h"
+
+#include "seqlock.h"
+
+SUITE(seqlock);
+
+struct record {
+    uint32_t seq;
+    uint64_t a;
+    uint64_t b;
+    uint64_t c;
+};
+
+static struct record shared;
+
+static void write_record(struct record *r, uint64_t value) {
+    ANKI_SEQLOCK_WRITE_BEGIN(&r->seq, r->seq + 1);
+    r->a = value;
+    r->b = value;
+    r->c = value;
+    ANKI_SEQLOCK_WRITE_END(&r->seq, r->seq + 1);
+}
+
+TEST test_single_thread(void) {
+    uint32_t before;
+
+    memset(&shared, 0, sizeof(shared));
+
+    before = ANKI_SEQLOCK_READ_BEGIN(&shared.seq);
+    ASSERT_EQ(before, 0);
+    ASSERT_FALSE(ANKI_SEQLOCK_READ_RETRY(&shared.seq, before));
+
+    // A write between begin and retry invalidates the copy
+    write_record(&shared, 1);
+    ASSERT_EQ(shared.seq, 2);
+    ASSERT(ANKI_SEQLOCK_READ_RETRY(&shared.seq, before));
+
+    // So does reading while a write is under way
+    ANKI_SEQLOCK_WRITE_BEGIN(&shared.seq, shared.seq + 1);
+    before = ANKI_SEQLOCK_READ_BEGIN(&shared.seq);
+    ASSERT_EQ(before & 1, 1);
+    ASSERT(ANKI_SEQLOCK_READ_RETRY(&shared.seq, before));
+    ANKI_SEQLOCK_WRITE_END(&shared.seq, shared.seq + 1);
+
+    before = ANKI_SEQLOCK_READ_BEGIN(&shared.seq);
+    ASSERT_FALSE(ANKI_SEQLOCK_READ_RETRY(&shared.seq, before));
+    PASS();
+}
+
+#define WRITES 200000
+
+static void *writer_thread(void *arg) {
+    uint64_t i;
+
+    (void)arg;
+    for (i = 1; i <= WRITES; i++)
+        write_record(&shared, i);
+
+    return NULL;
+}
+
+TEST test_no_torn_reads(void) {
+    struct record copy;
+    pthread_t thread;
+    uint64_t last = 0;
+
+    memset(&shared, 0, sizeof(shared));
+    ASSERT_EQ(pthread_create(&thread, NULL, writer_thread, NULL), 0);
+
+    do {
+        uint32_t before = ANKI_SEQLOCK_READ_BEGIN(&shared.seq);
+
+        memcpy(&copy, &shared, sizeof(copy));
+        if (ANKI_SEQLOCK_READ_RETRY(&shared.seq, before))
+            continue;
+        ASSERT_EQ(copy.b, copy.a);
+        ASSERT_EQ(copy.c, copy.a);
+        ASSERT(copy.a >= last);
+        last = copy.a;
+    } while (last < WRITES);
+
+    pthread_join(thread, NULL);
+    PASS();
+}
+
+SUITE(seqlock) {
+    RUN_TEST(test_single_thread);
+    RUN_TEST(test_no_torn_reads);
+}
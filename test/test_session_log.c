@@ -0,0 +1,311 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "greatest.h"
+
+#include "session_log.h"
+#include "protocol.h"
+#include "vehicle_state_table.h"
+
+SUITE(session_log);
+
+static char log_path[64];
+
+static void make_path(void) {
+    int fd;
+
+    strcpy(log_path, "/tmp/ankidrive-session-XXXXXX");
+    fd = mkstemp(log_path);
+    if (fd >= 0)
+        close(fd);
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Vehicle 0 sends a position update every 10ms and gets a speed command every 100ms
+static uint8_t record_race(anki_session_recorder_t *rec, uint32_t updates) {
+    anki_vehicle_msg_localization_position_update_t pos;
+    anki_vehicle_msg_t msg;
+    uint32_t i;
+
+    memset(&pos, 0, sizeof(pos));
+    pos.size = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE_SIZE;
+    pos.msg_id = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE;
+
+    for (i = 0; i < updates; i++) {
+        uint64_t t = 1000000 + (uint64_t)i * 10000;
+
+        if (i % 10 == 0) {
+            uint8_t len = anki_vehicle_msg_set_speed(&msg, 300 + i, 1000);
+            if (anki_session_recorder_record(rec, t, 0, ANKI_SESSION_RECORD_TX, (const uint8_t *)&msg, len) != 0)
+                return 1;
+        }
+
+        pos.road_piece_id = i % 40;
+        pos.location_id = i % 7;
+        pos.speed_mm_per_sec = 300 + i;
+        if (anki_session_recorder_record(rec, t + 1, 0, ANKI_SESSION_RECORD_RX,
+                                         (const uint8_t *)&pos, sizeof(pos)) != 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+TEST test_layout(void) {
+    ASSERT_EQ(sizeof(anki_session_log_header_t), 32);
+    ASSERT_EQ(sizeof(anki_session_block_header_t), 32);
+    ASSERT_EQ(sizeof(anki_session_record_header_t), 8);
+    PASS();
+}
+
+TEST test_record_read(void) {
+    anki_session_recorder_t rec;
+    anki_session_log_t log;
+    anki_session_log_cursor_t cursor;
+    anki_session_record_t record;
+    const uint8_t ping[] = { 1, ANKI_VEHICLE_MSG_C2V_PING_REQUEST };
+    const uint8_t pong[] = { 1, ANKI_VEHICLE_MSG_V2C_PING_RESPONSE };
+
+    make_path();
+    ASSERT_EQ(anki_session_recorder_create(&rec, log_path), 0);
+    ASSERT_EQ(anki_session_recorder_record(&rec, 5000, 3, ANKI_SESSION_RECORD_TX, ping, sizeof(ping)), 0);
+    ASSERT_EQ(anki_session_recorder_record(&rec, 5250, 3, ANKI_SESSION_RECORD_RX, pong, sizeof(pong)), 0);
+
+    // Time must not go backwards and the kind must be known
+    ASSERT_EQ(anki_session_recorder_record(&rec, 5100, 3, ANKI_SESSION_RECORD_TX, ping, sizeof(ping)), 1);
+    ASSERT_EQ(anki_session_recorder_record(&rec, 5300, 3, 7, ping, sizeof(ping)), 1);
+
+    // Nothing is visible before a flush
+    ASSERT_EQ(anki_session_log_open(&log, log_path), 0);
+    ASSERT_EQ(log.block_count, 0);
+    anki_session_log_rewind(&log, &cursor);
+    ASSERT_EQ(anki_session_log_next(&log, &cursor, &record), 0);
+    anki_session_log_close(&log);
+
+    ASSERT_EQ(anki_session_recorder_close(&rec), 0);
+
+    ASSERT_EQ(anki_session_log_open(&log, log_path), 0);
+    ASSERT_EQ(log.block_count, 1);
+    ASSERT_EQ(log.records, 2);
+    ASSERT_EQ(log.first_us, 5000);
+    ASSERT_EQ(log.last_us, 5250);
+
+    anki_session_log_rewind(&log, &cursor);
+    ASSERT_EQ(anki_session_log_next(&log, &cursor, &record), 1);
+    ASSERT_EQ(record.timestamp_us, 5000);
+    ASSERT_EQ(record.vehicle, 3);
+    ASSERT_EQ(record.kind, ANKI_SESSION_RECORD_TX);
+    ASSERT_EQ(record.len, sizeof(ping));
+    ASSERT_EQ(memcmp(record.data, ping, sizeof(ping)), 0);
+    ASSERT_EQ(anki_session_log_next(&log, &cursor, &record), 1);
+    ASSERT_EQ(record.timestamp_us, 5250);
+    ASSERT_EQ(record.kind, ANKI_SESSION_RECORD_RX);
+    ASSERT_EQ(memcmp(record.data, pong, sizeof(pong)), 0);
+    ASSERT_EQ(anki_session_log_next(&log, &cursor, &record), 0);
+
+    anki_session_log_close(&log);
+    unlink(log_path);
+    PASS();
+}
+
+TEST test_blocks_and_seek(void) {
+    anki_session_recorder_t rec;
+    anki_session_log_t log;
+    anki_session_log_cursor_t cursor;
+    anki_session_record_t record;
+    uint64_t count = 0, last = 0;
+
+    make_path();
+    ASSERT_EQ(anki_session_recorder_create(&rec, log_path), 0);
+    ASSERT_EQ(record_race(&rec, 2000), 0);
+
+    // A gap longer than a block can express starts a new block
+    ASSERT_EQ(anki_session_recorder_record(&rec, 1000000 + 0x100000000ull + 20000000, 1,
+                                           ANKI_SESSION_RECORD_TX, NULL, 0), 0);
+    ASSERT_EQ(anki_session_recorder_close(&rec), 0);
+
+    ASSERT_EQ(anki_session_log_open(&log, log_path), 0);
+    ASSERT(log.block_count > 10);
+    ASSERT_EQ(log.records, 2000 + 200 + 1);
+
+    anki_session_log_rewind(&log, &cursor);
+    while (anki_session_log_next(&log, &cursor, &record)) {
+        ASSERT(record.timestamp_us >= last);
+        last = record.timestamp_us;
+        count++;
+    }
+    ASSERT_EQ(count, log.records);
+    ASSERT_EQ(last, log.last_us);
+    ASSERT_EQ(record.len, 0);
+
+    // Exact hit, between records, before the start and past the end
+    anki_session_log_seek(&log, &cursor, 1000000 + 1234 * 10000 + 1);
+    ASSERT_EQ(anki_session_log_next(&log, &cursor, &record), 1);
+    ASSERT_EQ(record.timestamp_us, 1000000 + 1234 * 10000 + 1);
+    ASSERT_EQ(record.kind, ANKI_SESSION_RECORD_RX);
+
+    anki_session_log_seek(&log, &cursor, 1000000 + 1500 * 10000 - 5000);
+    ASSERT_EQ(anki_session_log_next(&log, &cursor, &record), 1);
+    ASSERT_EQ(record.timestamp_us, 1000000 + 1500 * 10000);
+    ASSERT_EQ(record.kind, ANKI_SESSION_RECORD_TX);
+
+    anki_session_log_seek(&log, &cursor, 0);
+    ASSERT_EQ(anki_session_log_next(&log, &cursor, &record), 1);
+    ASSERT_EQ(record.timestamp_us, log.first_us);
+
+    anki_session_log_seek(&log, &cursor, log.last_us + 1);
+    ASSERT_EQ(anki_session_log_next(&log, &cursor, &record), 0);
+
+    anki_session_log_close(&log);
+    unlink(log_path);
+    PASS();
+}
+
+TEST test_torn_log(void) {
+    anki_session_recorder_t rec;
+    anki_session_log_t log;
+    anki_session_log_cursor_t cursor;
+    anki_session_record_t record;
+    uint32_t blocks;
+    uint8_t byte;
+    int fd;
+
+    make_path();
+    ASSERT_EQ(anki_session_recorder_create(&rec, log_path), 0);
+    ASSERT_EQ(record_race(&rec, 1000), 0);
+    ASSERT_EQ(anki_session_recorder_close(&rec), 0);
+
+    ASSERT_EQ(anki_session_log_open(&log, log_path), 0);
+    blocks = log.block_count;
+    // The header fills the first block, so every block is block-aligned
+    ASSERT_EQ(log.size, (blocks + 1) * ANKI_SESSION_LOG_BLOCK_SIZE);
+    anki_session_log_close(&log);
+
+    // A damaged record fails its block's checksum and ends the log there
+    fd = open(log_path, O_RDWR);
+    ASSERT(fd >= 0);
+    ASSERT_EQ(pread(fd, &byte, 1, 3 * ANKI_SESSION_LOG_BLOCK_SIZE + 100), 1);
+    byte ^= 0x01;
+    ASSERT_EQ(pwrite(fd, &byte, 1, 3 * ANKI_SESSION_LOG_BLOCK_SIZE + 100), 1);
+    ASSERT_EQ(anki_session_log_open(&log, log_path), 0);
+    ASSERT_EQ(log.block_count, 2);
+    anki_session_log_close(&log);
+    byte ^= 0x01;
+    ASSERT_EQ(pwrite(fd, &byte, 1, 3 * ANKI_SESSION_LOG_BLOCK_SIZE + 100), 1);
+    close(fd);
+
+    // Losing half of the last block drops only that block
+    ASSERT_EQ(truncate(log_path, blocks * ANKI_SESSION_LOG_BLOCK_SIZE + ANKI_SESSION_LOG_BLOCK_SIZE / 2), 0);
+    ASSERT_EQ(anki_session_log_open(&log, log_path), 0);
+    ASSERT_EQ(log.block_count, blocks - 1);
+    anki_session_log_close(&log);
+
+    // Recording a new log leaves an open reader with the old one
+    ASSERT_EQ(anki_session_log_open(&log, log_path), 0);
+    ASSERT_EQ(anki_session_recorder_create(&rec, log_path), 0);
+    ASSERT_EQ(anki_session_recorder_close(&rec), 0);
+    ASSERT_EQ(log.block_count, blocks - 1);
+    anki_session_log_rewind(&log, &cursor);
+    ASSERT_EQ(anki_session_log_next(&log, &cursor, &record), 1);
+    anki_session_log_close(&log);
+    ASSERT_EQ(anki_session_log_open(&log, log_path), 0);
+    ASSERT_EQ(log.block_count, 0);
+    anki_session_log_close(&log);
+
+    // Not a log
+    ASSERT_EQ(truncate(log_path, 16), 0);
+    ASSERT_EQ(anki_session_log_open(&log, log_path), 1);
+
+    unlink(log_path);
+    PASS();
+}
+
+struct replay_state {
+    anki_vehicle_state_table_t *table;
+    uint32_t commands;
+    uint16_t commanded_speed;
+};
+
+static void replay_handler(const anki_session_record_t *record, void *user_data) {
+    struct replay_state *state = (struct replay_state *)user_data;
+
+    if (record->kind == ANKI_SESSION_RECORD_TX) {
+        const anki_vehicle_msg_set_speed_t *msg = (const anki_vehicle_msg_set_speed_t *)record->data;
+        state->commands++;
+        state->commanded_speed = msg->speed_mm_per_sec;
+    } else {
+        anki_vehicle_state_table_handle_msg(state->table, record->vehicle, record->timestamp_us,
+                                            (const anki_vehicle_msg_t *)record->data, record->len);
+    }
+}
+
+static uint64_t table_mem[2][(64 + 4 * 64) / sizeof(uint64_t)] __attribute__((aligned(64)));
+
+TEST test_replay(void) {
+    anki_session_recorder_t rec;
+    anki_session_log_t log;
+    anki_session_log_cursor_t cursor;
+    struct replay_state state[2];
+    anki_vehicle_state_t vehicle;
+    uint64_t start;
+    int i;
+
+    make_path();
+    ASSERT_EQ(anki_session_recorder_create(&rec, log_path), 0);
+    ASSERT_EQ(record_race(&rec, 500), 0);
+    ASSERT_EQ(anki_session_recorder_close(&rec), 0);
+    ASSERT_EQ(anki_session_log_open(&log, log_path), 0);
+
+    // Replaying twice, as fast as possible, ends in the same state
+    for (i = 0; i < 2; i++) {
+        memset(&state[i], 0, sizeof(state[i]));
+        state[i].table = anki_vehicle_state_table_init(table_mem[i], sizeof(table_mem[i]), 4);
+        anki_session_log_rewind(&log, &cursor);
+        ASSERT_EQ(anki_session_replay(&log, &cursor, UINT64_MAX, 0, replay_handler, &state[i]), 550);
+    }
+    ASSERT_EQ(memcmp(table_mem[0], table_mem[1], sizeof(table_mem[0])), 0);
+    ASSERT_EQ(state[0].commands, 50);
+    ASSERT_EQ(state[0].commanded_speed, 300 + 490);
+
+    anki_vehicle_state_table_read(state[0].table, 0, &vehicle);
+    ASSERT_EQ(vehicle.road_piece_id, 499 % 40);
+    ASSERT_EQ(vehicle.speed_mm_per_sec, 300 + 499);
+    ASSERT_EQ(vehicle.updated_us, 1000000 + 499 * 10000 + 1);
+
+    // A window stops before end_us and resumes from there
+    memset(&state[0], 0, sizeof(state[0]));
+    state[0].table = anki_vehicle_state_table_init(table_mem[0], sizeof(table_mem[0]), 4);
+    anki_session_log_seek(&log, &cursor, 1000000 + 100 * 10000);
+    ASSERT_EQ(anki_session_replay(&log, &cursor, 1000000 + 200 * 10000, 0, replay_handler, &state[0]), 110);
+    ASSERT_EQ(anki_session_replay(&log, &cursor, UINT64_MAX, 0, replay_handler, &state[0]), 330);
+
+    // 50ms of log at 10x takes at least 5ms
+    anki_session_log_seek(&log, &cursor, 1000000);
+    start = now_us();
+    ASSERT_EQ(anki_session_replay(&log, &cursor, 1000000 + 50002, 10, replay_handler, &state[0]), 7);
+    ASSERT(now_us() - start >= 5000);
+
+    anki_session_log_close(&log);
+    unlink(log_path);
+    PASS();
+}
+
+SUITE(session_log) {
+    RUN_TEST(test_layout);
+    RUN_TEST(test_record_read);
+    RUN_TEST(test_blocks_and_seek);
+    RUN_TEST(test_torn_log);
+    RUN_TEST(test_replay);
+}
@@ -6,7 +6,19 @@
 
 extern SUITE(ble_advertisement);
 extern SUITE(vehicle_advertisement);
+extern SUITE(adv_prefilter);
 extern SUITE(vehicle_protocol);
+extern SUITE(vehicle_stats);
+extern SUITE(seqlock);
+extern SUITE(vehicle_msg_ring);
+extern SUITE(track_map);
+extern SUITE(vehicle_predictor);
+extern SUITE(fleet_controller);
+extern SUITE(timeline);
+extern SUITE(lap_timer);
+extern SUITE(vehicle_state_table);
+extern SUITE(session_log);
+extern SUITE(vehicle_sim);
 
 /* Add all the definitions that need to be in the test runner's main file. */
 GREATEST_MAIN_DEFS();
@@ -15,6 +27,18 @@ int main(int argc, char **argv) {
     GREATEST_MAIN_BEGIN();      /* command-line arguments, initialization. */
     RUN_SUITE(ble_advertisement);
     RUN_SUITE(vehicle_advertisement);
+    RUN_SUITE(adv_prefilter);
     RUN_SUITE(vehicle_protocol);
+    RUN_SUITE(vehicle_stats);
+    RUN_SUITE(seqlock);
+    RUN_SUITE(vehicle_msg_ring);
+    RUN_SUITE(track_map);
+    RUN_SUITE(vehicle_predictor);
+    RUN_SUITE(fleet_controller);
+    RUN_SUITE(timeline);
+    RUN_SUITE(lap_timer);
+    RUN_SUITE(vehicle_state_table);
+    RUN_SUITE(session_log);
+    RUN_SUITE(vehicle_sim);
     GREATEST_MAIN_END();        /* display results */
 }
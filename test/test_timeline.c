@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "greatest.h"
+
+#include "timeline.h"
+
+SUITE(timeline);
+
+#define MAX_FIRED 32
+
+typedef struct {
+    uint32_t count;
+    uint8_t vehicle[MAX_FIRED];
+    uint8_t msg_id[MAX_FIRED];
+    uint64_t planned_us[MAX_FIRED];
+    // Simulated clock: every emit takes emit_us
+    uint64_t clock_us;
+    uint64_t emit_us;
+} fired_t;
+
+static uint64_t record(uint8_t vehicle, const anki_vehicle_msg_t *msg, uint8_t len,
+                       uint64_t planned_us, void *user_data) {
+    fired_t *f = (fired_t *)user_data;
+    if (f->count < MAX_FIRED) {
+        f->vehicle[f->count] = vehicle;
+        f->msg_id[f->count] = msg->msg_id;
+        f->planned_us[f->count] = planned_us;
+    }
+    f->count++;
+    f->clock_us += f->emit_us;
+    return f->clock_us;
+}
+
+TEST test_fires_in_time_order(void) {
+    anki_timeline_entry_t entries[8];
+    anki_timeline_t tl;
+    fired_t f;
+    uint64_t deadline;
+
+    memset(&f, 0, sizeof(f));
+    ASSERT_EQ(anki_timeline_init(&tl, entries, 8), 0);
+    anki_timeline_add_turn_180(&tl, 3000, 2);
+    anki_timeline_add_set_speed(&tl, 1000, 0, 500, 1000);
+    anki_timeline_add_lights_pattern(&tl, 2000, 1, LIGHT_RED, EFFECT_THROB, 0, 14, 60);
+    // Same time as the speed change, added later, fires after it
+    anki_timeline_add_set_speed(&tl, 1000, 1, 600, 1000);
+
+    ASSERT_EQ(anki_timeline_next_deadline(&tl, &deadline), 1);
+    ASSERT_EQ(anki_timeline_fire(&tl, 1000000, record, &f), 0);
+
+    anki_timeline_start(&tl, 100000);
+    ASSERT_EQ(anki_timeline_next_deadline(&tl, &deadline), 0);
+    ASSERT_EQ(deadline, 101000);
+
+    ASSERT_EQ(anki_timeline_fire(&tl, 100999, record, &f), 0);
+    ASSERT_EQ(anki_timeline_fire(&tl, 102000, record, &f), 3);
+    ASSERT_EQ(f.vehicle[0], 0);
+    ASSERT_EQ(f.vehicle[1], 1);
+    ASSERT_EQ(f.msg_id[1], ANKI_VEHICLE_MSG_C2V_SET_SPEED);
+    ASSERT_EQ(f.msg_id[2], ANKI_VEHICLE_MSG_C2V_LIGHTS_PATTERN);
+    ASSERT_EQ(f.planned_us[2], 102000);
+
+    ASSERT_EQ(anki_timeline_fire(&tl, 103000, record, &f), 1);
+    ASSERT_EQ(f.msg_id[3], ANKI_VEHICLE_MSG_C2V_TURN_180);
+    ASSERT_EQ(anki_timeline_next_deadline(&tl, &deadline), 1);
+    PASS();
+}
+
+TEST test_lateness_stats(void) {
+    anki_timeline_entry_t entries[4];
+    anki_timeline_t tl;
+    fired_t f;
+
+    memset(&f, 0, sizeof(f));
+    anki_timeline_init(&tl, entries, 4);
+    anki_timeline_add_turn_180(&tl, 0, 0);
+    anki_timeline_add_turn_180(&tl, 1000, 0);
+    anki_timeline_add_turn_180(&tl, 1900, 0);
+    anki_timeline_start(&tl, 0);
+
+    f.clock_us = 0;
+    anki_timeline_fire(&tl, 0, record, &f);
+    f.clock_us = 2000;
+    anki_timeline_fire(&tl, 2000, record, &f);
+
+    ASSERT_EQ(tl.stats.fired, 3);
+    ASSERT_EQ(tl.stats.max_late_us, 1000);
+    ASSERT_EQ(tl.stats.total_late_us, 1100);
+    ASSERT_EQ(tl.stats.late_histogram[0], 1);
+    ASSERT_EQ(tl.stats.late_histogram[7], 1);   // 100us
+    ASSERT_EQ(tl.stats.late_histogram[10], 1);  // 1000us
+    PASS();
+}
+
+TEST test_lateness_includes_emit_time(void) {
+    anki_timeline_entry_t entries[4];
+    anki_timeline_t tl;
+    fired_t f;
+
+    memset(&f, 0, sizeof(f));
+    anki_timeline_init(&tl, entries, 4);
+    anki_timeline_add_turn_180(&tl, 0, 0);
+    anki_timeline_add_turn_180(&tl, 0, 1);
+    anki_timeline_add_turn_180(&tl, 0, 2);
+    anki_timeline_start(&tl, 1000);
+
+    // All due together, each send waits for the ones before it
+    f.clock_us = 1000;
+    f.emit_us = 300;
+    ASSERT_EQ(anki_timeline_fire(&tl, 1000, record, &f), 3);
+    ASSERT_EQ(tl.stats.max_late_us, 900);
+    ASSERT_EQ(tl.stats.total_late_us, 300 + 600 + 900);
+    PASS();
+}
+
+TEST test_capacity_and_restart(void) {
+    anki_timeline_entry_t entries[3];
+    anki_timeline_t tl;
+    anki_vehicle_msg_t msg;
+    fired_t f;
+
+    memset(&f, 0, sizeof(f));
+    anki_timeline_init(&tl, entries, 3);
+    ASSERT_EQ(anki_timeline_add_msg(&tl, 0, 0, &msg, 0), 1);
+    anki_timeline_add_set_speed(&tl, 200, 0, 300, 1000);
+    anki_timeline_add_set_speed(&tl, 100, 1, 300, 1000);
+    anki_timeline_start(&tl, 0);
+
+    ASSERT_EQ(anki_timeline_fire(&tl, 150, record, &f), 1);
+
+    // Adding after some commands fired keeps them for the replay
+    ASSERT_EQ(anki_timeline_add_turn_180(&tl, 120, 2), 0);
+    ASSERT_EQ(anki_timeline_add_turn_180(&tl, 130, 2), 1);
+    ASSERT_EQ(anki_timeline_fire(&tl, 1000, record, &f), 2);
+    ASSERT_EQ(f.vehicle[1], 2);
+    ASSERT_EQ(f.vehicle[2], 0);
+
+    anki_timeline_restart(&tl, 5000);
+    ASSERT_EQ(tl.pending, 3);
+    ASSERT_EQ(anki_timeline_fire(&tl, 6000, record, &f), 3);
+    ASSERT_EQ(f.vehicle[3], 1);
+    ASSERT_EQ(f.vehicle[4], 2);
+    ASSERT_EQ(f.vehicle[5], 0);
+    ASSERT_EQ(f.planned_us[5], 5200);
+    PASS();
+}
+
+#ifdef __linux__
+TEST test_timerfd_drives_timeline(void) {
+    anki_timeline_entry_t entries[4];
+    anki_timeline_t tl;
+    fired_t f;
+    int fd = anki_timeline_timerfd_create();
+    struct pollfd pfd;
+    int polls = 0;
+
+    ASSERT(fd >= 0);
+    memset(&f, 0, sizeof(f));
+    anki_timeline_init(&tl, entries, 4);
+    tl.spin_us = 200;
+    anki_timeline_add_turn_180(&tl, 1000, 0);
+    anki_timeline_add_turn_180(&tl, 3000, 1);
+    anki_timeline_start(&tl, anki_timeline_now_us());
+    ASSERT_EQ(anki_timeline_timerfd_arm(&tl, fd), 0);
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (f.count < 2 && polls++ < 10) {
+        if (poll(&pfd, 1, 100) == 1)
+            anki_timeline_timerfd_dispatch(&tl, fd, record, &f);
+    }
+
+    ASSERT_EQ(f.count, 2);
+    ASSERT_EQ(f.vehicle[1], 1);
+    close(fd);
+    PASS();
+}
+#endif
+
+SUITE(timeline) {
+    RUN_TEST(test_fires_in_time_order);
+    RUN_TEST(test_lateness_stats);
+    RUN_TEST(test_lateness_includes_emit_time);
+    RUN_TEST(test_capacity_and_restart);
+#ifdef __linux__
+    RUN_TEST(test_timerfd_drives_timeline);
+#endif
+}
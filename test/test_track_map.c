@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "greatest.h"
+
+#include "track_map.h"
+
+SUITE(track_map);
+
+// Oval: start line, two curves, straight, two curves, finish
+static const uint8_t oval[] = { 33, 17, 18, 36, 20, 23, 34 };
+static const uint8_t oval_len_cm[] = { 10, 28, 28, 56, 28, 28, 34 };
+#define OVAL_PIECES (sizeof(oval) / sizeof(oval[0]))
+
+static uint8_t position(anki_track_map_t *map, uint8_t piece, uint8_t location, float offset) {
+    anki_vehicle_msg_localization_position_update_t m;
+    memset(&m, 0, sizeof(m));
+    m.size = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE_SIZE;
+    m.msg_id = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE;
+    m.location_id = location;
+    m.road_piece_id = piece;
+    m.offset_from_road_center_mm = offset;
+    return anki_track_map_handle_msg(map, (const anki_vehicle_msg_t *)&m, sizeof(m));
+}
+
+static void transition(anki_track_map_t *map, uint8_t dist_cm, uint8_t direction) {
+    anki_vehicle_msg_localization_transition_update_t m;
+    memset(&m, 0, sizeof(m));
+    m.size = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE_SIZE;
+    m.msg_id = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE;
+    m.driving_direction = direction;
+    m.left_wheel_dist_cm = dist_cm;
+    m.right_wheel_dist_cm = dist_cm;
+    anki_track_map_handle_msg(map, (const anki_vehicle_msg_t *)&m, sizeof(m));
+}
+
+// Drive from the start of piece `from` for `count` pieces
+static void drive(anki_track_map_t *map, const uint8_t *ids, const uint8_t *len_cm, uint8_t n,
+                  uint32_t from, uint32_t count) {
+    uint32_t i;
+    for (i = from; i < from + count; i++) {
+        uint8_t k = i % n;
+        position(map, ids[k], 0, -20.0f);
+        position(map, ids[k], 3, 20.0f);
+        transition(map, len_cm[k], FORWARD);
+    }
+}
+
+TEST test_piece_types(void) {
+    ASSERT_EQ(anki_track_piece_type_for_id(33), ANKI_TRACK_PIECE_START);
+    ASSERT_EQ(anki_track_piece_type_for_id(34), ANKI_TRACK_PIECE_FINISH);
+    ASSERT_EQ(anki_track_piece_type_for_id(17), ANKI_TRACK_PIECE_CURVE);
+    ASSERT_EQ(anki_track_piece_type_for_id(36), ANKI_TRACK_PIECE_STRAIGHT);
+    ASSERT_EQ(anki_track_piece_type_for_id(10), ANKI_TRACK_PIECE_INTERSECTION);
+    ASSERT_EQ(anki_track_piece_type_for_id(200), ANKI_TRACK_PIECE_UNKNOWN);
+    PASS();
+}
+
+TEST test_maps_oval(void) {
+    anki_track_map_t map;
+    uint8_t i;
+    anki_track_map_init(&map);
+
+    // Pieces before the start line are ignored
+    drive(&map, oval, oval_len_cm, OVAL_PIECES, 4, 2);
+    ASSERT_EQ(map.state, ANKI_TRACK_MAP_EMPTY);
+
+    drive(&map, oval, oval_len_cm, OVAL_PIECES, 0, OVAL_PIECES);
+    ASSERT_EQ(map.state, ANKI_TRACK_MAP_MAPPING);
+
+    // Reaching the start line again closes the loop
+    position(&map, oval[0], 0, 0.0f);
+    ASSERT_EQ(map.state, ANKI_TRACK_MAP_COMPLETE);
+    ASSERT_EQ(map.count, OVAL_PIECES);
+    ASSERT_EQ(map.current, 0);
+
+    for (i = 0; i < OVAL_PIECES; i++) {
+        ASSERT_EQ(map.pieces[i].road_piece_id, oval[i]);
+        ASSERT_EQ(map.pieces[i].length_mm, oval_len_cm[i] * 10);
+        ASSERT_EQ(map.pieces[i].offset_min_mm, -20);
+        ASSERT_EQ(map.pieces[i].offset_max_mm, 20);
+        ASSERT_EQ(map.pieces[i].location_max, 3);
+    }
+    ASSERT_EQ(map.pieces[1].type, ANKI_TRACK_PIECE_CURVE);
+    ASSERT_EQ(map.mismatches, 0);
+    PASS();
+}
+
+TEST test_tracks_and_refines_after_closing(void) {
+    anki_track_map_t map;
+    anki_track_map_init(&map);
+
+    drive(&map, oval, oval_len_cm, OVAL_PIECES, 0, OVAL_PIECES + 1);
+    ASSERT_EQ(map.state, ANKI_TRACK_MAP_COMPLETE);
+    ASSERT_EQ(map.current, 1);
+
+    // Second pass over the straight with a longer measurement
+    drive(&map, oval, oval_len_cm, OVAL_PIECES, 1, 2);
+    position(&map, oval[3], 0, 0.0f);
+    transition(&map, 60, FORWARD);
+    ASSERT_EQ(map.pieces[3].length_samples, 2);
+    ASSERT_EQ(map.pieces[3].length_mm, 580);
+
+    // Reverse driving walks back along the map
+    transition(&map, 0, REVERSE);
+    ASSERT_EQ(map.current, 3);
+
+    // A position that disagrees with the map drops localization until the anchor
+    position(&map, 51, 0, 0.0f);
+    ASSERT_EQ(map.mismatches, 1);
+    ASSERT_EQ(map.current, ANKI_TRACK_PIECE_NONE);
+    transition(&map, 10, FORWARD);
+    ASSERT_EQ(map.current, ANKI_TRACK_PIECE_NONE);
+    position(&map, oval[0], 0, 0.0f);
+    ASSERT_EQ(map.current, 0);
+    PASS();
+}
+
+TEST test_delocalized_discards_partial_map(void) {
+    anki_track_map_t map;
+    anki_vehicle_msg_t msg = { ANKI_VEHICLE_MSG_BASE_SIZE, ANKI_VEHICLE_MSG_V2C_VEHICLE_DELOCALIZED };
+    anki_track_map_init(&map);
+
+    drive(&map, oval, oval_len_cm, OVAL_PIECES, 0, 3);
+    ASSERT_EQ(map.state, ANKI_TRACK_MAP_MAPPING);
+    ASSERT_EQ(anki_track_map_handle_msg(&map, &msg, 2), 0);
+    ASSERT_EQ(map.state, ANKI_TRACK_MAP_EMPTY);
+    ASSERT_EQ(map.count, 0);
+    PASS();
+}
+
+TEST test_links_intersection(void) {
+    // Figure eight crossing the same intersection piece twice
+    static const uint8_t eight[] = { 33, 17, 10, 18, 20, 10, 23, 34 };
+    static const uint8_t eight_cm[] = { 10, 28, 45, 28, 28, 45, 28, 34 };
+    anki_track_map_t map;
+    anki_track_map_init(&map);
+
+    drive(&map, eight, eight_cm, 8, 0, 9);
+    ASSERT_EQ(map.state, ANKI_TRACK_MAP_COMPLETE);
+    ASSERT_EQ(map.count, 8);
+    ASSERT_EQ(map.pieces[2].link, 5);
+    ASSERT_EQ(map.pieces[5].link, 2);
+    ASSERT(map.pieces[2].flags & ANKI_TRACK_PIECE_FLAG_INTERSECTION);
+    ASSERT_EQ(map.pieces[1].link, ANKI_TRACK_PIECE_NONE);
+    PASS();
+}
+
+TEST test_rejects_bad_offset(void) {
+    anki_track_map_t map;
+    anki_track_map_init(&map);
+
+    drive(&map, oval, oval_len_cm, OVAL_PIECES, 0, 1);
+    ASSERT_EQ(position(&map, oval[1], 0, 0.0f / 0.0f), 1);
+    ASSERT_EQ(position(&map, oval[1], 0, 1.0f / 0.0f), 1);
+    ASSERT_EQ(position(&map, oval[1], 0, -40000.0f), 1);
+    ASSERT_EQ(map.pieces[1].road_piece_id, ANKI_TRACK_PIECE_ID_UNKNOWN);
+
+    ASSERT_EQ(position(&map, oval[1], 0, -32768.0f), 0);
+    ASSERT_EQ(map.pieces[1].road_piece_id, oval[1]);
+    ASSERT_EQ(map.pieces[1].offset_min_mm, INT16_MIN);
+    PASS();
+}
+
+TEST test_maps_max_pieces(void) {
+    uint8_t ids[ANKI_TRACK_MAP_MAX_PIECES + 1];
+    uint8_t len_cm[ANKI_TRACK_MAP_MAX_PIECES + 1];
+    anki_track_map_t map;
+    uint8_t i;
+
+    for (i = 0; i < ANKI_TRACK_MAP_MAX_PIECES + 1; i++) {
+        ids[i] = (i == 0) ? 33 : (i % 2) ? 17 : 36;
+        len_cm[i] = 28;
+    }
+
+    // The loop closes on the provisional piece after the last one
+    anki_track_map_init(&map);
+    drive(&map, ids, len_cm, ANKI_TRACK_MAP_MAX_PIECES, 0, ANKI_TRACK_MAP_MAX_PIECES);
+    ASSERT_EQ(map.state, ANKI_TRACK_MAP_MAPPING);
+    position(&map, ids[0], 0, 0.0f);
+    ASSERT_EQ(map.state, ANKI_TRACK_MAP_COMPLETE);
+    ASSERT_EQ(map.count, ANKI_TRACK_MAP_MAX_PIECES);
+
+    // One piece more does not fit
+    anki_track_map_init(&map);
+    drive(&map, ids, len_cm, ANKI_TRACK_MAP_MAX_PIECES + 1, 0, ANKI_TRACK_MAP_MAX_PIECES + 1);
+    ASSERT_EQ(map.state, ANKI_TRACK_MAP_EMPTY);
+    PASS();
+}
+
+TEST test_save_load_roundtrip(void) {
+    anki_track_map_t map, loaded;
+    uint8_t buf[ANKI_TRACK_MAP_MAX_PIECES * 16];
+    size_t size;
+    anki_track_map_init(&map);
+
+    ASSERT_EQ(anki_track_map_save(&map, buf, sizeof(buf)), 0);
+
+    drive(&map, oval, oval_len_cm, OVAL_PIECES, 0, OVAL_PIECES + 1);
+    size = anki_track_map_save(&map, buf, sizeof(buf));
+    ASSERT_EQ(size, anki_track_map_serialized_size(&map));
+    ASSERT_EQ(anki_track_map_save(&map, buf, size - 1), 0);
+
+    ASSERT_EQ(anki_track_map_load(&loaded, buf, size), 0);
+    ASSERT_EQ(loaded.state, ANKI_TRACK_MAP_COMPLETE);
+    ASSERT_EQ(loaded.count, map.count);
+    ASSERT_EQ(loaded.current, ANKI_TRACK_PIECE_NONE);
+    ASSERT_EQ(memcmp(loaded.pieces, map.pieces, map.count * sizeof(anki_track_piece_t)), 0);
+    ASSERT_EQ(anki_track_map_length_mm(&loaded), anki_track_map_length_mm(&map));
+
+    // A loaded map is joined at the anchor piece without a mapping lap
+    position(&loaded, oval[0], 0, 0.0f);
+    ASSERT_EQ(loaded.current, 0);
+
+    // Truncated and corrupted buffers are rejected
+    ASSERT_EQ(anki_track_map_load(&loaded, buf, size - 1), 1);
+    ASSERT_EQ(loaded.state, ANKI_TRACK_MAP_EMPTY);
+    buf[0] = 'X';
+    ASSERT_EQ(anki_track_map_load(&loaded, buf, size), 1);
+    PASS();
+}
+
+SUITE(track_map) {
+    RUN_TEST(test_piece_types);
+    RUN_TEST(test_maps_oval);
+    RUN_TEST(test_tracks_and_refines_after_closing);
+    RUN_TEST(test_delocalized_discards_partial_map);
+    RUN_TEST(test_links_intersection);
+    RUN_TEST(test_rejects_bad_offset);
+    RUN_TEST(test_maps_max_pieces);
+    RUN_TEST(test_save_load_roundtrip);
+}
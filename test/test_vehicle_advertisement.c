@@ -1,9 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "greatest.h"
 
 #include "advertisement.h"
+#include "eir.h"
+#include "vehicle_gatt_profile.h"
 #include "adv_data.h"
 
 SUITE(vehicle_advertisement);
@@ -71,10 +74,81 @@ TEST test_vehicle_parse_local_name(void) {
     PASS();
 }
 
+TEST test_vehicle_parse_adv_batch(void) {
+    uint8_t truncated[] = { 0x09, 0xFF, 0xBE, 0xEF };
+    const uint8_t *reports[6] = { adv0_scan, adv1_scan, st0_scan, st1_scan, truncated, NULL };
+    size_t lens[6] = { sizeof(adv0_scan), sizeof(adv1_scan), sizeof(st0_scan), sizeof(st1_scan), sizeof(truncated), 0 };
+
+    uint32_t identifier[6];
+    uint8_t model_id[6];
+    uint16_t version[6];
+    uint8_t state[6];
+    uint16_t name_offset[6];
+    uint8_t name_len[6];
+    uint64_t valid_uuid[1], valid_mfg[1], valid_name[1];
+
+    anki_vehicle_adv_columns_t columns;
+    memset(&columns, 0, sizeof(columns));
+    columns.identifier = identifier;
+    columns.model_id = model_id;
+    columns.version = version;
+    columns.state = state;
+    columns.name_offset = name_offset;
+    columns.name_len = name_len;
+    columns.valid_uuid = valid_uuid;
+    columns.valid_mfg = valid_mfg;
+    columns.valid_name = valid_name;
+
+    size_t matched = anki_vehicle_parse_adv_batch(reports, lens, 6, &columns);
+    ASSERT_EQ(matched, 1);
+    ASSERT_EQ(valid_uuid[0], 0x1);
+    ASSERT_EQ(valid_mfg[0], 0x1);
+    // SensorTag local name is valid EIR, it just isn't a vehicle
+    ASSERT_EQ(valid_name[0], 0xa);
+
+    ASSERT_EQ(identifier[0] & 0xffff, 0x0aa3);
+    ASSERT_EQ(model_id[0], 0x01);
+    ASSERT_EQ(identifier[4], 0);
+
+    ASSERT_EQ(version[1], 0x2120);
+    ASSERT_EQ(state[1], ANKI_VEHICLE_ADV_STATE_FULL_BATTERY | ANKI_VEHICLE_ADV_STATE_ON_CHARGER);
+    ASSERT_EQ(name_len[1], 10);
+    ASSERT_EQ(memcmp(&adv1_scan[name_offset[1]], "AA3 TOMMY", 10), 0);
+
+    PASS();
+}
+
+TEST test_vehicle_parse_adv_batch_counts_reports(void) {
+    uint8_t twice[2 * 18];
+    const uint8_t *reports[2] = { twice, adv0_scan };
+    size_t lens[2] = { sizeof(twice), sizeof(adv0_scan) };
+    const uint8_t uuid[16] = ANKI_SERVICE_UUID_LE;
+    anki_vehicle_adv_columns_t columns;
+    uint64_t valid_uuid[1];
+    uint8_t i;
+
+    // The service UUID record twice in one report
+    for (i = 0; i < 2; i++) {
+        twice[i * 18] = 17;
+        twice[i * 18 + 1] = ADV_TYPE_UUID_128;
+        memcpy(&twice[i * 18 + 2], uuid, sizeof(uuid));
+    }
+
+    memset(&columns, 0, sizeof(columns));
+    ASSERT_EQ(anki_vehicle_parse_adv_batch(reports, lens, 2, &columns), 2);
+
+    columns.valid_uuid = valid_uuid;
+    ASSERT_EQ(anki_vehicle_parse_adv_batch(reports, lens, 2, &columns), 2);
+    ASSERT_EQ(valid_uuid[0], 0x3);
+    PASS();
+}
+
 GREATEST_SUITE(vehicle_advertisement) {
     RUN_TEST(test_is_anki_vehicle);
     RUN_TEST(test_is_anki_vehicle_ignores_sensortag);
     RUN_TEST(test_anki_vehicle_parse_adv_record);
     RUN_TEST(test_vehicle_parse_mfg_data);
     RUN_TEST(test_vehicle_parse_local_name);
+    RUN_TEST(test_vehicle_parse_adv_batch);
+    RUN_TEST(test_vehicle_parse_adv_batch_counts_reports);
 }
@@ -0,0 +1,199 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "greatest.h"
+
+#include "vehicle_msg_ring.h"
+
+SUITE(vehicle_msg_ring);
+
+#define RING_CAPACITY 8
+
+static anki_vehicle_msg_ring_t ring;
+static anki_vehicle_msg_ring_slot_t slots[RING_CAPACITY];
+
+static void publish_n(uint32_t first, uint32_t count) {
+    uint32_t i;
+    for (i = first; i < first + count; i++) {
+        uint8_t data[3] = { 2, ANKI_VEHICLE_MSG_V2C_PING_RESPONSE, (uint8_t)i };
+        anki_vehicle_msg_ring_publish(&ring, i % 4, (uint64_t)i * 1000, data, sizeof(data));
+    }
+}
+
+TEST test_init_rejects_bad_capacity(void) {
+    ASSERT_EQ(anki_vehicle_msg_ring_init(&ring, slots, 0), 1);
+    ASSERT_EQ(anki_vehicle_msg_ring_init(&ring, slots, 6), 1);
+    ASSERT_EQ(anki_vehicle_msg_ring_init(&ring, NULL, RING_CAPACITY), 1);
+    ASSERT_EQ(anki_vehicle_msg_ring_init(&ring, slots, RING_CAPACITY), 0);
+    PASS();
+}
+
+TEST test_publish_rejects_oversized(void) {
+    uint8_t data[ANKI_VEHICLE_MSG_MAX_SIZE + 1];
+    memset(data, 0, sizeof(data));
+
+    anki_vehicle_msg_ring_init(&ring, slots, RING_CAPACITY);
+    ASSERT_EQ(anki_vehicle_msg_ring_publish(&ring, 0, 0, data, sizeof(data)), 1);
+    ASSERT_EQ(anki_vehicle_msg_ring_publish(&ring, 0, 0, NULL, 1), 1);
+    ASSERT_EQ(anki_vehicle_msg_ring_publish(&ring, 0, 0, data, ANKI_VEHICLE_MSG_MAX_SIZE), 0);
+    PASS();
+}
+
+TEST test_read_in_order(void) {
+    anki_vehicle_msg_ring_cursor_t cursor;
+    anki_vehicle_msg_ring_entry_t entry;
+    uint32_t i;
+
+    anki_vehicle_msg_ring_init(&ring, slots, RING_CAPACITY);
+    anki_vehicle_msg_ring_cursor_init(&ring, &cursor);
+    ASSERT_EQ(anki_vehicle_msg_ring_read(&ring, &cursor, &entry), 0);
+
+    publish_n(0, 5);
+    ASSERT_EQ(anki_vehicle_msg_ring_lag(&ring, &cursor), 5);
+
+    for (i = 0; i < 5; i++) {
+        ASSERT_EQ(anki_vehicle_msg_ring_read(&ring, &cursor, &entry), 1);
+        ASSERT_EQ(entry.len, 3);
+        ASSERT_EQ(entry.vehicle_id, i % 4);
+        ASSERT_EQ(entry.timestamp_us, (uint64_t)i * 1000);
+        ASSERT_EQ(entry.msg.msg_id, ANKI_VEHICLE_MSG_V2C_PING_RESPONSE);
+        ASSERT_EQ(entry.msg.payload[0], i);
+    }
+    ASSERT_EQ(anki_vehicle_msg_ring_read(&ring, &cursor, &entry), 0);
+    ASSERT_EQ(cursor.missed, 0);
+    ASSERT_EQ(anki_vehicle_msg_ring_lag(&ring, &cursor), 0);
+    PASS();
+}
+
+TEST test_cursors_are_independent(void) {
+    anki_vehicle_msg_ring_cursor_t fast, slow;
+    anki_vehicle_msg_ring_entry_t entry;
+
+    anki_vehicle_msg_ring_init(&ring, slots, RING_CAPACITY);
+    anki_vehicle_msg_ring_cursor_init(&ring, &fast);
+    anki_vehicle_msg_ring_cursor_init(&ring, &slow);
+
+    publish_n(0, 4);
+    while (anki_vehicle_msg_ring_read(&ring, &fast, &entry))
+        ;
+    ASSERT_EQ(entry.msg.payload[0], 3);
+
+    // The slow consumer still sees everything from the start
+    ASSERT_EQ(anki_vehicle_msg_ring_read(&ring, &slow, &entry), 1);
+    ASSERT_EQ(entry.msg.payload[0], 0);
+    ASSERT_EQ(anki_vehicle_msg_ring_lag(&ring, &slow), 3);
+    PASS();
+}
+
+TEST test_overrun_counts_missed(void) {
+    anki_vehicle_msg_ring_cursor_t cursor;
+    anki_vehicle_msg_ring_entry_t entry;
+    uint32_t expected = 5;
+
+    anki_vehicle_msg_ring_init(&ring, slots, RING_CAPACITY);
+    anki_vehicle_msg_ring_cursor_init(&ring, &cursor);
+
+    // 13 messages into 8 slots: the first 5 are gone
+    publish_n(0, 13);
+    ASSERT_EQ(anki_vehicle_msg_ring_lag(&ring, &cursor), 13);
+
+    while (anki_vehicle_msg_ring_read(&ring, &cursor, &entry)) {
+        ASSERT_EQ(entry.msg.payload[0], expected);
+        expected++;
+    }
+    ASSERT_EQ(expected, 13);
+    ASSERT_EQ(cursor.missed, 5);
+
+    // Missed counts accumulate across overruns
+    publish_n(13, 20);
+    ASSERT_EQ(anki_vehicle_msg_ring_read(&ring, &cursor, &entry), 1);
+    ASSERT_EQ(entry.msg.payload[0], 25);
+    ASSERT_EQ(cursor.missed, 17);
+    PASS();
+}
+
+TEST test_cursor_starts_at_head(void) {
+    anki_vehicle_msg_ring_cursor_t cursor;
+    anki_vehicle_msg_ring_entry_t entry;
+
+    anki_vehicle_msg_ring_init(&ring, slots, RING_CAPACITY);
+    publish_n(0, 3);
+
+    anki_vehicle_msg_ring_cursor_init(&ring, &cursor);
+    ASSERT_EQ(anki_vehicle_msg_ring_read(&ring, &cursor, &entry), 0);
+
+    publish_n(3, 1);
+    ASSERT_EQ(anki_vehicle_msg_ring_read(&ring, &cursor, &entry), 1);
+    ASSERT_EQ(entry.msg.payload[0], 3);
+    ASSERT_EQ(cursor.missed, 0);
+    PASS();
+}
+
+#define PRODUCED 200000
+
+// Every byte of message i is derived from i, so a torn entry mismatches
+static void fill_msg(uint8_t *data, uint32_t i) {
+    uint8_t k;
+
+    data[0] = ANKI_VEHICLE_MSG_MAX_SIZE - 1;
+    data[1] = ANKI_VEHICLE_MSG_V2C_PING_RESPONSE;
+    for (k = 2; k < ANKI_VEHICLE_MSG_MAX_SIZE; k++)
+        data[k] = (uint8_t)(i >> (8 * (k % 4))) ^ k;
+}
+
+static void *producer_thread(void *arg) {
+    uint8_t data[ANKI_VEHICLE_MSG_MAX_SIZE];
+    uint32_t i;
+
+    (void)arg;
+    for (i = 0; i < PRODUCED; i++) {
+        fill_msg(data, i);
+        anki_vehicle_msg_ring_publish(&ring, i, i, data, sizeof(data));
+    }
+
+    return NULL;
+}
+
+TEST test_concurrent_producer(void) {
+    anki_vehicle_msg_ring_cursor_t cursor;
+    anki_vehicle_msg_ring_entry_t entry;
+    uint8_t expected[ANKI_VEHICLE_MSG_MAX_SIZE];
+    pthread_t thread;
+    uint64_t received = 0;
+
+    anki_vehicle_msg_ring_init(&ring, slots, RING_CAPACITY);
+    anki_vehicle_msg_ring_cursor_init(&ring, &cursor);
+    ASSERT_EQ(pthread_create(&thread, NULL, producer_thread, NULL), 0);
+
+    // Each message is either read whole, in order, or counted as missed
+    while (received + cursor.missed < PRODUCED) {
+        if (!anki_vehicle_msg_ring_read(&ring, &cursor, &entry))
+            continue;
+        ASSERT_EQ(entry.timestamp_us, received + cursor.missed);
+        ASSERT_EQ(entry.vehicle_id, (uint32_t)entry.timestamp_us);
+        ASSERT_EQ(entry.len, ANKI_VEHICLE_MSG_MAX_SIZE);
+        fill_msg(expected, entry.vehicle_id);
+        ASSERT_EQ(memcmp(&entry.msg, expected, sizeof(expected)), 0);
+        received++;
+    }
+    ASSERT_EQ(received + cursor.missed, PRODUCED);
+    ASSERT(received > 0);
+
+    pthread_join(thread, NULL);
+    ASSERT_EQ(anki_vehicle_msg_ring_read(&ring, &cursor, &entry), 0);
+    PASS();
+}
+
+SUITE(vehicle_msg_ring) {
+    RUN_TEST(test_init_rejects_bad_capacity);
+    RUN_TEST(test_publish_rejects_oversized);
+    RUN_TEST(test_read_in_order);
+    RUN_TEST(test_cursors_are_independent);
+    RUN_TEST(test_overrun_counts_missed);
+    RUN_TEST(test_cursor_starts_at_head);
+    RUN_TEST(test_concurrent_producer);
+}
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "greatest.h"
+#include "anki_greatest.h"
+
+#include "vehicle_predictor.h"
+
+#include "track_data.h"
+
+SUITE(vehicle_predictor);
+
+TEST test_init(void) {
+    anki_track_map_t map;
+    anki_vehicle_predictor_t pred;
+
+    anki_track_map_init(&map);
+    ASSERT_EQ(anki_vehicle_predictor_init(&pred, &map, 1), 1);
+
+    make_map(&map);
+    ASSERT_EQ(anki_vehicle_predictor_init(&pred, &map, ANKI_VEHICLE_PREDICTOR_MAX_VEHICLES + 1), 1);
+
+    // Unmeasured pieces take the mean measured length
+    map.pieces[3].length_mm = 0;
+    ASSERT_EQ(anki_vehicle_predictor_init(&pred, &map, 2), 0);
+    ASSERT_NEAR(1400.0f + 1400.0f / 3, pred.track_length_mm, 0.01f);
+    PASS();
+}
+
+TEST test_piece_at(void) {
+    anki_track_map_t map;
+    anki_vehicle_predictor_t pred;
+
+    make_map(&map);
+    anki_vehicle_predictor_init(&pred, &map, 1);
+
+    ASSERT_EQ(anki_vehicle_predictor_piece_at(&pred, 0.0f), 0);
+    ASSERT_EQ(anki_vehicle_predictor_piece_at(&pred, 399.0f), 0);
+    ASSERT_EQ(anki_vehicle_predictor_piece_at(&pred, 400.0f), 1);
+    ASSERT_EQ(anki_vehicle_predictor_piece_at(&pred, 1999.0f), 3);
+    ASSERT_EQ(anki_vehicle_predictor_piece_at(&pred, 2100.0f), 0);
+    ASSERT_EQ(anki_vehicle_predictor_piece_at(&pred, -100.0f), 3);
+    PASS();
+}
+
+TEST test_dead_reckoning(void) {
+    anki_track_map_t map;
+    anki_vehicle_predictor_t pred;
+    anki_vehicle_prediction_t p;
+
+    make_map(&map);
+    anki_vehicle_predictor_init(&pred, &map, 1);
+
+    ASSERT_EQ(anki_vehicle_predictor_predict(&pred, 0, 0, &p), 1);
+    anki_vehicle_predictor_position(&pred, 0, 0, 0, 500, 0.0f);
+
+    ASSERT_EQ(anki_vehicle_predictor_predict(&pred, 0, 500000, &p), 0);
+    ASSERT_NEAR(250.0f, p.distance_mm, 0.1f);
+    ASSERT_EQ(p.piece, 0);
+
+    // Speeding up from 500 to 1000 at 2000 mm/s^2 takes 0.25s
+    anki_vehicle_predictor_set_speed(&pred, 0, 0, 1000, 2000);
+    anki_vehicle_predictor_predict(&pred, 0, 250000, &p);
+    ASSERT_NEAR(187.5f, p.distance_mm, 0.1f);
+    ASSERT_NEAR(1000.0f, p.speed_mm_per_sec, 0.1f);
+    anki_vehicle_predictor_predict(&pred, 0, 1000000, &p);
+    ASSERT_NEAR(937.5f, p.distance_mm, 0.1f);
+    ASSERT_EQ(p.piece, 1);
+
+    // Wraps around the lap
+    anki_vehicle_predictor_predict(&pred, 0, 2500000, &p);
+    ASSERT_NEAR(437.5f, p.distance_mm, 0.5f);
+    PASS();
+}
+
+TEST test_correction_is_smooth(void) {
+    anki_track_map_t map;
+    anki_vehicle_predictor_t pred;
+    anki_vehicle_prediction_t p;
+
+    make_map(&map);
+    anki_vehicle_predictor_init(&pred, &map, 1);
+    anki_vehicle_predictor_position(&pred, 0, 0, 0, 500, 0.0f);
+
+    // Predicted 500mm at 1s, but the vehicle reports entering piece 1 at 400mm
+    anki_vehicle_predictor_transition(&pred, 0, 1000000, 1);
+
+    anki_vehicle_predictor_predict(&pred, 0, 1000000, &p);
+    ASSERT_NEAR(500.0f, p.distance_mm, 0.1f);
+
+    // Half way through the blend, half of the 100mm error remains
+    anki_vehicle_predictor_predict(&pred, 0, 1000000 + ANKI_VEHICLE_PREDICTOR_DEFAULT_BLEND_US / 2, &p);
+    ASSERT_NEAR(400.0f + 25.0f + 50.0f, p.distance_mm, 0.1f);
+
+    anki_vehicle_predictor_predict(&pred, 0, 1000000 + ANKI_VEHICLE_PREDICTOR_DEFAULT_BLEND_US, &p);
+    ASSERT_NEAR(450.0f, p.distance_mm, 0.1f);
+
+    // A position update on the predicted piece does not move the prediction
+    anki_vehicle_predictor_position(&pred, 0, 1200000, 1, 500, 0.0f);
+    anki_vehicle_predictor_predict(&pred, 0, 1200000, &p);
+    ASSERT_NEAR(500.0f, p.distance_mm, 0.1f);
+    PASS();
+}
+
+TEST test_lane_change(void) {
+    anki_track_map_t map;
+    anki_vehicle_predictor_t pred;
+    anki_vehicle_prediction_t p;
+
+    make_map(&map);
+    anki_vehicle_predictor_init(&pred, &map, 1);
+    ASSERT_EQ(anki_vehicle_predictor_change_lane(&pred, 0, 0, 100, 50.0f), 1);
+
+    anki_vehicle_predictor_position(&pred, 0, 0, 0, 0, -10.0f);
+    anki_vehicle_predictor_change_lane(&pred, 0, 0, 100, 50.0f);
+
+    anki_vehicle_predictor_predict(&pred, 0, 250000, &p);
+    ASSERT_NEAR(15.0f, p.offset_mm, 0.01f);
+    anki_vehicle_predictor_predict(&pred, 0, 1000000, &p);
+    ASSERT_NEAR(50.0f, p.offset_mm, 0.01f);
+    PASS();
+}
+
+TEST test_predict_all_matches_predict(void) {
+    anki_track_map_t map;
+    anki_vehicle_predictor_t pred;
+    anki_vehicle_prediction_t p;
+    float distance[4], offset[4], speed[4];
+    uint8_t i;
+
+    make_map(&map);
+    anki_vehicle_predictor_init(&pred, &map, 4);
+    for (i = 0; i < 4; i++) {
+        anki_vehicle_predictor_position(&pred, i, 0, i, 300 + i * 100, i * 10.0f);
+        anki_vehicle_predictor_set_speed(&pred, i, 10000, 800, 500);
+    }
+    anki_vehicle_predictor_transition(&pred, 2, 50000, 3);
+
+    anki_vehicle_predictor_predict_all(&pred, 90000, distance, offset, speed);
+    for (i = 0; i < 4; i++) {
+        anki_vehicle_predictor_predict(&pred, i, 90000, &p);
+        ASSERT_NEAR(p.distance_mm, distance[i], 0.01f);
+        ASSERT_NEAR(p.offset_mm, offset[i], 0.01f);
+        ASSERT_NEAR(p.speed_mm_per_sec, speed[i], 0.01f);
+    }
+    PASS();
+}
+
+SUITE(vehicle_predictor) {
+    RUN_TEST(test_init);
+    RUN_TEST(test_piece_at);
+    RUN_TEST(test_dead_reckoning);
+    RUN_TEST(test_correction_is_smooth);
+    RUN_TEST(test_lane_change);
+    RUN_TEST(test_predict_all_matches_predict);
+}
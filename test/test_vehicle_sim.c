@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "greatest.h"
+#include "anki_greatest.h"
+
+#include "vehicle_sim.h"
+
+#include "track_data.h"
+
+SUITE(vehicle_sim);
+
+#define MAX_VEHICLES 512
+
+static uint8_t storage[(MAX_VEHICLES * 48) + 4096] __attribute__((aligned(ANKI_VEHICLE_SIM_ALIGN)));
+
+struct capture {
+    uint32_t count;
+    uint32_t positions;
+    uint32_t transitions;
+    uint32_t vehicle;
+    uint8_t len;
+    anki_vehicle_msg_t last;
+    anki_vehicle_msg_localization_position_update_t position;
+    anki_vehicle_msg_localization_transition_update_t transition;
+    anki_track_map_t *map;
+};
+
+static void capture_msg(uint32_t vehicle, const anki_vehicle_msg_t *msg, uint8_t len,
+                        uint64_t timestamp_us, void *user_data) {
+    struct capture *c = (struct capture *)user_data;
+
+    (void)timestamp_us;
+    c->count++;
+    c->vehicle = vehicle;
+    c->len = len;
+    memcpy(&c->last, msg, len);
+
+    if (msg->msg_id == ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE) {
+        c->positions++;
+        memcpy(&c->position, msg, sizeof(c->position));
+    } else if (msg->msg_id == ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE) {
+        c->transitions++;
+        memcpy(&c->transition, msg, sizeof(c->transition));
+    }
+
+    if (c->map)
+        anki_track_map_handle_msg(c->map, msg, len);
+}
+
+static void run(anki_vehicle_sim_t *sim, uint64_t until_us, struct capture *c) {
+    uint64_t t;
+
+    for (t = sim->now_us + 10000; t <= until_us; t += 10000)
+        anki_vehicle_sim_step(sim, t, capture_msg, c);
+}
+
+static void send(anki_vehicle_sim_t *sim, uint32_t vehicle, const anki_vehicle_msg_t *msg, uint8_t len) {
+    anki_vehicle_sim_handle_msg(sim, vehicle, msg, len, NULL, NULL);
+}
+
+TEST test_init(void) {
+    anki_track_map_t map;
+    anki_vehicle_sim_t sim;
+    size_t size = anki_vehicle_sim_storage_size(8);
+    uint32_t i;
+
+    ASSERT(anki_vehicle_sim_storage_size(MAX_VEHICLES) <= sizeof(storage));
+
+    anki_track_map_init(&map);
+    ASSERT_EQ(anki_vehicle_sim_init(&sim, &map, storage, size, 8, 0), 1);
+
+    make_map(&map);
+    ASSERT_EQ(anki_vehicle_sim_init(&sim, &map, storage, size - 1, 8, 0), 1);
+    ASSERT_EQ(anki_vehicle_sim_init(&sim, &map, storage + 4, size, 8, 0), 1);
+    ASSERT_EQ(anki_vehicle_sim_init(&sim, &map, storage, size, 8, 0), 0);
+    ASSERT_NEAR(2000.0f, sim.track_length_mm, 0.01f);
+
+    // Spread around the track and over the lanes
+    for (i = 0; i < 8; i++) {
+        ASSERT_NEAR(250.0f * i, sim.distance_mm[i], 0.01f);
+        ASSERT_EQ(sim.speed[i], 0.0f);
+    }
+    ASSERT_EQ(sim.piece[1], 0);
+    ASSERT_EQ(sim.piece[2], 1);
+    ASSERT_NEAR(-1.5f * ANKI_VEHICLE_SIM_LANE_WIDTH_MM, sim.offset_mm[0], 0.01f);
+    ASSERT_NEAR(1.5f * ANKI_VEHICLE_SIM_LANE_WIDTH_MM, sim.offset_mm[3], 0.01f);
+    ASSERT_NEAR(-1.5f * ANKI_VEHICLE_SIM_LANE_WIDTH_MM, sim.offset_mm[4], 0.01f);
+    PASS();
+}
+
+TEST test_drive(void) {
+    anki_track_map_t map;
+    anki_vehicle_sim_t sim;
+    anki_vehicle_msg_t msg;
+    struct capture c;
+    uint8_t len;
+
+    make_map(&map);
+    anki_vehicle_sim_init(&sim, &map, storage, sizeof(storage), 1, 1000000);
+    memset(&c, 0, sizeof(c));
+
+    // Nothing moves before a speed command
+    run(&sim, 1500000, &c);
+    ASSERT_EQ(c.count, 0);
+
+    // 0.5s ramp to 500mm/s covers 125mm, then 1.5s at speed another 750mm
+    len = anki_vehicle_msg_set_speed(&msg, 500, 1000);
+    ASSERT_EQ(anki_vehicle_sim_handle_msg(&sim, 0, &msg, len, capture_msg, &c), 0);
+    ASSERT_EQ(c.count, 0);
+    run(&sim, 3500000, &c);
+
+    ASSERT_NEAR(875.0f, sim.distance_mm[0], 1.0f);
+    ASSERT_EQ(sim.speed[0], 500.0f);
+    ASSERT_EQ(c.transitions, 1);
+    ASSERT_EQ(c.transition.road_piece_idx, 1);
+    ASSERT_EQ(c.transition.road_piece_idx_prev, 0);
+    ASSERT_EQ(c.transition.driving_direction, FORWARD);
+    ASSERT_EQ(c.transition.left_wheel_dist_cm, 40);
+    ASSERT_EQ(c.transition.last_desired_speed_mm_per_sec, 500);
+
+    // One position update per location code passed
+    ASSERT_EQ(c.positions, 875 / ANKI_VEHICLE_SIM_DEFAULT_LOCATION_SPACING_MM);
+    ASSERT_EQ(c.position.road_piece_id, 17);
+    ASSERT_EQ(c.position.location_id, (875 - 400) / ANKI_VEHICLE_SIM_DEFAULT_LOCATION_SPACING_MM);
+    ASSERT_EQ(c.position.speed_mm_per_sec, 500);
+    ASSERT_EQ(c.position.parsing_flags & PARSEFLAGS_MASK_REVERSE_DRIVING, 0);
+
+    // Time does not run backwards
+    ASSERT_EQ(anki_vehicle_sim_step(&sim, 3000000, capture_msg, &c), 0);
+    PASS();
+}
+
+TEST test_requests(void) {
+    anki_track_map_t map;
+    anki_vehicle_sim_t sim;
+    anki_vehicle_msg_t msg;
+    struct capture c;
+    uint8_t len;
+
+    make_map(&map);
+    anki_vehicle_sim_init(&sim, &map, storage, sizeof(storage), 4, 0);
+    memset(&c, 0, sizeof(c));
+
+    len = anki_vehicle_msg_ping(&msg);
+    ASSERT_EQ(anki_vehicle_sim_handle_msg(&sim, 2, &msg, len, capture_msg, &c), 0);
+    ASSERT_EQ(c.count, 1);
+    ASSERT_EQ(c.vehicle, 2);
+    ASSERT_EQ(c.len, 2);
+    ASSERT_EQ(c.last.msg_id, ANKI_VEHICLE_MSG_V2C_PING_RESPONSE);
+
+    sim.version = 0x1234;
+    len = anki_vehicle_msg_get_version(&msg);
+    ASSERT_EQ(anki_vehicle_sim_handle_msg(&sim, 1, &msg, len, capture_msg, &c), 0);
+    ASSERT_EQ(c.len, sizeof(anki_vehicle_msg_version_response_t));
+    ASSERT_EQ(c.last.size, ANKI_VEHICLE_MSG_V2C_VERSION_RESPONSE_SIZE);
+    ASSERT_EQ(((anki_vehicle_msg_version_response_t *)&c.last)->version, 0x1234);
+
+    len = anki_vehicle_msg_get_battery_level(&msg);
+    ASSERT_EQ(anki_vehicle_sim_handle_msg(&sim, 1, &msg, len, capture_msg, &c), 0);
+    ASSERT_EQ(c.last.msg_id, ANKI_VEHICLE_MSG_V2C_BATTERY_LEVEL_RESPONSE);
+    ASSERT_EQ(((anki_vehicle_msg_battery_level_response_t *)&c.last)->battery_level,
+              ANKI_VEHICLE_SIM_DEFAULT_BATTERY_MV);
+
+    // Headlights on, then brake lights on and headlights off
+    len = anki_vehicle_msg_set_lights(&msg, (1 << LIGHT_HEADLIGHTS) | (1 << (4 + LIGHT_HEADLIGHTS)));
+    ASSERT_EQ(anki_vehicle_sim_handle_msg(&sim, 0, &msg, len, capture_msg, &c), 0);
+    ASSERT_EQ(sim.lights[0], 1 << LIGHT_HEADLIGHTS);
+    len = anki_vehicle_msg_set_lights(&msg, (1 << LIGHT_HEADLIGHTS) | (1 << LIGHT_BRAKELIGHTS) |
+                                            (1 << (4 + LIGHT_BRAKELIGHTS)));
+    ASSERT_EQ(anki_vehicle_sim_handle_msg(&sim, 0, &msg, len, capture_msg, &c), 0);
+    ASSERT_EQ(sim.lights[0], 1 << LIGHT_BRAKELIGHTS);
+
+    len = anki_vehicle_msg_lights_pattern(&msg, LIGHT_RED, EFFECT_THROB, 0, 10, 10);
+    ASSERT_EQ(anki_vehicle_sim_handle_msg(&sim, 0, &msg, len, capture_msg, &c), 0);
+    len = anki_vehicle_msg_set_sdk_mode(&msg, 1);
+    ASSERT_EQ(anki_vehicle_sim_handle_msg(&sim, 0, &msg, len, capture_msg, &c), 0);
+
+    // Truncated, unknown, or for a vehicle that does not exist
+    len = anki_vehicle_msg_set_speed(&msg, 500, 1000);
+    ASSERT_EQ(anki_vehicle_sim_handle_msg(&sim, 0, &msg, len - 1, capture_msg, &c), 1);
+    ASSERT_EQ(anki_vehicle_sim_handle_msg(&sim, 4, &msg, len, capture_msg, &c), 1);
+    msg.msg_id = ANKI_VEHICLE_MSG_V2C_PING_RESPONSE;
+    ASSERT_EQ(anki_vehicle_sim_handle_msg(&sim, 0, &msg, 2, capture_msg, &c), 1);
+    ASSERT_EQ(c.count, 3);
+    PASS();
+}
+
+TEST test_lane_change_and_turn(void) {
+    anki_track_map_t map;
+    anki_vehicle_sim_t sim;
+    anki_vehicle_msg_t msg;
+    struct capture c;
+    uint8_t len;
+
+    make_map(&map);
+    anki_vehicle_sim_init(&sim, &map, storage, sizeof(storage), 1, 0);
+    anki_vehicle_sim_place(&sim, 0, 2, 0.0f);
+    memset(&c, 0, sizeof(c));
+
+    len = anki_vehicle_msg_set_speed(&msg, 300, 3000);
+    send(&sim, 0, &msg, len);
+    len = anki_vehicle_msg_change_lane(&msg, 100, 60.0f);
+    send(&sim, 0, &msg, len);
+
+    run(&sim, 300000, &c);
+    ASSERT_NEAR(30.0f, sim.offset_mm[0], 0.5f);
+    run(&sim, 1000000, &c);
+    ASSERT_EQ(sim.offset_mm[0], 60.0f);
+    ASSERT_EQ(c.position.offset_from_road_center_mm, 60.0f);
+    ASSERT_EQ(c.position.last_recv_lane_change_cmd_id, 1);
+    ASSERT_EQ(c.position.last_desired_horizontal_speed_mm_per_sec, 100);
+
+    // Telling the vehicle where it is moves it at once
+    len = anki_vehicle_msg_set_offset_from_road_center(&msg, -20.0f);
+    send(&sim, 0, &msg, len);
+    ASSERT_EQ(sim.offset_mm[0], -20.0f);
+
+    // After a U-turn the vehicle drives back from piece 2 into piece 1
+    c.transitions = 0;
+    len = anki_vehicle_msg_turn_180(&msg);
+    send(&sim, 0, &msg, len);
+    run(&sim, 3000000, &c);
+    ASSERT_EQ(c.transitions, 1);
+    ASSERT_EQ(c.transition.driving_direction, REVERSE);
+    ASSERT_EQ(c.transition.road_piece_idx, 1);
+    ASSERT_EQ(c.transition.road_piece_idx_prev, 2);
+    ASSERT(c.position.parsing_flags & PARSEFLAGS_MASK_REVERSE_DRIVING);
+    ASSERT_EQ(c.position.road_piece_id, 17);
+    PASS();
+}
+
+TEST test_builds_track_map(void) {
+    anki_track_map_t source, built;
+    anki_vehicle_sim_t sim;
+    anki_vehicle_msg_t msg;
+    struct capture c;
+    uint8_t len, i;
+
+    make_map(&source);
+    anki_vehicle_sim_init(&sim, &source, storage, sizeof(storage), 1, 0);
+    anki_vehicle_sim_place(&sim, 0, 1, 0.0f);
+    memset(&c, 0, sizeof(c));
+    anki_track_map_init(&built);
+    c.map = &built;
+
+    // The simulated telemetry is enough to map the track
+    len = anki_vehicle_msg_set_speed(&msg, 700, 5000);
+    send(&sim, 0, &msg, len);
+    run(&sim, 10000000, &c);
+
+    ASSERT_EQ(built.state, ANKI_TRACK_MAP_COMPLETE);
+    ASSERT_EQ(built.count, 4);
+    ASSERT_EQ(built.mismatches, 0);
+    for (i = 0; i < 4; i++) {
+        ASSERT_EQ(built.pieces[i].road_piece_id, source.pieces[i].road_piece_id);
+        ASSERT_NEAR(source.pieces[i].length_mm, built.pieces[i].length_mm, 10);
+    }
+    PASS();
+}
+
+TEST test_fleet(void) {
+    anki_track_map_t map;
+    anki_vehicle_sim_t sim;
+    anki_vehicle_msg_t msg;
+    struct capture c;
+    uint8_t len;
+    uint32_t i;
+
+    make_map(&map);
+    ASSERT_EQ(anki_vehicle_sim_init(&sim, &map, storage, sizeof(storage), MAX_VEHICLES, 0), 0);
+    memset(&c, 0, sizeof(c));
+
+    len = anki_vehicle_msg_set_speed(&msg, 600, 6000);
+    for (i = 0; i < MAX_VEHICLES; i++)
+        send(&sim, i, &msg, len);
+
+    // 10s around a 2m track: each vehicle passes about 200 codes and 12 pieces
+    run(&sim, 10000000, &c);
+    ASSERT_NEAR(MAX_VEHICLES * 5970 / ANKI_VEHICLE_SIM_DEFAULT_LOCATION_SPACING_MM, (int32_t)c.positions, MAX_VEHICLES);
+    ASSERT_NEAR(MAX_VEHICLES * 12, (int32_t)c.transitions, MAX_VEHICLES);
+    for (i = 0; i < MAX_VEHICLES; i++)
+        ASSERT_EQ(sim.speed[i], 600.0f);
+    PASS();
+}
+
+SUITE(vehicle_sim) {
+    RUN_TEST(test_init);
+    RUN_TEST(test_drive);
+    RUN_TEST(test_requests);
+    RUN_TEST(test_lane_change_and_turn);
+    RUN_TEST(test_builds_track_map);
+    RUN_TEST(test_fleet);
+}
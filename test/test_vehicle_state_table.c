@@ -0,0 +1,248 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "greatest.h"
+
+#include "vehicle_state_table.h"
+
+SUITE(vehicle_state_table);
+
+#define CAPACITY 4
+
+static uint64_t table_mem[(64 + CAPACITY * 64) / sizeof(uint64_t)] __attribute__((aligned(64)));
+
+TEST test_layout(void) {
+    anki_vehicle_state_table_t *table;
+
+    ASSERT_EQ(sizeof(anki_vehicle_state_table_header_t), 64);
+    ASSERT_EQ(sizeof(anki_vehicle_state_slot_t), 64);
+    ASSERT_EQ(anki_vehicle_state_table_size(CAPACITY), sizeof(table_mem));
+
+    ASSERT_EQ(anki_vehicle_state_table_init(table_mem, sizeof(table_mem) - 1, CAPACITY), NULL);
+    table = anki_vehicle_state_table_init(table_mem, sizeof(table_mem), CAPACITY);
+    ASSERT(table != NULL);
+    ASSERT_EQ(table->header.magic, ANKI_VEHICLE_STATE_TABLE_MAGIC);
+    ASSERT_EQ(table->header.capacity, CAPACITY);
+    ASSERT_EQ(table->header.count, 0);
+    ASSERT_EQ((const anki_vehicle_state_table_t *)table, anki_vehicle_state_table_attach(table_mem, sizeof(table_mem)));
+
+    // Readers reject other layouts and truncated regions
+    ASSERT_EQ(anki_vehicle_state_table_attach(table_mem, sizeof(table_mem) - 64), NULL);
+    table->header.version++;
+    ASSERT_EQ(anki_vehicle_state_table_attach(table_mem, sizeof(table_mem)), NULL);
+    table->header.version--;
+    table->header.magic = 0;
+    ASSERT_EQ(anki_vehicle_state_table_attach(table_mem, sizeof(table_mem)), NULL);
+    PASS();
+}
+
+TEST test_write_read(void) {
+    anki_vehicle_state_table_t *table = anki_vehicle_state_table_init(table_mem, sizeof(table_mem), CAPACITY);
+    anki_vehicle_state_t in, out;
+
+    memset(&in, 0, sizeof(in));
+    in.updated_us = 123456789;
+    in.connection = ANKI_VEHICLE_CONNECTED;
+    in.road_piece_id = 17;
+    in.speed_mm_per_sec = 650;
+    in.offset_mm = -23.5f;
+
+    ASSERT_EQ(anki_vehicle_state_table_write(table, 2, &in), 0);
+    ASSERT_EQ(anki_vehicle_state_table_write(table, CAPACITY, &in), 1);
+    ASSERT_EQ(table->header.count, 3);
+    ASSERT_EQ(table->slots[2].seq, 2);
+
+    ASSERT_EQ(anki_vehicle_state_table_read(table, 2, &out), 0);
+    ASSERT_EQ(memcmp(&in, &out, sizeof(in)), 0);
+    ASSERT_EQ(anki_vehicle_state_table_read(table, CAPACITY, &out), 1);
+
+    // Untouched slots read as zero
+    ASSERT_EQ(anki_vehicle_state_table_read(table, 0, &out), 0);
+    ASSERT_EQ(out.updated_us, 0);
+
+    // A cleared slot keeps nothing of the previous vehicle
+    ASSERT_EQ(anki_vehicle_state_table_clear(table, 2), 0);
+    ASSERT_EQ(anki_vehicle_state_table_clear(table, CAPACITY), 1);
+    ASSERT_EQ(table->slots[2].seq, 4);
+    ASSERT_EQ(anki_vehicle_state_table_read(table, 2, &out), 0);
+    ASSERT_EQ(out.connection, 0);
+    ASSERT_EQ(out.road_piece_id, 0);
+    ASSERT_EQ(out.speed_mm_per_sec, 0);
+
+    // A writer that never finishes its update does not hang readers
+    ASSERT(anki_vehicle_state_table_begin(table, 1) != NULL);
+    ASSERT_EQ(anki_vehicle_state_table_read(table, 1, &out), 2);
+    anki_vehicle_state_table_end(table, 1);
+    ASSERT_EQ(anki_vehicle_state_table_read(table, 1, &out), 0);
+    PASS();
+}
+
+TEST test_handle_msg(void) {
+    anki_vehicle_state_table_t *table = anki_vehicle_state_table_init(table_mem, sizeof(table_mem), CAPACITY);
+    anki_vehicle_msg_localization_position_update_t pos;
+    anki_vehicle_msg_localization_transition_update_t trans;
+    anki_vehicle_msg_battery_level_response_t battery;
+    anki_vehicle_msg_t deloc;
+    anki_vehicle_adv_state_t adv;
+    anki_vehicle_state_t state;
+    const uint8_t address[6] = { 0xdc, 0x45, 0xdf, 0xfb, 0xcb, 0x31 };
+
+    ASSERT_EQ(anki_vehicle_state_table_set_connection(table, 1, 100, address, ANKI_VEHICLE_CONNECTED), 0);
+
+    memset(&pos, 0, sizeof(pos));
+    pos.size = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE_SIZE;
+    pos.msg_id = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_POSITION_UPDATE;
+    pos.location_id = 5;
+    pos.road_piece_id = 36;
+    pos.offset_from_road_center_mm = 68.0f;
+    pos.speed_mm_per_sec = 800;
+    pos.parsing_flags = PARSEFLAGS_MASK_REVERSE_DRIVING;
+    ASSERT_EQ(anki_vehicle_state_table_handle_msg(table, 1, 200, (const anki_vehicle_msg_t *)&pos, sizeof(pos)), 0);
+
+    memset(&trans, 0, sizeof(trans));
+    trans.size = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE_SIZE;
+    trans.msg_id = ANKI_VEHICLE_MSG_V2C_LOCALIZATION_TRANSITION_UPDATE;
+    trans.offset_from_road_center_mm = 60.0f;
+    ASSERT_EQ(anki_vehicle_state_table_handle_msg(table, 1, 300, (const anki_vehicle_msg_t *)&trans, sizeof(trans)), 0);
+
+    battery.size = ANKI_VEHICLE_MSG_V2C_BATTERY_LEVEL_RESPONSE_SIZE;
+    battery.msg_id = ANKI_VEHICLE_MSG_V2C_BATTERY_LEVEL_RESPONSE;
+    battery.battery_level = 3850;
+    ASSERT_EQ(anki_vehicle_state_table_handle_msg(table, 1, 400, (const anki_vehicle_msg_t *)&battery, sizeof(battery)), 0);
+
+    memset(&adv, 0, sizeof(adv));
+    adv.low_battery = 1;
+    ASSERT_EQ(anki_vehicle_state_table_set_adv_state(table, 1, 450, adv), 0);
+
+    ASSERT_EQ(anki_vehicle_state_table_read(table, 1, &state), 0);
+    ASSERT_EQ(memcmp(state.address, address, 6), 0);
+    ASSERT_EQ(state.connection, ANKI_VEHICLE_CONNECTED);
+    ASSERT_EQ(state.road_piece_id, 36);
+    ASSERT_EQ(state.location_id, 5);
+    ASSERT_EQ(state.speed_mm_per_sec, 800);
+    ASSERT_EQ(state.offset_mm, 60.0f);
+    ASSERT_EQ(state.transitions, 1);
+    ASSERT_EQ(state.battery_mv, 3850);
+    ASSERT_EQ(state.flags, ANKI_VEHICLE_STATE_LOCALIZED | ANKI_VEHICLE_STATE_REVERSE |
+                           ANKI_VEHICLE_STATE_LOW_BATTERY);
+    ASSERT_EQ(state.position_us, 300);
+    ASSERT_EQ(state.updated_us, 450);
+
+    deloc.size = ANKI_VEHICLE_MSG_BASE_SIZE;
+    deloc.msg_id = ANKI_VEHICLE_MSG_V2C_VEHICLE_DELOCALIZED;
+    ASSERT_EQ(anki_vehicle_state_table_handle_msg(table, 1, 500, &deloc, 2), 0);
+    anki_vehicle_state_table_read(table, 1, &state);
+    ASSERT_EQ(state.flags, ANKI_VEHICLE_STATE_LOW_BATTERY);
+
+    // Truncated and out-of-range updates are rejected without touching the slot
+    ASSERT_EQ(anki_vehicle_state_table_handle_msg(table, 1, 600, (const anki_vehicle_msg_t *)&pos, 8), 1);
+    ASSERT_EQ(anki_vehicle_state_table_handle_msg(table, CAPACITY, 600, &deloc, 2), 1);
+    ASSERT_EQ(table->slots[1].seq & 1, 0);
+    anki_vehicle_state_table_read(table, 1, &state);
+    ASSERT_EQ(state.updated_us, 500);
+    PASS();
+}
+
+TEST test_shared_file(void) {
+    char path[] = "/tmp/ankidrive-state-XXXXXX";
+    anki_vehicle_state_table_t *writer;
+    const anki_vehicle_state_table_t *reader;
+    anki_vehicle_state_t state;
+    int fd = mkstemp(path);
+
+    ASSERT(fd >= 0);
+    close(fd);
+
+    writer = anki_vehicle_state_table_create(path, 8);
+    ASSERT(writer != NULL);
+    reader = anki_vehicle_state_table_open(path);
+    ASSERT(reader != NULL);
+    ASSERT_EQ(reader->header.capacity, 8);
+
+    // Writes through one mapping show up in the other
+    anki_vehicle_state_table_set_connection(writer, 7, 42, NULL, ANKI_VEHICLE_CONNECTING);
+    ASSERT_EQ(reader->header.count, 8);
+    ASSERT_EQ(anki_vehicle_state_table_read(reader, 7, &state), 0);
+    ASSERT_EQ(state.connection, ANKI_VEHICLE_CONNECTING);
+    ASSERT_EQ(state.updated_us, 42);
+
+    anki_vehicle_state_table_unmap(writer);
+
+    // Recreating the table leaves the old mapping readable and intact
+    writer = anki_vehicle_state_table_create(path, 2);
+    ASSERT(writer != NULL);
+    ASSERT_EQ(anki_vehicle_state_table_read(reader, 7, &state), 0);
+    ASSERT_EQ(state.updated_us, 42);
+    anki_vehicle_state_table_unmap(reader);
+
+    reader = anki_vehicle_state_table_open(path);
+    ASSERT(reader != NULL);
+    ASSERT_EQ(reader->header.capacity, 2);
+    anki_vehicle_state_table_unmap(reader);
+    anki_vehicle_state_table_unmap(writer);
+
+    // Not a table
+    fd = open(path, O_WRONLY | O_TRUNC);
+    ASSERT(fd >= 0);
+    ASSERT_EQ(write(fd, "nothing here", 12), 12);
+    close(fd);
+    ASSERT_EQ(anki_vehicle_state_table_open(path), NULL);
+
+    unlink(path);
+    PASS();
+}
+
+#define WRITES 200000
+
+static void *writer_thread(void *arg) {
+    anki_vehicle_state_table_t *table = (anki_vehicle_state_table_t *)arg;
+    uint32_t i;
+
+    for (i = 1; i <= WRITES; i++) {
+        anki_vehicle_state_t *state = anki_vehicle_state_table_begin(table, 0);
+        state->updated_us = i;
+        state->position_us = i;
+        state->transitions = i;
+        state->speed_mm_per_sec = (uint16_t)i;
+        anki_vehicle_state_table_end(table, 0);
+    }
+
+    return NULL;
+}
+
+TEST test_no_torn_reads(void) {
+    anki_vehicle_state_table_t *table = anki_vehicle_state_table_init(table_mem, sizeof(table_mem), CAPACITY);
+    anki_vehicle_state_t state;
+    pthread_t thread;
+    uint64_t last = 0;
+
+    ASSERT_EQ(pthread_create(&thread, NULL, writer_thread, table), 0);
+
+    do {
+        // The writer may be preempted mid-update on a busy machine
+        if (anki_vehicle_state_table_read(table, 0, &state) != 0)
+            continue;
+        ASSERT_EQ(state.position_us, state.updated_us);
+        ASSERT_EQ(state.transitions, (uint32_t)state.updated_us);
+        ASSERT_EQ(state.speed_mm_per_sec, (uint16_t)state.updated_us);
+        ASSERT(state.updated_us >= last);
+        last = state.updated_us;
+    } while (last < WRITES);
+
+    pthread_join(thread, NULL);
+    PASS();
+}
+
+SUITE(vehicle_state_table) {
+    RUN_TEST(test_layout);
+    RUN_TEST(test_write_read);
+    RUN_TEST(test_handle_msg);
+    RUN_TEST(test_shared_file);
+    RUN_TEST(test_no_torn_reads);
+}
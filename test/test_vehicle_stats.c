@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "greatest.h"
+#include "anki_greatest.h"
+
+#include "vehicle_stats.h"
+
+SUITE(vehicle_stats);
+
+TEST test_rssi_min_max(void) {
+    anki_vehicle_stats_t stats;
+    anki_vehicle_stats_init(&stats);
+
+    ASSERT_EQ(anki_vehicle_stats_update(NULL, 0, -50), 1);
+
+    ASSERT_EQ(anki_vehicle_stats_update(&stats, 0, -60), 0);
+    ASSERT_EQ(anki_vehicle_stats_update(&stats, 50000, -45), 0);
+    ASSERT_EQ(anki_vehicle_stats_update(&stats, 100000, -72), 0);
+
+    ASSERT_EQ(stats.count, 3);
+    ASSERT_EQ(stats.rssi_last, -72);
+    ASSERT_EQ(stats.rssi_min, -72);
+    ASSERT_EQ(stats.rssi_max, -45);
+    PASS();
+}
+
+TEST test_rssi_filters_converge(void) {
+    anki_vehicle_stats_t stats;
+    anki_vehicle_stats_init(&stats);
+
+    int i;
+    for (i = 0; i < 200; i++) {
+        int8_t rssi = (i & 1) ? -58 : -62;
+        anki_vehicle_stats_update(&stats, (uint64_t)i * 50000, rssi);
+    }
+
+    ASSERT_NEAR(-60.0f, stats.rssi_ewma, 1.0f);
+    ASSERT_NEAR(-60.0f, stats.rssi_kalman, 1.0f);
+    ASSERT(stats.rssi_kalman_variance < stats.kalman_r);
+    PASS();
+}
+
+TEST test_rssi_slope(void) {
+    anki_vehicle_stats_t stats;
+    anki_vehicle_stats_init(&stats);
+
+    ASSERT_NEAR(0.0f, anki_vehicle_stats_rssi_slope(&stats), 0.001f);
+
+    // Fill past the window so the sliding sums are exercised
+    int i;
+    for (i = 0; i < ANKI_VEHICLE_STATS_RSSI_WINDOW * 3; i++) {
+        anki_vehicle_stats_update(&stats, (uint64_t)i * 100000, (int8_t)(-30 - i / 2));
+    }
+
+    // -0.5 dB per report at 10 reports per second
+    ASSERT_NEAR(-0.5f, anki_vehicle_stats_rssi_slope(&stats), 0.05f);
+    ASSERT_NEAR(-5.0f, anki_vehicle_stats_rssi_trend(&stats), 0.5f);
+    PASS();
+}
+
+TEST test_interval_histogram(void) {
+    anki_vehicle_stats_t stats;
+    anki_vehicle_stats_init(&stats);
+
+    int i;
+    for (i = 0; i <= ANKI_VEHICLE_STATS_INTERVAL_WINDOW * 2; i++) {
+        anki_vehicle_stats_update(&stats, (uint64_t)i * 40000, -50);
+    }
+
+    // 40ms intervals land in [32, 64) ms
+    ASSERT_EQ(stats.interval_histogram[6], ANKI_VEHICLE_STATS_INTERVAL_WINDOW);
+    ASSERT_EQ(anki_vehicle_stats_interval_mean_us(&stats), 40000);
+    ASSERT_EQ(stats.nominal_interval_us, 40000);
+    ASSERT_EQ(stats.missed, 0);
+    PASS();
+}
+
+TEST test_scan_response_same_event(void) {
+    anki_vehicle_stats_t stats;
+    anki_vehicle_stats_init(&stats);
+
+    // Advertisement followed by its scan response 1ms later
+    anki_vehicle_stats_update(&stats, 0, -50);
+    anki_vehicle_stats_update(&stats, 1000, -51);
+    anki_vehicle_stats_update(&stats, 30000, -50);
+    anki_vehicle_stats_update(&stats, 31000, -51);
+
+    ASSERT_EQ(stats.count, 4);
+    ASSERT_EQ(stats.events, 2);
+    ASSERT_EQ(anki_vehicle_stats_interval_mean_us(&stats), 30000);
+    PASS();
+}
+
+TEST test_missed_estimate(void) {
+    anki_vehicle_stats_t stats;
+    anki_vehicle_stats_init(&stats);
+
+    uint64_t t = 0;
+    int i;
+    for (i = 0; i < 10; i++) {
+        anki_vehicle_stats_update(&stats, t, -50);
+        t += 30000;
+    }
+    ASSERT_EQ(stats.missed, 0);
+
+    // Skip three advertisements
+    t += 3 * 30000;
+    anki_vehicle_stats_update(&stats, t, -50);
+
+    ASSERT_EQ(stats.missed, 3);
+    ASSERT_EQ(stats.nominal_interval_us, 30000);
+    ASSERT_NEAR(3.0f / 14.0f, anki_vehicle_stats_loss_ratio(&stats), 0.001f);
+
+    ASSERT_EQ(anki_vehicle_stats_overdue(&stats, t + 20000), 0);
+    ASSERT_EQ(anki_vehicle_stats_overdue(&stats, t + 150000), 4);
+    PASS();
+}
+
+TEST test_nominal_interval_recovers(void) {
+    anki_vehicle_stats_t stats;
+    anki_vehicle_stats_init(&stats);
+
+    // First interval spans a lost advertisement
+    anki_vehicle_stats_update(&stats, 0, -50);
+    anki_vehicle_stats_update(&stats, 100000, -50);
+    ASSERT_EQ(stats.nominal_interval_us, 100000);
+
+    anki_vehicle_stats_update(&stats, 120000, -50);
+    ASSERT_EQ(stats.nominal_interval_us, 20000);
+    PASS();
+}
+
+GREATEST_SUITE(vehicle_stats) {
+    RUN_TEST(test_rssi_min_max);
+    RUN_TEST(test_rssi_filters_converge);
+    RUN_TEST(test_rssi_slope);
+    RUN_TEST(test_interval_histogram);
+    RUN_TEST(test_scan_response_same_event);
+    RUN_TEST(test_missed_estimate);
+    RUN_TEST(test_nominal_interval_recovers);
+}